@@ -0,0 +1,467 @@
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/msg.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include "msg.h"    /* For the message struct */
+#include "stats.h"    /* For the statistics page */
+#include "async_transfer.h"
+
+using namespace std;
+
+/**
+ * Consumes an eventfd's count so the next wait only wakes for new events
+ * @param  fd The eventfd
+ */
+static void drainEventFd(int fd)
+{
+	uint64_t count;
+
+	/* Nothing to read (EAGAIN) just means there were no new events */
+	while (read(fd, &count, sizeof(count)) < 0 && errno == EINTR)
+	{
+	}
+}
+
+/**
+ * Bumps an eventfd to wake whoever waits on it
+ * @param  fd The eventfd
+ * @return 0, or -1 with errno set
+ */
+static int signalEventFd(int fd)
+{
+	uint64_t one = 1;
+
+	while (write(fd, &one, sizeof(one)) < 0)
+	{
+		if (errno != EINTR)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Registers the awaiting coroutine to be resumed once the descriptor is readable
+ * @param  handle The awaiting coroutine
+ * @return True to suspend it, false to let it carry on if registering failed
+ */
+bool EventLoop::readableAwaiter::await_suspend(coroutine_handle<> handle)
+{
+	/* Wake once, then stay quiet until someone waits on the descriptor again */
+	epoll_event event;
+	event.events = EPOLLIN | EPOLLONESHOT;
+	event.data.ptr = handle.address();
+
+	if (epoll_ctl(loop.epollFd, EPOLL_CTL_MOD, fd, &event) < 0)
+	{
+		/* Not registered yet, or registration failed and the coroutine carries on */
+		if (errno != ENOENT || epoll_ctl(loop.epollFd, EPOLL_CTL_ADD, fd, &event) < 0)
+		{
+			return false;
+		}
+	}
+
+	++loop.numWaiting;
+	return true;
+}
+
+EventLoop::EventLoop() : epollFd(epoll_create1(EPOLL_CLOEXEC)), numWaiting(0)
+{
+}
+
+EventLoop::~EventLoop()
+{
+	for (Task<int>::handle_type handle : spawned)
+	{
+		handle.destroy();
+	}
+
+	if (epollFd >= 0)
+	{
+		::close(epollFd);
+	}
+}
+
+/**
+ * Starts a task that runs on its own until it finishes
+ * @param  task The task
+ */
+void EventLoop::spawn(Task<int>&& task)
+{
+	Task<int>::handle_type handle = task.release();
+	spawned.push_back(handle);
+	ready.push_back(handle);
+}
+
+/**
+ * Runs until every spawned task has finished
+ * @return 0, or -1 if waiting failed or tasks are stuck with nothing to wait for
+ */
+int EventLoop::run()
+{
+	/* The events returned by one epoll_wait() */
+	epoll_event events[64];
+
+	while (!spawned.empty())
+	{
+		/* Resume everything that is ready, which may make more coroutines ready */
+		while (!ready.empty())
+		{
+			vector<coroutine_handle<>> batch;
+			batch.swap(ready);
+
+			for (coroutine_handle<> handle : batch)
+			{
+				handle.resume();
+			}
+		}
+
+		/* Reap the tasks that finished */
+		for (size_t i = 0; i < spawned.size(); )
+		{
+			if (spawned[i].done())
+			{
+				spawned[i].destroy();
+				spawned[i] = spawned.back();
+				spawned.pop_back();
+			}
+			else
+			{
+				++i;
+			}
+		}
+
+		if (spawned.empty())
+		{
+			break;
+		}
+
+		/* Every task is suspended on something other than this loop */
+		if (numWaiting == 0)
+		{
+			errno = EDEADLK;
+			return -1;
+		}
+
+		int numEvents = epoll_wait(epollFd, events, sizeof(events) / sizeof(events[0]), -1);
+
+		if (numEvents < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+
+		for (int i = 0; i < numEvents; ++i)
+		{
+			--numWaiting;
+			ready.push_back(coroutine_handle<>::from_address(events[i].data.ptr));
+		}
+	}
+
+	return 0;
+}
+
+AsyncChannel::AsyncChannel() : msqid(-1), dataFd(-1), creditFd(-1), numSlots(0), chunkSize(0),
+	shmid(-1), sharedMemPtr((void*)-1), owner(0)
+{
+}
+
+AsyncChannel::~AsyncChannel()
+{
+	close();
+}
+
+/**
+ * Creates the channel's IPC objects
+ * @param  numSlots The number of chunk slots, which is the most chunks in flight
+ * @param  chunkSize The size of each slot
+ * @return 0, or -1 with errno set
+ */
+int AsyncChannel::open(int numSlots, size_t chunkSize)
+{
+	this->numSlots = numSlots;
+	this->chunkSize = chunkSize;
+	owner = getpid();
+
+	/* A private segment with the statistics page and one slot per credit, laid out like recv.cpp's */
+	if ((shmid = shmget(IPC_PRIVATE, STATS_PAGE_SIZE + (size_t)numSlots * chunkSize, IPC_CREAT | S_IRUSR | S_IWUSR)) < 0 ||
+		(sharedMemPtr = shmat(shmid, NULL, 0)) == (void*)-1 ||
+		(msqid = msgget(IPC_PRIVATE, IPC_CREAT | S_IRUSR | S_IWUSR)) < 0 ||
+		(dataFd = eventfd(0, EFD_NONBLOCK)) < 0 ||
+		(creditFd = eventfd(0, EFD_NONBLOCK)) < 0)
+	{
+		int savedErrno = errno;
+		close();
+		errno = savedErrno;
+		return -1;
+	}
+
+	/* Attachments survive fork(), so the segment can go away with the last one */
+	shmctl(shmid, IPC_RMID, NULL);
+
+	transferStats* stats = (transferStats*)sharedMemPtr;
+	memset(static_cast<void*>(stats), 0, sizeof(transferStats));
+	stats->numSlots.store(numSlots, memory_order_relaxed);
+	stats->chunkSize.store(chunkSize, memory_order_relaxed);
+	stats->state.store(STATE_TRANSFERRING, memory_order_relaxed);
+	stats->startNs.store(nowNs(), memory_order_relaxed);
+	stats->magic.store(STATS_MAGIC, memory_order_release);
+
+	return 0;
+}
+
+/**
+ * Detaches from the segment, and removes the IPC objects if this process
+ * created them
+ */
+void AsyncChannel::close()
+{
+	if (sharedMemPtr != (void*)-1)
+	{
+		shmdt(sharedMemPtr);
+		sharedMemPtr = (void*)-1;
+	}
+
+	/* Only the creator removes the queue, so a forked peer can finish first */
+	if (msqid >= 0 && owner == getpid())
+	{
+		msgctl(msqid, IPC_RMID, NULL);
+	}
+	msqid = -1;
+	shmid = -1;
+
+	if (dataFd >= 0)
+	{
+		::close(dataFd);
+		dataFd = -1;
+	}
+
+	if (creditFd >= 0)
+	{
+		::close(creditFd);
+		creditFd = -1;
+	}
+}
+
+/**
+ * Gets a chunk slot
+ * @param  slot The index of the slot
+ * @return The start of the slot
+ */
+char* AsyncChannel::getSlot(int slot) const
+{
+	return (char*)sharedMemPtr + STATS_PAGE_SIZE + (size_t)slot * chunkSize;
+}
+
+AsyncSender::AsyncSender(EventLoop& loop, AsyncChannel& channel) : loop(loop), channel(channel),
+	credits(-1), slot(0), offset(0)
+{
+}
+
+/**
+ * Waits until the receiver has handed back at least one credit
+ * @return 0, or -1 with errno set
+ */
+Task<int> AsyncSender::waitForCredits()
+{
+	/* The acknowledgment message */
+	ackMessage ackMsg;
+
+	while (credits <= 0)
+	{
+		/* Consume the wakeups first; an ack whose wakeup we consume is already queued */
+		drainEventFd(channel.creditFd);
+
+		while (msgrcv(channel.msqid, &ackMsg, sizeof(ackMessage) - sizeof(long), RECV_DONE_TYPE, IPC_NOWAIT) >= 0)
+		{
+			credits = max(credits, 0) + ackMsg.credits;
+		}
+
+		if (errno != ENOMSG)
+		{
+			co_return -1;
+		}
+
+		if (credits <= 0)
+		{
+			co_await loop.readable(channel.creditFd);
+		}
+	}
+
+	co_return 0;
+}
+
+/**
+ * Copies a buffer into the channel, a chunk at a time as credits allow
+ * @param  data The bytes to send
+ * @return 0, or -1 with errno set
+ */
+Task<int> AsyncSender::send(span<const char> data)
+{
+	/* A buffer to store message we will send to the receiver */
+	message sndMsg;
+	sndMsg.mtype = SENDER_DATA_TYPE;
+	sndMsg.checksum = 0;
+
+	while (!data.empty())
+	{
+		if (credits <= 0 && co_await waitForCredits() < 0)
+		{
+			co_return -1;
+		}
+
+		size_t size = min(data.size(), channel.chunkSize);
+		memcpy(channel.getSlot(slot), data.data(), size);
+
+		sndMsg.size = size;
+		sndMsg.offset = offset;
+		sndMsg.slot = slot;
+		sndMsg.flags = --credits == 0 ? MSG_FLAG_LAST_CREDIT : 0;
+
+		/* Queue the notice, then wake the receiver */
+		if (msgsnd(channel.msqid, &sndMsg, sizeof(message) - sizeof(long), IPC_NOWAIT) < 0 ||
+			signalEventFd(channel.dataFd) < 0)
+		{
+			co_return -1;
+		}
+
+		data = data.subspan(size);
+		offset += size;
+		slot = (slot + 1) % channel.numSlots;
+	}
+
+	co_return 0;
+}
+
+/**
+ * Tells the receiver there is no more data
+ * @return 0, or -1 with errno set
+ */
+Task<int> AsyncSender::finish()
+{
+	/* The zero size message that ends the transfer, which needs no credit */
+	message sndMsg;
+	sndMsg.mtype = SENDER_DATA_TYPE;
+	sndMsg.size = 0;
+	sndMsg.offset = offset;
+	sndMsg.slot = 0;
+	sndMsg.flags = 0;
+	sndMsg.checksum = 0;
+
+	if (msgsnd(channel.msqid, &sndMsg, sizeof(message) - sizeof(long), IPC_NOWAIT) < 0 ||
+		signalEventFd(channel.dataFd) < 0)
+	{
+		co_return -1;
+	}
+
+	co_return 0;
+}
+
+AsyncReceiver::AsyncReceiver(EventLoop& loop, AsyncChannel& channel) : loop(loop), channel(channel),
+	granted(false), holding(false), holdingLastCredit(false), numFreed(0)
+{
+}
+
+/**
+ * Hands credits back to the sender
+ * @param  credits The number of slots the sender may fill
+ * @return 0, or -1 with errno set
+ */
+int AsyncReceiver::sendCredits(int credits)
+{
+	/* The acknowledgment message */
+	ackMessage ackMsg;
+	ackMsg.mtype = RECV_DONE_TYPE;
+	ackMsg.credits = credits;
+
+	if (msgsnd(channel.msqid, &ackMsg, sizeof(ackMessage) - sizeof(long), IPC_NOWAIT) < 0)
+	{
+		return -1;
+	}
+
+	return signalEventFd(channel.creditFd);
+}
+
+/**
+ * Hands back the previous chunk's slot and waits for the next chunk
+ * @return The chunk
+ */
+Task<AsyncChunk> AsyncReceiver::nextChunk()
+{
+	/* The chunk to hand out */
+	AsyncChunk chunk = { span<const char>(), 0, -1 };
+
+	/* The notice from the sender */
+	message rcvMsg;
+
+	/* Grant the whole window up front */
+	if (!granted)
+	{
+		if (sendCredits(channel.numSlots) < 0)
+		{
+			co_return chunk;
+		}
+		granted = true;
+	}
+
+	/* Hand back the previous chunk's slot: at once if the sender is out of
+	 * credits, otherwise batched half a window at a time
+	 */
+	if (holding)
+	{
+		holding = false;
+		++numFreed;
+
+		if (holdingLastCredit || numFreed >= (channel.numSlots + 1) / 2)
+		{
+			if (sendCredits(numFreed) < 0)
+			{
+				co_return chunk;
+			}
+			numFreed = 0;
+		}
+	}
+
+	while (msgrcv(channel.msqid, &rcvMsg, sizeof(message) - sizeof(long), SENDER_DATA_TYPE, IPC_NOWAIT) < 0)
+	{
+		if (errno != ENOMSG)
+		{
+			co_return chunk;
+		}
+
+		/* Consume the wakeups first; a notice whose wakeup we consume is already queued */
+		co_await loop.readable(channel.dataFd);
+		drainEventFd(channel.dataFd);
+	}
+
+	/* A notice that does not fit the channel means the sender is broken */
+	if (rcvMsg.size < 0 || (uint64_t)rcvMsg.size > channel.chunkSize ||
+		rcvMsg.slot < 0 || rcvMsg.slot >= channel.numSlots)
+	{
+		errno = EPROTO;
+		co_return chunk;
+	}
+
+	chunk.offset = rcvMsg.offset;
+	chunk.status = 0;
+
+	if (rcvMsg.size > 0)
+	{
+		chunk.data = span<const char>(channel.getSlot(rcvMsg.slot), rcvMsg.size);
+		holding = true;
+		holdingLastCredit = rcvMsg.flags & MSG_FLAG_LAST_CREDIT;
+	}
+
+	co_return chunk;
+}
@@ -0,0 +1,351 @@
+/* An asynchronous interface to the shared memory transport for programs that
+ * want to move buffers to a co-located consumer without a thread blocked in
+ * msgrcv(). Senders and receivers are C++20 coroutines driven by an epoll
+ * event loop, so one thread can run many transfers at once:
+ *
+ *	Task<int> produce(AsyncSender& sender, std::span<const char> data)
+ *	{
+ *		co_await sender.send(data);
+ *		co_return co_await sender.finish();
+ *	}
+ *
+ *	Task<int> consume(AsyncReceiver& receiver)
+ *	{
+ *		for (AsyncChunk chunk = co_await receiver.nextChunk(); chunk.data.size() > 0;
+ *			chunk = co_await receiver.nextChunk())
+ *		{
+ *			... use chunk.data until the next call to nextChunk() ...
+ *		}
+ *		co_return 0;
+ *	}
+ *
+ * A channel uses the same segment layout (statistics page, then slots) and
+ * the same message, ackMessage and credit rules as sender.cpp and recv.cpp.
+ * Each side also bumps an eventfd after every msgsnd() so the event loop
+ * knows when to look at the queue. The eventfds are inherited across fork(),
+ * so the two ends can live in a parent and a child as well as in one process.
+ *
+ * Build with -std=c++20.
+ */
+
+#include <coroutine>
+#include <exception>
+#include <span>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <utility>
+#include <vector>
+
+/**
+ * A lazily started coroutine producing a value. Awaiting it runs it and
+ * resumes the awaiter when it finishes; EventLoop::spawn() runs it on its own.
+ */
+template <typename T>
+class Task
+{
+public:
+	struct promise_type;
+
+	/* The handle of the coroutine */
+	typedef std::coroutine_handle<promise_type> handle_type;
+
+	/**
+	 * Resumes whoever awaited the task once it finishes
+	 */
+	struct finalAwaiter
+	{
+		bool await_ready() noexcept { return false; }
+
+		std::coroutine_handle<> await_suspend(handle_type handle) noexcept
+		{
+			std::coroutine_handle<> continuation = handle.promise().continuation;
+			return continuation ? continuation : std::noop_coroutine();
+		}
+
+		void await_resume() noexcept { }
+	};
+
+	/**
+	 * The state of the coroutine
+	 */
+	struct promise_type
+	{
+		/* The value the coroutine returned */
+		T value{};
+
+		/* The coroutine awaiting this one, if any */
+		std::coroutine_handle<> continuation;
+
+		Task get_return_object() { return Task(handle_type::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		finalAwaiter final_suspend() noexcept { return {}; }
+		void return_value(T result) { value = std::move(result); }
+		void unhandled_exception() { std::terminate(); }
+	};
+
+	/**
+	 * Runs the task when awaited and hands back its value
+	 */
+	struct awaiter
+	{
+		/* The task being awaited */
+		handle_type handle;
+
+		bool await_ready() noexcept { return false; }
+
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+		{
+			handle.promise().continuation = awaiting;
+			return handle;
+		}
+
+		T await_resume() { return std::move(handle.promise().value); }
+	};
+
+	explicit Task(handle_type handle) : handle(handle) { }
+	Task(Task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) { }
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+
+	~Task()
+	{
+		if (handle)
+		{
+			handle.destroy();
+		}
+	}
+
+	awaiter operator co_await() noexcept { return awaiter{handle}; }
+
+	/**
+	 * Gives up ownership of the coroutine
+	 * @return The handle of the coroutine
+	 */
+	handle_type release() { return std::exchange(handle, nullptr); }
+
+private:
+	/* The coroutine, owned by the task */
+	handle_type handle;
+};
+
+/**
+ * Resumes coroutines when the file descriptors they wait on become readable
+ */
+class EventLoop
+{
+public:
+	/**
+	 * Suspends the awaiting coroutine until a file descriptor is readable
+	 */
+	struct readableAwaiter
+	{
+		/* The loop to wait in */
+		EventLoop& loop;
+
+		/* The file descriptor to wait for */
+		int fd;
+
+		bool await_ready() noexcept { return false; }
+		bool await_suspend(std::coroutine_handle<> handle);
+		void await_resume() noexcept { }
+	};
+
+	EventLoop();
+	~EventLoop();
+	EventLoop(const EventLoop&) = delete;
+	EventLoop& operator=(const EventLoop&) = delete;
+
+	/**
+	 * Checks whether the loop was set up
+	 * @return True if epoll_create1() worked
+	 */
+	bool isOpen() const { return epollFd >= 0; }
+
+	/**
+	 * Waits for a file descriptor to become readable
+	 * @param  fd The file descriptor
+	 * @return The awaitable
+	 */
+	readableAwaiter readable(int fd) { return readableAwaiter{*this, fd}; }
+
+	/**
+	 * Starts a task that runs on its own until it finishes
+	 * @param  task The task
+	 */
+	void spawn(Task<int>&& task);
+
+	/**
+	 * Runs until every spawned task has finished
+	 * @return 0, or -1 if waiting failed or tasks are stuck with nothing to wait for
+	 */
+	int run();
+
+private:
+	/* The epoll instance */
+	int epollFd;
+
+	/* The number of file descriptors some coroutine is waiting on */
+	int numWaiting;
+
+	/* The coroutines ready to resume */
+	std::vector<std::coroutine_handle<>> ready;
+
+	/* The spawned tasks that have not finished */
+	std::vector<Task<int>::handle_type> spawned;
+};
+
+/**
+ * A shared memory segment, message queue and pair of eventfds connecting
+ * one AsyncSender to one AsyncReceiver
+ */
+class AsyncChannel
+{
+public:
+	AsyncChannel();
+	~AsyncChannel();
+	AsyncChannel(const AsyncChannel&) = delete;
+	AsyncChannel& operator=(const AsyncChannel&) = delete;
+
+	/**
+	 * Creates the channel's IPC objects
+	 * @param  numSlots The number of chunk slots, which is the most chunks in flight
+	 * @param  chunkSize The size of each slot
+	 * @return 0, or -1 with errno set
+	 */
+	int open(int numSlots, size_t chunkSize);
+
+	/**
+	 * Detaches from the segment, and removes the IPC objects if this process
+	 * created them
+	 */
+	void close();
+
+	/**
+	 * Gets a chunk slot
+	 * @param  slot The index of the slot
+	 * @return The start of the slot
+	 */
+	char* getSlot(int slot) const;
+
+	/* The message queue carrying the notices and acknowledgments */
+	int msqid;
+
+	/* Bumped by the sender after each notice and by the receiver after each acknowledgment */
+	int dataFd;
+	int creditFd;
+
+	/* The number of slots and the size of each */
+	int numSlots;
+	size_t chunkSize;
+
+private:
+	/* The shared memory segment */
+	int shmid;
+	void* sharedMemPtr;
+
+	/* The process that created the IPC objects */
+	pid_t owner;
+};
+
+/**
+ * The sending end of a channel
+ */
+class AsyncSender
+{
+public:
+	/**
+	 * @param  loop The loop to wait in
+	 * @param  channel The channel to send on, which must outlive the sender
+	 */
+	AsyncSender(EventLoop& loop, AsyncChannel& channel);
+
+	/**
+	 * Copies a buffer into the channel, a chunk at a time as credits allow
+	 * @param  data The bytes to send
+	 * @return 0, or -1 with errno set
+	 */
+	Task<int> send(std::span<const char> data);
+
+	/**
+	 * Tells the receiver there is no more data
+	 * @return 0, or -1 with errno set
+	 */
+	Task<int> finish();
+
+private:
+	/**
+	 * Waits until the receiver has handed back at least one credit
+	 * @return 0, or -1 with errno set
+	 */
+	Task<int> waitForCredits();
+
+	/* The loop and channel */
+	EventLoop& loop;
+	AsyncChannel& channel;
+
+	/* The number of slots we may fill, or -1 before the initial grant */
+	int credits;
+
+	/* The next slot to fill */
+	int slot;
+
+	/* The number of bytes sent */
+	uint64_t offset;
+};
+
+/**
+ * One chunk handed out by AsyncReceiver::nextChunk()
+ */
+struct AsyncChunk
+{
+	/* The bytes, valid until the next call to nextChunk(). Empty at the end of the transfer. */
+	std::span<const char> data;
+
+	/* Where the bytes belong in the stream */
+	uint64_t offset;
+
+	/* 0, or -1 with errno set if the chunk could not be received */
+	int status;
+};
+
+/**
+ * The receiving end of a channel
+ */
+class AsyncReceiver
+{
+public:
+	/**
+	 * @param  loop The loop to wait in
+	 * @param  channel The channel to receive from, which must outlive the receiver
+	 */
+	AsyncReceiver(EventLoop& loop, AsyncChannel& channel);
+
+	/**
+	 * Hands back the previous chunk's slot and waits for the next chunk
+	 * @return The chunk
+	 */
+	Task<AsyncChunk> nextChunk();
+
+private:
+	/**
+	 * Hands credits back to the sender
+	 * @param  credits The number of slots the sender may fill
+	 * @return 0, or -1 with errno set
+	 */
+	int sendCredits(int credits);
+
+	/* The loop and channel */
+	EventLoop& loop;
+	AsyncChannel& channel;
+
+	/* Whether the initial window has been granted */
+	bool granted;
+
+	/* Whether a chunk is handed out, and whether it used the sender's last credit */
+	bool holding;
+	bool holdingLastCredit;
+
+	/* The number of slots freed but not yet handed back */
+	int numFreed;
+};
@@ -0,0 +1,286 @@
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "async_transfer.h"    /* For the coroutine interface */
+#include "util.h"    /* For parsing sizes */
+
+using namespace std;
+
+/* The number of chunk slots in each channel */
+int numSlots = 16;
+
+/* The size of each chunk slot */
+size_t chunkSize = 64 * 1024;
+
+/**
+ * Sends a file over a channel
+ * @param  sender The sending end of the channel
+ * @param  fileName The file to send
+ * @return 0, or -1 on failure
+ */
+Task<int> sendFile(AsyncSender& sender, string fileName)
+{
+	/* Open the file for reading */
+	FILE* fp = fopen(fileName.c_str(), "r");
+
+	if (!fp)
+	{
+		perror(fileName.c_str());
+		co_return -1;
+	}
+
+	/* The buffer to read into, which send() copies out of before it completes */
+	vector<char> buffer(chunkSize * 4);
+	size_t numBytes;
+
+	while ((numBytes = fread(buffer.data(), 1, buffer.size(), fp)) > 0)
+	{
+		if (co_await sender.send(span<const char>(buffer.data(), numBytes)) < 0)
+		{
+			perror("send");
+			fclose(fp);
+			co_return -1;
+		}
+	}
+
+	fclose(fp);
+
+	if (co_await sender.finish() < 0)
+	{
+		perror("finish");
+		co_return -1;
+	}
+
+	co_return 0;
+}
+
+/**
+ * Receives a file from a channel into <FILE NAME>__recv
+ * @param  receiver The receiving end of the channel
+ * @param  fileName The name of the file being sent
+ * @return 0, or -1 on failure
+ */
+Task<int> recvFile(AsyncReceiver& receiver, string fileName)
+{
+	/* Open the file for writing */
+	string recvFileName = fileName + "__recv";
+	FILE* fp = fopen(recvFileName.c_str(), "w");
+
+	if (!fp)
+	{
+		perror(recvFileName.c_str());
+		co_return -1;
+	}
+
+	/* The number of bytes received */
+	unsigned long long numBytesRecv = 0;
+
+	while (true)
+	{
+		AsyncChunk chunk = co_await receiver.nextChunk();
+
+		if (chunk.status < 0)
+		{
+			perror("nextChunk");
+			fclose(fp);
+			co_return -1;
+		}
+
+		/* An empty chunk ends the transfer */
+		if (chunk.data.empty())
+		{
+			break;
+		}
+
+		if (chunk.offset != numBytesRecv)
+		{
+			fprintf(stderr, "%s: expected offset %llu, got %llu.\n", fileName.c_str(),
+				numBytesRecv, (unsigned long long)chunk.offset);
+			fclose(fp);
+			co_return -1;
+		}
+
+		if (fwrite(chunk.data.data(), sizeof(char), chunk.data.size(), fp) != chunk.data.size())
+		{
+			perror("fwrite");
+			fclose(fp);
+			co_return -1;
+		}
+
+		numBytesRecv += chunk.data.size();
+	}
+
+	fclose(fp);
+	fprintf(stderr, "%s: received %llu bytes.\n", fileName.c_str(), numBytesRecv);
+
+	co_return 0;
+}
+
+/**
+ * Reports a failed task
+ * @param  task The task
+ * @param  failed Set if the task fails
+ * @return The task's result
+ */
+Task<int> track(Task<int> task, bool& failed)
+{
+	int result = co_await task;
+
+	if (result < 0)
+	{
+		failed = true;
+	}
+
+	co_return result;
+}
+
+/**
+ * Runs a set of tasks on one thread
+ * @param  loop The loop
+ * @param  failed Set by the tasks that fail
+ * @return 0, or -1 if any task failed
+ */
+int runLoop(EventLoop& loop, bool& failed)
+{
+	if (loop.run() < 0)
+	{
+		perror("run");
+		return -1;
+	}
+
+	return failed ? -1 : 0;
+}
+
+int main(int argc, char** argv)
+{
+	/* The command line option being parsed */
+	int opt;
+
+	/* Run the senders in a child process */
+	bool forkSenders = false;
+
+	/* Parse the command line options */
+	while ((opt = getopt(argc, argv, "w:s:f")) != -1)
+	{
+		switch (opt)
+		{
+			/* The number of slots in each channel */
+			case 'w':
+				numSlots = atoi(optarg);
+
+				if (numSlots < 1)
+				{
+					fprintf(stderr, "Window size must be at least 1.\n");
+					exit(-1);
+				}
+				break;
+
+			/* The size of each slot */
+			case 's':
+				chunkSize = parseSize(optarg);
+
+				if (chunkSize == 0)
+				{
+					fprintf(stderr, "Invalid chunk size %s.\n", optarg);
+					exit(-1);
+				}
+				break;
+
+			/* Send from a forked child instead of this process */
+			case 'f':
+				forkSenders = true;
+				break;
+
+			default:
+				fprintf(stderr, "USAGE: %s [-w <WINDOW SIZE>] [-s <CHUNK SIZE>] [-f] <FILE NAME>...\n", argv[0]);
+				exit(-1);
+		}
+	}
+
+	/* Check the command line arguments */
+	if (optind >= argc)
+	{
+		fprintf(stderr, "USAGE: %s [-w <WINDOW SIZE>] [-s <CHUNK SIZE>] [-f] <FILE NAME>...\n", argv[0]);
+		exit(-1);
+	}
+
+	/* One channel per file */
+	int numFiles = argc - optind;
+	vector<AsyncChannel> channels(numFiles);
+
+	for (int i = 0; i < numFiles; ++i)
+	{
+		if (channels[i].open(numSlots, chunkSize) < 0)
+		{
+			perror("open");
+			exit(-1);
+		}
+	}
+
+	/* The child sends while the parent receives */
+	pid_t child = -1;
+
+	if (forkSenders && (child = fork()) < 0)
+	{
+		perror("fork");
+		exit(-1);
+	}
+
+	/* The loop driving this process's ends of every channel */
+	EventLoop loop;
+
+	if (!loop.isOpen())
+	{
+		perror("epoll_create1");
+		exit(-1);
+	}
+
+	/* Set if any transfer fails */
+	bool failed = false;
+
+	/* The ends of the channels, which must outlive the loop's run */
+	vector<AsyncSender> senders;
+	vector<AsyncReceiver> receivers;
+	senders.reserve(numFiles);
+	receivers.reserve(numFiles);
+
+	for (int i = 0; i < numFiles; ++i)
+	{
+		if (child <= 0)
+		{
+			senders.emplace_back(loop, channels[i]);
+			loop.spawn(track(sendFile(senders.back(), argv[optind + i]), failed));
+		}
+
+		if (child != 0)
+		{
+			receivers.emplace_back(loop, channels[i]);
+			loop.spawn(track(recvFile(receivers.back(), argv[optind + i]), failed));
+		}
+	}
+
+	int result = runLoop(loop, failed);
+
+	/* The child is done once its senders are */
+	if (child == 0)
+	{
+		_exit(result < 0 ? 1 : 0);
+	}
+
+	/* Wait for the child before the queues go away */
+	if (child > 0)
+	{
+		int status;
+
+		if (waitpid(child, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		{
+			result = -1;
+		}
+	}
+
+	return result < 0 ? -1 : 0;
+}
@@ -0,0 +1,89 @@
+#!/bin/sh
+#
+# Times sender/recv transfers with both processes and the shared memory
+# placed on the same core, on two cores of the same socket and on two
+# different sockets.
+#
+# Usage: ./bench.sh [size in MB]
+#
+# Run from the directory holding the binaries and keyfile.txt.
+
+SIZE_MB=${1:-256}
+TMP_DIR=$(mktemp -d)
+FILE=$TMP_DIR/bench.bin
+
+trap 'rm -rf "$TMP_DIR"' EXIT
+
+# Prints the socket a CPU belongs to
+socket_of()
+{
+	cat /sys/devices/system/cpu/cpu$1/topology/physical_package_id
+}
+
+# Prints the NUMA node a CPU belongs to
+node_of()
+{
+	for n in /sys/devices/system/cpu/cpu$1/node*; do
+		[ -e "$n" ] && basename "$n" | sed 's/node//' && return
+	done
+	echo 0
+}
+
+# Prints the online CPUs one per line
+online_cpus()
+{
+	for c in /sys/devices/system/cpu/cpu[0-9]*; do
+		[ -e "$c/topology/physical_package_id" ] && basename "$c" | sed 's/cpu//'
+	done | sort -n
+}
+
+# Runs one transfer and prints its throughput
+# $1 = label, $2 = recv cpu, $3 = sender cpu, $4 = segment node
+run()
+{
+	if [ -z "$3" ]; then
+		printf "%-14s %8s %10s %6s %10s\n" "$1" "$2" "-" "$4" "skipped"
+		return
+	fi
+
+	./recv -c "$2" -n "$4" 2>/dev/null &
+	RECV_PID=$!
+	sleep 0.5
+
+	START=$(date +%s%N)
+	./sender -c "$3" "$FILE" 2>/dev/null
+	wait $RECV_PID
+	END=$(date +%s%N)
+
+	if ! cmp -s "$FILE" "$FILE"__recv; then
+		printf "%-14s %8s %10s %6s %10s\n" "$1" "$2" "$3" "$4" "MISMATCH"
+		return
+	fi
+
+	awk -v l="$1" -v r="$2" -v s="$3" -v n="$4" -v mb="$SIZE_MB" -v ns=$((END - START)) \
+		'BEGIN { printf "%-14s %8s %10s %6s %10.1f\n", l, r, s, n, mb * 1e9 / ns }'
+	rm -f "$FILE"__recv
+}
+
+head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom > "$FILE"
+
+HOME_CPU=$(online_cpus | head -n 1)
+HOME_SOCKET=$(socket_of "$HOME_CPU")
+HOME_NODE=$(node_of "$HOME_CPU")
+SAME_SOCKET_CPU=
+OTHER_SOCKET_CPU=
+
+for c in $(online_cpus); do
+	[ "$c" = "$HOME_CPU" ] && continue
+
+	if [ "$(socket_of "$c")" = "$HOME_SOCKET" ]; then
+		[ -z "$SAME_SOCKET_CPU" ] && SAME_SOCKET_CPU=$c
+	else
+		[ -z "$OTHER_SOCKET_CPU" ] && OTHER_SOCKET_CPU=$c
+	fi
+done
+
+printf "%-14s %8s %10s %6s %10s\n" "placement" "recv cpu" "sender cpu" "node" "MB/s"
+run same-core "$HOME_CPU" "$HOME_CPU" "$HOME_NODE"
+run same-socket "$HOME_CPU" "$SAME_SOCKET_CPU" "$HOME_NODE"
+run cross-socket "$HOME_CPU" "$OTHER_SOCKET_CPU" "$HOME_NODE"
@@ -0,0 +1,753 @@
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <vector>
+#include "broadcast.h"
+#include "session.h"    /* For the key, waiting for the publisher and clearing stale rings */
+#include "stats.h"    /* For the live statistics page */
+#include "transfer.h"    /* For sources and sinks */
+#include "util.h"    /* For formatting errors and reading sources */
+
+using namespace std;
+
+/* The states of a broadcast */
+#define BROADCAST_OPEN 0
+#define BROADCAST_RUNNING 1
+#define BROADCAST_ENDED 2
+#define BROADCAST_FAILED 3
+
+/* The states of a subscriber entry. Every entry leaves SUBSCRIBER_FREE exactly
+ * once, to SUBSCRIBER_JOINING when a subscriber claims it or to
+ * SUBSCRIBER_CLOSED when the broadcast starts without it.
+ */
+#define SUBSCRIBER_FREE 0
+#define SUBSCRIBER_JOINING 1
+#define SUBSCRIBER_ACTIVE 2
+#define SUBSCRIBER_DONE 3
+#define SUBSCRIBER_LEFT 4
+#define SUBSCRIBER_EVICTED 5
+#define SUBSCRIBER_CLOSED 6
+
+/* The space the header takes after the statistics page. The slots follow it. */
+#define BROADCAST_HEADER_SIZE 4096
+
+/* The longest name the header keeps, with its terminator */
+#define BROADCAST_NAME_SIZE 256
+
+/* How many times a waiting side yields the CPU before it starts sleeping, and its longest sleep */
+#define BROADCAST_YIELD_ROUNDS 64
+#define BROADCAST_MAX_PAUSE_US 1000
+
+/**
+ * One subscriber's place in the header, on its own cache line since the
+ * subscriber writes its cursor after every chunk
+ */
+struct alignas(64) subscriberEntry
+{
+	/* One of the SUBSCRIBER_* states */
+	std::atomic<uint32_t> state;
+
+	/* The subscriber's pid, set before the state becomes SUBSCRIBER_ACTIVE */
+	std::atomic<int32_t> pid;
+
+	/* The number of chunks the subscriber has consumed */
+	std::atomic<uint64_t> cursor;
+};
+
+/**
+ * The header between the statistics page and the slots. A new segment is
+ * zero-filled, so the broadcast starts out open with every entry free.
+ */
+struct broadcastHeader
+{
+	/* One of the BROADCAST_* states */
+	std::atomic<uint32_t> state;
+
+	/* Set once fileName holds the name */
+	std::atomic<uint32_t> named;
+
+	/* The ring, fixed by the publisher before it marks the statistics page ready */
+	uint32_t numSlots;
+	uint64_t chunkSize;
+
+	/* The number of chunks published. Chunk n is in slot n % numSlots. */
+	std::atomic<uint64_t> head;
+
+	/* The size of the chunk in each slot, written before head moves past it */
+	uint32_t sizes[MAX_BROADCAST_SLOTS];
+
+	/* The name the publisher gave */
+	char fileName[BROADCAST_NAME_SIZE];
+
+	/* One entry per possible subscriber */
+	subscriberEntry subscribers[MAX_SUBSCRIBERS];
+};
+
+static_assert(sizeof(broadcastHeader) <= BROADCAST_HEADER_SIZE, "the broadcast header does not fit in its page");
+
+/**
+ * Waits a little before looking again, yielding the CPU at first and then
+ * sleeping longer each round
+ * @param  round The number of rounds waited so far, updated here
+ */
+static void backOff(unsigned& round)
+{
+	if (round < BROADCAST_YIELD_ROUNDS)
+	{
+		sched_yield();
+	}
+	else
+	{
+		/* 10 us, doubling up to the longest sleep */
+		unsigned shift = round - BROADCAST_YIELD_ROUNDS;
+		usleep(shift >= 7 ? BROADCAST_MAX_PAUSE_US : min(10u << shift, (unsigned)BROADCAST_MAX_PAUSE_US));
+	}
+
+	++round;
+}
+
+Publisher::Publisher() : numSlots(DEFAULT_BROADCAST_SLOTS), chunkSize(DEFAULT_BROADCAST_CHUNK_SIZE), minSubscribers(1),
+	joinTimeoutMs(DEFAULT_JOIN_TIMEOUT_MS), evictAfterMs(0), shmid(-1), sharedMemPtr(NULL), stats(NULL), header(NULL),
+	slots(NULL), numJoined(0), numDetached(0), numEvicted(0)
+{
+}
+
+Publisher::~Publisher()
+{
+	close();
+}
+
+/**
+ * Records a failure
+ * @param  format The printf() format of the description
+ * @return -1
+ */
+int Publisher::fail(const char* format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	formatError(error, format, args);
+	va_end(args);
+
+	return -1;
+}
+
+/**
+ * Creates the ring subscribers attach to, first removing any a publisher that died left behind
+ * @param  keyFile The file to generate the key from
+ * @return 0, or -1 on failure
+ */
+int Publisher::open(const char* keyFile)
+{
+	/* Generate the broadcast key, creating the key file if we are first */
+	key_t key = sessionKey(keyFile, BROADCAST_PROJECT_ID);
+
+	/* The creator of a segment already using the key */
+	pid_t owner;
+
+	/* Failed to generate the key */
+	if (key < 0)
+	{
+		return fail("%s: %s", keyFile, strerror(errno));
+	}
+
+	if (numSlots < 1 || numSlots > MAX_BROADCAST_SLOTS)
+	{
+		return fail("The number of slots must be between 1 and %d.", MAX_BROADCAST_SLOTS);
+	}
+
+	/* Chunk sizes are kept in 32 bits */
+	if (chunkSize == 0 || chunkSize > UINT32_MAX)
+	{
+		return fail("Invalid chunk size %zu.", chunkSize);
+	}
+
+	if (minSubscribers < 1 || minSubscribers > MAX_SUBSCRIBERS)
+	{
+		return fail("The number of subscribers must be between 1 and %d.", MAX_SUBSCRIBERS);
+	}
+
+	/* Remove what a publisher that died left behind, but never a live one's ring */
+	if (clearStaleSession(key, owner) < 0)
+	{
+		if (errno == EBUSY)
+		{
+			return fail("Publisher %d is already using %s.", (int)owner, keyFile);
+		}
+
+		return fail("Removing a stale broadcast: %s", strerror(errno));
+	}
+
+	/* The statistics page, the header and the ring */
+	if ((shmid = shmget(key, STATS_PAGE_SIZE + BROADCAST_HEADER_SIZE + numSlots * chunkSize,
+		IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR)) < 0)
+	{
+		if (errno == EEXIST)
+		{
+			return fail("Another publisher is already using %s.", keyFile);
+		}
+
+		return fail("shmget: %s", strerror(errno));
+	}
+
+	if ((sharedMemPtr = shmat(shmid, NULL, 0)) == (void*)-1)
+	{
+		sharedMemPtr = NULL;
+		close();
+		return fail("shmat: %s", strerror(errno));
+	}
+
+	stats = static_cast<transferStats*>(sharedMemPtr);
+	header = reinterpret_cast<broadcastHeader*>(static_cast<char*>(sharedMemPtr) + STATS_PAGE_SIZE);
+	slots = static_cast<char*>(sharedMemPtr) + STATS_PAGE_SIZE + BROADCAST_HEADER_SIZE;
+
+	header->numSlots = numSlots;
+	header->chunkSize = chunkSize;
+
+	/* Subscribers only look at the header once the page is marked ready */
+	stats->numSlots.store(numSlots, memory_order_relaxed);
+	stats->chunkSize.store(chunkSize, memory_order_relaxed);
+	stats->sender.pid.store(getpid(), memory_order_relaxed);
+	stats->state.store(STATE_WAITING, memory_order_relaxed);
+	stats->magic.store(STATS_MAGIC, memory_order_release);
+
+	return 0;
+}
+
+/**
+ * Detaches from the ring and removes it
+ */
+void Publisher::close()
+{
+	if (sharedMemPtr)
+	{
+		/* Subscribers still waiting find out the broadcast is over without them */
+		if (header->state.load(memory_order_relaxed) != BROADCAST_ENDED)
+		{
+			header->state.store(BROADCAST_FAILED, memory_order_release);
+		}
+
+		shmdt(sharedMemPtr);
+		sharedMemPtr = NULL;
+		stats = NULL;
+		header = NULL;
+		slots = NULL;
+	}
+
+	/* Subscribers still attached keep their mapping until they detach */
+	if (shmid >= 0)
+	{
+		shmctl(shmid, IPC_RMID, 0);
+		shmid = -1;
+	}
+}
+
+/**
+ * Finds the subscriber furthest behind, detaching any that died on the way
+ * @param  numActive Set to the number of subscribers still reading or done
+ * @return The lowest cursor of those still reading, or the head if none are
+ */
+uint64_t Publisher::slowestCursor(int& numActive)
+{
+	/* The lowest cursor so far */
+	uint64_t slowest = header->head.load(memory_order_relaxed);
+
+	numActive = 0;
+
+	for (int i = 0; i < MAX_SUBSCRIBERS; ++i)
+	{
+		subscriberEntry& entry = header->subscribers[i];
+		uint32_t state = entry.state.load(memory_order_acquire);
+
+		if (state == SUBSCRIBER_ACTIVE)
+		{
+			slowest = min(slowest, entry.cursor.load(memory_order_acquire));
+		}
+
+		numActive += state == SUBSCRIBER_ACTIVE || state == SUBSCRIBER_DONE;
+	}
+
+	return slowest;
+}
+
+/**
+ * Waits for minSubscribers to join, then closes the remaining entries
+ * @return 0, or -1 on failure
+ */
+int Publisher::waitForSubscribers()
+{
+	/* When to give up */
+	uint64_t deadline = nowNs() + (uint64_t)joinTimeoutMs * 1000000;
+
+	/* The rounds waited so far */
+	unsigned round = 0;
+
+	/* The number of subscribers that joined so far */
+	int numActive;
+
+	while (true)
+	{
+		/* Drop subscribers that died while waiting with us */
+		for (int i = 0; i < MAX_SUBSCRIBERS; ++i)
+		{
+			subscriberEntry& entry = header->subscribers[i];
+			uint32_t expected = SUBSCRIBER_ACTIVE;
+
+			if (entry.state.load(memory_order_acquire) == SUBSCRIBER_ACTIVE && !processAlive(entry.pid.load(memory_order_relaxed)))
+			{
+				entry.state.compare_exchange_strong(expected, SUBSCRIBER_LEFT);
+			}
+		}
+
+		slowestCursor(numActive);
+
+		if (numActive >= minSubscribers)
+		{
+			break;
+		}
+
+		if (joinTimeoutMs >= 0 && nowNs() >= deadline)
+		{
+			return fail("Only %d of %d subscribers joined within %d ms.", numActive, minSubscribers, joinTimeoutMs);
+		}
+
+		backOff(round);
+	}
+
+	/* Close every free entry, so anyone who has not joined by now never will. A
+	 * subscriber partway through joining owns its entry and finishes quickly.
+	 */
+	header->state.store(BROADCAST_RUNNING, memory_order_seq_cst);
+
+	for (int i = 0; i < MAX_SUBSCRIBERS; ++i)
+	{
+		subscriberEntry& entry = header->subscribers[i];
+		uint32_t expected = SUBSCRIBER_FREE;
+
+		round = 0;
+
+		while (!entry.state.compare_exchange_strong(expected, SUBSCRIBER_CLOSED) && expected == SUBSCRIBER_JOINING)
+		{
+			backOff(round);
+			expected = SUBSCRIBER_FREE;
+		}
+	}
+
+	slowestCursor(numJoined);
+
+	return 0;
+}
+
+/**
+ * Waits for every subscriber still reading to consume up to a chunk,
+ * detaching the ones that die and evicting the ones that take too long
+ * @param  target The number of chunks each must have consumed
+ * @return 0, or -1 on failure, when no subscribers are left
+ */
+int Publisher::waitForSlowest(uint64_t target)
+{
+	/* When we started waiting, for the blocked time and eviction */
+	uint64_t start = nowNs();
+
+	/* The rounds waited so far */
+	unsigned round = 0;
+
+	/* The number of subscribers still reading or done */
+	int numActive;
+
+	while (slowestCursor(numActive) < target)
+	{
+		/* Look for dead and lagging subscribers once yielding alone has not helped */
+		if (round >= BROADCAST_YIELD_ROUNDS)
+		{
+			bool tooLong = evictAfterMs > 0 && nowNs() - start >= (uint64_t)evictAfterMs * 1000000;
+
+			for (int i = 0; i < MAX_SUBSCRIBERS; ++i)
+			{
+				subscriberEntry& entry = header->subscribers[i];
+				uint32_t expected = SUBSCRIBER_ACTIVE;
+
+				if (entry.state.load(memory_order_acquire) != SUBSCRIBER_ACTIVE || entry.cursor.load(memory_order_acquire) >= target)
+				{
+					continue;
+				}
+
+				/* Evicting before reusing its slot is what tells the subscriber not to trust the bytes it is reading */
+				if (!processAlive(entry.pid.load(memory_order_relaxed)))
+				{
+					entry.state.compare_exchange_strong(expected, SUBSCRIBER_LEFT);
+				}
+				else if (tooLong)
+				{
+					entry.state.compare_exchange_strong(expected, SUBSCRIBER_EVICTED);
+				}
+			}
+		}
+
+		backOff(round);
+	}
+
+	statAdd(stats->sender.blockedNs, nowNs() - start);
+
+	if (numActive == 0)
+	{
+		return fail("Every subscriber left or was evicted.");
+	}
+
+	return 0;
+}
+
+/**
+ * Waits for minSubscribers to join, then publishes the whole source and waits for every subscriber still attached to consume it
+ * @param  name The name to give the subscribers
+ * @param  source Where the bytes come from
+ * @return The number of bytes published, or -1 on failure
+ */
+int64_t Publisher::publish(const char* name, TransferSource& source)
+{
+	/* The number of chunks published and bytes read */
+	uint64_t numChunks = 0;
+	int64_t numBytes = 0;
+
+	/* Whether the source has ended */
+	bool atEnd = false;
+
+	/* When the current read started, and the transfer rate bookkeeping */
+	uint64_t start, rateNs = nowNs(), rateBytes = 0;
+
+	if (strlen(name) >= BROADCAST_NAME_SIZE)
+	{
+		return fail("The name must be shorter than %d bytes.", BROADCAST_NAME_SIZE);
+	}
+
+	if (header->state.load(memory_order_relaxed) != BROADCAST_OPEN)
+	{
+		return fail("A publisher runs one broadcast per open().");
+	}
+
+	/* Subscribers may learn the name while the others join */
+	strcpy(header->fileName, name);
+	header->named.store(1, memory_order_release);
+
+	strncpy(stats->fileName, name, STATS_FILE_NAME_SIZE - 1);
+
+	if (source.size() >= 0)
+	{
+		stats->fileSize.store(source.size(), memory_order_relaxed);
+	}
+
+	if (waitForSubscribers() < 0)
+	{
+		header->state.store(BROADCAST_FAILED, memory_order_release);
+		return -1;
+	}
+
+	stats->startNs.store(nowNs(), memory_order_relaxed);
+	stats->state.store(STATE_TRANSFERRING, memory_order_release);
+
+	while (!atEnd)
+	{
+		/* The slot of chunk n last held chunk n - numSlots, which everyone must be done with */
+		if (numChunks >= (uint64_t)numSlots && waitForSlowest(numChunks + 1 - numSlots) < 0)
+		{
+			header->state.store(BROADCAST_FAILED, memory_order_release);
+			return -1;
+		}
+
+		/* Read straight into the slot */
+		char* slot = slots + (numChunks % numSlots) * chunkSize;
+		start = nowNs();
+		ssize_t size = readFully(source, slot, chunkSize, atEnd);
+
+		if (size < 0)
+		{
+			header->state.store(BROADCAST_FAILED, memory_order_release);
+			return fail("read: %s", strerror(errno));
+		}
+
+		statAdd(stats->sender.diskNs, nowNs() - start);
+
+		if (size == 0)
+		{
+			break;
+		}
+
+		/* The size goes out with the head that makes the chunk visible */
+		header->sizes[numChunks % numSlots] = size;
+		header->head.store(++numChunks, memory_order_release);
+		numBytes += size;
+
+		statAdd(stats->sender.bytes, size);
+		statAdd(stats->sender.chunks, 1);
+		statUpdateRate(stats->sender, nowNs(), rateNs, rateBytes);
+	}
+
+	header->state.store(BROADCAST_ENDED, memory_order_release);
+
+	/* Keep the ring until everyone still reading has all of it */
+	if (waitForSlowest(numChunks) < 0)
+	{
+		return -1;
+	}
+
+	/* How it went for the subscribers */
+	numDetached = numEvicted = 0;
+
+	for (int i = 0; i < MAX_SUBSCRIBERS; ++i)
+	{
+		uint32_t state = header->subscribers[i].state.load(memory_order_acquire);
+
+		numDetached += state == SUBSCRIBER_LEFT;
+		numEvicted += state == SUBSCRIBER_EVICTED;
+	}
+
+	stats->state.store(STATE_DONE, memory_order_relaxed);
+
+	return numBytes;
+}
+
+Subscriber::Subscriber() : readyTimeoutMs(DEFAULT_READY_TIMEOUT_MS), shmid(-1), sharedMemPtr(NULL), header(NULL), slots(NULL),
+	slot(-1), publisherPid(0)
+{
+}
+
+Subscriber::~Subscriber()
+{
+	close();
+}
+
+/**
+ * Records a failure
+ * @param  format The printf() format of the description
+ * @return -1
+ */
+int Subscriber::fail(const char* format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	formatError(error, format, args);
+	va_end(args);
+
+	return -1;
+}
+
+/**
+ * Waits up to readyTimeoutMs for a publisher's ring and joins it
+ * @param  keyFile The file the publisher generated its key from
+ * @return 0, or -1 on failure, including when the broadcast already started
+ */
+int Subscriber::open(const char* keyFile)
+{
+	/* Generate the broadcast key, creating the key file if we are first */
+	key_t key = sessionKey(keyFile, BROADCAST_PROJECT_ID);
+
+	/* The segment's attributes */
+	struct shmid_ds shmInfo;
+
+	/* Failed to generate the key */
+	if (key < 0)
+	{
+		return fail("%s: %s", keyFile, strerror(errno));
+	}
+
+	/* Attach once a live publisher has set up the ring */
+	if ((sharedMemPtr = attachWhenReady(key, readyTimeoutMs, shmid)) == NULL)
+	{
+		shmid = -1;
+
+		if (errno == ETIMEDOUT)
+		{
+			return fail("No publisher got ready within %d ms.", readyTimeoutMs);
+		}
+
+		return fail("shmget: %s", strerror(errno));
+	}
+
+	if (shmctl(shmid, IPC_STAT, &shmInfo) < 0)
+	{
+		close();
+		return fail("shmctl: %s", strerror(errno));
+	}
+
+	publisherPid = shmInfo.shm_cpid;
+	header = reinterpret_cast<broadcastHeader*>(static_cast<char*>(sharedMemPtr) + STATS_PAGE_SIZE);
+	slots = static_cast<const char*>(sharedMemPtr) + STATS_PAGE_SIZE + BROADCAST_HEADER_SIZE;
+
+	/* Claim a free entry, then fill it in before the publisher counts it */
+	for (int i = 0; i < MAX_SUBSCRIBERS; ++i)
+	{
+		subscriberEntry& entry = header->subscribers[i];
+		uint32_t expected = SUBSCRIBER_FREE;
+
+		if (entry.state.compare_exchange_strong(expected, SUBSCRIBER_JOINING))
+		{
+			entry.pid.store(getpid(), memory_order_relaxed);
+			entry.cursor.store(0, memory_order_relaxed);
+			entry.state.store(SUBSCRIBER_ACTIVE, memory_order_release);
+			slot = i;
+
+			return 0;
+		}
+	}
+
+	bool started = header->state.load(memory_order_acquire) != BROADCAST_OPEN;
+	close();
+
+	return started ? fail("The broadcast has already started.") : fail("The broadcast already has %d subscribers.", MAX_SUBSCRIBERS);
+}
+
+/**
+ * Leaves the broadcast, so the publisher stops waiting for us, and detaches
+ */
+void Subscriber::close()
+{
+	if (sharedMemPtr)
+	{
+		if (slot >= 0)
+		{
+			uint32_t expected = SUBSCRIBER_ACTIVE;
+			header->subscribers[slot].state.compare_exchange_strong(expected, SUBSCRIBER_LEFT);
+		}
+
+		shmdt(sharedMemPtr);
+		sharedMemPtr = NULL;
+		header = NULL;
+		slots = NULL;
+	}
+
+	shmid = -1;
+	slot = -1;
+}
+
+/**
+ * Checks that the publisher is still publishing
+ * @return 0, or -1 on failure
+ */
+int Subscriber::checkPublisher()
+{
+	if (header->state.load(memory_order_acquire) == BROADCAST_FAILED)
+	{
+		return fail("The publisher gave up.");
+	}
+
+	if (!processAlive(publisherPid))
+	{
+		return fail("The publisher died.");
+	}
+
+	return 0;
+}
+
+/**
+ * Waits for the publisher to start
+ * @param  fileName Set to the name the publisher gave
+ * @return 0, or -1 on failure
+ */
+int Subscriber::accept(string& fileName)
+{
+	/* The rounds waited so far */
+	unsigned round = 0;
+
+	while (!header->named.load(memory_order_acquire))
+	{
+		if (round >= BROADCAST_YIELD_ROUNDS && checkPublisher() < 0)
+		{
+			return -1;
+		}
+
+		backOff(round);
+	}
+
+	fileName = header->fileName;
+
+	return 0;
+}
+
+/**
+ * Receives every byte of the broadcast
+ * @param  sink Where to put them
+ * @return The number of bytes received, or -1 on failure, including eviction
+ */
+int64_t Subscriber::receive(TransferSink& sink)
+{
+	subscriberEntry& entry = header->subscribers[slot];
+
+	/* The ring, as the publisher set it up */
+	uint32_t numSlots = header->numSlots;
+	uint64_t chunkSize = header->chunkSize;
+
+	/* The next chunk to consume and the number of bytes received */
+	uint64_t cursor = entry.cursor.load(memory_order_relaxed);
+	int64_t numBytes = 0;
+
+	/* The rounds waited for the current chunk */
+	unsigned round = 0;
+
+	/* A copy of the current chunk, so nothing reaches the sink before we know
+	 * the publisher did not reuse its slot while we read it
+	 */
+	vector<char> chunk(chunkSize);
+
+	while (true)
+	{
+		if (cursor < header->head.load(memory_order_acquire))
+		{
+			uint32_t index = cursor % numSlots;
+			uint32_t size = header->sizes[index];
+
+			memcpy(chunk.data(), slots + index * chunkSize, size);
+
+			/* The publisher evicts us before it reuses a slot we have not
+			 * finished with, so the bytes are only good if we are still active
+			 */
+			atomic_thread_fence(memory_order_acquire);
+
+			if (entry.state.load(memory_order_relaxed) != SUBSCRIBER_ACTIVE)
+			{
+				return fail("Evicted for falling behind.");
+			}
+
+			if (sink.write(chunk.data(), size) < 0)
+			{
+				return fail("write: %s", strerror(errno));
+			}
+
+			entry.cursor.store(++cursor, memory_order_release);
+			numBytes += size;
+			round = 0;
+			continue;
+		}
+
+		/* The head only moves before the broadcast ends, so look at it again after */
+		if (header->state.load(memory_order_acquire) == BROADCAST_ENDED && cursor == header->head.load(memory_order_acquire))
+		{
+			break;
+		}
+
+		if (round >= BROADCAST_YIELD_ROUNDS && checkPublisher() < 0)
+		{
+			return -1;
+		}
+
+		backOff(round);
+	}
+
+	if (sink.finish() < 0)
+	{
+		return fail("finish: %s", strerror(errno));
+	}
+
+	/* The publisher may remove the ring as soon as it sees this */
+	uint32_t expected = SUBSCRIBER_ACTIVE;
+	entry.state.compare_exchange_strong(expected, SUBSCRIBER_DONE);
+
+	return numBytes;
+}
@@ -0,0 +1,201 @@
+/* One-to-many transfers. A Publisher reads each chunk of its source once
+ * into a ring of slots in its own shared memory segment, and every
+ * Subscriber that joined before the first chunk reads it from there through
+ * its own cursor. A slot is reused only once the slowest subscriber has
+ * consumed it, so the slowest one sets the pace. A subscriber that dies is
+ * detached, and one that holds the publisher up for longer than
+ * evictAfterMs is evicted and fails instead of slowing everyone down.
+ *
+ *	Publisher publisher;
+ *	FileSource source;
+ *
+ *	publisher.minSubscribers = 3;
+ *	if (publisher.open() < 0 || source.open("file") < 0 || publisher.publish("file", source) < 0)
+ *		fprintf(stderr, "%s\n", publisher.lastError());
+ *
+ *	Subscriber subscriber;
+ *	std::string name;
+ *	MemorySink sink;
+ *
+ *	if (subscriber.open() < 0 || subscriber.accept(name) < 0 || subscriber.receive(sink) < 0)
+ *		fprintf(stderr, "%s\n", subscriber.lastError());
+ *
+ * Both sides only touch shared memory, so each waits by polling with a
+ * growing pause, which lets it notice a dead or lagging peer in time. The
+ * segment uses the same key file as a Receiver's but its own key, and
+ * starts with the statistics page, where the publisher keeps the sender
+ * counters. A Publisher runs one broadcast per open().
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string>
+
+class TransferSource;
+class TransferSink;
+struct transferStats;
+struct broadcastHeader;
+
+/* The ftok() project id of broadcast segments, beside the 'a' of the normal protocol */
+#define BROADCAST_PROJECT_ID 'b'
+
+/* The most subscribers one broadcast can have */
+#define MAX_SUBSCRIBERS 32
+
+/* The most slots in the ring */
+#define MAX_BROADCAST_SLOTS 256
+
+/* The default ring */
+#define DEFAULT_BROADCAST_SLOTS 16
+#define DEFAULT_BROADCAST_CHUNK_SIZE (64 * 1024)
+
+/* How long a publisher waits for its subscribers to join by default, in milliseconds */
+#define DEFAULT_JOIN_TIMEOUT_MS 10000
+
+/**
+ * The publishing side of a broadcast
+ */
+class Publisher
+{
+public:
+	Publisher();
+	~Publisher();
+	Publisher(const Publisher&) = delete;
+	Publisher& operator=(const Publisher&) = delete;
+
+	/**
+	 * Creates the ring subscribers attach to, first removing any a
+	 * publisher that died left behind
+	 * @param  keyFile The file to generate the key from
+	 * @return 0, or -1 on failure
+	 */
+	int open(const char* keyFile = "keyfile.txt");
+
+	/**
+	 * Detaches from the ring and removes it
+	 */
+	void close();
+
+	/**
+	 * Waits for minSubscribers to join, then publishes the whole source and
+	 * waits for every subscriber still attached to consume it
+	 * @param  name The name to give the subscribers
+	 * @param  source Where the bytes come from
+	 * @return The number of bytes published, or -1 on failure
+	 */
+	int64_t publish(const char* name, TransferSource& source);
+
+	/**
+	 * Describes the last failure
+	 * @return The description
+	 */
+	const char* lastError() const { return error.c_str(); }
+
+	/* The number of subscribers that joined, and how many of them were
+	 * detached because they died or evicted for falling behind
+	 */
+	int joined() const { return numJoined; }
+	int detached() const { return numDetached; }
+	int evicted() const { return numEvicted; }
+
+	/* The number of slots in the ring and the size of each, set before open() */
+	int numSlots;
+	size_t chunkSize;
+
+	/* How many subscribers to wait for, and for how long in milliseconds, -1 for as long as it takes */
+	int minSubscribers;
+	int joinTimeoutMs;
+
+	/* How long a subscriber may hold up the publisher at a stretch before
+	 * it is evicted, in milliseconds, 0 to wait for it however long it takes
+	 */
+	int evictAfterMs;
+
+private:
+	int fail(const char* format, ...) __attribute__((format(printf, 2, 3)));
+	int waitForSubscribers();
+	int waitForSlowest(uint64_t target);
+	uint64_t slowestCursor(int& numActive);
+
+	/* The segment and where its parts start */
+	int shmid;
+	void* sharedMemPtr;
+	transferStats* stats;
+	broadcastHeader* header;
+	char* slots;
+
+	/* The outcome of the last broadcast */
+	int numJoined;
+	int numDetached;
+	int numEvicted;
+
+	/* The description of the last failure */
+	std::string error;
+};
+
+/**
+ * One of the receiving sides of a broadcast
+ */
+class Subscriber
+{
+public:
+	Subscriber();
+	~Subscriber();
+	Subscriber(const Subscriber&) = delete;
+	Subscriber& operator=(const Subscriber&) = delete;
+
+	/**
+	 * Waits up to readyTimeoutMs for a publisher's ring and joins it
+	 * @param  keyFile The file the publisher generated its key from
+	 * @return 0, or -1 on failure, including when the broadcast already started
+	 */
+	int open(const char* keyFile = "keyfile.txt");
+
+	/**
+	 * Leaves the broadcast, so the publisher stops waiting for us, and detaches
+	 */
+	void close();
+
+	/**
+	 * Waits for the publisher to start
+	 * @param  fileName Set to the name the publisher gave
+	 * @return 0, or -1 on failure
+	 */
+	int accept(std::string& fileName);
+
+	/**
+	 * Receives every byte of the broadcast
+	 * @param  sink Where to put them
+	 * @return The number of bytes received, or -1 on failure, including eviction
+	 */
+	int64_t receive(TransferSink& sink);
+
+	/**
+	 * Describes the last failure
+	 * @return The description
+	 */
+	const char* lastError() const { return error.c_str(); }
+
+	/* Our place among the subscribers, from 0, once open() succeeds */
+	int index() const { return slot; }
+
+	/* How long open() waits for a publisher, in milliseconds, -1 for as long as it takes */
+	int readyTimeoutMs;
+
+private:
+	int fail(const char* format, ...) __attribute__((format(printf, 2, 3)));
+	int checkPublisher();
+
+	/* The segment and where its parts start */
+	int shmid;
+	void* sharedMemPtr;
+	broadcastHeader* header;
+	const char* slots;
+
+	/* Our entry in the header, and the publisher that created the segment */
+	int slot;
+	pid_t publisherPid;
+
+	/* The description of the last failure */
+	std::string error;
+};
@@ -0,0 +1,126 @@
+#include <string.h>
+#include "checksum.h"
+
+/* The 8-byte crc32 instruction only exists on 64-bit x86. Elsewhere the
+ * checksum is always computed in software.
+ */
+#if defined(__x86_64__)
+#define CHECKSUM_HAVE_CRC32 1
+#endif
+
+/* The reversed CRC-32C (Castagnoli) polynomial */
+#define CRC32C_POLY 0x82f63b78
+
+/* The checksum of every byte value */
+struct crc32cTable
+{
+	uint32_t entries[256];
+};
+
+/**
+ * Computes the CRC-32C of a buffer a bit at a time
+ * @param  crc The running checksum
+ * @param  data The bytes to checksum
+ * @param  len The number of bytes
+ * @return The updated running checksum
+ */
+static uint32_t crc32cSoftware(uint32_t crc, const unsigned char* data, size_t len)
+{
+	/* The table, built on first use. Pipeline workers may get here at once,
+	 * and only the initialization of a static is guaranteed to happen once.
+	 */
+	static const crc32cTable table = []()
+	{
+		crc32cTable built;
+
+		for (uint32_t i = 0; i < 256; ++i)
+		{
+			uint32_t entry = i;
+
+			for (int bit = 0; bit < 8; ++bit)
+			{
+				entry = (entry >> 1) ^ (entry & 1 ? CRC32C_POLY : 0);
+			}
+
+			built.entries[i] = entry;
+		}
+
+		return built;
+	}();
+
+	while (len--)
+	{
+		crc = table.entries[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+	}
+
+	return crc;
+}
+
+/**
+ * Computes the CRC-32C of a buffer eight bytes at a time with the SSE4.2 crc32 instruction
+ * @param  crc The running checksum
+ * @param  data The bytes to checksum
+ * @param  len The number of bytes
+ * @return The updated running checksum
+ */
+#ifdef CHECKSUM_HAVE_CRC32
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(uint32_t crc, const unsigned char* data, size_t len)
+{
+	/* The checksum is kept in a 64-bit register by the 8-byte form of the instruction */
+	uint64_t crc64 = crc;
+
+	for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t), data += sizeof(uint64_t))
+	{
+		uint64_t word;
+
+		memcpy(&word, data, sizeof(word));
+		crc64 = __builtin_ia32_crc32di(crc64, word);
+	}
+
+	crc = (uint32_t)crc64;
+
+	for (; len > 0; --len)
+	{
+		crc = __builtin_ia32_crc32qi(crc, *data++);
+	}
+
+	return crc;
+}
+#endif
+
+/**
+ * Computes the CRC-32C of a buffer, using the SSE4.2 crc32 instruction
+ * when the CPU has it
+ * @param  data The bytes to checksum
+ * @param  len The number of bytes
+ * @return The checksum
+ */
+uint32_t crc32c(const void* data, size_t len)
+{
+	return crc32cExtend(0, data, len);
+}
+
+/**
+ * Extends a checksum with the bytes that follow
+ * @param  crc The CRC-32C of the bytes so far, 0 for none
+ * @param  data The next bytes
+ * @param  len The number of bytes
+ * @return The CRC-32C of all the bytes
+ */
+uint32_t crc32cExtend(uint32_t crc, const void* data, size_t len)
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+
+#ifdef CHECKSUM_HAVE_CRC32
+	/* Whether the CPU has the crc32 instruction */
+	static bool haveSse42 = __builtin_cpu_supports("sse4.2");
+
+	if (haveSse42)
+	{
+		return ~crc32cHardware(~crc, bytes, len);
+	}
+#endif
+
+	return ~crc32cSoftware(~crc, bytes, len);
+}
@@ -0,0 +1,23 @@
+/* CRC-32C checksums of chunk data */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Computes the CRC-32C of a buffer, using the SSE4.2 crc32 instruction
+ * when the CPU has it
+ * @param  data The bytes to checksum
+ * @param  len The number of bytes
+ * @return The checksum
+ */
+uint32_t crc32c(const void* data, size_t len);
+
+/**
+ * Extends a checksum with the bytes that follow, so a file's checksum can be
+ * computed a chunk at a time
+ * @param  crc The CRC-32C of the bytes so far, 0 for none
+ * @param  data The next bytes
+ * @param  len The number of bytes
+ * @return The CRC-32C of all the bytes
+ */
+uint32_t crc32cExtend(uint32_t crc, const void* data, size_t len);
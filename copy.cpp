@@ -0,0 +1,168 @@
+#include <stdint.h>
+#include <string.h>
+#include "copy.h"
+
+/* The streaming kernels need x86 intrinsics. Elsewhere every kernel but
+ * scalar is unsupported.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define COPY_HAVE_STREAMING 1
+#endif
+
+/* The kernel in use, -1 until the first call picks the fastest */
+static int currentKernel = -1;
+
+#ifdef COPY_HAVE_STREAMING
+
+/**
+ * Copies with 32-byte AVX2 streaming stores, four at a time
+ * @param  dst Where to copy to
+ * @param  src Where to copy from
+ * @param  len The number of bytes, at least STREAM_COPY_MIN_SIZE
+ */
+__attribute__((target("avx2")))
+static void streamCopyAvx2(char* dst, const char* src, size_t len)
+{
+	/* Copy up to the first 32-byte boundary normally so the stores are aligned */
+	size_t head = (32 - ((uintptr_t)dst & 31)) & 31;
+
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	len -= head;
+
+	for (; len >= 128; len -= 128, src += 128, dst += 128)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i*)src);
+		__m256i b = _mm256_loadu_si256((const __m256i*)(src + 32));
+		__m256i c = _mm256_loadu_si256((const __m256i*)(src + 64));
+		__m256i d = _mm256_loadu_si256((const __m256i*)(src + 96));
+
+		_mm256_stream_si256((__m256i*)dst, a);
+		_mm256_stream_si256((__m256i*)(dst + 32), b);
+		_mm256_stream_si256((__m256i*)(dst + 64), c);
+		_mm256_stream_si256((__m256i*)(dst + 96), d);
+	}
+
+	for (; len >= 32; len -= 32, src += 32, dst += 32)
+	{
+		_mm256_stream_si256((__m256i*)dst, _mm256_loadu_si256((const __m256i*)src));
+	}
+
+	_mm_sfence();
+	memcpy(dst, src, len);
+}
+
+/**
+ * Copies with 16-byte SSE2 streaming stores, four at a time
+ * @param  dst Where to copy to
+ * @param  src Where to copy from
+ * @param  len The number of bytes, at least STREAM_COPY_MIN_SIZE
+ */
+__attribute__((target("sse2")))
+static void streamCopySse2(char* dst, const char* src, size_t len)
+{
+	/* Copy up to the first 16-byte boundary normally so the stores are aligned */
+	size_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	len -= head;
+
+	for (; len >= 64; len -= 64, src += 64, dst += 64)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i*)src);
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+		__m128i c = _mm_loadu_si128((const __m128i*)(src + 32));
+		__m128i d = _mm_loadu_si128((const __m128i*)(src + 48));
+
+		_mm_stream_si128((__m128i*)dst, a);
+		_mm_stream_si128((__m128i*)(dst + 16), b);
+		_mm_stream_si128((__m128i*)(dst + 32), c);
+		_mm_stream_si128((__m128i*)(dst + 48), d);
+	}
+
+	for (; len >= 16; len -= 16, src += 16, dst += 16)
+	{
+		_mm_stream_si128((__m128i*)dst, _mm_loadu_si128((const __m128i*)src));
+	}
+
+	_mm_sfence();
+	memcpy(dst, src, len);
+}
+#endif
+
+/**
+ * Copies bytes with the current kernel
+ * @param  dst Where to copy to
+ * @param  src Where to copy from, not overlapping dst
+ * @param  len The number of bytes
+ */
+void streamCopy(void* dst, const void* src, size_t len)
+{
+	if (currentKernel < 0)
+	{
+		currentKernel = bestCopyKernel();
+	}
+
+#ifdef COPY_HAVE_STREAMING
+	if (len >= STREAM_COPY_MIN_SIZE && currentKernel == COPY_KERNEL_AVX2)
+	{
+		streamCopyAvx2(static_cast<char*>(dst), static_cast<const char*>(src), len);
+		return;
+	}
+
+	if (len >= STREAM_COPY_MIN_SIZE && currentKernel == COPY_KERNEL_SSE2)
+	{
+		streamCopySse2(static_cast<char*>(dst), static_cast<const char*>(src), len);
+		return;
+	}
+#endif
+
+	memcpy(dst, src, len);
+}
+
+/**
+ * Gets the fastest kernel the CPU supports
+ * @return One of the COPY_KERNEL_* values
+ */
+int bestCopyKernel()
+{
+#ifdef COPY_HAVE_STREAMING
+	/* What the CPU has */
+	static bool haveAvx2 = __builtin_cpu_supports("avx2");
+	static bool haveSse2 = __builtin_cpu_supports("sse2");
+
+	return haveAvx2 ? COPY_KERNEL_AVX2 : haveSse2 ? COPY_KERNEL_SSE2 : COPY_KERNEL_SCALAR;
+#else
+	return COPY_KERNEL_SCALAR;
+#endif
+}
+
+/**
+ * Gets the kernel streamCopy() uses
+ * @return One of the COPY_KERNEL_* values
+ */
+int copyKernel()
+{
+	return currentKernel < 0 ? bestCopyKernel() : currentKernel;
+}
+
+/**
+ * Makes streamCopy() use a kernel
+ * @param  kernel One of the COPY_KERNEL_* values
+ * @return 0, or -1 if the CPU does not support it
+ */
+int useCopyKernel(int kernel)
+{
+	if (kernel < 0 || kernel > bestCopyKernel())
+	{
+		return -1;
+	}
+
+	currentKernel = kernel;
+
+	return 0;
+}
@@ -0,0 +1,49 @@
+/* Copying bytes into shared memory with non-temporal stores, which write
+ * around the caches instead of evicting what the copying process still
+ * needs for bytes it never reads again. The kernel is picked at run time
+ * from what the CPU supports. Only x86 CPUs have streaming kernels; others
+ * always use memcpy().
+ */
+
+#include <stddef.h>
+
+/* The copy kernels, slowest first. Scalar is plain memcpy(). */
+#define COPY_KERNEL_SCALAR 0
+#define COPY_KERNEL_SSE2 1
+#define COPY_KERNEL_AVX2 2
+#define NUM_COPY_KERNELS 3
+#define COPY_KERNEL_NAMES { "scalar", "sse2", "avx2" }
+
+/* Copies shorter than this use memcpy() whatever the kernel, since the
+ * stores would mostly be the unaligned head and tail anyway
+ */
+#define STREAM_COPY_MIN_SIZE 256
+
+/**
+ * Copies bytes with the current kernel. The streaming stores are fenced
+ * before it returns, so whatever announces the bytes afterwards cannot
+ * overtake them.
+ * @param  dst Where to copy to
+ * @param  src Where to copy from, not overlapping dst
+ * @param  len The number of bytes
+ */
+void streamCopy(void* dst, const void* src, size_t len);
+
+/**
+ * Gets the fastest kernel the CPU supports
+ * @return One of the COPY_KERNEL_* values
+ */
+int bestCopyKernel();
+
+/**
+ * Gets the kernel streamCopy() uses, the fastest one unless useCopyKernel() said otherwise
+ * @return One of the COPY_KERNEL_* values
+ */
+int copyKernel();
+
+/**
+ * Makes streamCopy() use a kernel, for comparing them
+ * @param  kernel One of the COPY_KERNEL_* values
+ * @return 0, or -1 if the CPU does not support it
+ */
+int useCopyKernel(int kernel);
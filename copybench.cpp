@@ -0,0 +1,207 @@
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "copy.h"    /* For picking the copy kernel */
+#include "transfer.h"    /* For the sources the sender reads files with */
+#include "stats.h"    /* For nowNs() */
+#include "util.h"    /* For parseSize() */
+
+using namespace std;
+
+/* The default slot size and number of slots, as a receiver started with -s 64K offers */
+#define DEFAULT_BENCH_CHUNK_SIZE (64 * 1024)
+#define DEFAULT_BENCH_SLOTS 8
+
+/* The default number of times to copy the file with each method */
+#define DEFAULT_REPEATS 5
+
+/**
+ * Copies a whole source into a ring of slots chunk by chunk, the way a Sender fills them
+ * @param  source Where the bytes come from, freshly opened
+ * @param  slots The start of the ring
+ * @param  numSlots The number of slots in the ring
+ * @param  chunkSize The size of each slot
+ * @return The number of bytes copied, or -1 on failure
+ */
+int64_t fillSlots(TransferSource& source, char* slots, int numSlots, size_t chunkSize)
+{
+	/* The number of bytes copied so far and the slot to fill next */
+	int64_t numBytes = 0;
+	int slot = 0;
+
+	/* The bytes of the last read */
+	ssize_t numRead;
+
+	while ((numRead = source.read(slots + slot * chunkSize, chunkSize)) > 0)
+	{
+		numBytes += numRead;
+		slot = (slot + 1) % numSlots;
+	}
+
+	return numRead < 0 ? -1 : numBytes;
+}
+
+/**
+ * Copies a file with one method several times and reports the best bandwidth
+ * @param  label What to call the method
+ * @param  fileName The file
+ * @param  mapped Whether to map the file rather than read it through stdio
+ * @param  slots The start of the ring
+ * @param  numSlots The number of slots in the ring
+ * @param  chunkSize The size of each slot
+ * @param  numRepeats How many times to copy the file
+ */
+void run(const char* label, const char* fileName, bool mapped, char* slots, int numSlots, size_t chunkSize, int numRepeats)
+{
+	/* The fastest and slowest copies */
+	uint64_t bestNs = 0, worstNs = 0;
+
+	/* The number of bytes each copy moved */
+	int64_t numBytes = 0;
+
+	for (int i = 0; i < numRepeats; ++i)
+	{
+		/* The two ways of reading the file */
+		FileSource fileSource;
+		MappedFileSource mappedSource;
+		TransferSource& source = mapped ? (TransferSource&)mappedSource : (TransferSource&)fileSource;
+
+		/* When the copy started and how long it took */
+		uint64_t startNs = nowNs(), elapsedNs;
+
+		if ((mapped ? mappedSource.open(fileName) : fileSource.open(fileName)) < 0)
+		{
+			perror(fileName);
+			exit(-1);
+		}
+
+		if ((numBytes = fillSlots(source, slots, numSlots, chunkSize)) < 0)
+		{
+			perror("read");
+			exit(-1);
+		}
+
+		elapsedNs = nowNs() - startNs;
+
+		if (i == 0 || elapsedNs < bestNs)
+		{
+			bestNs = elapsedNs;
+		}
+
+		if (elapsedNs > worstNs)
+		{
+			worstNs = elapsedNs;
+		}
+	}
+
+	printf("%-14s %12.1f %12.1f\n", label,
+		bestNs ? numBytes / 1e6 / (bestNs / 1e9) : 0.0,
+		worstNs ? numBytes / 1e6 / (worstNs / 1e9) : 0.0);
+}
+
+/**
+ * Measures how fast each way the sender can read a file gets it into
+ * shared memory slots: fread() through a FileSource, and a mapped file
+ * copied with memcpy() and with each streaming kernel the CPU supports
+ * @param argc The number of command line arguments
+ * @param argv An array of C strings containing each command line argument
+ * @return The exit code
+ */
+int main(int argc, char** argv)
+{
+	/* The command line option being parsed */
+	int opt;
+
+	/* The ring's shape and how many times to copy the file with each method */
+	size_t chunkSize = DEFAULT_BENCH_CHUNK_SIZE;
+	int numSlots = DEFAULT_BENCH_SLOTS;
+	int numRepeats = DEFAULT_REPEATS;
+
+	/* The ring, shared like a segment so its pages behave the same */
+	char* slots;
+
+	/* The names of the kernels */
+	const char* kernelNames[] = COPY_KERNEL_NAMES;
+
+	/* Parse the command line options */
+	while ((opt = getopt(argc, argv, "s:w:r:")) != -1)
+	{
+		switch (opt)
+		{
+			/* The size of each slot */
+			case 's':
+				chunkSize = parseSize(optarg);
+
+				if (chunkSize == 0)
+				{
+					fprintf(stderr, "The slot size must be a positive number of bytes.\n");
+					exit(-1);
+				}
+				break;
+
+			/* The number of slots */
+			case 'w':
+				numSlots = atoi(optarg);
+
+				if (numSlots < 1)
+				{
+					fprintf(stderr, "The number of slots must be at least 1.\n");
+					exit(-1);
+				}
+				break;
+
+			/* The number of copies per method */
+			case 'r':
+				numRepeats = atoi(optarg);
+
+				if (numRepeats < 1)
+				{
+					fprintf(stderr, "The number of repeats must be at least 1.\n");
+					exit(-1);
+				}
+				break;
+
+			default:
+				optind = argc + 1;
+				break;
+		}
+	}
+
+	if (optind != argc - 1)
+	{
+		fprintf(stderr, "USAGE: %s [-s <SLOT SIZE>] [-w <SLOTS>] [-r <REPEATS>] <FILE NAME>\n", argv[0]);
+		exit(-1);
+	}
+
+	if ((slots = (char*)mmap(NULL, numSlots * chunkSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+	{
+		perror("mmap");
+		exit(-1);
+	}
+
+	/* Touch every slot so no method pays for the first faults */
+	memset(slots, 0, numSlots * chunkSize);
+
+	printf("%d copies of %s into %d slots of %zu bytes, in MB/s\n", numRepeats, argv[optind], numSlots, chunkSize);
+	printf("%-14s %12s %12s\n", "", "best", "worst");
+
+	/* Read the file once first so every method finds it in the page cache */
+	run("warm-up", argv[optind], false, slots, numSlots, chunkSize, 1);
+	run("fread", argv[optind], false, slots, numSlots, chunkSize, numRepeats);
+
+	for (int kernel = COPY_KERNEL_SCALAR; kernel <= bestCopyKernel(); ++kernel)
+	{
+		/* The method's label */
+		char label[32];
+
+		useCopyKernel(kernel);
+		snprintf(label, sizeof(label), "mmap+%s", kernel == COPY_KERNEL_SCALAR ? "memcpy" : kernelNames[kernel]);
+		run(label, argv[optind], true, slots, numSlots, chunkSize, numRepeats);
+	}
+
+	munmap(slots, numSlots * chunkSize);
+
+	return 0;
+}
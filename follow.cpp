@@ -0,0 +1,343 @@
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <thread>
+#include "stats.h"    /* For nowNs() */
+#include "transfer.h"    /* For TransferSource */
+#include "follow.h"
+
+using namespace std;
+
+/* What to hear about the file: appends and truncation, and it losing its name */
+#define FILE_EVENTS (IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)
+
+/* What to hear about its directory: a new file taking the name */
+#define DIR_EVENTS (IN_CREATE | IN_MOVED_TO)
+
+FollowSource::FollowSource() : flushDeadlineUs(DEFAULT_FLUSH_DEADLINE_US), fd(-1), offset(0), inotifyFd(-1),
+	fileWatch(-1), dirWatch(-1), stopping(false), stopFd(-1), numRotations(0), numTruncations(0)
+{
+}
+
+FollowSource::~FollowSource()
+{
+	close();
+}
+
+/**
+ * Opens the file from its start and starts watching it and its directory
+ * @param  name The name of the file
+ * @return 0, or -1 with errno set
+ */
+int FollowSource::open(const char* name)
+{
+	close();
+
+	fileName = name;
+	size_t slash = fileName.rfind('/');
+	dirName = slash == string::npos ? "." : slash == 0 ? "/" : fileName.substr(0, slash);
+
+	if ((fd = ::open(name, O_RDONLY)) < 0 ||
+		(inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0 ||
+		(stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+		(fileWatch = inotify_add_watch(inotifyFd, name, FILE_EVENTS)) < 0 ||
+		(dirWatch = inotify_add_watch(inotifyFd, dirName.c_str(), DIR_EVENTS)) < 0)
+	{
+		int error = errno;
+		close();
+		errno = error;
+		return -1;
+	}
+
+	offset = 0;
+	stopping.store(false);
+	numRotations = 0;
+	numTruncations = 0;
+
+	return 0;
+}
+
+/**
+ * Stops watching and closes the file
+ */
+void FollowSource::close()
+{
+	/* The watches go with the instance */
+	if (inotifyFd >= 0)
+	{
+		::close(inotifyFd);
+		inotifyFd = -1;
+	}
+
+	fileWatch = -1;
+	dirWatch = -1;
+
+	if (fd >= 0)
+	{
+		::close(fd);
+		fd = -1;
+	}
+
+	if (stopFd >= 0)
+	{
+		::close(stopFd);
+		stopFd = -1;
+	}
+}
+
+/**
+ * Reads the next bytes, waiting for them to be written
+ * @param  buffer Where to put them
+ * @param  size The most bytes to read
+ * @return The number of bytes read, 0 once stopped with nothing left, or -1 with errno set
+ */
+ssize_t FollowSource::read(char* buffer, size_t size)
+{
+	/* The bytes read so far, and when they have to go */
+	size_t numBytes = 0;
+	uint64_t deadlineNs = 0;
+
+	while (numBytes < size)
+	{
+		ssize_t numRead = ::read(fd, buffer + numBytes, size - numBytes);
+
+		if (numRead < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			return -1;
+		}
+
+		if (numRead > 0)
+		{
+			if (numBytes == 0)
+			{
+				deadlineNs = nowNs() + flushDeadlineUs * 1000ULL;
+			}
+
+			numBytes += numRead;
+			offset += numRead;
+			continue;
+		}
+
+		/* At the end of the file, which may have been truncated or replaced */
+		int changed = checkFile();
+
+		if (changed < 0)
+		{
+			return -1;
+		}
+
+		if (changed)
+		{
+			continue;
+		}
+
+		/* Hand over what we have once its time is up, or end once stopped */
+		if (stopping.load() || (numBytes > 0 && nowNs() >= deadlineNs))
+		{
+			break;
+		}
+
+		if (wait(numBytes > 0 ? deadlineNs : 0) < 0)
+		{
+			return -1;
+		}
+	}
+
+	return numBytes;
+}
+
+/**
+ * Looks for what happened to the file once there is nothing more to read
+ * @return 1 if there is a new file or a new start to read from, 0 if not,
+ *         or -1 with errno set
+ */
+int FollowSource::checkFile()
+{
+	/* The file we have open, and the one with its name now */
+	struct stat current, named;
+
+	if (fstat(fd, &current) < 0)
+	{
+		return -1;
+	}
+
+	/* Truncated below what we read, so start over */
+	if (current.st_size < offset)
+	{
+		if (lseek(fd, 0, SEEK_SET) < 0)
+		{
+			return -1;
+		}
+
+		offset = 0;
+		++numTruncations;
+		return 1;
+	}
+
+	/* Nothing has the name yet after a rename or delete, so wait for something to */
+	if (stat(fileName.c_str(), &named) < 0)
+	{
+		return errno == ENOENT ? 0 : -1;
+	}
+
+	if (named.st_ino == current.st_ino && named.st_dev == current.st_dev)
+	{
+		return 0;
+	}
+
+	/* Another file has the name and the old one is read to its end, so move over */
+	int newFd = ::open(fileName.c_str(), O_RDONLY);
+
+	if (newFd < 0)
+	{
+		return errno == ENOENT ? 0 : -1;
+	}
+
+	inotify_rm_watch(inotifyFd, fileWatch);
+
+	if ((fileWatch = inotify_add_watch(inotifyFd, fileName.c_str(), FILE_EVENTS)) < 0)
+	{
+		int error = errno;
+		::close(newFd);
+		errno = error;
+		return -1;
+	}
+
+	::close(fd);
+	fd = newFd;
+	offset = 0;
+	++numRotations;
+
+	return 1;
+}
+
+/**
+ * Sleeps until the file or its directory changes, stop() is called or a deadline passes
+ * @param  deadlineNs When to stop waiting, or 0 for no deadline
+ * @return 0, or -1 with errno set
+ */
+int FollowSource::wait(uint64_t deadlineNs)
+{
+	/* The inotify instance and the stop eventfd */
+	struct pollfd fds[2];
+	fds[0].fd = inotifyFd;
+	fds[0].events = POLLIN;
+	fds[1].fd = stopFd;
+	fds[1].events = POLLIN;
+
+	/* How long until the deadline */
+	struct timespec timeout;
+
+	if (deadlineNs)
+	{
+		uint64_t now = nowNs();
+
+		if (now >= deadlineNs)
+		{
+			return 0;
+		}
+
+		timeout.tv_sec = (deadlineNs - now) / 1000000000ULL;
+		timeout.tv_nsec = (deadlineNs - now) % 1000000000ULL;
+	}
+
+	if (ppoll(fds, 2, deadlineNs ? &timeout : NULL, NULL) < 0 && errno != EINTR)
+	{
+		return -1;
+	}
+
+	/* The events only wake us; the file itself says what changed */
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	while (::read(inotifyFd, events, sizeof(events)) > 0)
+	{
+	}
+
+	return 0;
+}
+
+/**
+ * Ends the source once everything written so far is read
+ */
+void FollowSource::stop()
+{
+	/* The value to add to the eventfd */
+	uint64_t one = 1;
+
+	stopping.store(true);
+
+	/* This only fails once the count is about to overflow, when it is readable anyway */
+	if (write(stopFd, &one, sizeof(one)) < 0)
+	{
+		return;
+	}
+}
+
+/**
+ * Makes the first SIGINT or SIGTERM stop a source instead of killing the process
+ * @param  source The source to stop
+ * @return 0, or -1 with errno set
+ */
+int stopOnSignals(FollowSource& source)
+{
+	/* The signals that would otherwise end the process, every signal, and our mask before */
+	sigset_t signals, all, previous;
+
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigfillset(&all);
+
+	/* The thread starts with every signal blocked, so one meant for another
+	 * thread, such as the rate signal of a pacer set up later, never lands
+	 * on it and takes its default action
+	 */
+	if ((errno = pthread_sigmask(SIG_BLOCK, &all, &previous)) != 0)
+	{
+		return -1;
+	}
+
+	thread([&source, signals]()
+	{
+		/* The signal that arrived */
+		int sig;
+
+		while (sigwait(&signals, &sig) != 0)
+		{
+		}
+
+		source.stop();
+
+		/* A second one ends the process the usual way, in case the transfer is stuck */
+		while (sigwait(&signals, &sig) != 0)
+		{
+		}
+
+		signal(sig, SIG_DFL);
+		pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+		raise(sig);
+	}).detach();
+
+	/* Keep ours blocked here, and so in every thread started from now on */
+	sigaddset(&previous, SIGINT);
+	sigaddset(&previous, SIGTERM);
+
+	if ((errno = pthread_sigmask(SIG_SETMASK, &previous, NULL)) != 0)
+	{
+		return -1;
+	}
+
+	return 0;
+}
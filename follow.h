@@ -0,0 +1,116 @@
+/* Following a file as it grows, the way tail -F does, for shipping logs as
+ * they are written. A FollowSource reads the file to its end and then,
+ * instead of ending, sleeps on inotify until more is appended, so each new
+ * line goes out within a wakeup of being written without polling. Its
+ * reads return as soon as they have something, or once flushDeadlineUs
+ * has passed since the first new byte if more may be on its way, so a
+ * burst of small appends goes out as one chunk.
+ *
+ *	FollowSource source;
+ *
+ *	sender.requestedFeatures |= FEATURE_LIVE;
+ *	if (source.open("app.log") < 0 || stopOnSignals(source) < 0 || sender.send("app.log", source) < 0)
+ *		...
+ *
+ * When the file is renamed or deleted and a new one takes its name, the
+ * source reads what is left of the old one and carries on from the start of
+ * the new one. When the file is truncated, it starts over from the start.
+ * Either way the receiver's copy is every byte the source read, in order,
+ * as one stream. The transfer ends once stop() is called and everything
+ * appended before then is sent.
+ *
+ * Ask for FEATURE_LIVE so the receiver passes each chunk on to its sink
+ * right away instead of letting small ones pile up in a buffer.
+ *
+ * Include transfer.h first.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+/* By default, hand over new bytes as soon as they are read */
+#define DEFAULT_FLUSH_DEADLINE_US 0
+
+/**
+ * Reads a file as it grows, across rotation and truncation
+ */
+class FollowSource : public TransferSource
+{
+public:
+	FollowSource();
+	~FollowSource();
+	FollowSource(const FollowSource&) = delete;
+	FollowSource& operator=(const FollowSource&) = delete;
+
+	/**
+	 * Opens the file from its start and starts watching it and its directory
+	 * @param  fileName The name of the file
+	 * @return 0, or -1 with errno set
+	 */
+	int open(const char* fileName);
+
+	/**
+	 * Stops watching and closes the file
+	 */
+	void close();
+
+	/**
+	 * Reads the next bytes, waiting for them to be written
+	 * @param  buffer Where to put them
+	 * @param  size The most bytes to read
+	 * @return The number of bytes read, 0 once stopped with nothing left, or -1 with errno set
+	 */
+	ssize_t read(char* buffer, size_t size);
+
+	bool live() { return true; }
+
+	/**
+	 * Ends the source once everything written so far is read. Safe to call
+	 * from any thread and from a signal handler.
+	 */
+	void stop();
+
+	/* How long to wait for more bytes after the first new ones before handing them over, in microseconds */
+	unsigned flushDeadlineUs;
+
+	/* The number of times a new file took the name, and the times the file was truncated */
+	unsigned long rotations() const { return numRotations; }
+	unsigned long truncations() const { return numTruncations; }
+
+private:
+	int checkFile();
+	int wait(uint64_t deadlineNs);
+
+	/* The name of the file and of its directory */
+	std::string fileName;
+	std::string dirName;
+
+	/* The open file and how far into it we have read */
+	int fd;
+	off_t offset;
+
+	/* The inotify instance and its watches on the file and its directory */
+	int inotifyFd;
+	int fileWatch;
+	int dirWatch;
+
+	/* Set by stop(), with an eventfd that becomes readable to wake a waiting read() */
+	std::atomic<bool> stopping;
+	int stopFd;
+
+	/* What has happened to the file since open() */
+	unsigned long numRotations;
+	unsigned long numTruncations;
+};
+
+/**
+ * Makes the first SIGINT or SIGTERM stop a source instead of killing the
+ * process; a second one kills it. The signals are blocked and a thread of
+ * its own waits for them, so they never interrupt a system call. Call this
+ * before starting any other thread.
+ * @param  source The source to stop
+ * @return 0, or -1 with errno set
+ */
+int stopOnSignals(FollowSource& source);
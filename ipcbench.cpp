@@ -0,0 +1,686 @@
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/msg.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/futex.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <vector>
+#include "msg.h"    /* For the messages the sender and receiver exchange */
+#include "placement.h"    /* For pinning to CPUs */
+#include "stats.h"    /* For nowNs() */
+
+using namespace std;
+
+/* The default number of round trips to measure, and how many to run first without measuring */
+#define DEFAULT_ITERATIONS 100000
+#define WARMUP_ITERATIONS 1000
+
+/* How many times a spinning waiter checks before letting the other process have the CPU */
+#define SPINS_PER_YIELD 1000
+
+/* The two processes of a run: the pinger measures round trips, the ponger answers */
+#define PINGER 0
+#define PONGER 1
+
+/**
+ * The memory both processes of a run share
+ */
+struct sharedState
+{
+	/* The pid of each process, for signals */
+	pid_t pids[2];
+
+	/* The number of notifications sent to each process, for futexes and spinning */
+	alignas(64) atomic<uint32_t> counts[2];
+
+	/* When the pinger sent the last ping */
+	alignas(64) atomic<uint64_t> sentNs;
+
+	/* How long each ping took to reach the ponger, filled in by the ponger */
+	alignas(64) uint64_t oneWayNs[];
+};
+
+/* Set by the signal handler when the signal a process waits for arrives */
+volatile sig_atomic_t signalled = 0;
+
+/**
+ * A way for one process to wake the other
+ */
+class Mechanism
+{
+public:
+	virtual ~Mechanism() { }
+
+	/* The name to report and to pick the mechanism by */
+	virtual const char* name() const = 0;
+
+	/**
+	 * Sets up whatever both processes need, before they fork
+	 * @param  state The memory the processes share
+	 */
+	virtual void setup(sharedState* state) { this->state = state; }
+
+	/**
+	 * Wakes a process
+	 * @param  to PINGER or PONGER
+	 */
+	virtual void notify(int to) = 0;
+
+	/**
+	 * Waits for the other process to wake us
+	 * @param  me PINGER or PONGER
+	 */
+	virtual void wait(int me) = 0;
+
+	/* Releases what setup() created, after both processes are done */
+	virtual void cleanup() { }
+
+protected:
+	/* The memory the processes share */
+	sharedState* state;
+};
+
+/**
+ * The SysV message queue exchange sender.cpp and recv.cpp use: the sender's
+ * notice of a filled slot and the receiver's acknowledgment handing back a credit
+ */
+class MsgQueueMechanism : public Mechanism
+{
+public:
+	const char* name() const { return "msgq"; }
+
+	void setup(sharedState* state)
+	{
+		Mechanism::setup(state);
+
+		if ((msqid = msgget(IPC_PRIVATE, S_IRUSR | S_IWUSR)) < 0)
+		{
+			perror("msgget");
+			exit(-1);
+		}
+	}
+
+	void notify(int to)
+	{
+		if (to == PONGER)
+		{
+			/* The notice of a filled slot */
+			message sndMsg;
+			memset(&sndMsg, 0, sizeof(sndMsg));
+			sndMsg.mtype = SENDER_DATA_TYPE;
+			sndMsg.size = 1;
+
+			if (msgsnd(msqid, &sndMsg, sizeof(message) - sizeof(long), 0) < 0)
+			{
+				perror("msgsnd");
+				exit(-1);
+			}
+		}
+		else
+		{
+			/* The acknowledgment handing the slot back */
+			ackMessage sndMsg;
+			sndMsg.mtype = TRANSFER_ACK_TYPE_BASE;
+			sndMsg.credits = 1;
+
+			if (msgsnd(msqid, &sndMsg, sizeof(ackMessage) - sizeof(long), 0) < 0)
+			{
+				perror("msgsnd");
+				exit(-1);
+			}
+		}
+	}
+
+	void wait(int me)
+	{
+		/* Big enough for either message */
+		message rcvMsg;
+
+		if (msgrcv(msqid, &rcvMsg, sizeof(message) - sizeof(long),
+			me == PONGER ? SENDER_DATA_TYPE : TRANSFER_ACK_TYPE_BASE, 0) < 0)
+		{
+			perror("msgrcv");
+			exit(-1);
+		}
+	}
+
+	void cleanup()
+	{
+		msgctl(msqid, IPC_RMID, NULL);
+	}
+
+private:
+	/* The queue */
+	int msqid;
+};
+
+/**
+ * Handles the signals of the signal mechanism
+ * @param  signal The signal type
+ */
+void wakeSignal(int signal)
+{
+	signalled = 1;
+}
+
+/**
+ * The kill() and sigsuspend() exchange of sender_ec.cpp and recv_ec.cpp:
+ * the ponger waits for SIGUSR1 like recv_ec, the pinger for SIGUSR2 like sender_ec
+ */
+class SignalMechanism : public Mechanism
+{
+public:
+	const char* name() const { return "signal"; }
+
+	void setup(sharedState* state)
+	{
+		Mechanism::setup(state);
+
+		if (signal(SIGUSR1, wakeSignal) == SIG_ERR || signal(SIGUSR2, wakeSignal) == SIG_ERR)
+		{
+			perror("signal");
+			exit(-1);
+		}
+	}
+
+	void notify(int to)
+	{
+		if (kill(state->pids[to], to == PONGER ? SIGUSR1 : SIGUSR2) < 0)
+		{
+			perror("kill");
+			exit(-1);
+		}
+	}
+
+	void wait(int me)
+	{
+		/* The signal to wait for, and the mask to restore while waiting */
+		sigset_t mask, oldmask;
+
+		sigemptyset(&mask);
+		sigaddset(&mask, me == PONGER ? SIGUSR1 : SIGUSR2);
+
+		if (sigprocmask(SIG_BLOCK, &mask, &oldmask) < 0)
+		{
+			perror("sigprocmask");
+			exit(-1);
+		}
+
+		while (!signalled)
+		{
+			sigsuspend(&oldmask);
+		}
+
+		if (sigprocmask(SIG_UNBLOCK, &mask, NULL) < 0)
+		{
+			perror("sigprocmask");
+			exit(-1);
+		}
+
+		signalled = 0;
+	}
+
+	void cleanup()
+	{
+		signal(SIGUSR1, SIG_DFL);
+		signal(SIGUSR2, SIG_DFL);
+	}
+};
+
+/**
+ * A counter in shared memory, waited on with FUTEX_WAIT and bumped with FUTEX_WAKE
+ */
+class FutexMechanism : public Mechanism
+{
+public:
+	const char* name() const { return "futex"; }
+
+	void setup(sharedState* state)
+	{
+		Mechanism::setup(state);
+		seen = 0;
+	}
+
+	void notify(int to)
+	{
+		state->counts[to].fetch_add(1, memory_order_release);
+
+		/* The memory is shared between processes, so no FUTEX_PRIVATE_FLAG */
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(&state->counts[to]), FUTEX_WAKE, 1, NULL, NULL, 0);
+	}
+
+	void wait(int me)
+	{
+		while (state->counts[me].load(memory_order_acquire) == seen)
+		{
+			if (syscall(SYS_futex, reinterpret_cast<uint32_t*>(&state->counts[me]), FUTEX_WAIT, seen, NULL, NULL, 0) < 0 &&
+				errno != EAGAIN && errno != EINTR)
+			{
+				perror("futex");
+				exit(-1);
+			}
+		}
+
+		++seen;
+	}
+
+private:
+	/* The number of notifications this process has consumed */
+	uint32_t seen;
+};
+
+/**
+ * One eventfd per process
+ */
+class EventFdMechanism : public Mechanism
+{
+public:
+	const char* name() const { return "eventfd"; }
+
+	void setup(sharedState* state)
+	{
+		Mechanism::setup(state);
+
+		if ((fds[PINGER] = eventfd(0, 0)) < 0 || (fds[PONGER] = eventfd(0, 0)) < 0)
+		{
+			perror("eventfd");
+			exit(-1);
+		}
+	}
+
+	void notify(int to)
+	{
+		/* The amount to add to the counter */
+		uint64_t one = 1;
+
+		if (write(fds[to], &one, sizeof(one)) != sizeof(one))
+		{
+			perror("write");
+			exit(-1);
+		}
+	}
+
+	void wait(int me)
+	{
+		/* The counter, reset by reading it */
+		uint64_t count;
+
+		if (read(fds[me], &count, sizeof(count)) != sizeof(count))
+		{
+			perror("read");
+			exit(-1);
+		}
+	}
+
+	void cleanup()
+	{
+		close(fds[PINGER]);
+		close(fds[PONGER]);
+	}
+
+private:
+	/* The eventfd each process waits on */
+	int fds[2];
+};
+
+/**
+ * One pipe per process, carrying a byte per notification
+ */
+class PipeMechanism : public Mechanism
+{
+public:
+	const char* name() const { return "pipe"; }
+
+	void setup(sharedState* state)
+	{
+		Mechanism::setup(state);
+
+		if (pipe(fds[PINGER]) < 0 || pipe(fds[PONGER]) < 0)
+		{
+			perror("pipe");
+			exit(-1);
+		}
+	}
+
+	void notify(int to)
+	{
+		/* The byte to send */
+		char byte = 0;
+
+		if (write(fds[to][1], &byte, 1) != 1)
+		{
+			perror("write");
+			exit(-1);
+		}
+	}
+
+	void wait(int me)
+	{
+		/* The byte received */
+		char byte;
+
+		if (read(fds[me][0], &byte, 1) != 1)
+		{
+			perror("read");
+			exit(-1);
+		}
+	}
+
+	void cleanup()
+	{
+		for (int side = PINGER; side <= PONGER; ++side)
+		{
+			close(fds[side][0]);
+			close(fds[side][1]);
+		}
+	}
+
+private:
+	/* The read and write ends of the pipe each process waits on */
+	int fds[2][2];
+};
+
+/**
+ * A counter in shared memory, polled without sleeping. The waiter yields
+ * every SPINS_PER_YIELD checks, without which two processes on one core
+ * would only trade places when the scheduler's time slice runs out.
+ */
+class SpinMechanism : public Mechanism
+{
+public:
+	const char* name() const { return "spin"; }
+
+	void setup(sharedState* state)
+	{
+		Mechanism::setup(state);
+		seen = 0;
+	}
+
+	void notify(int to)
+	{
+		state->counts[to].fetch_add(1, memory_order_release);
+	}
+
+	void wait(int me)
+	{
+		/* The number of checks so far */
+		unsigned long numSpins = 0;
+
+		while (state->counts[me].load(memory_order_acquire) == seen)
+		{
+			if (++numSpins % SPINS_PER_YIELD == 0)
+			{
+				sched_yield();
+			}
+			else
+			{
+				__builtin_ia32_pause();
+			}
+		}
+
+		++seen;
+	}
+
+private:
+	/* The number of notifications this process has consumed */
+	uint32_t seen;
+};
+
+/**
+ * Gets a nearest-rank percentile
+ * @param  sorted The samples in ascending order
+ * @param  percent The percentile, from 0 to 100
+ * @return The sample
+ */
+uint64_t percentile(const vector<uint64_t>& sorted, double percent)
+{
+	/* The rank of the sample, counting from 1 */
+	size_t rank = (size_t)(percent / 100.0 * sorted.size() + 0.999999);
+
+	return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+/**
+ * Prints the percentiles of some latencies
+ * @param  samples The latencies in nanoseconds, sorted here
+ */
+void printPercentiles(vector<uint64_t>& samples)
+{
+	sort(samples.begin(), samples.end());
+
+	printf(" %8.2f %8.2f %8.2f %9.2f", percentile(samples, 50) / 1e3, percentile(samples, 99) / 1e3,
+		percentile(samples, 99.9) / 1e3, samples.back() / 1e3);
+}
+
+/**
+ * Runs ping-pong between two processes and prints the latencies and rate
+ * @param  mechanism How the processes wake each other
+ * @param  pingCpu The CPU the pinger runs on
+ * @param  pongCpu The CPU the ponger runs on
+ * @param  numIterations The number of round trips to measure
+ */
+void run(Mechanism& mechanism, int pingCpu, int pongCpu, int numIterations)
+{
+	/* The number of round trips including the warm-up */
+	int numTotal = WARMUP_ITERATIONS + numIterations;
+
+	/* The shared memory, big enough for every one-way latency */
+	size_t stateSize = sizeof(sharedState) + numTotal * sizeof(uint64_t);
+	void* mem = mmap(NULL, stateSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	/* The round trip latencies */
+	vector<uint64_t> roundTrips, oneWays;
+
+	/* When the measured round trips started and ended, and when the current one started */
+	uint64_t start = 0, end, sent;
+
+	/* The ponger */
+	pid_t pid;
+
+	if (mem == MAP_FAILED)
+	{
+		perror("mmap");
+		exit(-1);
+	}
+
+	sharedState* state = new (mem) sharedState;
+	state->counts[PINGER].store(0);
+	state->counts[PONGER].store(0);
+	state->pids[PINGER] = getpid();
+
+	mechanism.setup(state);
+	signalled = 0;
+
+	if ((pid = fork()) < 0)
+	{
+		perror("fork");
+		exit(-1);
+	}
+
+	/* The ponger answers every ping and notes how long it took to arrive */
+	if (pid == 0)
+	{
+		pinToCpu(pongCpu);
+
+		for (int i = 0; i < numTotal; ++i)
+		{
+			mechanism.wait(PONGER);
+			state->oneWayNs[i] = nowNs() - state->sentNs.load(memory_order_acquire);
+			mechanism.notify(PINGER);
+		}
+
+		_exit(0);
+	}
+
+	state->pids[PONGER] = pid;
+	pinToCpu(pingCpu);
+
+	/* Let the ponger get going */
+	usleep(10000);
+
+	for (int i = 0; i < numTotal; ++i)
+	{
+		if (i == WARMUP_ITERATIONS)
+		{
+			start = nowNs();
+		}
+
+		sent = nowNs();
+		state->sentNs.store(sent, memory_order_release);
+		mechanism.notify(PONGER);
+		mechanism.wait(PINGER);
+
+		if (i >= WARMUP_ITERATIONS)
+		{
+			roundTrips.push_back(nowNs() - sent);
+		}
+	}
+
+	end = nowNs();
+	waitpid(pid, NULL, 0);
+
+	oneWays.assign(state->oneWayNs + WARMUP_ITERATIONS, state->oneWayNs + numTotal);
+
+	printf("%-8s %3d -> %-3d", mechanism.name(), pingCpu, pongCpu);
+	printPercentiles(oneWays);
+	printf("  ");
+	printPercentiles(roundTrips);
+
+	/* Every round trip is two handoffs */
+	printf(" %12.0f\n", 2.0 * numIterations / ((end - start) / 1e9));
+	fflush(stdout);
+
+	mechanism.cleanup();
+	munmap(mem, stateSize);
+}
+
+/**
+ * Begins program execution
+ * @param  argc The number of command line arguments
+ * @param  argv An array of C strings containing each command line argument
+ * @return The exit code
+ */
+int main(int argc, char** argv)
+{
+	/* The command line option being parsed */
+	int opt;
+
+	/* The number of round trips per run */
+	int numIterations = DEFAULT_ITERATIONS;
+
+	/* The CPUs to run on: the first for same-core runs and both for cross-core ones */
+	int firstCpu = PLACEMENT_ANY, secondCpu = PLACEMENT_ANY;
+
+	/* The mechanism to run, or NULL for all of them */
+	const char* only = NULL;
+
+	/* Every mechanism, the way the transfers use them first */
+	MsgQueueMechanism msgQueue;
+	SignalMechanism signals;
+	FutexMechanism futex;
+	EventFdMechanism eventFd;
+	PipeMechanism pipes;
+	SpinMechanism spin;
+	Mechanism* mechanisms[] = { &msgQueue, &signals, &futex, &eventFd, &pipes, &spin };
+
+	/* The CPUs we may run on */
+	cpu_set_t cpus;
+
+	/* Parse the command line options */
+	while ((opt = getopt(argc, argv, "n:a:b:m:")) != -1)
+	{
+		switch (opt)
+		{
+			/* The number of round trips per run */
+			case 'n':
+				numIterations = atoi(optarg);
+
+				if (numIterations < 1)
+				{
+					fprintf(stderr, "The number of round trips must be at least 1.\n");
+					exit(-1);
+				}
+				break;
+
+			/* The CPU of same-core runs and the pinger's in cross-core runs */
+			case 'a':
+				firstCpu = atoi(optarg);
+				break;
+
+			/* The ponger's CPU in cross-core runs */
+			case 'b':
+				secondCpu = atoi(optarg);
+				break;
+
+			/* The one mechanism to run */
+			case 'm':
+				only = optarg;
+				break;
+
+			default:
+				fprintf(stderr, "USAGE: %s [-n <ROUND TRIPS>] [-a <CPU>] [-b <CPU>] [-m msgq|signal|futex|eventfd|pipe|spin]\n", argv[0]);
+				exit(-1);
+		}
+	}
+
+	/* Default to the first two CPUs we may use */
+	if (sched_getaffinity(0, sizeof(cpus), &cpus) < 0)
+	{
+		perror("sched_getaffinity");
+		exit(-1);
+	}
+
+	for (int cpu = 0; cpu < CPU_SETSIZE && (firstCpu == PLACEMENT_ANY || secondCpu == PLACEMENT_ANY); ++cpu)
+	{
+		if (!CPU_ISSET(cpu, &cpus) || cpu == firstCpu)
+		{
+			continue;
+		}
+
+		if (firstCpu == PLACEMENT_ANY)
+		{
+			firstCpu = cpu;
+		}
+		else
+		{
+			secondCpu = cpu;
+		}
+	}
+
+	printf("%d round trips per run after %d to warm up, latencies in microseconds\n", numIterations, WARMUP_ITERATIONS);
+	printf("%-8s %-10s %-37s  %-37s %12s\n", "", "", "one-way", "round trip", "");
+	printf("%-8s %-10s %8s %8s %8s %9s   %8s %8s %8s %9s %12s\n", "", "cpus", "p50", "p99", "p99.9", "max",
+		"p50", "p99", "p99.9", "max", "handoffs/s");
+
+	for (size_t i = 0; i < sizeof(mechanisms) / sizeof(mechanisms[0]); ++i)
+	{
+		if (only && strcmp(only, mechanisms[i]->name()) != 0)
+		{
+			continue;
+		}
+
+		run(*mechanisms[i], firstCpu, firstCpu, numIterations);
+
+		if (secondCpu != PLACEMENT_ANY)
+		{
+			run(*mechanisms[i], firstCpu, secondCpu, numIterations);
+		}
+		else
+		{
+			printf("%-8s cross-core skipped: only one CPU available\n", mechanisms[i]->name());
+		}
+	}
+
+	return 0;
+}
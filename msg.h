@@ -1,4 +1,18 @@
-#define MAX_MSG_PAYLOAD 100
+#include <stddef.h>
+#include <stdint.h>
+
+/* The most bytes a data or file name message can carry inside itself. Messages
+ * must fit in msgmax (8192 by default), so keep it well below that.
+ */
+#define MAX_MSG_PAYLOAD 4096
+
+/* The version of the messages below. Bump it whenever their layout changes. */
+#define PROTOCOL_VERSION 5
+
+/* The oldest sender version the receiver still talks to. Version 2 senders
+ * skip the hello exchange and go straight to the file name.
+ */
+#define MIN_PROTOCOL_VERSION 2
 
 /* The information type */
 #define SENDER_DATA_TYPE 1
@@ -9,9 +23,99 @@
 /* The file name transfer message */
 #define FILE_NAME_TRANSFER_TYPE 3
 
+/* The sender's capabilities, sent before the file name */
+#define HELLO_TYPE 4
+
+/* The configuration the receiver picked from the sender's capabilities */
+#define HELLO_ACK_TYPE 5
+
+/* Acknowledgments for version 4 transfers use their own type, this plus the
+ * transfer's lane, so concurrent senders each get only their own credits.
+ * It sits above every fixed type so receivers asking for the lowest type up
+ * to HELLO_TYPE never take one.
+ */
+#define TRANSFER_ACK_TYPE_BASE 16
+
+/* The priority classes a version 4 sender can ask for, most urgent first.
+ * The receiver shares its time among active transfers in proportion to
+ * their class's weight.
+ */
+#define PRIORITY_URGENT 0
+#define PRIORITY_NORMAL 1
+#define PRIORITY_BULK 2
+#define NUM_PRIORITY_CLASSES 3
+#define PRIORITY_NAMES { "urgent", "normal", "bulk" }
+#define PRIORITY_WEIGHTS { 16, 4, 1 }
+
+/* Each data message carries a CRC-32C of its chunk */
+#define FEATURE_CHECKSUM 0x1
+
+/* Chunks are compressed in shared memory. Reserved: no build supports it yet. */
+#define FEATURE_COMPRESSION 0x2
+
+/* The receiver sends a doneMsg once the file is stored the way its
+ * durability policy says, and the sender waits for it
+ */
+#define FEATURE_DURABLE 0x4
+
+/* The source is live, such as a file being followed: chunks may be short
+ * and far apart, so the receiver flushes its sink after each one
+ */
+#define FEATURE_LIVE 0x8
+
 /* The maximum size of the file name */
 #define MAX_FILE_NAME_SIZE 100
 
+/* The default maximum number of chunks the receiver lets the sender have in flight */
+#define DEFAULT_WINDOW_SIZE 16
+
+/* The number of chunks the receiver lets the sender have in flight at first */
+#define INITIAL_WINDOW_SIZE 4
+
+/* The number of whole windows the sender must go without stalling before the
+ * receiver shrinks the window by a slot
+ */
+#define WINDOW_SHRINK_WINDOWS 4
+
+/* The maximum window size. Every outstanding chunk has a message waiting in the
+ * queue, so the window must stay well below the queue capacity (msgmnb)
+ */
+#define MAX_WINDOW_SIZE 256
+
+/* Set in a data message when it used up the sender's last credit */
+#define MSG_FLAG_LAST_CREDIT 0x1
+
+/* Set in a data message whose bytes follow it in an inlineMessage instead of
+ * sitting in a slot. Only sent from version 5 on.
+ */
+#define MSG_FLAG_INLINE 0x2
+
+/* Set in the last data message of a transfer, which then needs no empty
+ * terminator. Only sent from version 5 on.
+ */
+#define MSG_FLAG_END 0x4
+
+/* Set in the first data message after a tuning sender changes its chunk size,
+ * whose size is then the new one unless the source ended. Older receivers
+ * ignore it, since chunks may be shorter than a slot anyway.
+ */
+#define MSG_FLAG_RESIZED 0x8
+
+/* Set in the first data message after the sender ran out of credits and found
+ * no acknowledgment waiting, so the receiver widens the window only when it
+ * really kept the sender waiting. Older receivers ignore it; the window for
+ * older senders, which never set it, stays at its initial size or shrinks.
+ */
+#define MSG_FLAG_STALLED 0x10
+
+/* Set in a file name message that carries the whole file, so no data messages follow */
+#define NAME_FLAG_INLINE 0x1
+
+/* Set in a file name message sent without a hello, by a sender that already
+ * agreed on a configuration with this receiver
+ */
+#define NAME_FLAG_NO_HELLO 0x2
+
 /**
  * The structure representing the message
  * used by sender to send the name of the file
@@ -25,16 +129,125 @@ struct fileNameMsg
 	/* The name of the file */
 	char fileName[MAX_FILE_NAME_SIZE];
 	
+	/* The PROTOCOL_VERSION the sender speaks. It comes last so that messages
+	 * from senders older than version 2, which lack it, arrive short.
+	 */
+	int32_t version;
+	
+	/* The PRIORITY_* class of the transfer. Only sent from version 4 on. */
+	int32_t priority;
+	
+	/* The NAME_FLAG_* bits and the number of bytes in data. Only sent from
+	 * version 5 on, and data only as far as size.
+	 */
+	int32_t flags;
+	int32_t size;
+	char data[MAX_MSG_PAYLOAD];
+	
+	/**
+ 	 * Prints the structure
+ 	 * @param fp - the file stream to print to
+ 	 */
+	void print(FILE* fp)
+	{
+		fprintf(fp, "%ld %s %d %d %#x %d\n", mtype, fileName, version, priority, flags, size);
+	}
+};
+
+/**
+ * The message the sender opens with to tell the receiver
+ * what it can do
+ */
+struct helloMsg
+{
+	/* The message type */
+	long mtype;
+	
+	/* The PROTOCOL_VERSION the sender speaks */
+	int32_t version;
+	
+	/* The most chunks the sender wants in flight */
+	int32_t maxSlots;
+	
+	/* The largest chunk the sender can handle, or 0 for no limit */
+	uint64_t maxChunkSize;
+	
+	/* The FEATURE_* bits the sender supports */
+	uint32_t features;
+	
+	/* The FEATURE_* bits the sender asks to use if the receiver supports them */
+	uint32_t requested;
+	
+	/* The most bytes the sender wants to carry inside messages. Only sent from
+	 * version 5 on; older receivers read the hello into a bigger buffer and ignore it.
+	 */
+	uint32_t maxInline;
+	
+	/**
+ 	 * Prints the structure
+ 	 * @param fp - the file stream to print to
+ 	 */
+	void print(FILE* fp)
+	{
+		fprintf(fp, "%ld %d %d %llu %#x %#x %u\n", mtype, version, maxSlots,
+			(unsigned long long)maxChunkSize, features, requested, maxInline);
+	}
+};
+
+/**
+ * The message the receiver answers a hello with, giving the
+ * configuration both sides will use for the transfer
+ */
+struct helloAckMsg
+{
+	/* The message type */
+	long mtype;
+	
+	/* The protocol version both sides will speak */
+	int32_t version;
+	
+	/* The number of slots the sender may cycle through, which caps the window */
+	int32_t numSlots;
+	
+	/* The most bytes the sender may put in one chunk */
+	uint64_t chunkSize;
+	
+	/* The distance between the starts of consecutive slots */
+	uint64_t slotSize;
+	
+	/* The FEATURE_* bits both sides will use */
+	uint32_t features;
+	
+	/* The first slot of the sender's lane. Only sent from version 4 on. */
+	int32_t slotBase;
+	
+	/* The message type of the sender's acknowledgments. Only sent from version 4 on. */
+	long ackType;
+	
+	/* The most bytes either side may carry inside a message, 0 for none. Only
+	 * sent from version 5 on.
+	 */
+	uint32_t inlineSize;
+	
 	/**
  	 * Prints the structure
  	 * @param fp - the file stream to print to
  	 */
 	void print(FILE* fp)
 	{
-		fprintf(fp, "%ld %s\n", mtype, fileName);
+		fprintf(fp, "%ld %d %d %llu %llu %#x %d %ld %u\n", mtype, version, numSlots,
+			(unsigned long long)chunkSize, (unsigned long long)slotSize, features, slotBase, ackType, inlineSize);
 	}
 };
 
+/* The sizes, after the message type, of the messages older peers expect.
+ * Anything longer fails their msgrcv() with E2BIG.
+ */
+#define FILE_NAME_MSG_V3_SIZE (offsetof(fileNameMsg, priority) - sizeof(long))
+#define FILE_NAME_MSG_V4_SIZE (offsetof(fileNameMsg, flags) - sizeof(long))
+#define HELLO_ACK_MSG_V3_SIZE (offsetof(helloAckMsg, slotBase) - sizeof(long))
+#define HELLO_ACK_MSG_V4_SIZE (offsetof(helloAckMsg, inlineSize) - sizeof(long))
+
 /**
  * The message structure representing the message
  * sent from the sender to the receiver indicating
@@ -48,7 +261,44 @@ struct message
 	long mtype;
 	
 	/* How many bytes in the message */
-	int size;
+	int64_t size;
+	
+	/* Where in the file the bytes belong */
+	uint64_t offset;
+	
+	/* The index of the shared memory slot holding the bytes */
+	int32_t slot;
+	
+	/* The MSG_FLAG_* bits describing the message */
+	int32_t flags;
+	
+	/* The CRC-32C of the bytes, when FEATURE_CHECKSUM was agreed. It comes
+	 * last so that messages from version 2 senders, which lack it, still line up.
+	 */
+	uint32_t checksum;
+	
+	/**
+ 	 * Prints the structure
+ 	 * @param fp - the file stream to print to
+ 	 */
+	void print(FILE* fp)
+	{
+		fprintf(fp, "%ld %lld %llu %d %d %#x", mtype, (long long)size, (unsigned long long)offset,
+			slot, flags, checksum);
+	}
+};
+
+/**
+ * A data message with its bytes inside it, used for the last few bytes of
+ * a transfer when they fit in the agreed inline size
+ */
+struct inlineMessage
+{
+	/* The data message, with MSG_FLAG_INLINE set and size giving the number of bytes */
+	message header;
+	
+	/* The bytes, sent only as far as header.size */
+	char data[MAX_MSG_PAYLOAD];
 	
 	/**
  	 * Prints the structure
@@ -56,19 +306,51 @@ struct message
  	 */
 	void print(FILE* fp)
 	{
-		fprintf(fp, "%ld %d", mtype, size);
+		header.print(fp);
 	}
 };
 
 /* Struct representing the message sent from the receiver
  * to the sender acknowledging the successful reception and
- * saving of data.
+ * saving of data. The first one sent for a file grants the
+ * initial window; later ones return the slots freed since the
+ * previous acknowledgment, give or take any change to the window.
  */
 struct ackMessage
 {
 	/* The type of message */
 	long mtype;
 	
+	/* The number of slots (credits) handed back to the sender */
+	int32_t credits;
+	
+	/**
+ 	 * Prints the structure
+ 	 * @param fp - the file stream to print to
+ 	 */
+	
+	void print(FILE* fp)
+	{
+		fprintf(fp, "%ld %d\n", mtype, credits);
+	}
+};
+
+/* Struct representing the message sent from the receiver once
+ * it has finished storing a file, when FEATURE_DURABLE was agreed.
+ * It uses the sender's acknowledgment type and comes after every
+ * acknowledgment of the transfer.
+ */
+struct doneMsg
+{
+	/* The type of message */
+	long mtype;
+	
+	/* Always -1, so the message cannot be taken for credits */
+	int32_t credits;
+	
+	/* 0 if the file is stored, otherwise the errno of the failure */
+	int32_t error;
+	
 	/**
  	 * Prints the structure
  	 * @param fp - the file stream to print to
@@ -76,6 +358,6 @@ struct ackMessage
 	
 	void print(FILE* fp)
 	{
-		fprintf(fp, "%ld\n", mtype);
+		fprintf(fp, "%ld %d %d\n", mtype, credits, error);
 	}
 };
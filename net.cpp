@@ -0,0 +1,1120 @@
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include "msg.h"    /* For the messages */
+#include "checksum.h"    /* For checksumming chunks */
+#include "session.h"    /* For the pauses between connection attempts */
+#include "stats.h"    /* For timing transfers */
+#include "transfer.h"    /* For sources, sinks and handlers */
+#include "net.h"
+#include "util.h"    /* For formatting errors and reading sources */
+
+using namespace std;
+
+/* The alignment of the chunk buffers */
+#define NET_BUFFER_ALIGNMENT 4096
+
+/**
+ * Looks up the addresses a host:port names
+ * @param  address host:port, [host]:port for IPv6, or just the port
+ * @param  defaultHost The host when the address only gives a port, NULL for any
+ * @param  passive Whether the addresses are to listen on
+ * @param  result Set to the addresses, to be freed with freeaddrinfo()
+ * @return 0, or the getaddrinfo() error
+ */
+static int lookUp(const char* address, const char* defaultHost, bool passive, addrinfo** result)
+{
+	/* The host and port, split at the last colon */
+	string text = address;
+	size_t colon = text.rfind(':');
+	string host = colon == string::npos ? "" : text.substr(0, colon);
+	string port = colon == string::npos ? text : text.substr(colon + 1);
+
+	if (host.size() >= 2 && host[0] == '[' && host[host.size() - 1] == ']')
+	{
+		host = host.substr(1, host.size() - 2);
+	}
+
+	/* Stream sockets of either family */
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+
+	return getaddrinfo(!host.empty() ? host.c_str() : defaultHost, port.c_str(), &hints, result);
+}
+
+/**
+ * Asks for big socket buffers, so a whole window fits in flight, and turns
+ * off Nagle's algorithm, so acknowledgments go out at once. The kernel caps
+ * the buffers, and the transfer works with whatever it grants.
+ * @param  sock The socket
+ */
+static void tuneSocket(int sock)
+{
+	/* The option values */
+	int size = NET_SOCKET_BUFFER_SIZE, on = 1;
+
+	setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+/**
+ * Makes sure a buffer is page-aligned and holds at least a chunk
+ * @param  buffer The buffer, replaced if it is too small
+ * @param  bufferSize Its size, updated here
+ * @param  size The size needed
+ * @return 0, or -1 with errno set
+ */
+static int reserveBuffer(char*& buffer, size_t& bufferSize, size_t size)
+{
+	/* The new buffer */
+	void* newBuffer;
+
+	if (bufferSize >= size)
+	{
+		return 0;
+	}
+
+	if ((errno = posix_memalign(&newBuffer, NET_BUFFER_ALIGNMENT, size)) != 0)
+	{
+		return -1;
+	}
+
+	free(buffer);
+	buffer = (char*)newBuffer;
+	bufferSize = size;
+
+	return 0;
+}
+
+NetSender::NetSender() : maxSlots(0), maxChunkSize(0), supportedFeatures(FEATURE_CHECKSUM | FEATURE_DURABLE),
+	requestedFeatures(0), priority(PRIORITY_NORMAL), maxInline(MAX_MSG_PAYLOAD), readyTimeoutMs(DEFAULT_READY_TIMEOUT_MS),
+	sock(-1), buffer(NULL), bufferSize(0), numSyscalls(0)
+{
+	memset(&agreed, 0, sizeof(agreed));
+}
+
+NetSender::~NetSender()
+{
+	close();
+	free(buffer);
+}
+
+/**
+ * Records a failure
+ * @param  format The printf() format of the description
+ * @return -1
+ */
+int NetSender::fail(const char* format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	formatError(error, format, args);
+	va_end(args);
+
+	return -1;
+}
+
+/**
+ * Connects to a receiver, retrying for up to readyTimeoutMs until it listens
+ * @param  address The receiver's host and port as host:port, or just the port for this host
+ * @return 0, or -1 on failure
+ */
+int NetSender::open(const char* address)
+{
+	/* The receiver's addresses and the one being tried */
+	addrinfo* addresses;
+	addrinfo* a;
+
+	/* The result of the lookup and the errno of the last attempt */
+	int result, lastErrno = 0;
+
+	/* When we gave up waiting, and the pause before the next round */
+	uint64_t deadline = nowNs() + (uint64_t)readyTimeoutMs * 1000000;
+	useconds_t pause = READY_POLL_MIN_US;
+
+	if (sock >= 0)
+	{
+		return fail("The sender is already open.");
+	}
+
+	if ((result = lookUp(address, DEFAULT_NET_HOST, false, &addresses)) != 0)
+	{
+		return fail("%s: %s", address, gai_strerror(result));
+	}
+
+	/* Try every address until one takes the connection */
+	while (true)
+	{
+		for (a = addresses; a && sock < 0; a = a->ai_next)
+		{
+			if ((sock = socket(a->ai_family, a->ai_socktype, a->ai_protocol)) < 0)
+			{
+				lastErrno = errno;
+				continue;
+			}
+
+			/* The buffers must be set before connecting for the window scale to cover them */
+			tuneSocket(sock);
+
+			if (connect(sock, a->ai_addr, a->ai_addrlen) < 0)
+			{
+				lastErrno = errno;
+				::close(sock);
+				sock = -1;
+			}
+		}
+
+		/* Nobody listening yet is the only reason to keep trying */
+		if (sock >= 0 || lastErrno != ECONNREFUSED || (readyTimeoutMs >= 0 && nowNs() >= deadline))
+		{
+			break;
+		}
+
+		usleep(pause);
+		pause = min(pause * 2, (useconds_t)READY_POLL_MAX_US);
+	}
+
+	freeaddrinfo(addresses);
+
+	if (sock < 0 && lastErrno == ECONNREFUSED)
+	{
+		return fail("No receiver is listening on %s.", address);
+	}
+
+	if (sock < 0)
+	{
+		return fail("connect to %s: %s", address, strerror(lastErrno));
+	}
+
+	return 0;
+}
+
+/**
+ * Closes the connection
+ */
+void NetSender::close()
+{
+	if (sock >= 0)
+	{
+		::close(sock);
+		sock = -1;
+	}
+}
+
+/**
+ * Sends every byte of a buffer
+ * @param  data The bytes
+ * @param  size The number of bytes
+ * @param  flags The send() flags, such as MSG_MORE when more follows at once
+ * @return 0, or -1 on failure
+ */
+int NetSender::sendAll(const void* data, size_t size, int flags)
+{
+	/* The bytes not yet sent */
+	const char* p = (const char*)data;
+	ssize_t numSent;
+
+	while (size > 0)
+	{
+		if ((numSent = ::send(sock, p, size, flags | MSG_NOSIGNAL)) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return fail("send: %s", strerror(errno));
+		}
+		++numSyscalls;
+
+		p += numSent;
+		size -= numSent;
+	}
+
+	return 0;
+}
+
+/**
+ * Receives exactly a number of bytes
+ * @param  data Where to put them
+ * @param  size The number of bytes
+ * @return 0, or -1 on failure, including the receiver hanging up
+ */
+int NetSender::recvAll(void* data, size_t size)
+{
+	/* The bytes not yet received */
+	char* p = (char*)data;
+	ssize_t numRecv;
+
+	while (size > 0)
+	{
+		if ((numRecv = ::recv(sock, p, size, MSG_WAITALL)) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return fail("recv: %s", strerror(errno));
+		}
+		++numSyscalls;
+
+		if (numRecv == 0)
+		{
+			return fail("The receiver hung up.");
+		}
+
+		p += numRecv;
+		size -= numRecv;
+	}
+
+	return 0;
+}
+
+/**
+ * Waits for the receiver to hand back credits, or for its answer at the end
+ * of a transfer, which comes after every acknowledgment of the transfer
+ * @param  credits Set to the number of credits returned, or -1 for the answer
+ * @param  doneError Set to the error in the answer
+ * @return 0, or -1 on failure
+ */
+int NetSender::recvCredits(int& credits, int32_t& doneError)
+{
+	/* The acknowledgment or the answer, which starts the same way */
+	doneMsg rcvMsg;
+
+	if (recvAll(&rcvMsg, sizeof(ackMessage)) < 0 ||
+		(rcvMsg.credits < 0 && recvAll((char*)&rcvMsg + sizeof(ackMessage), sizeof(doneMsg) - sizeof(ackMessage)) < 0))
+	{
+		return -1;
+	}
+
+	if (rcvMsg.mtype != RECV_DONE_TYPE)
+	{
+		return fail("Got a message of type %ld instead of an acknowledgment.", rcvMsg.mtype);
+	}
+
+	credits = rcvMsg.credits;
+	doneError = rcvMsg.credits < 0 ? rcvMsg.error : 0;
+
+	return 0;
+}
+
+/**
+ * Tells the receiver what we can do and gets back the configuration to use
+ * @return 0, or -1 on failure
+ */
+int NetSender::sendHello()
+{
+	/* Our capabilities */
+	helloMsg hello;
+	memset(&hello, 0, sizeof(hello));
+	hello.mtype = HELLO_TYPE;
+	hello.version = PROTOCOL_VERSION;
+	hello.maxSlots = maxSlots;
+	hello.maxChunkSize = maxChunkSize;
+	hello.features = supportedFeatures;
+	hello.requested = requestedFeatures;
+	hello.maxInline = maxInline < MAX_MSG_PAYLOAD ? maxInline : MAX_MSG_PAYLOAD;
+
+	/* The receiver's answer */
+	helloAckMsg ack;
+
+	if (sendAll(&hello, sizeof(hello), 0) < 0 || recvAll(&ack, sizeof(ack)) < 0)
+	{
+		return -1;
+	}
+
+	if (ack.mtype != HELLO_ACK_TYPE || ack.version < NET_MIN_PROTOCOL_VERSION || ack.numSlots < 1 ||
+		ack.chunkSize == 0 || ack.inlineSize > MAX_MSG_PAYLOAD)
+	{
+		return fail("The receiver's answer makes no sense: version %d, %d slots of %llu bytes, %u bytes inline.",
+			ack.version, ack.numSlots, (unsigned long long)ack.chunkSize, ack.inlineSize);
+	}
+
+	agreed.version = ack.version;
+	agreed.numSlots = ack.numSlots;
+	agreed.chunkSize = ack.chunkSize;
+	agreed.features = ack.features;
+	agreed.inlineSize = ack.inlineSize;
+
+	if (reserveBuffer(buffer, bufferSize, agreed.chunkSize) < 0)
+	{
+		return fail("posix_memalign: %s", strerror(errno));
+	}
+
+	return 0;
+}
+
+/**
+ * Reads until the buffer is full or the source ends
+ * @param  source Where the bytes come from, or NULL to read the file
+ * @param  fd The file, when there is no source
+ * @param  buffer Where to put them
+ * @param  size The number of bytes wanted
+ * @param  atEnd Set once the source has ended
+ * @return The number of bytes read, or -1 on failure
+ */
+ssize_t NetSender::readChunk(TransferSource* source, int fd, char* buffer, size_t size, bool& atEnd)
+{
+	/* The number of bytes read so far and by the last call */
+	size_t numBytes = 0;
+	ssize_t numRead;
+
+	if (source)
+	{
+		if ((numRead = readFully(*source, buffer, size, atEnd)) < 0)
+		{
+			return fail("read: %s", strerror(errno));
+		}
+
+		return numRead;
+	}
+
+	while (numBytes < size && !atEnd)
+	{
+		if ((numRead = ::read(fd, buffer + numBytes, size - numBytes)) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return fail("read: %s", strerror(errno));
+		}
+
+		atEnd = numRead == 0;
+		numBytes += numRead;
+	}
+
+	return numBytes;
+}
+
+/**
+ * Runs one transfer from a source, or from a file with sendfile()
+ * @param  name The name to give the receiver
+ * @param  source Where the bytes come from, or NULL to send the file
+ * @param  fd The file, when there is no source
+ * @param  fileSize The size of the file
+ * @return The number of bytes sent, or -1 on failure
+ */
+int64_t NetSender::transfer(const char* name, TransferSource* source, int fd, int64_t fileSize)
+{
+	/* The notice sent ahead of each chunk, and the two go out together */
+	message sndMsg;
+	memset(&sndMsg, 0, sizeof(sndMsg));
+	sndMsg.mtype = SENDER_DATA_TYPE;
+
+	iovec iov[2];
+	msghdr gather;
+	memset(&gather, 0, sizeof(gather));
+
+	/* The file name message */
+	fileNameMsg nameMsg;
+	memset(&nameMsg, 0, offsetof(fileNameMsg, data));
+
+	/* The bytes read to find out whether the source fits in the name, and
+	 * how many of them have gone into chunks
+	 */
+	char ahead[MAX_MSG_PAYLOAD + 1];
+	ssize_t numAhead = 0;
+	size_t aheadPos = 0;
+
+	/* Whether the source has ended and whether the last chunk went out */
+	bool atEnd = false, ended = false;
+
+	/* Whether chunks go straight from the file */
+	bool useSendfile;
+
+	/* The bytes read for a chunk, and sent by the last call */
+	ssize_t numRead, numSent;
+	off_t fileOffset;
+
+	/* The number of bytes sent */
+	int64_t numBytesSent = 0;
+
+	/* The slots we may still fill before hearing back, and the receiver's
+	 * final answer
+	 */
+	int credits = 0;
+	int32_t doneError = 0;
+
+	/* The next slot, which only tells the receiver where we are in the window */
+	int slot = 0;
+
+	if (sock < 0)
+	{
+		return fail("The sender is not open.");
+	}
+
+	/* Validate the length of the file name before the receiver hears anything */
+	if (strlen(name) >= MAX_FILE_NAME_SIZE)
+	{
+		return fail("File name exceeds max size of %d.", MAX_FILE_NAME_SIZE);
+	}
+
+	numSyscalls = 0;
+
+	if (sendHello() < 0)
+	{
+		return -1;
+	}
+
+	/* The page cache can hand file chunks to the socket unless we have to checksum them */
+	useSendfile = !source && !(agreed.features & FEATURE_CHECKSUM);
+
+	/* Read one byte past the inline size to find out whether the source fits in the name */
+	if (agreed.inlineSize > 0 && (!useSendfile || fileSize <= (int64_t)agreed.inlineSize))
+	{
+		if ((numAhead = readChunk(source, fd, ahead, agreed.inlineSize + 1, atEnd)) < 0)
+		{
+			return -1;
+		}
+	}
+
+	/* Name the file, carrying the whole source if it fits */
+	nameMsg.mtype = FILE_NAME_TRANSFER_TYPE;
+	strncpy(nameMsg.fileName, name, MAX_FILE_NAME_SIZE - 1);
+	nameMsg.version = agreed.version;
+	nameMsg.priority = priority;
+
+	if (atEnd && (size_t)numAhead <= agreed.inlineSize)
+	{
+		nameMsg.flags = NAME_FLAG_INLINE;
+		nameMsg.size = numAhead;
+		memcpy(nameMsg.data, ahead, numAhead);
+		numBytesSent = numAhead;
+		ended = true;
+	}
+
+	if (sendAll(&nameMsg, offsetof(fileNameMsg, data) + nameMsg.size, 0) < 0)
+	{
+		return -1;
+	}
+
+	/* Send chunks while the credits last, and wait for more when they run out */
+	while (!ended)
+	{
+		if (credits == 0 && recvCredits(credits, doneError) < 0)
+		{
+			return -1;
+		}
+
+		if (credits < 0)
+		{
+			return fail("The receiver answered before the transfer ended.");
+		}
+
+		if (useSendfile)
+		{
+			sndMsg.size = min((int64_t)agreed.chunkSize, fileSize - numBytesSent);
+			ended = numBytesSent + sndMsg.size == fileSize;
+		}
+		else
+		{
+			/* Fill the buffer, first with the bytes read ahead, then from the source */
+			sndMsg.size = min((size_t)numAhead - aheadPos, agreed.chunkSize);
+			memcpy(buffer, ahead + aheadPos, sndMsg.size);
+			aheadPos += sndMsg.size;
+
+			if ((numRead = readChunk(source, fd, buffer + sndMsg.size, agreed.chunkSize - sndMsg.size, atEnd)) < 0)
+			{
+				return -1;
+			}
+			sndMsg.size += numRead;
+
+			ended = atEnd && aheadPos == (size_t)numAhead;
+			sndMsg.checksum = (agreed.features & FEATURE_CHECKSUM) ? crc32c(buffer, sndMsg.size) : 0;
+		}
+
+		/* Say where the bytes go, and whether they end the transfer or use up our credits */
+		sndMsg.offset = numBytesSent;
+		sndMsg.slot = slot;
+		sndMsg.flags = (--credits == 0 ? MSG_FLAG_LAST_CREDIT : 0) | (ended ? MSG_FLAG_END : 0);
+
+		if (useSendfile)
+		{
+			/* The notice waits in the socket for the bytes sendfile() adds */
+			if (sendAll(&sndMsg, sizeof(sndMsg), sndMsg.size > 0 ? MSG_MORE : 0) < 0)
+			{
+				return -1;
+			}
+
+			for (fileOffset = numBytesSent; fileOffset < numBytesSent + sndMsg.size; )
+			{
+				if ((numSent = sendfile(sock, fd, &fileOffset, numBytesSent + sndMsg.size - fileOffset)) < 0)
+				{
+					if (errno == EINTR)
+					{
+						continue;
+					}
+					return fail("sendfile: %s", strerror(errno));
+				}
+
+				if (numSent == 0)
+				{
+					return fail("The file shrank while it was sent.");
+				}
+				++numSyscalls;
+			}
+		}
+		else
+		{
+			/* Gather the notice and its bytes into one call */
+			iov[0].iov_base = &sndMsg;
+			iov[0].iov_len = sizeof(sndMsg);
+			iov[1].iov_base = buffer;
+			iov[1].iov_len = sndMsg.size;
+			gather.msg_iov = iov;
+			gather.msg_iovlen = 2;
+
+			while (gather.msg_iovlen > 0)
+			{
+				if ((numSent = sendmsg(sock, &gather, MSG_NOSIGNAL)) < 0)
+				{
+					if (errno == EINTR)
+					{
+						continue;
+					}
+					return fail("sendmsg: %s", strerror(errno));
+				}
+				++numSyscalls;
+
+				/* Skip what went out, which may end in the middle of either part */
+				while (gather.msg_iovlen > 0 && (size_t)numSent >= gather.msg_iov[0].iov_len)
+				{
+					numSent -= gather.msg_iov[0].iov_len;
+					++gather.msg_iov;
+					--gather.msg_iovlen;
+				}
+
+				if (gather.msg_iovlen > 0)
+				{
+					gather.msg_iov[0].iov_base = (char*)gather.msg_iov[0].iov_base + numSent;
+					gather.msg_iov[0].iov_len -= numSent;
+				}
+			}
+		}
+
+		numBytesSent += sndMsg.size;
+		slot = (slot + 1) % agreed.numSlots;
+	}
+
+	/* Skip the credits still on their way until the receiver's answer */
+	do
+	{
+		if (recvCredits(credits, doneError) < 0)
+		{
+			return -1;
+		}
+	}
+	while (credits >= 0);
+
+	if (doneError != 0)
+	{
+		return fail("The receiver could not store the file: %s", strerror(doneError));
+	}
+
+	return numBytesSent;
+}
+
+/**
+ * Runs one transfer
+ * @param  name The name to give the receiver
+ * @param  source Where the bytes come from
+ * @return The number of bytes sent, or -1 on failure
+ */
+int64_t NetSender::send(const char* name, TransferSource& source)
+{
+	return transfer(name, &source, -1, -1);
+}
+
+/**
+ * Runs one transfer of a file under its own name, with sendfile() when no
+ * checksums were agreed
+ * @param  fileName The name of the file
+ * @return The number of bytes sent, or -1 on failure
+ */
+int64_t NetSender::sendFile(const char* fileName)
+{
+	/* The file and its size */
+	int fd = ::open(fileName, O_RDONLY);
+	struct stat st;
+
+	/* The result */
+	int64_t numBytesSent;
+
+	if (fd < 0)
+	{
+		return fail("%s: %s", fileName, strerror(errno));
+	}
+
+	if (fstat(fd, &st) < 0)
+	{
+		fail("fstat: %s", strerror(errno));
+		::close(fd);
+		return -1;
+	}
+
+	numBytesSent = transfer(fileName, NULL, fd, st.st_size);
+	::close(fd);
+
+	return numBytesSent;
+}
+
+NetReceiver::NetReceiver() : numSlots(DEFAULT_WINDOW_SIZE), chunkSize(DEFAULT_NET_CHUNK_SIZE), supportedFeatures(FEATURE_CHECKSUM),
+	requestedFeatures(0), inlineSize(MAX_MSG_PAYLOAD), listenSock(-1), sock(-1), buffer(NULL), bufferSize(0), numSyscalls(0),
+	activeSink(NULL), handlerStopped(false), numDropped(0)
+{
+}
+
+NetReceiver::~NetReceiver()
+{
+	close();
+	free(buffer);
+}
+
+/**
+ * Records a failure
+ * @param  format The printf() format of the description
+ * @return -1
+ */
+int NetReceiver::fail(const char* format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	formatError(error, format, args);
+	va_end(args);
+
+	return -1;
+}
+
+/**
+ * Starts listening
+ * @param  address The port, or host:port to listen on one address only
+ * @return 0, or -1 on failure
+ */
+int NetReceiver::open(const char* address)
+{
+	/* The addresses to listen on, the result of the lookup and the option value */
+	addrinfo* addresses;
+	int result, on = 1;
+
+	if (listenSock >= 0)
+	{
+		return fail("The receiver is already open.");
+	}
+
+	if ((result = lookUp(address, NULL, true, &addresses)) != 0)
+	{
+		return fail("%s: %s", address, gai_strerror(result));
+	}
+
+	if ((listenSock = socket(addresses->ai_family, addresses->ai_socktype, addresses->ai_protocol)) < 0)
+	{
+		fail("socket: %s", strerror(errno));
+		freeaddrinfo(addresses);
+		return -1;
+	}
+
+	/* Connections inherit the buffers, and a restarted receiver can listen again at once */
+	tuneSocket(listenSock);
+	setsockopt(listenSock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	if (bind(listenSock, addresses->ai_addr, addresses->ai_addrlen) < 0 || listen(listenSock, SOMAXCONN) < 0)
+	{
+		fail("Cannot listen on %s: %s", address, strerror(errno));
+		freeaddrinfo(addresses);
+		close();
+		return -1;
+	}
+
+	freeaddrinfo(addresses);
+
+	return 0;
+}
+
+/**
+ * Stops listening and closes any connection
+ */
+void NetReceiver::close()
+{
+	if (sock >= 0)
+	{
+		::close(sock);
+		sock = -1;
+	}
+
+	if (listenSock >= 0)
+	{
+		::close(listenSock);
+		listenSock = -1;
+	}
+}
+
+/**
+ * Receives a number of bytes, or as many as come before the sender hangs up
+ * @param  data Where to put them
+ * @param  size The number of bytes
+ * @return The number of bytes received, or -1 on failure
+ */
+ssize_t NetReceiver::recvAll(void* data, size_t size)
+{
+	/* The bytes received so far and by the last call */
+	size_t numBytes = 0;
+	ssize_t numRecv;
+
+	while (numBytes < size)
+	{
+		if ((numRecv = ::recv(sock, (char*)data + numBytes, size - numBytes, MSG_WAITALL)) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return fail("recv: %s", strerror(errno));
+		}
+		++numSyscalls;
+
+		if (numRecv == 0)
+		{
+			break;
+		}
+
+		numBytes += numRecv;
+	}
+
+	return numBytes;
+}
+
+/**
+ * Hands credits back to the sender
+ * @param  credits The number of slots the sender may fill
+ * @return 0, or -1 on failure
+ */
+int NetReceiver::sendAck(int credits)
+{
+	/* The acknowledgment */
+	ackMessage ack;
+	memset(&ack, 0, sizeof(ack));
+	ack.mtype = RECV_DONE_TYPE;
+	ack.credits = credits;
+
+	if (::send(sock, &ack, sizeof(ack), MSG_NOSIGNAL) != (ssize_t)sizeof(ack))
+	{
+		return fail("send: %s", strerror(errno));
+	}
+	++numSyscalls;
+
+	return 0;
+}
+
+/**
+ * Picks the best configuration both sides can do and tells the sender
+ * @param  hello The sender's capabilities
+ * @param  config Set to the configuration
+ * @return 0, or -1 on failure
+ */
+int NetReceiver::answerHello(const helloMsg& hello, transferConfig& config)
+{
+	/* The configuration to send back */
+	helloAckMsg ack;
+	memset(&ack, 0, sizeof(ack));
+	ack.mtype = HELLO_ACK_TYPE;
+
+	/* A sender with another byte order or layout garbles even the type */
+	if (hello.mtype != HELLO_TYPE || hello.version < NET_MIN_PROTOCOL_VERSION)
+	{
+		return fail("The sender's hello makes no sense. Sockets need protocol version %d or later "
+			"and both hosts to have the same byte order and word size.", NET_MIN_PROTOCOL_VERSION);
+	}
+
+	/* Use as many slots and as big chunks as both sides allow, and the
+	 * features both sides support that either side asked for
+	 */
+	ack.version = hello.version < PROTOCOL_VERSION ? hello.version : PROTOCOL_VERSION;
+	ack.numSlots = (hello.maxSlots > 0 && hello.maxSlots < numSlots) ? hello.maxSlots : numSlots;
+	ack.chunkSize = (hello.maxChunkSize > 0 && hello.maxChunkSize < chunkSize) ? hello.maxChunkSize : chunkSize;
+	ack.slotSize = ack.chunkSize;
+	ack.features = hello.features & supportedFeatures & (hello.requested | requestedFeatures);
+	ack.slotBase = 0;
+	ack.ackType = RECV_DONE_TYPE;
+	ack.inlineSize = min((size_t)hello.maxInline, inlineSize);
+
+	if (::send(sock, &ack, sizeof(ack), MSG_NOSIGNAL) != (ssize_t)sizeof(ack))
+	{
+		return fail("send: %s", strerror(errno));
+	}
+	++numSyscalls;
+
+	config.version = ack.version;
+	config.numSlots = ack.numSlots;
+	config.chunkSize = ack.chunkSize;
+	config.features = ack.features;
+	config.inlineSize = ack.inlineSize;
+
+	return 0;
+}
+
+/**
+ * Receives the file name and every chunk of one transfer, then answers
+ * @param  handler Decides where the bytes go
+ * @param  config The configuration agreed with the sender
+ * @return 0, or -1 on failure
+ */
+int NetReceiver::runTransfer(TransferHandler& handler, const transferConfig& config)
+{
+	/* The file name message, and the size of the part before its bytes */
+	fileNameMsg name;
+	const size_t nameSize = offsetof(fileNameMsg, data);
+
+	/* The notice ahead of each chunk */
+	message rcvMsg;
+
+	/* Where the bytes go */
+	TransferSink* sink;
+
+	/* When the transfer started, and the bytes received */
+	uint64_t start = nowNs();
+	int64_t numBytesRecv = 0;
+
+	/* The chunks consumed since the last acknowledgment */
+	int pending = 0;
+
+	/* The answer at the end */
+	doneMsg done;
+	memset(&done, 0, sizeof(done));
+
+	if (recvAll(&name, nameSize) != (ssize_t)nameSize)
+	{
+		return fail("The sender hung up before naming the file.");
+	}
+
+	if (name.mtype != FILE_NAME_TRANSFER_TYPE || name.version != config.version || name.size < 0 ||
+		(size_t)name.size > ((name.flags & NAME_FLAG_INLINE) ? config.inlineSize : 0))
+	{
+		return fail("Got a file name message of type %ld, version %d, carrying %d bytes.", name.mtype, name.version, name.size);
+	}
+
+	if (recvAll(name.data, name.size) != name.size)
+	{
+		return fail("The sender hung up in the middle of the file name message.");
+	}
+
+	name.fileName[MAX_FILE_NAME_SIZE - 1] = '\0';
+
+	if (name.priority < 0 || name.priority >= NUM_PRIORITY_CLASSES)
+	{
+		name.priority = PRIORITY_NORMAL;
+	}
+
+	if (!(sink = handler.start(name.fileName, name.priority, config)))
+	{
+		handlerStopped = true;
+		return fail("No sink for %s.", name.fileName);
+	}
+
+	activeSink = sink;
+
+	if (reserveBuffer(buffer, bufferSize, config.chunkSize) < 0)
+	{
+		return fail("posix_memalign: %s", strerror(errno));
+	}
+
+	/* The whole source came in the name */
+	if (name.flags & NAME_FLAG_INLINE)
+	{
+		if (name.size > 0 && sink->write(name.data, name.size) < 0)
+		{
+			return fail("write: %s", strerror(errno));
+		}
+
+		numBytesRecv = name.size;
+	}
+	/* Grant the whole window, then take chunks until the last one */
+	else if (sendAck(config.numSlots) < 0)
+	{
+		return -1;
+	}
+	else
+	{
+		while (true)
+		{
+			if (recvAll(&rcvMsg, sizeof(rcvMsg)) != (ssize_t)sizeof(rcvMsg))
+			{
+				return fail("The sender hung up after %lld bytes of %s.", (long long)numBytesRecv, name.fileName);
+			}
+
+			/* Chunks arrive in order, so anything else means the sender is confused */
+			if (rcvMsg.mtype != SENDER_DATA_TYPE || (int64_t)rcvMsg.offset != numBytesRecv || rcvMsg.size < 0 ||
+				(uint64_t)rcvMsg.size > config.chunkSize)
+			{
+				return fail("Got %lld bytes for offset %llu when expecting offset %lld.",
+					(long long)rcvMsg.size, (unsigned long long)rcvMsg.offset, (long long)numBytesRecv);
+			}
+
+			if (recvAll(buffer, rcvMsg.size) != rcvMsg.size)
+			{
+				return fail("The sender hung up after %lld bytes of %s.", (long long)numBytesRecv, name.fileName);
+			}
+
+			/* Make sure the chunk was not damaged on the way */
+			if ((config.features & FEATURE_CHECKSUM) && crc32c(buffer, rcvMsg.size) != rcvMsg.checksum)
+			{
+				return fail("Checksum mismatch in the chunk at offset %lld.", (long long)numBytesRecv);
+			}
+
+			if (rcvMsg.size > 0 && sink->write(buffer, rcvMsg.size) < 0)
+			{
+				return fail("write: %s", strerror(errno));
+			}
+
+			numBytesRecv += rcvMsg.size;
+
+			if (rcvMsg.size == 0 || (rcvMsg.flags & MSG_FLAG_END))
+			{
+				break;
+			}
+
+			/* Hand back credits in batches, and at once when the sender has none left */
+			if (++pending >= (config.numSlots + 1) / 2 || (rcvMsg.flags & MSG_FLAG_LAST_CREDIT))
+			{
+				if (sendAck(pending) < 0)
+				{
+					return -1;
+				}
+				pending = 0;
+			}
+		}
+	}
+
+	/* Always answer once the sink is done, so no credits spill into the next transfer */
+	done.mtype = RECV_DONE_TYPE;
+	done.credits = -1;
+	done.error = sink->finish() < 0 ? errno : 0;
+
+	if (::send(sock, &done, sizeof(done), MSG_NOSIGNAL) != (ssize_t)sizeof(done))
+	{
+		return fail("send: %s", strerror(errno));
+	}
+	++numSyscalls;
+
+	if (done.error)
+	{
+		return fail("finish: %s", strerror(done.error));
+	}
+
+	activeSink = NULL;
+	handler.finish(sink, numBytesRecv, nowNs() - start);
+
+	return 0;
+}
+
+/**
+ * Hangs up on a sender whose transfer failed and hands what it left to the handler
+ * @param  handler The handler the transfer's sink came from
+ */
+void NetReceiver::dropSender(TransferHandler& handler)
+{
+	/* The failed transfer's sink, if it got that far */
+	TransferSink* sink = activeSink;
+
+	activeSink = NULL;
+	::close(sock);
+	sock = -1;
+	++numDropped;
+
+	handler.abandon(sink, error.c_str());
+}
+
+/**
+ * Runs transfers as senders connect, one connection at a time, dropping
+ * senders whose transfers fail
+ * @param  handler Decides where each transfer's bytes go
+ * @param  numTransfers The number of transfers to run, or 0 to run until failure
+ * @return 0, or -1 on failure of the listening socket or when the handler gives no sink
+ */
+int NetReceiver::serve(TransferHandler& handler, int numTransfers)
+{
+	/* The sender's capabilities, how many bytes of them came and the configuration picked */
+	helloMsg hello;
+	ssize_t numRecv;
+	transferConfig config;
+
+	/* The number of transfers run */
+	int numDone = 0;
+
+	if (listenSock < 0)
+	{
+		return fail("The receiver is not open.");
+	}
+
+	numSyscalls = 0;
+	numDropped = 0;
+	handlerStopped = false;
+
+	while (numTransfers == 0 || numDone < numTransfers)
+	{
+		/* Wait for the next sender */
+		if (sock < 0)
+		{
+			if ((sock = accept(listenSock, NULL, NULL)) < 0)
+			{
+				/* A sender that gave up while waiting is no reason to stop */
+				if (errno == EINTR || errno == ECONNABORTED)
+				{
+					continue;
+				}
+				return fail("accept: %s", strerror(errno));
+			}
+			++numSyscalls;
+
+			tuneSocket(sock);
+		}
+
+		/* A sender that hangs up between transfers is done with us */
+		if ((numRecv = recvAll(&hello, sizeof(hello))) == 0)
+		{
+			::close(sock);
+			sock = -1;
+			continue;
+		}
+
+		/* One that fails only costs its own connection */
+		if (numRecv > 0 && numRecv != (ssize_t)sizeof(hello))
+		{
+			fail("The sender hung up in the middle of its hello.");
+		}
+
+		if (numRecv != (ssize_t)sizeof(hello) || answerHello(hello, config) < 0 || runTransfer(handler, config) < 0)
+		{
+			if (handlerStopped)
+			{
+				return -1;
+			}
+
+			dropSender(handler);
+			continue;
+		}
+
+		++numDone;
+	}
+
+	return 0;
+}
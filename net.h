@@ -0,0 +1,225 @@
+/* Transfers over a stream socket, for when the receiver runs on another host.
+ * The messages are the same as over the message queue, written back to back
+ * on one TCP connection: the sender's hello, the receiver's answer, the file
+ * name, then each data message followed by its bytes, with acknowledgments
+ * and the durable completion flowing the other way. Slots become the
+ * receiver's buffer, so the window still bounds the bytes in flight while
+ * the sender keeps it full without waiting for each chunk.
+ *
+ *	NetSender sender;
+ *
+ *	if (sender.open("otherhost:7000") < 0 || sender.sendFile("file") < 0)
+ *		fprintf(stderr, "%s\n", sender.lastError());
+ *
+ *	NetReceiver receiver;
+ *
+ *	if (receiver.open("7000") < 0 || receiver.serve(handler, 0) < 0)
+ *		fprintf(stderr, "%s\n", receiver.lastError());
+ *
+ * The sender hands file chunks to the kernel with sendfile() unless it has
+ * to checksum them, and otherwise gathers each notice and its chunk into
+ * one sendmsg(), the writev() that can ask for MSG_NOSIGNAL. The receiver
+ * reads each chunk straight into a page-aligned buffer.
+ *
+ * Messages go out in the sender's byte order and layout, so both hosts must
+ * share them; a receiver that cannot make sense of a hello says so. Only
+ * senders of protocol version 5 or later use sockets. Either side may start
+ * first: the sender keeps trying to connect for readyTimeoutMs. A connection
+ * can carry any number of transfers, one after another, and the receiver
+ * serves one connection at a time.
+ *
+ * Include transfer.h first.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string>
+
+class TransferSource;
+class TransferHandler;
+
+/* The oldest protocol version spoken over sockets */
+#define NET_MIN_PROTOCOL_VERSION 5
+
+/* The host a sender connects to when the address is only a port */
+#define DEFAULT_NET_HOST "127.0.0.1"
+
+/* The chunk size of a socket receiver. Bigger than shared memory chunks,
+ * since each one costs system calls on both sides.
+ */
+#define DEFAULT_NET_CHUNK_SIZE (256 * 1024)
+
+/* The socket buffers both sides ask for, capped by net.core.[rw]mem_max */
+#define NET_SOCKET_BUFFER_SIZE (4 * 1024 * 1024)
+
+/**
+ * The sending side over a socket
+ */
+class NetSender
+{
+public:
+	NetSender();
+	~NetSender();
+	NetSender(const NetSender&) = delete;
+	NetSender& operator=(const NetSender&) = delete;
+
+	/**
+	 * Connects to a receiver, retrying for up to readyTimeoutMs until it listens
+	 * @param  address The receiver's host and port as host:port, or just the
+	 *         port for this host
+	 * @return 0, or -1 on failure
+	 */
+	int open(const char* address);
+
+	/**
+	 * Closes the connection
+	 */
+	void close();
+
+	/**
+	 * Runs one transfer
+	 * @param  name The name to give the receiver
+	 * @param  source Where the bytes come from
+	 * @return The number of bytes sent, or -1 on failure
+	 */
+	int64_t send(const char* name, TransferSource& source);
+
+	/**
+	 * Runs one transfer of a file under its own name, with sendfile() when
+	 * no checksums were agreed
+	 * @param  fileName The name of the file
+	 * @return The number of bytes sent, or -1 on failure
+	 */
+	int64_t sendFile(const char* fileName);
+
+	/**
+	 * Describes the last failure
+	 * @return The description
+	 */
+	const char* lastError() const { return error.c_str(); }
+
+	/* The configuration of the last transfer */
+	const transferConfig& config() const { return agreed; }
+
+	/* The number of system calls on the socket in the last transfer */
+	unsigned long syscalls() const { return numSyscalls; }
+
+	/* The limits and features to ask for, as for a Sender */
+	int maxSlots;
+	size_t maxChunkSize;
+	uint32_t supportedFeatures;
+	uint32_t requestedFeatures;
+	int priority;
+	size_t maxInline;
+
+	/* How long open() keeps trying to connect, in milliseconds, -1 for as long as it takes */
+	int readyTimeoutMs;
+
+private:
+	int fail(const char* format, ...) __attribute__((format(printf, 2, 3)));
+	int64_t transfer(const char* name, TransferSource* source, int fd, int64_t fileSize);
+	int sendHello();
+	int sendAll(const void* data, size_t size, int flags);
+	int recvAll(void* data, size_t size);
+	int recvCredits(int& credits, int32_t& doneError);
+	ssize_t readChunk(TransferSource* source, int fd, char* buffer, size_t size, bool& atEnd);
+
+	/* The connected socket */
+	int sock;
+
+	/* The buffer chunks are read into when they cannot be sent from the file */
+	char* buffer;
+	size_t bufferSize;
+
+	/* The configuration the receiver picked */
+	transferConfig agreed;
+
+	/* The number of system calls on the socket in the last transfer */
+	unsigned long numSyscalls;
+
+	/* The last failure */
+	std::string error;
+};
+
+/**
+ * The receiving side over a socket
+ */
+class NetReceiver
+{
+public:
+	NetReceiver();
+	~NetReceiver();
+	NetReceiver(const NetReceiver&) = delete;
+	NetReceiver& operator=(const NetReceiver&) = delete;
+
+	/**
+	 * Starts listening
+	 * @param  address The port, or host:port to listen on one address only
+	 * @return 0, or -1 on failure
+	 */
+	int open(const char* address);
+
+	/**
+	 * Stops listening and closes any connection
+	 */
+	void close();
+
+	/**
+	 * Runs transfers as senders connect, one connection at a time. A sender
+	 * whose hello or transfer fails is dropped and handed to the handler's
+	 * abandon(), and the next one is accepted.
+	 * @param  handler Decides where each transfer's bytes go
+	 * @param  numTransfers The number of transfers to run, or 0 to run until failure
+	 * @return 0, or -1 on failure of the listening socket or when the handler
+	 *         gives no sink
+	 */
+	int serve(TransferHandler& handler, int numTransfers);
+
+	/**
+	 * Describes the last failure
+	 * @return The description
+	 */
+	const char* lastError() const { return error.c_str(); }
+
+	/* The number of system calls on sockets in the transfers served */
+	unsigned long syscalls() const { return numSyscalls; }
+
+	/* The number of senders serve() dropped because their transfers failed */
+	unsigned long dropped() const { return numDropped; }
+
+	/* The window, chunk size, features and inline size to offer, as for a Receiver */
+	int numSlots;
+	size_t chunkSize;
+	uint32_t supportedFeatures;
+	uint32_t requestedFeatures;
+	size_t inlineSize;
+
+private:
+	int fail(const char* format, ...) __attribute__((format(printf, 2, 3)));
+	int answerHello(const helloMsg& hello, transferConfig& config);
+	int runTransfer(TransferHandler& handler, const transferConfig& config);
+	void dropSender(TransferHandler& handler);
+	int sendAck(int credits);
+	ssize_t recvAll(void* data, size_t size);
+
+	/* The listening socket and the connection being served */
+	int listenSock;
+	int sock;
+
+	/* The page-aligned buffer chunks are read into */
+	char* buffer;
+	size_t bufferSize;
+
+	/* The number of system calls on sockets in the transfers served */
+	unsigned long numSyscalls;
+
+	/* The sink of the transfer running, and whether the handler gave none */
+	TransferSink* activeSink;
+	bool handlerStopped;
+
+	/* The number of senders dropped */
+	unsigned long numDropped;
+
+	/* The last failure */
+	std::string error;
+};
@@ -0,0 +1,332 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <thread>
+#include "pacer.h"
+
+using namespace std;
+
+Pacer::Pacer() : rateLimit(0), currentRate(0), burstSize(0), tokens(0), lastNs(0), totalSleptNs(0),
+	ioFd(-1), memoryFd(-1), ioStallUs(0), memoryStallUs(0), totalBytes(0), sampleBytes(0), sampleNs(0),
+	measuredRate(0), unthrottledRate(0), requestedRate(0), rateRequested(false), slowdownRequested(false)
+{
+}
+
+Pacer::~Pacer()
+{
+	watchPressure(false);
+}
+
+/**
+ * Sets the rate limit, dropping any back-off from pressure
+ * @param  bytesPerSec The limit, or 0 for none
+ * @param  burst The most bytes to let through at once after a pause, or 0
+ *         for DEFAULT_PACER_BURST_NS worth of the limit
+ */
+void Pacer::setRate(uint64_t bytesPerSec, uint64_t burst)
+{
+	rateLimit = bytesPerSec;
+	currentRate = bytesPerSec;
+	burstSize = burst;
+	unthrottledRate = 0;
+}
+
+/**
+ * Opens or closes the pressure stall files of the kernel
+ * @param  on Whether to watch the pressure
+ * @return 0, or -1 with errno set if neither file could be opened
+ */
+int Pacer::watchPressure(bool on)
+{
+	if (ioFd >= 0)
+	{
+		::close(ioFd);
+		ioFd = -1;
+	}
+
+	if (memoryFd >= 0)
+	{
+		::close(memoryFd);
+		memoryFd = -1;
+	}
+
+	if (!on)
+	{
+		return 0;
+	}
+
+	/* Either file is enough, since kernels built without one of them still have the other */
+	ioFd = ::open(PRESSURE_IO_FILE, O_RDONLY | O_CLOEXEC);
+	memoryFd = ::open(PRESSURE_MEMORY_FILE, O_RDONLY | O_CLOEXEC);
+
+	if (ioFd < 0 && memoryFd < 0)
+	{
+		return -1;
+	}
+
+	ioStallUs = readStallUs(ioFd);
+	memoryStallUs = readStallUs(memoryFd);
+
+	return 0;
+}
+
+/**
+ * Leaves a new rate limit for the next pace() to apply, from any thread
+ * @param  bytesPerSec The limit, or 0 for none
+ */
+void Pacer::requestRate(uint64_t bytesPerSec)
+{
+	requestedRate.store(bytesPerSec, memory_order_relaxed);
+	rateRequested.store(true, memory_order_release);
+}
+
+/**
+ * Leaves a request to halve the rate for the next pace() to apply, from any thread
+ */
+void Pacer::requestSlowdown()
+{
+	slowdownRequested.store(true, memory_order_release);
+}
+
+/**
+ * Fills the bucket and starts measuring afresh for a new transfer
+ * @param  now The current time
+ */
+void Pacer::restart(uint64_t now)
+{
+	lastNs = now;
+	sampleBytes = totalBytes;
+	sampleNs = now;
+	measuredRate = 0;
+	ioStallUs = readStallUs(ioFd);
+	memoryStallUs = readStallUs(memoryFd);
+
+	/* Start full, so a short transfer goes out at once */
+	tokens = burstSize ? burstSize : currentRate * (double)DEFAULT_PACER_BURST_NS / 1e9;
+}
+
+/**
+ * Applies whatever signal handlers asked for since the last chunk
+ */
+void Pacer::applyRequests()
+{
+	if (rateRequested.load(memory_order_relaxed) && rateRequested.exchange(false, memory_order_acquire))
+	{
+		setRate(requestedRate.load(memory_order_relaxed), burstSize);
+	}
+
+	if (slowdownRequested.load(memory_order_relaxed) && slowdownRequested.exchange(false, memory_order_acquire))
+	{
+		/* Halve what we go at now, measuring it if nothing limits it yet */
+		uint64_t from = currentRate ? currentRate : measuredRate;
+
+		if (from > 0)
+		{
+			setRate(max(from / 2, min(from, (uint64_t)PACER_MIN_RATE)), burstSize);
+		}
+	}
+}
+
+/**
+ * Gets the total time tasks stalled from a pressure file
+ * @param  fd The open file, or -1
+ * @return The "some" total in microseconds, or 0 if there is none
+ */
+uint64_t Pacer::readStallUs(int fd)
+{
+	/* The start of the file, whose first line is "some avg10=... total=<us>" */
+	char buffer[256];
+	ssize_t size;
+	const char* total;
+
+	if (fd < 0 || (size = pread(fd, buffer, sizeof(buffer) - 1, 0)) <= 0)
+	{
+		return 0;
+	}
+
+	buffer[size] = '\0';
+
+	if ((total = strstr(buffer, "total=")) == NULL)
+	{
+		return 0;
+	}
+
+	return strtoull(total + strlen("total="), NULL, 10);
+}
+
+/**
+ * Backs off while tasks stall on I/O or memory, and recovers once they stop
+ * @param  now The current time, at least PRESSURE_INTERVAL_NS after the last sample
+ */
+void Pacer::checkPressure(uint64_t now)
+{
+	/* The stall totals now */
+	uint64_t io = readStallUs(ioFd), memory = readStallUs(memoryFd);
+
+	/* The worse share of the interval that tasks spent stalled */
+	double share = max(io > ioStallUs ? io - ioStallUs : 0, memory > memoryStallUs ? memory - memoryStallUs : 0) *
+		1000.0 / (now - sampleNs);
+
+	/* The slowest to back off to, unless the limit itself is slower */
+	uint64_t floor = (rateLimit && rateLimit < PACER_MIN_RATE) ? rateLimit : PACER_MIN_RATE;
+
+	ioStallUs = io;
+	memoryStallUs = memory;
+
+	if (share >= PRESSURE_HIGH)
+	{
+		/* Halve the rate, remembering what to climb back to if there was no limit */
+		if (currentRate == 0)
+		{
+			if (measuredRate == 0)
+			{
+				return;
+			}
+
+			unthrottledRate = measuredRate;
+			currentRate = measuredRate;
+		}
+
+		currentRate = max(currentRate / 2, floor);
+	}
+	else if (share < PRESSURE_LOW && currentRate != 0 && currentRate != rateLimit)
+	{
+		/* Climb back an eighth at a time, letting go altogether once an unlimited pacer is back */
+		uint64_t ceiling = rateLimit ? rateLimit : unthrottledRate;
+
+		currentRate = min(currentRate + ceiling / 8, ceiling);
+
+		if (rateLimit == 0 && currentRate >= unthrottledRate)
+		{
+			currentRate = 0;
+			unthrottledRate = 0;
+		}
+	}
+}
+
+/**
+ * Measures the rate and looks at the pressure once per PRESSURE_INTERVAL_NS
+ * @param  now The current time
+ */
+void Pacer::sample(uint64_t now)
+{
+	if (now - sampleNs < PRESSURE_INTERVAL_NS)
+	{
+		return;
+	}
+
+	measuredRate = (totalBytes - sampleBytes) * 1000000000ULL / (now - sampleNs);
+
+	if (watchingPressure())
+	{
+		checkPressure(now);
+	}
+
+	sampleBytes = totalBytes;
+	sampleNs = now;
+}
+
+/**
+ * Takes a chunk out of the bucket, sleeping until the bucket has paid for it
+ * @param  numBytes The size of the chunk
+ * @param  now The current time
+ * @return The nanoseconds slept
+ */
+uint64_t Pacer::pace(size_t numBytes, uint64_t now)
+{
+	/* The most the bucket holds at the current rate, and how long to sleep */
+	double capacity;
+	uint64_t sleepNs;
+
+	/* The time to sleep until */
+	struct timespec deadline;
+
+	applyRequests();
+	totalBytes += numBytes;
+	sample(now);
+
+	if (currentRate == 0)
+	{
+		lastNs = now;
+		return 0;
+	}
+
+	/* Refill for the time since the last chunk, then take this one out */
+	capacity = burstSize ? burstSize : currentRate * (double)DEFAULT_PACER_BURST_NS / 1e9;
+	tokens = min(tokens + (now - lastNs) * (double)currentRate / 1e9, capacity) - numBytes;
+	lastNs = now;
+
+	if (tokens >= 0)
+	{
+		return 0;
+	}
+
+	/* Sleep until the bucket has paid the chunk back. Signals, such as the
+	 * ones asking for a new rate, only interrupt the sleep.
+	 */
+	sleepNs = (uint64_t)(-tokens * 1e9 / currentRate);
+	lastNs = now + sleepNs;
+	tokens = 0;
+	totalSleptNs += sleepNs;
+
+	deadline.tv_sec = lastNs / 1000000000ULL;
+	deadline.tv_nsec = lastNs % 1000000000ULL;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+	{
+	}
+
+	return sleepNs;
+}
+
+/**
+ * Blocks RATE_SIGNAL and starts a thread that turns each one into a request
+ * to the pacer: a queued value asks for that limit, a plain signal for half
+ * the rate
+ * @param  pacer The pacer to adjust
+ * @return 0, or -1 with errno set
+ */
+int adjustOnSignal(Pacer& pacer)
+{
+	/* Just the rate signal */
+	sigset_t signals;
+
+	sigemptyset(&signals);
+	sigaddset(&signals, RATE_SIGNAL);
+
+	/* Block it here, and so in every thread started from now on */
+	if ((errno = pthread_sigmask(SIG_BLOCK, &signals, NULL)) != 0)
+	{
+		return -1;
+	}
+
+	thread([&pacer, signals]()
+	{
+		/* Who sent the signal and how */
+		siginfo_t info;
+
+		while (true)
+		{
+			if (sigwaitinfo(&signals, &info) < 0)
+			{
+				continue;
+			}
+
+			if (info.si_code == SI_QUEUE)
+			{
+				pacer.requestRate((uint64_t)(uint32_t)info.si_value.sival_int * RATE_SIGNAL_UNIT);
+			}
+			else
+			{
+				pacer.requestSlowdown();
+			}
+		}
+	}).detach();
+
+	return 0;
+}
@@ -0,0 +1,166 @@
+/* Pacing a transfer to a rate limit, so it leaves memory bandwidth and disk
+ * time for the other work on the host. A token bucket holds up to a burst of
+ * bytes and refills at the limit; each chunk takes its size out, and once
+ * the bucket runs dry the caller sleeps just long enough to pay the chunk
+ * back, so the rate stays smooth down to the chunk instead of arriving in
+ * bursts once a second.
+ *
+ * A pacer can also watch the kernel's pressure stall information for I/O
+ * and memory: while the share of time tasks stall on either rises past
+ * PRESSURE_HIGH it halves the rate, and once both fall below PRESSURE_LOW
+ * it climbs back by an eighth of the limit at a time.
+ *
+ * requestRate() and requestSlowdown() only store to atomics, so any thread
+ * can call them; the change applies at the next chunk. adjustOnSignal()
+ * lets other processes, such as shmstat -R, call them with RATE_SIGNAL.
+ */
+
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+/* How much a bucket holds when no burst is given, in nanoseconds at the limit */
+#define DEFAULT_PACER_BURST_NS 10000000ULL
+
+/* The slowest a pacer goes when backing off or being slowed down, in bytes per second */
+#define PACER_MIN_RATE (1024 * 1024)
+
+/* Where the kernel reports pressure stalls */
+#define PRESSURE_IO_FILE "/proc/pressure/io"
+#define PRESSURE_MEMORY_FILE "/proc/pressure/memory"
+
+/* How often to look at the pressure, and the stall shares that make the pacer back off and recover */
+#define PRESSURE_INTERVAL_NS 100000000ULL
+#define PRESSURE_HIGH 0.10
+#define PRESSURE_LOW 0.02
+
+/* The signal that adjusts a pacer. Queued with sigqueue(), its value is the
+ * new limit in RATE_SIGNAL_UNIT bytes per second, 0 for none; sent with
+ * kill(), it halves the rate.
+ */
+#define RATE_SIGNAL SIGUSR1
+#define RATE_SIGNAL_UNIT 1024
+
+/**
+ * Keeps a stream of chunks under a rate limit
+ */
+class Pacer
+{
+public:
+	Pacer();
+	~Pacer();
+	Pacer(const Pacer&) = delete;
+	Pacer& operator=(const Pacer&) = delete;
+
+	/**
+	 * Sets the rate limit
+	 * @param  bytesPerSec The limit, or 0 for none
+	 * @param  burst The most bytes to let through at once after a pause, or 0
+	 *         for DEFAULT_PACER_BURST_NS worth of the limit
+	 */
+	void setRate(uint64_t bytesPerSec, uint64_t burst = 0);
+
+	/**
+	 * Starts or stops backing off under I/O and memory pressure
+	 * @param  on Whether to watch the pressure
+	 * @return 0, or -1 with errno set if the kernel reports no pressure
+	 */
+	int watchPressure(bool on);
+
+	/**
+	 * Asks for a new rate limit from any thread
+	 * @param  bytesPerSec The limit, or 0 for none
+	 */
+	void requestRate(uint64_t bytesPerSec);
+
+	/**
+	 * Asks for half the current rate from any thread
+	 */
+	void requestSlowdown();
+
+	/**
+	 * Fills the bucket for a new transfer
+	 * @param  now The current time
+	 */
+	void restart(uint64_t now);
+
+	/**
+	 * Takes a chunk out of the bucket, sleeping until the bucket can pay for it
+	 * @param  numBytes The size of the chunk
+	 * @param  now The current time
+	 * @return The nanoseconds slept
+	 */
+	uint64_t pace(size_t numBytes, uint64_t now);
+
+	/**
+	 * Gets the rate chunks go at now, which pressure may hold below the limit
+	 * @return Bytes per second, or 0 if nothing holds them back
+	 */
+	uint64_t rate() const { return currentRate; }
+
+	/* The limit set, in bytes per second, 0 for none */
+	uint64_t limit() const { return rateLimit; }
+
+	/* The nanoseconds pace() has slept in all */
+	uint64_t slept() const { return totalSleptNs; }
+
+	/* Whether the pressure is being watched */
+	bool watchingPressure() const { return ioFd >= 0 || memoryFd >= 0; }
+
+private:
+	void applyRequests();
+	void checkPressure(uint64_t now);
+	void sample(uint64_t now);
+	uint64_t readStallUs(int fd);
+
+	/* The limit set, the rate after backing off, and the bucket's size, 0
+	 * for DEFAULT_PACER_BURST_NS worth of the current rate
+	 */
+	uint64_t rateLimit;
+	uint64_t currentRate;
+	uint64_t burstSize;
+
+	/* The bytes the bucket holds, negative while a chunk is being paid back, as of lastNs */
+	double tokens;
+	uint64_t lastNs;
+
+	/* The nanoseconds slept in all */
+	uint64_t totalSleptNs;
+
+	/* The pressure files, -1 when not watched, and their stall totals at the last sample */
+	int ioFd;
+	int memoryFd;
+	uint64_t ioStallUs;
+	uint64_t memoryStallUs;
+
+	/* The bytes paced so far, the count and time at the last sample, and
+	 * the rate between the last two samples, for backing off from when
+	 * there is no limit
+	 */
+	uint64_t totalBytes;
+	uint64_t sampleBytes;
+	uint64_t sampleNs;
+	uint64_t measuredRate;
+
+	/* The rate before pressure first held back an unlimited pacer, which it
+	 * climbs back to before letting go
+	 */
+	uint64_t unthrottledRate;
+
+	/* Requests from other threads: a new limit with a flag saying it is
+	 * there, and a flag asking for half the rate
+	 */
+	std::atomic<uint64_t> requestedRate;
+	std::atomic<bool> rateRequested;
+	std::atomic<bool> slowdownRequested;
+};
+
+/**
+ * Lets RATE_SIGNAL adjust a pacer for the rest of the process's life. The
+ * signal is blocked and a thread of its own waits for it, so it never
+ * interrupts a system call. Call this before starting any other thread.
+ * @param  pacer The pacer to adjust
+ * @return 0, or -1 with errno set
+ */
+int adjustOnSignal(Pacer& pacer);
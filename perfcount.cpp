@@ -0,0 +1,228 @@
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "perfcount.h"
+
+/* The number of bytes in a megabyte */
+#define BYTES_PER_MB (1024.0 * 1024.0)
+
+/**
+ * What the kernel returns for a counter read with the times it was enabled and running
+ */
+struct perfReading
+{
+	uint64_t value;
+	uint64_t enabledNs;
+	uint64_t runningNs;
+};
+
+/**
+ * Opens a counter with perf_event_open(), which glibc has no wrapper for
+ * @param  attr What to count
+ * @return The file descriptor, or -1 with errno set
+ */
+static int perfEventOpen(perf_event_attr& attr)
+{
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+/**
+ * Gets the cache event config for read misses in one cache
+ * @param  cache A PERF_COUNT_HW_CACHE_* cache
+ * @return The config
+ */
+static uint64_t cacheReadMisses(uint64_t cache)
+{
+	return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+
+/**
+ * Explains why a counter did not open
+ * @param  error The errno perf_event_open() set
+ * @return The explanation
+ */
+static const char* describeFailure(int error)
+{
+	switch (error)
+	{
+		case ENOENT:
+		case ENODEV:
+		case EOPNOTSUPP:
+			return "not exposed by this CPU, VM or container";
+
+		case EACCES:
+		case EPERM:
+			return "not permitted, see /proc/sys/kernel/perf_event_paranoid";
+
+		case ENOSYS:
+			return "no perf_event_open() in this kernel";
+
+		default:
+			return strerror(error);
+	}
+}
+
+PerfCounters::PerfCounters()
+{
+	for (int i = 0; i < NUM_PERF_COUNTERS; ++i)
+	{
+		fds[i] = -1;
+		errors[i] = ENOENT;
+		userOnly[i] = false;
+	}
+}
+
+PerfCounters::~PerfCounters()
+{
+	for (int i = 0; i < NUM_PERF_COUNTERS; ++i)
+	{
+		if (fds[i] >= 0)
+		{
+			close(fds[i]);
+		}
+	}
+}
+
+/**
+ * Opens every counter the kernel allows, stopped, counting user space
+ * only where the kernel's share is off limits
+ * @return The number of counters opened
+ */
+int PerfCounters::open()
+{
+	/* The type and config of each counter */
+	static const uint32_t types[NUM_PERF_COUNTERS] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+		PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE, PERF_TYPE_SOFTWARE, PERF_TYPE_SOFTWARE };
+	const uint64_t configs[NUM_PERF_COUNTERS] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+		cacheReadMisses(PERF_COUNT_HW_CACHE_LL), cacheReadMisses(PERF_COUNT_HW_CACHE_DTLB),
+		PERF_COUNT_SW_CONTEXT_SWITCHES, PERF_COUNT_SW_PAGE_FAULTS };
+
+	/* The number of counters opened */
+	int numOpened = 0;
+
+	for (int i = 0; i < NUM_PERF_COUNTERS; ++i)
+	{
+		/* What to count: ourselves and the threads we start, with the times
+		 * needed to scale counts the kernel multiplexed
+		 */
+		perf_event_attr attr;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = types[i];
+		attr.config = configs[i];
+		attr.disabled = 1;
+		attr.inherit = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		fds[i] = perfEventOpen(attr);
+
+		/* perf_event_paranoid may still allow counting user space */
+		if (fds[i] < 0 && (errno == EACCES || errno == EPERM))
+		{
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			fds[i] = perfEventOpen(attr);
+			userOnly[i] = fds[i] >= 0;
+		}
+
+		if (fds[i] < 0)
+		{
+			errors[i] = errno;
+			continue;
+		}
+
+		++numOpened;
+	}
+
+	return numOpened;
+}
+
+/**
+ * Zeroes the counters and starts them
+ */
+void PerfCounters::start()
+{
+	for (int i = 0; i < NUM_PERF_COUNTERS; ++i)
+	{
+		if (fds[i] >= 0)
+		{
+			ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+}
+
+/**
+ * Stops the counters
+ */
+void PerfCounters::stop()
+{
+	for (int i = 0; i < NUM_PERF_COUNTERS; ++i)
+	{
+		if (fds[i] >= 0)
+		{
+			ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+		}
+	}
+}
+
+/**
+ * Prints each counter's total, per MB and per chunk, scaled up when the
+ * kernel had to share the hardware between counters
+ * @param  fp The file stream to print to
+ * @param  who The name of the process to print
+ * @param  numBytes The number of bytes transferred while counting
+ * @param  numChunks The number of chunks transferred while counting
+ */
+void PerfCounters::print(FILE* fp, const char* who, unsigned long long numBytes, unsigned long long numChunks) const
+{
+	/* The name of each counter */
+	static const char* names[NUM_PERF_COUNTERS] = PERF_COUNTER_NAMES;
+
+	/* Each counter's scaled total, and whether it has one */
+	double totals[NUM_PERF_COUNTERS];
+	bool counted[NUM_PERF_COUNTERS];
+
+	/* Guard against dividing by zero for empty files */
+	double numMB = numBytes ? numBytes / BYTES_PER_MB : 1.0;
+	double chunks = numChunks ? numChunks : 1.0;
+
+	fprintf(fp, "Performance counters (%s):\n", who);
+	fprintf(fp, "%-18s %18s %16s %14s\n", "", "total", "per MB", "per chunk");
+
+	for (int i = 0; i < NUM_PERF_COUNTERS; ++i)
+	{
+		/* The counter's value and times */
+		perfReading reading;
+
+		counted[i] = false;
+
+		if (fds[i] < 0)
+		{
+			fprintf(fp, "%-18s %18s  (%s)\n", names[i], "unavailable", describeFailure(errors[i]));
+			continue;
+		}
+
+		if (read(fds[i], &reading, sizeof(reading)) != sizeof(reading) || reading.runningNs == 0)
+		{
+			fprintf(fp, "%-18s %18s  (never scheduled on the hardware)\n", names[i], "not counted");
+			continue;
+		}
+
+		totals[i] = (double)reading.value * reading.enabledNs / reading.runningNs;
+		counted[i] = true;
+
+		fprintf(fp, "%-18s %18.0f %16.1f %14.1f%s%s\n", names[i], totals[i], totals[i] / numMB, totals[i] / chunks,
+			reading.runningNs < reading.enabledNs ? "  (scaled)" : "", userOnly[i] ? "  (user only)" : "");
+	}
+
+	if (counted[PERF_CYCLES] && counted[PERF_INSTRUCTIONS] && totals[PERF_CYCLES] > 0)
+	{
+		fprintf(fp, "%-18s %18.2f\n", "instructions/cycle", totals[PERF_INSTRUCTIONS] / totals[PERF_CYCLES]);
+	}
+}
@@ -0,0 +1,64 @@
+/* Hardware and software performance counters around a transfer, read with
+ * perf_event_open(), to tell why one configuration beats another. Containers
+ * and virtual machines often expose only some counters or none, and
+ * perf_event_paranoid may keep out the kernel's share, so each counter opens
+ * on its own and one that cannot is reported as unavailable instead of
+ * failing the transfer.
+ */
+
+#include <stdio.h>
+
+/* The counters, in the order they are reported */
+#define PERF_CYCLES 0
+#define PERF_INSTRUCTIONS 1
+#define PERF_LLC_MISSES 2
+#define PERF_DTLB_MISSES 3
+#define PERF_CONTEXT_SWITCHES 4
+#define PERF_PAGE_FAULTS 5
+#define NUM_PERF_COUNTERS 6
+#define PERF_COUNTER_NAMES { "cycles", "instructions", "LLC misses", "dTLB misses", "context switches", "page faults" }
+
+/**
+ * A set of counters for this process and the threads it starts from then on
+ */
+class PerfCounters
+{
+public:
+	PerfCounters();
+	~PerfCounters();
+	PerfCounters(const PerfCounters&) = delete;
+	PerfCounters& operator=(const PerfCounters&) = delete;
+
+	/**
+	 * Opens every counter the kernel allows, stopped, counting user space
+	 * only where the kernel's share is off limits
+	 * @return The number of counters opened
+	 */
+	int open();
+
+	/* Zeroes the counters and starts them */
+	void start();
+
+	/* Stops the counters */
+	void stop();
+
+	/**
+	 * Prints each counter's total, per MB and per chunk, scaled up when the
+	 * kernel had to share the hardware between counters
+	 * @param  fp The file stream to print to
+	 * @param  who The name of the process to print
+	 * @param  numBytes The number of bytes transferred while counting
+	 * @param  numChunks The number of chunks transferred while counting
+	 */
+	void print(FILE* fp, const char* who, unsigned long long numBytes, unsigned long long numChunks) const;
+
+private:
+	/* Each counter's file descriptor, -1 if it did not open */
+	int fds[NUM_PERF_COUNTERS];
+
+	/* Why each counter that did not open failed, as an errno */
+	int errors[NUM_PERF_COUNTERS];
+
+	/* Whether each counter leaves out the kernel */
+	bool userOnly[NUM_PERF_COUNTERS];
+};
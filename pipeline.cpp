@@ -0,0 +1,338 @@
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include "checksum.h"    /* For the crc32c stage */
+#include "transfer.h"
+#include "pipeline.h"
+
+using namespace std;
+
+/**
+ * Computes the CRC-32C of the whole file
+ */
+class Crc32cStage : public ChunkStage
+{
+public:
+	Crc32cStage() : crc(0) { }
+
+	int process(const char* data, size_t size)
+	{
+		crc = crc32cExtend(crc, data, size);
+		return 0;
+	}
+
+	string result()
+	{
+		char buffer[32];
+
+		snprintf(buffer, sizeof(buffer), "crc32c %08x", crc);
+		return buffer;
+	}
+
+private:
+	/* The checksum of the chunks so far */
+	uint32_t crc;
+};
+
+/**
+ * Counts newlines, like wc -l
+ */
+class LineStage : public ChunkStage
+{
+public:
+	LineStage() : numLines(0) { }
+
+	int process(const char* data, size_t size)
+	{
+		/* The end of the chunk, and the next newline */
+		const char* end = data + size;
+		const char* newline;
+
+		while ((newline = static_cast<const char*>(memchr(data, '\n', end - data))) != NULL)
+		{
+			++numLines;
+			data = newline + 1;
+		}
+
+		return 0;
+	}
+
+	string result()
+	{
+		return to_string(numLines) + " lines";
+	}
+
+private:
+	/* The number of newlines so far */
+	unsigned long long numLines;
+};
+
+/**
+ * Creates a stage from its description
+ * @param  spec "crc32c", "lines", or the path of a plugin optionally followed by a colon and its argument
+ * @param  error Set to what went wrong on failure
+ * @return The new stage, or NULL on failure
+ */
+ChunkStage* createStage(const string& spec, string& error)
+{
+	if (spec == "crc32c")
+	{
+		return new Crc32cStage;
+	}
+
+	if (spec == "lines")
+	{
+		return new LineStage;
+	}
+
+	/* Anything else names a plugin */
+	size_t colon = spec.find(':');
+	string path = spec.substr(0, colon);
+	string arg = colon == string::npos ? "" : spec.substr(colon + 1);
+
+	/* Each call adds a reference, so the plugin's code outlives every stage it made */
+	void* handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+
+	if (!handle)
+	{
+		error = dlerror();
+		return NULL;
+	}
+
+	ChunkStage* (*factory)(const char*) = reinterpret_cast<ChunkStage* (*)(const char*)>(dlsym(handle, STAGE_FACTORY_NAME));
+
+	if (!factory)
+	{
+		error = path + " has no " STAGE_FACTORY_NAME "()";
+		dlclose(handle);
+		return NULL;
+	}
+
+	ChunkStage* stage = factory(arg.c_str());
+
+	if (!stage)
+	{
+		error = path + " could not create a stage from \"" + arg + "\"";
+		dlclose(handle);
+		return NULL;
+	}
+
+	return stage;
+}
+
+/**
+ * Starts the worker threads
+ * @param  sink Where the bytes go, which the pipeline owns from here on
+ * @param  stages The stages, which the pipeline owns from here on
+ * @param  numWorkers The number of threads, 0 for one per stage
+ */
+PipelineSink::PipelineSink(TransferSink* sink, const vector<ChunkStage*>& stages, int numWorkers) :
+	depth(DEFAULT_PIPELINE_DEPTH), sink(sink), stages(stages), firstChunk(0), next(stages.size(), 0),
+	busy(stages.size(), false), failed(false), stopping(false)
+{
+	/* More workers than stages would have nothing to do */
+	if (numWorkers <= 0 || numWorkers > (int)stages.size())
+	{
+		numWorkers = stages.size();
+	}
+
+	for (int i = 0; i < numWorkers; ++i)
+	{
+		workers.push_back(thread(&PipelineSink::work, this));
+	}
+}
+
+PipelineSink::~PipelineSink()
+{
+	stop();
+
+	for (size_t i = 0; i < stages.size(); ++i)
+	{
+		delete stages[i];
+	}
+
+	delete sink;
+}
+
+/**
+ * Stops the workers once they run out of chunks and waits for them
+ */
+void PipelineSink::stop()
+{
+	{
+		lock_guard<mutex> guard(lock);
+		stopping = true;
+	}
+
+	workReady.notify_all();
+
+	for (size_t i = 0; i < workers.size(); ++i)
+	{
+		workers[i].join();
+	}
+
+	workers.clear();
+}
+
+/**
+ * Passes a chunk on to the wrapped sink and queues a copy for the stages
+ * @param  data The bytes
+ * @param  size The number of bytes
+ * @return 0, or -1 with errno set, EIO if a stage failed
+ */
+int PipelineSink::write(const char* data, size_t size)
+{
+	if (sink->write(data, size) < 0)
+	{
+		return -1;
+	}
+
+	if (stages.empty())
+	{
+		return 0;
+	}
+
+	/* Copy the chunk while it is in cache, before its slot goes back to the sender */
+	pendingChunk chunk;
+	chunk.data.assign(data, data + size);
+	chunk.remaining = stages.size();
+
+	{
+		unique_lock<mutex> guard(lock);
+
+		/* Hold back the receiver while the slowest stage is too far behind */
+		spaceReady.wait(guard, [this] { return chunks.size() < depth || failed; });
+
+		if (failed)
+		{
+			errno = EIO;
+			return -1;
+		}
+
+		chunks.push_back(move(chunk));
+	}
+
+	workReady.notify_all();
+
+	return 0;
+}
+
+/**
+ * Runs stages on waiting chunks until the pipeline stops
+ */
+void PipelineSink::work()
+{
+	unique_lock<mutex> guard(lock);
+
+	while (true)
+	{
+		/* Find a stage with its next chunk waiting and no worker on it */
+		int stage = -1;
+
+		for (size_t i = 0; i < stages.size() && stage < 0; ++i)
+		{
+			if (!busy[i] && next[i] < firstChunk + chunks.size())
+			{
+				stage = i;
+			}
+		}
+
+		if (stage < 0)
+		{
+			if (stopping)
+			{
+				return;
+			}
+
+			workReady.wait(guard);
+			continue;
+		}
+
+		/* Elements of a deque stay put while others are added, and this one
+		 * is not removed until every stage is done with it
+		 */
+		busy[stage] = true;
+		pendingChunk& chunk = chunks[next[stage] - firstChunk];
+		bool skip = failed;
+
+		guard.unlock();
+		int status = skip ? 0 : stages[stage]->process(chunk.data.data(), chunk.data.size());
+		guard.lock();
+
+		busy[stage] = false;
+		++next[stage];
+
+		if (status < 0)
+		{
+			failed = true;
+		}
+
+		/* Free the chunks every stage is done with, oldest first */
+		bool freed = false;
+
+		if (--chunk.remaining == 0)
+		{
+			while (!chunks.empty() && chunks.front().remaining == 0)
+			{
+				chunks.pop_front();
+				++firstChunk;
+				freed = true;
+			}
+		}
+
+		if (freed || status < 0)
+		{
+			spaceReady.notify_all();
+		}
+	}
+}
+
+/**
+ * Flushes the wrapped sink without waiting for the stages
+ * @return 0, or -1 with errno set
+ */
+int PipelineSink::flush()
+{
+	return sink->flush();
+}
+
+/**
+ * Finishes the wrapped sink while the stages catch up, then waits for them
+ * @return 0, or -1 with errno set, EIO if a stage failed
+ */
+int PipelineSink::finish()
+{
+	int status = sink->finish();
+
+	{
+		unique_lock<mutex> guard(lock);
+		spaceReady.wait(guard, [this] { return chunks.empty(); });
+	}
+
+	stop();
+
+	if (failed)
+	{
+		errno = EIO;
+		return -1;
+	}
+
+	return status;
+}
+
+/**
+ * Gets what every stage found, once finish() has returned
+ * @return One description per stage, in order
+ */
+vector<string> PipelineSink::results()
+{
+	vector<string> found;
+
+	for (size_t i = 0; i < stages.size(); ++i)
+	{
+		found.push_back(stages[i]->result());
+	}
+
+	return found;
+}
@@ -0,0 +1,142 @@
+/* Processing received bytes while they are still in cache. A PipelineSink
+ * passes every chunk on to the sink it wraps and hands a copy to each of its
+ * stages, so a file is hashed, counted or indexed without reading it back.
+ * Each stage sees the chunks one at a time and in order, but different
+ * stages work on different chunks at once on a pool of worker threads, and
+ * the receiver only waits for them when too many chunks are outstanding.
+ *
+ * Besides the built-in stages, a stage can come from a plugin: a shared
+ * object, built with -fPIC -shared against this header, that exports
+ *
+ *	extern "C" ChunkStage* createChunkStage(const char* arg);
+ *
+ * returning a new stage, or NULL with a message on stderr if arg is bad.
+ * wordstage.cpp is an example. Plugins stay loaded until the process exits.
+ *
+ * Include transfer.h first.
+ */
+
+#include <stddef.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* The most stages in one pipeline */
+#define MAX_STAGES 16
+
+/* The most chunks a pipeline holds before write() waits for the stages */
+#define DEFAULT_PIPELINE_DEPTH 64
+
+/* The name plugins export their factory under */
+#define STAGE_FACTORY_NAME "createChunkStage"
+
+/**
+ * One step of processing. A stage is only ever called from one thread at a
+ * time, so it needs no locking of its own.
+ */
+class ChunkStage
+{
+public:
+	virtual ~ChunkStage() { }
+
+	/**
+	 * Processes the next chunk
+	 * @param  data The bytes, valid until this returns
+	 * @param  size The number of bytes
+	 * @return 0, or -1 to fail the transfer
+	 */
+	virtual int process(const char* data, size_t size) = 0;
+
+	/**
+	 * Describes what the stage found once every chunk has been processed
+	 * @return A short description, such as "crc32c 8a9136aa"
+	 */
+	virtual std::string result() = 0;
+};
+
+/**
+ * Creates a stage from its description
+ * @param  spec "crc32c", "lines", or the path of a plugin optionally
+ *         followed by a colon and its argument
+ * @param  error Set to what went wrong on failure
+ * @return The new stage, or NULL on failure
+ */
+ChunkStage* createStage(const std::string& spec, std::string& error);
+
+/**
+ * Feeds everything written to another sink through a chain of stages
+ */
+class PipelineSink : public TransferSink
+{
+public:
+	/**
+	 * Starts the worker threads
+	 * @param  sink Where the bytes go, which the pipeline owns from here on
+	 * @param  stages The stages, which the pipeline owns from here on
+	 * @param  numWorkers The number of threads, 0 for one per stage
+	 */
+	PipelineSink(TransferSink* sink, const std::vector<ChunkStage*>& stages, int numWorkers = 0);
+	~PipelineSink();
+
+	int write(const char* data, size_t size);
+
+	/* Flushes the wrapped sink. The stages see the chunk whenever they get to it. */
+	int flush();
+
+	/* Waits for the stages to process every chunk, then finishes the wrapped sink */
+	int finish();
+
+	/**
+	 * Gets what every stage found, once finish() has returned
+	 * @return One description per stage, in order
+	 */
+	std::vector<std::string> results();
+
+	/* The most chunks to hold at once, set before the first write() */
+	size_t depth;
+
+private:
+	void work();
+	void stop();
+
+	/**
+	 * A chunk on its way through the stages
+	 */
+	struct pendingChunk
+	{
+		/* A copy of the bytes */
+		std::vector<char> data;
+
+		/* The number of stages yet to process it */
+		int remaining;
+	};
+
+	/* The wrapped sink and the stages */
+	TransferSink* sink;
+	std::vector<ChunkStage*> stages;
+
+	/* The chunks not yet processed by every stage, oldest first, and the
+	 * sequence number of the oldest
+	 */
+	std::deque<pendingChunk> chunks;
+	uint64_t firstChunk;
+
+	/* The next chunk each stage processes, and whether a worker has it now */
+	std::vector<uint64_t> next;
+	std::vector<bool> busy;
+
+	/* Set when a stage fails or the pipeline is shutting down */
+	bool failed;
+	bool stopping;
+
+	/* Guards everything above, with signals for work and for free space */
+	std::mutex lock;
+	std::condition_variable workReady;
+	std::condition_variable spaceReady;
+
+	/* The worker threads */
+	std::vector<std::thread> workers;
+};
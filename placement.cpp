@@ -0,0 +1,158 @@
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include "placement.h"
+
+using namespace std;
+
+/* The highest NUMA node we can address */
+#define MAX_NUMA_NODES 1024
+
+/* The number of bits in one word of a node mask */
+#define BITS_PER_MASK_WORD (8 * sizeof(unsigned long))
+
+/**
+ * Pins the calling process, and any threads it starts afterwards, to one CPU
+ * @param  cpu The CPU to run on
+ */
+void pinToCpu(int cpu)
+{
+	/* The set of CPUs we are allowed to run on */
+	cpu_set_t cpus;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+
+	if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+	{
+		perror("sched_setaffinity");
+		exit(-1);
+	}
+}
+
+/**
+ * Binds a freshly attached shared memory segment to a NUMA node and touches
+ * every page so the memory is allocated there. Pages that were already
+ * allocated on another node are migrated.
+ * @param  addr The address the segment is attached at
+ * @param  len The size of the segment in bytes
+ * @param  node The NUMA node to place the segment on
+ */
+void bindToNode(void* addr, size_t len, int node)
+{
+	/* The mask of nodes the segment may live on */
+	unsigned long nodeMask[MAX_NUMA_NODES / BITS_PER_MASK_WORD];
+
+	if (node < 0 || node >= MAX_NUMA_NODES)
+	{
+		fprintf(stderr, "NUMA node must be between 0 and %d.\n", MAX_NUMA_NODES - 1);
+		exit(-1);
+	}
+
+	memset(nodeMask, 0, sizeof(nodeMask));
+	nodeMask[node / BITS_PER_MASK_WORD] |= 1UL << (node % BITS_PER_MASK_WORD);
+
+	/* Set the policy for the segment. There is no glibc wrapper without libnuma, so
+	 * make the system call directly. The kernel ignores the last bit of maxnode.
+	 */
+	if (syscall(SYS_mbind, addr, len, MPOL_BIND, nodeMask, MAX_NUMA_NODES + 1, MPOL_MF_MOVE | MPOL_MF_STRICT) < 0)
+	{
+		perror("mbind");
+		exit(-1);
+	}
+
+	/* First touch every page so it is allocated under the new policy now
+	 * rather than by whichever process happens to write to it first
+	 */
+	memset(addr, 0, len);
+}
+
+/**
+ * Prints which CPU and node this process runs on and which nodes
+ * back the pages of a shared memory segment
+ * @param  fp The file stream to print to
+ * @param  who The name of the process to print
+ * @param  addr The address the segment is attached at
+ * @param  len The size of the segment in bytes
+ */
+void printPlacement(FILE* fp, const char* who, void* addr, size_t len)
+{
+	/* The CPU and node we are running on */
+	unsigned int cpu, node;
+
+	/* The size of a page */
+	size_t pageSize = sysconf(_SC_PAGESIZE);
+
+	/* The number of pages in the segment */
+	size_t numPages = (len + pageSize - 1) / pageSize;
+
+	/* The pages to look up and the node (or negative error) of each */
+	vector<void*> pages(numPages);
+	vector<int> status(numPages);
+
+	/* The number of pages found on each node, plus those that could not be looked up */
+	vector<size_t> numOnNode;
+	size_t numMissing = 0;
+
+	if (getcpu(&cpu, &node) < 0)
+	{
+		perror("getcpu");
+		exit(-1);
+	}
+
+	fprintf(fp, "%s: pid %d on cpu %u, node %u; segment:", who, getpid(), cpu, node);
+
+	/* Read a byte of each page so it is mapped into this process, which is
+	 * what move_pages looks at. Pages nobody has touched yet get allocated
+	 * here, on our node unless a policy says otherwise.
+	 */
+	for (size_t i = 0; i < numPages; ++i)
+	{
+		pages[i] = static_cast<char*>(addr) + i * pageSize;
+		(void)*static_cast<volatile char*>(pages[i]);
+	}
+
+	/* Passing no target nodes makes move_pages report where each page is */
+	if (syscall(SYS_move_pages, 0, numPages, &pages[0], NULL, &status[0], 0) < 0)
+	{
+		fprintf(fp, " unknown (%s)\n", strerror(errno));
+		return;
+	}
+
+	for (size_t i = 0; i < numPages; ++i)
+	{
+		if (status[i] < 0)
+		{
+			++numMissing;
+			continue;
+		}
+
+		if ((size_t)status[i] >= numOnNode.size())
+		{
+			numOnNode.resize(status[i] + 1);
+		}
+
+		++numOnNode[status[i]];
+	}
+
+	for (size_t i = 0; i < numOnNode.size(); ++i)
+	{
+		if (numOnNode[i] > 0)
+		{
+			fprintf(fp, " %lu pages on node %lu", numOnNode[i], i);
+		}
+	}
+
+	if (numMissing > 0)
+	{
+		fprintf(fp, " %lu pages unknown", numMissing);
+	}
+
+	fprintf(fp, "\n");
+}
@@ -0,0 +1,33 @@
+/* CPU and NUMA placement helpers shared by the sender and the receiver */
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* No CPU or NUMA node was requested */
+#define PLACEMENT_ANY -1
+
+/**
+ * Pins the calling process, and any threads it starts afterwards, to one CPU
+ * @param  cpu The CPU to run on
+ */
+void pinToCpu(int cpu);
+
+/**
+ * Binds a freshly attached shared memory segment to a NUMA node and touches
+ * every page so the memory is allocated there. Pages that were already
+ * allocated on another node are migrated.
+ * @param  addr The address the segment is attached at
+ * @param  len The size of the segment in bytes
+ * @param  node The NUMA node to place the segment on
+ */
+void bindToNode(void* addr, size_t len, int node);
+
+/**
+ * Prints which CPU and node this process runs on and which nodes
+ * back the pages of a shared memory segment
+ * @param  fp The file stream to print to
+ * @param  who The name of the process to print
+ * @param  addr The address the segment is attached at
+ * @param  len The size of the segment in bytes
+ */
+void printPlacement(FILE* fp, const char* who, void* addr, size_t len);
@@ -0,0 +1,107 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "transfer.h"    /* For TransferSource */
+#include "progress.h"    /* For reading a file as it arrives */
+#include "stats.h"    /* For nowNs() */
+
+/* How long to wait for the file to appear by default, in milliseconds */
+#define DEFAULT_OPEN_TIMEOUT_MS 10000
+
+/* The most bytes to copy at once */
+#define COPY_BUFFER_SIZE (256 * 1024)
+
+/**
+ * Copies a file to the standard output while recv -W is still receiving
+ * it, and reports how soon the first bytes came compared to the end
+ * @param argc The number of command line arguments
+ * @param argv An array of C strings containing each command line argument
+ * @return The exit code
+ */
+int main(int argc, char** argv)
+{
+	/* The command line option being parsed */
+	int opt;
+
+	/* How long to wait for the file to appear */
+	int timeoutMs = DEFAULT_OPEN_TIMEOUT_MS;
+
+	/* The file, and the bytes of the last read */
+	ProgressReader reader;
+	ssize_t numRead;
+
+	/* The bytes copied so far */
+	unsigned long long numBytes = 0;
+
+	/* When the file was opened, and when the first bytes came */
+	uint64_t startNs, firstNs = 0;
+
+	/* The bytes being copied */
+	static char buffer[COPY_BUFFER_SIZE];
+
+	/* Parse the command line options */
+	while ((opt = getopt(argc, argv, "t:")) != -1)
+	{
+		switch (opt)
+		{
+			/* How long to wait for the file to appear */
+			case 't':
+				timeoutMs = atoi(optarg);
+				break;
+
+			default:
+				optind = argc + 1;
+				break;
+		}
+	}
+
+	if (optind != argc - 1)
+	{
+		fprintf(stderr, "USAGE: %s [-t <TIMEOUT>] <FILE NAME>\n", argv[0]);
+		exit(-1);
+	}
+
+	if (reader.open(argv[optind], timeoutMs) < 0)
+	{
+		perror(argv[optind]);
+		exit(-1);
+	}
+
+	startNs = nowNs();
+
+	while ((numRead = reader.read(buffer, sizeof(buffer))) > 0)
+	{
+		if (!firstNs)
+		{
+			firstNs = nowNs();
+		}
+
+		if (fwrite(buffer, sizeof(char), numRead, stdout) != (size_t)numRead)
+		{
+			perror("fwrite");
+			exit(-1);
+		}
+
+		numBytes += numRead;
+	}
+
+	if (numRead < 0)
+	{
+		fprintf(stderr, "%s: %s\n", argv[optind], errno == EIO ? "the transfer failed" :
+			errno == EPIPE ? "the receiver died" : strerror(errno));
+		exit(-1);
+	}
+
+	if (fflush(stdout) != 0)
+	{
+		perror("fflush");
+		exit(-1);
+	}
+
+	fprintf(stderr, "progcat: %llu bytes, the first after %.3f ms and the last after %.3f ms\n", numBytes,
+		firstNs ? (firstNs - startNs) / 1e6 : 0.0, (nowNs() - startNs) / 1e6);
+
+	return 0;
+}
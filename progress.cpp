@@ -0,0 +1,428 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include "stats.h"    /* For nowNs() */
+#include "transfer.h"    /* For TransferSource */
+#include "progress.h"
+#include "util.h"    /* For the futex */
+
+using namespace std;
+
+/* Marks a file as a progress page, in case something else has its name */
+#define PROGRESS_MAGIC 0x50524f47
+
+/* The size of the page's file */
+#define PROGRESS_PAGE_SIZE 4096
+
+/* How often a reader looks for a file that has not appeared yet, in microseconds */
+#define PROGRESS_OPEN_POLL_US 10000
+
+/**
+ * The progress page. ftruncate() fills it with zeros before the writer sets it up.
+ */
+struct progressPage
+{
+	/* PROGRESS_MAGIC */
+	uint32_t magic;
+
+	/* One of the PROGRESS_* states */
+	atomic<uint32_t> state;
+
+	/* The receiver, so readers can tell one that died from a slow one */
+	int32_t writerPid;
+
+	/* The number of readers asleep on generation, so the writer only makes a system call when someone waits */
+	atomic<uint32_t> waiters;
+
+	/* The futex word, bumped after every change */
+	atomic<uint32_t> generation;
+
+	/* The bytes readers can have, and the bytes of those on disk */
+	atomic<uint64_t> committed;
+	atomic<uint64_t> durable;
+};
+
+ProgressWriter::ProgressWriter() : page(NULL)
+{
+}
+
+ProgressWriter::~ProgressWriter()
+{
+	if (page)
+	{
+		page->state.store(PROGRESS_FAILED, memory_order_release);
+		wake();
+		munmap(page, PROGRESS_PAGE_SIZE);
+	}
+}
+
+/**
+ * Creates the page of a file, replacing any page a previous transfer
+ * left, before the file itself is created
+ * @param  fileName The name of the file
+ * @return 0, or -1 with errno set
+ */
+int ProgressWriter::open(const char* fileName)
+{
+	pageName = string(fileName) + PROGRESS_SUFFIX;
+
+	/* Set the page up under a name of its own and rename it into place, so
+	 * a reader never maps one half set up and one still mapping a previous
+	 * transfer's page keeps that one
+	 */
+	string tempName = pageName + "." + to_string(getpid());
+	int fd = ::open(tempName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+
+	if (fd < 0)
+	{
+		return -1;
+	}
+
+	if (ftruncate(fd, PROGRESS_PAGE_SIZE) < 0)
+	{
+		int error = errno;
+		::close(fd);
+		unlink(tempName.c_str());
+		errno = error;
+		return -1;
+	}
+
+	void* address = mmap(NULL, PROGRESS_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+
+	if (address == MAP_FAILED)
+	{
+		int error = errno;
+		unlink(tempName.c_str());
+		errno = error;
+		return -1;
+	}
+
+	page = static_cast<progressPage*>(address);
+	page->magic = PROGRESS_MAGIC;
+	page->writerPid = getpid();
+	page->state.store(PROGRESS_RECEIVING, memory_order_release);
+
+	if (rename(tempName.c_str(), pageName.c_str()) < 0)
+	{
+		int error = errno;
+		munmap(page, PROGRESS_PAGE_SIZE);
+		page = NULL;
+		unlink(tempName.c_str());
+		errno = error;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Publishes how much of the file readers can have
+ * @param  committed The bytes written out of any buffer
+ * @param  durable The bytes of those known to be on disk
+ */
+void ProgressWriter::publish(uint64_t committed, uint64_t durable)
+{
+	page->committed.store(committed, memory_order_release);
+	page->durable.store(durable, memory_order_release);
+	wake();
+}
+
+/**
+ * Ends the transfer. A complete file's page is removed.
+ * @param  committed The size of the file
+ * @param  durable The bytes of it known to be on disk
+ * @param  complete Whether every byte arrived and was written
+ */
+void ProgressWriter::finish(uint64_t committed, uint64_t durable, bool complete)
+{
+	page->committed.store(committed, memory_order_release);
+	page->durable.store(durable, memory_order_release);
+	page->state.store(complete ? PROGRESS_COMPLETE : PROGRESS_FAILED, memory_order_release);
+	wake();
+
+	/* Readers that have the page keep it, and later ones find the file without one */
+	if (complete)
+	{
+		unlink(pageName.c_str());
+	}
+
+	munmap(page, PROGRESS_PAGE_SIZE);
+	page = NULL;
+}
+
+/**
+ * Tells readers the page changed, waking any that sleep on it
+ */
+void ProgressWriter::wake()
+{
+	/* A reader counts itself before it checks the word, so either it sees
+	 * the new generation or we see it waiting
+	 */
+	page->generation.fetch_add(1);
+
+	if (page->waiters.load() > 0)
+	{
+		futexWake(page->generation, INT_MAX);
+	}
+}
+
+ProgressReader::ProgressReader() : fileFd(-1), page(NULL), offset(0)
+{
+}
+
+ProgressReader::~ProgressReader()
+{
+	close();
+}
+
+/**
+ * Opens a file, waiting for it to appear if it has not yet
+ * @param  fileName The name of the file, such as song.mp3__recv
+ * @param  timeoutMs How long to wait for the file, -1 for as long as it takes
+ * @return 0, or -1 with errno set
+ */
+int ProgressReader::open(const char* fileName, int timeoutMs)
+{
+	close();
+
+	/* The name of the page, and when to give up waiting for the file */
+	string pageName = string(fileName) + PROGRESS_SUFFIX;
+	uint64_t deadlineNs = timeoutMs < 0 ? 0 : nowNs() + timeoutMs * 1000000ULL;
+
+	/* Wait for the file itself */
+	while ((fileFd = ::open(fileName, O_RDONLY)) < 0)
+	{
+		if (errno != ENOENT)
+		{
+			return -1;
+		}
+
+		if (deadlineNs && nowNs() >= deadlineNs)
+		{
+			errno = ETIMEDOUT;
+			return -1;
+		}
+
+		usleep(PROGRESS_OPEN_POLL_US);
+	}
+
+	offset = 0;
+
+	/* Then look for its page. The sink creates the page before the file and
+	 * removes it only once the file is complete, so a file without one now
+	 * really is complete.
+	 */
+	int pageFd = ::open(pageName.c_str(), O_RDWR);
+
+	if (pageFd < 0)
+	{
+		if (errno == ENOENT)
+		{
+			return 0;
+		}
+
+		int error = errno;
+		close();
+		errno = error;
+		return -1;
+	}
+
+	void* address = mmap(NULL, PROGRESS_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, pageFd, 0);
+	::close(pageFd);
+
+	if (address == MAP_FAILED)
+	{
+		int error = errno;
+		close();
+		errno = error;
+		return -1;
+	}
+
+	page = static_cast<progressPage*>(address);
+
+	if (page->magic != PROGRESS_MAGIC)
+	{
+		close();
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Closes the file
+ */
+void ProgressReader::close()
+{
+	if (fileFd >= 0)
+	{
+		::close(fileFd);
+		fileFd = -1;
+	}
+
+	if (page)
+	{
+		munmap(page, PROGRESS_PAGE_SIZE);
+		page = NULL;
+	}
+}
+
+/**
+ * Looks at how much of the file is there without waiting
+ * @param  durable Whether to count only the bytes on disk
+ * @param  state Set to the PROGRESS_* state of the transfer
+ * @return The number of bytes available, or -1 with errno set
+ */
+int64_t ProgressReader::available(bool durable, int& state)
+{
+	/* A file without a page is all there, and as durable as it is going to get */
+	if (!page)
+	{
+		struct stat st;
+		state = PROGRESS_COMPLETE;
+
+		return fstat(fileFd, &st) < 0 ? -1 : st.st_size;
+	}
+
+	/* The counts are stored before the state, so a complete state means final counts */
+	state = page->state.load(memory_order_acquire);
+	return durable ? page->durable.load(memory_order_acquire) : page->committed.load(memory_order_acquire);
+}
+
+/**
+ * Waits until the file has a given number of bytes, or ends short of it
+ * @param  end The number of bytes from the start of the file to wait for
+ * @param  durable Whether to wait for them to be on disk rather than only written
+ * @param  timeoutMs How long to wait, -1 for as long as it takes
+ * @return The number of bytes available, or -1 with errno set to EIO if the
+ *         transfer failed, EPIPE if the receiver died or ETIMEDOUT
+ */
+int64_t ProgressReader::waitFor(uint64_t end, bool durable, int timeoutMs)
+{
+	/* When to give up, 0 for never */
+	uint64_t deadlineNs = timeoutMs < 0 ? 0 : nowNs() + timeoutMs * 1000000ULL;
+
+	while (true)
+	{
+		/* Take the generation before looking, so a change after we look wakes us */
+		uint32_t generation = page ? page->generation.load() : 0;
+		int state;
+		int64_t numBytes = available(durable, state);
+
+		if (numBytes < 0 || (uint64_t)numBytes >= end || state == PROGRESS_COMPLETE)
+		{
+			return numBytes;
+		}
+
+		if (state == PROGRESS_FAILED)
+		{
+			errno = EIO;
+			return -1;
+		}
+
+		if (kill(page->writerPid, 0) < 0 && errno == ESRCH)
+		{
+			errno = EPIPE;
+			return -1;
+		}
+
+		/* Sleep until the writer publishes, waking now and then to check it is still alive */
+		uint64_t waitNs = PROGRESS_CHECK_MS * 1000000ULL;
+
+		if (deadlineNs)
+		{
+			uint64_t now = nowNs();
+
+			if (now >= deadlineNs)
+			{
+				errno = ETIMEDOUT;
+				return -1;
+			}
+
+			waitNs = min(waitNs, deadlineNs - now);
+		}
+
+		page->waiters.fetch_add(1);
+		futexWait(page->generation, generation, waitNs);
+		page->waiters.fetch_sub(1);
+	}
+}
+
+/**
+ * Reads bytes from anywhere in the file, waiting for them to arrive
+ * @param  buffer Where to put them
+ * @param  size The most bytes to read
+ * @param  offset Where in the file to start
+ * @return The number of bytes read, 0 past the end of a complete file, or -1 with errno set
+ */
+ssize_t ProgressReader::readAt(char* buffer, size_t size, uint64_t offset)
+{
+	/* Wait for at least the first byte asked for, and take whatever is there by then */
+	int64_t numBytes = waitFor(offset + 1);
+
+	if (numBytes < 0)
+	{
+		return -1;
+	}
+
+	if ((uint64_t)numBytes <= offset)
+	{
+		return 0;
+	}
+
+	return pread(fileFd, buffer, min<uint64_t>(size, numBytes - offset), offset);
+}
+
+/**
+ * Reads the next bytes, waiting for them to arrive
+ * @param  buffer Where to put them
+ * @param  size The most bytes to read
+ * @return The number of bytes read, 0 at the end of a complete file, or -1 with errno set
+ */
+ssize_t ProgressReader::read(char* buffer, size_t size)
+{
+	ssize_t numRead = readAt(buffer, size, offset);
+
+	if (numRead > 0)
+	{
+		offset += numRead;
+	}
+
+	return numRead;
+}
+
+/**
+ * Gets the size of a complete file
+ * @return The size, or -1 while the file is still arriving
+ */
+int64_t ProgressReader::size()
+{
+	struct stat st;
+
+	if (!complete() || fstat(fileFd, &st) < 0)
+	{
+		return -1;
+	}
+
+	return st.st_size;
+}
+
+/**
+ * Tells whether every byte of the file has arrived
+ * @return Whether the transfer is complete
+ */
+bool ProgressReader::complete()
+{
+	return !page || page->state.load(memory_order_acquire) == PROGRESS_COMPLETE;
+}
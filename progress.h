@@ -0,0 +1,172 @@
+/* Reading a file while the receiver is still writing it. A FileSink with
+ * publishProgress set keeps a progress page beside the file, in
+ * <file>.progress: one page of shared memory, mapped from that file, that
+ * says how many bytes of the file are committed, meaning out of stdio's
+ * buffer where any reader sees them, how many of those are on disk, and
+ * whether the transfer is still going. The sink publishes every
+ * progressStep bytes and wakes waiting readers with a futex in the page.
+ * Once the file is complete it says so and removes the page; a transfer
+ * that fails leaves the page behind marked failed.
+ *
+ *	ProgressReader reader;
+ *	char buffer[65536];
+ *	ssize_t numRead;
+ *
+ *	if (reader.open("song.mp3__recv") < 0)
+ *		perror("open");
+ *
+ *	while ((numRead = reader.read(buffer, sizeof(buffer))) > 0)
+ *		... the next bytes of the file, as soon as they arrive ...
+ *
+ * A reader that finds the file but no page takes the file as complete, so
+ * readers work the same on files received without progress. The sink
+ * creates the page before the file and a reader opens the file before
+ * looking for the page, so a reader never mistakes a file still arriving
+ * for a complete one.
+ * Readers also notice a receiver that died without saying so.
+ *
+ * A ProgressReader is a TransferSource, so a file still arriving can be sent on.
+ *
+ * Include transfer.h first.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string>
+
+struct progressPage;
+
+/* What the progress page's name adds to the file's */
+#define PROGRESS_SUFFIX ".progress"
+
+/* The states of a transfer, as a progress page reports them */
+#define PROGRESS_RECEIVING 1
+#define PROGRESS_COMPLETE 2
+#define PROGRESS_FAILED 3
+
+/* The default number of bytes between publications */
+#define DEFAULT_PROGRESS_STEP (64 * 1024)
+
+/* How often a waiting reader checks that the receiver is still alive, in milliseconds */
+#define PROGRESS_CHECK_MS 100
+
+/**
+ * The receiver's side of a progress page, which a FileSink keeps
+ */
+class ProgressWriter
+{
+public:
+	ProgressWriter();
+
+	/* Marks the transfer failed if finish() was not called, and unmaps the page */
+	~ProgressWriter();
+	ProgressWriter(const ProgressWriter&) = delete;
+	ProgressWriter& operator=(const ProgressWriter&) = delete;
+
+	/**
+	 * Creates the page of a file, replacing any page a previous transfer
+	 * left, before the file itself is created
+	 * @param  fileName The name of the file
+	 * @return 0, or -1 with errno set
+	 */
+	int open(const char* fileName);
+
+	/**
+	 * Publishes how much of the file readers can have
+	 * @param  committed The bytes written out of any buffer
+	 * @param  durable The bytes of those known to be on disk
+	 */
+	void publish(uint64_t committed, uint64_t durable);
+
+	/**
+	 * Ends the transfer. A complete file's page is removed.
+	 * @param  committed The size of the file
+	 * @param  durable The bytes of it known to be on disk
+	 * @param  complete Whether every byte arrived and was written
+	 */
+	void finish(uint64_t committed, uint64_t durable, bool complete);
+
+private:
+	void wake();
+
+	/* The mapped page, NULL before open() */
+	progressPage* page;
+
+	/* The name of the page's file */
+	std::string pageName;
+};
+
+/**
+ * Reads a file as it arrives, blocking until the bytes asked for are there
+ */
+class ProgressReader : public TransferSource
+{
+public:
+	ProgressReader();
+	~ProgressReader();
+	ProgressReader(const ProgressReader&) = delete;
+	ProgressReader& operator=(const ProgressReader&) = delete;
+
+	/**
+	 * Opens a file, waiting for it to appear if it has not yet
+	 * @param  fileName The name of the file, such as song.mp3__recv
+	 * @param  timeoutMs How long to wait for the file, -1 for as long as it takes
+	 * @return 0, or -1 with errno set
+	 */
+	int open(const char* fileName, int timeoutMs = -1);
+
+	/**
+	 * Closes the file
+	 */
+	void close();
+
+	/**
+	 * Waits until the file has a given number of bytes, or ends short of it
+	 * @param  end The number of bytes from the start of the file to wait for
+	 * @param  durable Whether to wait for them to be on disk rather than
+	 *         only written, which only ever happens under a durability policy
+	 * @param  timeoutMs How long to wait, -1 for as long as it takes
+	 * @return The number of bytes available, which is less than end only
+	 *         once the transfer is complete, or -1 with errno set to EIO if
+	 *         the transfer failed, EPIPE if the receiver died or ETIMEDOUT
+	 */
+	int64_t waitFor(uint64_t end, bool durable = false, int timeoutMs = -1);
+
+	/**
+	 * Reads the next bytes, waiting for them to arrive
+	 * @param  buffer Where to put them
+	 * @param  size The most bytes to read
+	 * @return The number of bytes read, 0 at the end of a complete file, or -1 with errno set
+	 */
+	ssize_t read(char* buffer, size_t size);
+
+	/**
+	 * Reads bytes from anywhere in the file, waiting for them to arrive
+	 * @param  buffer Where to put them
+	 * @param  size The most bytes to read
+	 * @param  offset Where in the file to start
+	 * @return The number of bytes read, 0 past the end of a complete file, or -1 with errno set
+	 */
+	ssize_t readAt(char* buffer, size_t size, uint64_t offset);
+
+	/* The size of a complete file, or -1 while it is still arriving */
+	int64_t size();
+
+	/* Whether every byte of the file has arrived */
+	bool complete();
+
+	/* The file's descriptor, for reading what waitFor() said is there */
+	int fd() const { return fileFd; }
+
+private:
+	int64_t available(bool durable, int& state);
+
+	/* The open file, -1 before open() */
+	int fileFd;
+
+	/* The mapped progress page, NULL for a file that was complete when opened */
+	progressPage* page;
+
+	/* Where read() reads next */
+	uint64_t offset;
+};
@@ -0,0 +1,625 @@
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include "session.h"    /* For the key, waiting for the collector and clearing stale rings */
+#include "stats.h"    /* For the live statistics page */
+#include "transfer.h"    /* For sinks */
+#include "records.h"
+#include "util.h"    /* For formatting errors and the futexes */
+
+using namespace std;
+
+/* The states of a ring: taking records, writing out the ones reserved before stop(), and gone */
+#define RECORD_RING_OPEN 0
+#define RECORD_RING_CLOSING 1
+#define RECORD_RING_CLOSED 2
+
+/* The space the header takes after the statistics page. The ring follows it. */
+#define RECORD_RING_HEADER_SIZE 4096
+
+/* Each record starts with a word holding its length, its state and its
+ * producer's pid, and its space is rounded up to the next word
+ */
+#define RECORD_HEADER_SIZE 8
+#define RECORD_LENGTH_MASK 0x3fffffffULL
+#define RECORD_BUSY (1ULL << 30)
+#define RECORD_COMMITTED (1ULL << 31)
+#define RECORD_PID_SHIFT 32
+
+/* How long either side sleeps before checking the other is still alive, in milliseconds */
+#define RECORD_CHECK_MS 100
+
+/**
+ * The header between the statistics page and the ring. A new segment is
+ * zero-filled, so the ring starts out open and empty with every record
+ * header clear.
+ */
+struct recordRingHeader
+{
+	/* One of the RECORD_RING_* states */
+	std::atomic<uint32_t> state;
+
+	/* The size of the ring, fixed before the collector marks the statistics page ready */
+	uint64_t ringSize;
+
+	/* The bytes reserved so far. A producer takes its record's space with a fetch-add here. */
+	alignas(64) std::atomic<uint64_t> head;
+
+	/* Bumped after every commit, for the collector to sleep on, and whether it does */
+	alignas(64) std::atomic<uint32_t> committedSeq;
+	std::atomic<uint32_t> collectorWaiting;
+
+	/* The bytes the collector has freed. The space up to tail + ringSize may be written. */
+	alignas(64) std::atomic<uint64_t> tail;
+
+	/* Bumped whenever the tail moves, for producers waiting for room to sleep on, and how many do */
+	std::atomic<uint32_t> freedSeq;
+	std::atomic<uint32_t> producersWaiting;
+};
+
+static_assert(sizeof(recordRingHeader) <= RECORD_RING_HEADER_SIZE, "the record ring header does not fit in its page");
+
+/**
+ * Gets the space a record takes in the ring
+ * @param  size The number of bytes in it
+ * @return The bytes of ring it takes, header included
+ */
+static uint64_t recordSpan(uint64_t size)
+{
+	return RECORD_HEADER_SIZE + ((size + RECORD_HEADER_SIZE - 1) & ~(uint64_t)(RECORD_HEADER_SIZE - 1));
+}
+
+/**
+ * Gets the header word of the record at a position. Positions and the ring's
+ * size are multiples of the word, so a header never wraps.
+ * @param  ring The start of the ring
+ * @param  ringSize The size of the ring
+ * @param  position The record's position, counting every byte ever reserved
+ * @return The word
+ */
+static atomic<uint64_t>& recordHeader(char* ring, uint64_t ringSize, uint64_t position)
+{
+	return *reinterpret_cast<atomic<uint64_t>*>(ring + position % ringSize);
+}
+
+RecordCollector::RecordCollector() : ringSize(DEFAULT_RECORD_RING_SIZE), shmid(-1), sharedMemPtr(NULL), stats(NULL),
+	header(NULL), ring(NULL), stopping(false), numRecords(0), numAbandoned(0)
+{
+}
+
+RecordCollector::~RecordCollector()
+{
+	close();
+}
+
+/**
+ * Records a failure
+ * @param  format The printf() format of the description
+ * @return -1
+ */
+int RecordCollector::fail(const char* format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	formatError(error, format, args);
+	va_end(args);
+
+	return -1;
+}
+
+/**
+ * Creates the ring producers attach to, first removing any a collector that died left behind
+ * @param  keyFile The file to generate the key from
+ * @return 0, or -1 on failure
+ */
+int RecordCollector::open(const char* keyFile)
+{
+	/* Generate the ring's key, creating the key file if we are first */
+	key_t key = sessionKey(keyFile, RECORDS_PROJECT_ID);
+
+	/* The creator of a segment already using the key */
+	pid_t owner;
+
+	/* Failed to generate the key */
+	if (key < 0)
+	{
+		return fail("%s: %s", keyFile, strerror(errno));
+	}
+
+	if (ringSize < MIN_RECORD_RING_SIZE || ringSize % RECORD_HEADER_SIZE != 0)
+	{
+		return fail("The ring size must be a multiple of %d bytes and at least %d.", RECORD_HEADER_SIZE, MIN_RECORD_RING_SIZE);
+	}
+
+	/* Remove what a collector that died left behind, but never a live one's ring */
+	if (clearStaleSession(key, owner) < 0)
+	{
+		if (errno == EBUSY)
+		{
+			return fail("Collector %d is already using %s.", (int)owner, keyFile);
+		}
+
+		return fail("Removing a stale record ring: %s", strerror(errno));
+	}
+
+	/* The statistics page, the header and the ring */
+	if ((shmid = shmget(key, STATS_PAGE_SIZE + RECORD_RING_HEADER_SIZE + ringSize,
+		IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR)) < 0)
+	{
+		if (errno == EEXIST)
+		{
+			return fail("Another collector is already using %s.", keyFile);
+		}
+
+		return fail("shmget: %s", strerror(errno));
+	}
+
+	if ((sharedMemPtr = shmat(shmid, NULL, 0)) == (void*)-1)
+	{
+		sharedMemPtr = NULL;
+		close();
+		return fail("shmat: %s", strerror(errno));
+	}
+
+	stats = static_cast<transferStats*>(sharedMemPtr);
+	header = reinterpret_cast<recordRingHeader*>(static_cast<char*>(sharedMemPtr) + STATS_PAGE_SIZE);
+	ring = static_cast<char*>(sharedMemPtr) + STATS_PAGE_SIZE + RECORD_RING_HEADER_SIZE;
+
+	header->ringSize = ringSize;
+	stopping.store(false);
+
+	/* Producers only look at the header once the page is marked ready */
+	stats->numSlots.store(1, memory_order_relaxed);
+	stats->chunkSize.store(ringSize, memory_order_relaxed);
+	stats->recv.pid.store(getpid(), memory_order_relaxed);
+	stats->state.store(STATE_WAITING, memory_order_relaxed);
+	stats->magic.store(STATS_MAGIC, memory_order_release);
+
+	return 0;
+}
+
+/**
+ * Marks the ring closed for producers still waiting for room, detaches from it and removes it
+ */
+void RecordCollector::close()
+{
+	if (sharedMemPtr)
+	{
+		/* Producers waiting for room find out there will be none */
+		header->state.store(RECORD_RING_CLOSED, memory_order_release);
+		header->freedSeq.fetch_add(1);
+		futexWake(header->freedSeq, INT_MAX);
+
+		shmdt(sharedMemPtr);
+		sharedMemPtr = NULL;
+		stats = NULL;
+		header = NULL;
+		ring = NULL;
+	}
+
+	/* Producers still attached keep their mapping until they detach */
+	if (shmid >= 0)
+	{
+		shmctl(shmid, IPC_RMID, 0);
+		shmid = -1;
+	}
+}
+
+/**
+ * Hands the space up to a new tail back to the producers
+ * @param  tail The new tail
+ */
+void RecordCollector::release(uint64_t tail)
+{
+	/* A producer counts itself before it checks the word, so either it sees
+	 * the new sequence or we see it waiting
+	 */
+	header->tail.store(tail, memory_order_release);
+	header->freedSeq.fetch_add(1);
+
+	if (header->producersWaiting.load() > 0)
+	{
+		futexWake(header->freedSeq, INT_MAX);
+	}
+}
+
+/**
+ * Writes committed records to a sink in the order their space was reserved,
+ * freeing their space as it goes, until stop() is called and every record
+ * reserved by then is written or the grace period runs out
+ * @param  sink Where the records go, finished before this returns
+ * @return The number of bytes written, or -1 on failure
+ */
+int64_t RecordCollector::collect(TransferSink& sink)
+{
+	/* The ring's size, the next record to take, and the bytes written */
+	uint64_t size = header ? header->ringSize : 0;
+	uint64_t tail;
+	int64_t numBytes = 0;
+
+	/* When we stopped taking new records, whether anything is in the sink's
+	 * buffer, and whether the last sleep ran its full time
+	 */
+	uint64_t closingNs = 0;
+	bool unflushed = false, timedOut = false;
+
+	if (!sharedMemPtr)
+	{
+		return fail("The collector is not open.");
+	}
+
+	tail = header->tail.load(memory_order_relaxed);
+	numRecords = 0;
+	numAbandoned = 0;
+
+	stats->startNs.store(nowNs(), memory_order_relaxed);
+	stats->state.store(STATE_TRANSFERRING, memory_order_relaxed);
+
+	while (true)
+	{
+		/* Take the sequence before looking, so a commit after we look wakes us */
+		uint32_t seq = header->committedSeq.load();
+		uint64_t start = tail;
+
+		while (tail < header->head.load(memory_order_acquire))
+		{
+			atomic<uint64_t>& word = recordHeader(ring, size, tail);
+			uint64_t value = word.load(memory_order_acquire);
+			uint64_t length = value & RECORD_LENGTH_MASK;
+
+			if (!(value & RECORD_COMMITTED))
+			{
+				/* Still being written, unless its producer died in the middle */
+				if (!(value & RECORD_BUSY) || !timedOut || processAlive(value >> RECORD_PID_SHIFT))
+				{
+					break;
+				}
+
+				++numAbandoned;
+			}
+			else
+			{
+				/* The bytes, in two pieces if they wrap */
+				uint64_t at = (tail + RECORD_HEADER_SIZE) % size;
+				uint64_t first = min(length, size - at);
+
+				if (sink.write(ring + at, first) < 0 || (first < length && sink.write(ring, length - first) < 0))
+				{
+					return fail("write: %s", strerror(errno));
+				}
+
+				++numRecords;
+				numBytes += length;
+				unflushed = true;
+				statAdd(stats->recv.bytes, length);
+				statAdd(stats->recv.chunks, 1);
+			}
+
+			/* Clear the space for the next lap, header first, in two pieces if it wraps */
+			uint64_t span = recordSpan(length);
+			uint64_t from = tail % size;
+			uint64_t firstSpan = min(span, size - from);
+
+			memset(ring + from, 0, firstSpan);
+			memset(ring, 0, span - firstSpan);
+			tail += span;
+		}
+
+		if (tail != start)
+		{
+			release(tail);
+			timedOut = false;
+			continue;
+		}
+
+		/* Once stopped, turn new records away and wait for the reserved ones */
+		if (stopping.load())
+		{
+			if (header->state.load(memory_order_relaxed) == RECORD_RING_OPEN)
+			{
+				header->state.store(RECORD_RING_CLOSING, memory_order_release);
+				closingNs = nowNs();
+				continue;
+			}
+
+			if (nowNs() - closingNs > RECORD_CLOSE_GRACE_MS * 1000000ULL)
+			{
+				break;
+			}
+
+			/* Drained, so turn reservations away too, then look once more for any
+			 * that got in first. Producers check the state after reserving, so
+			 * one of us sees the other.
+			 */
+			if (tail == header->head.load())
+			{
+				if (header->state.load(memory_order_relaxed) == RECORD_RING_CLOSED)
+				{
+					break;
+				}
+
+				header->state.store(RECORD_RING_CLOSED);
+				continue;
+			}
+		}
+
+		/* Let readers of the file see everything so far before we sleep */
+		if (unflushed)
+		{
+			if (sink.flush() < 0)
+			{
+				return fail("write: %s", strerror(errno));
+			}
+
+			unflushed = false;
+		}
+
+		header->collectorWaiting.store(1);
+		timedOut = futexWait(header->committedSeq, seq, RECORD_CHECK_MS * 1000000ULL) < 0 && errno == ETIMEDOUT;
+		header->collectorWaiting.store(0);
+	}
+
+	/* Producers still waiting for room find out there will be none */
+	header->state.store(RECORD_RING_CLOSED, memory_order_release);
+	release(tail);
+	stats->state.store(STATE_DONE, memory_order_relaxed);
+
+	if (sink.finish() < 0)
+	{
+		return fail("finish: %s", strerror(errno));
+	}
+
+	return numBytes;
+}
+
+/**
+ * Makes collect() finish, waking it if it sleeps. Only touches atomics and
+ * makes a system call, so it is safe in a signal handler.
+ */
+void RecordCollector::stop()
+{
+	stopping.store(true);
+
+	if (header)
+	{
+		header->committedSeq.fetch_add(1);
+		futexWake(header->committedSeq, 1);
+	}
+}
+
+RecordProducer::RecordProducer() : readyTimeoutMs(DEFAULT_READY_TIMEOUT_MS), shmid(-1), sharedMemPtr(NULL), header(NULL),
+	ring(NULL), collectorPid(0), pid(0), numRecords(0), numWaits(0)
+{
+}
+
+RecordProducer::~RecordProducer()
+{
+	close();
+}
+
+/**
+ * Records a failure
+ * @param  format The printf() format of the description
+ * @return -1
+ */
+int RecordProducer::fail(const char* format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	formatError(error, format, args);
+	va_end(args);
+
+	return -1;
+}
+
+/**
+ * Waits up to readyTimeoutMs for a collector's ring and attaches to it
+ * @param  keyFile The file the collector generated its key from
+ * @return 0, or -1 on failure, including when the collector already stopped
+ */
+int RecordProducer::open(const char* keyFile)
+{
+	/* Generate the ring's key, creating the key file if we are first */
+	key_t key = sessionKey(keyFile, RECORDS_PROJECT_ID);
+
+	/* The segment's attributes */
+	struct shmid_ds shmInfo;
+
+	/* Failed to generate the key */
+	if (key < 0)
+	{
+		return fail("%s: %s", keyFile, strerror(errno));
+	}
+
+	/* Attach once a live collector has set up the ring */
+	if ((sharedMemPtr = attachWhenReady(key, readyTimeoutMs, shmid)) == NULL)
+	{
+		shmid = -1;
+
+		if (errno == ETIMEDOUT)
+		{
+			return fail("No collector got ready within %d ms.", readyTimeoutMs);
+		}
+
+		return fail("shmget: %s", strerror(errno));
+	}
+
+	if (shmctl(shmid, IPC_STAT, &shmInfo) < 0)
+	{
+		close();
+		return fail("shmctl: %s", strerror(errno));
+	}
+
+	collectorPid = shmInfo.shm_cpid;
+	pid = getpid();
+	header = reinterpret_cast<recordRingHeader*>(static_cast<char*>(sharedMemPtr) + STATS_PAGE_SIZE);
+	ring = static_cast<char*>(sharedMemPtr) + STATS_PAGE_SIZE + RECORD_RING_HEADER_SIZE;
+	numRecords = 0;
+	numWaits = 0;
+
+	if (header->state.load(memory_order_acquire) != RECORD_RING_OPEN)
+	{
+		close();
+		return fail("The collector has stopped taking records.");
+	}
+
+	return 0;
+}
+
+/**
+ * Detaches from the ring
+ */
+void RecordProducer::close()
+{
+	if (sharedMemPtr)
+	{
+		shmdt(sharedMemPtr);
+		sharedMemPtr = NULL;
+		header = NULL;
+		ring = NULL;
+	}
+
+	shmid = -1;
+}
+
+/**
+ * Gets the largest record the ring takes
+ * @return The number of bytes, 0 before open()
+ */
+size_t RecordProducer::maxRecordSize() const
+{
+	/* Half the ring, so a waiting record never needs the space of the one before it */
+	return header ? min((uint64_t)RECORD_LENGTH_MASK, header->ringSize / 2 - RECORD_HEADER_SIZE) : 0;
+}
+
+/**
+ * Sleeps until the collector has freed the ring up to a position
+ * @param  end The end of our record
+ * @return 0, or -1 on failure
+ */
+int RecordProducer::waitForRoom(uint64_t end)
+{
+	/* The ring's size */
+	uint64_t size = header->ringSize;
+
+	while (true)
+	{
+		/* Take the sequence before looking, so a release after we look wakes us */
+		uint32_t seq = header->freedSeq.load();
+
+		if (end - header->tail.load(memory_order_acquire) <= size)
+		{
+			return 0;
+		}
+
+		if (header->state.load(memory_order_acquire) == RECORD_RING_CLOSED)
+		{
+			return fail("The collector stopped before there was room for the record.");
+		}
+
+		header->producersWaiting.fetch_add(1);
+		bool timedOut = futexWait(header->freedSeq, seq, RECORD_CHECK_MS * 1000000ULL) < 0 && errno == ETIMEDOUT;
+		header->producersWaiting.fetch_sub(1);
+
+		if (timedOut && !processAlive(collectorPid))
+		{
+			return fail("The collector died.");
+		}
+	}
+}
+
+/**
+ * Reserves a record's space with a fetch-add on the head, waits for the
+ * collector to free it if the ring is full, then copies the record in and
+ * commits it
+ * @param  data The bytes
+ * @param  size The number of bytes, from 1 to maxRecordSize()
+ * @param  wait Whether to wait for room rather than fail when the ring looks full
+ * @return 0, or -1 on failure, with errno set to EMSGSIZE, EPIPE or EAGAIN
+ *         for a bad size, a stopped collector or a full ring
+ */
+int RecordProducer::append(const void* data, size_t size, bool wait)
+{
+	if (!sharedMemPtr)
+	{
+		return fail("The producer is not open.");
+	}
+
+	if (size == 0 || size > maxRecordSize())
+	{
+		errno = EMSGSIZE;
+		return fail("Records must be from 1 to %zu bytes.", maxRecordSize());
+	}
+
+	/* The ring's size and the space the record takes */
+	uint64_t ringSize = header->ringSize;
+	uint64_t span = recordSpan(size);
+
+	if (header->state.load(memory_order_acquire) != RECORD_RING_OPEN)
+	{
+		errno = EPIPE;
+		return fail("The collector has stopped taking records.");
+	}
+
+	/* Without waiting, only reserve what looks free. Other producers may
+	 * still get in first, but then the wait is short.
+	 */
+	if (!wait && header->head.load(memory_order_relaxed) + span - header->tail.load(memory_order_acquire) > ringSize)
+	{
+		errno = EAGAIN;
+		return fail("The ring is full.");
+	}
+
+	/* Our space, which is ours alone once the collector has freed it */
+	uint64_t position = header->head.fetch_add(span);
+
+	/* The collector may have finished draining just before we reserved */
+	if (header->state.load() == RECORD_RING_CLOSED)
+	{
+		errno = EPIPE;
+		return fail("The collector has stopped taking records.");
+	}
+
+	if (position + span - header->tail.load(memory_order_acquire) > ringSize)
+	{
+		++numWaits;
+
+		if (waitForRoom(position + span) < 0)
+		{
+			return -1;
+		}
+	}
+
+	/* Mark the record busy, so the collector can tell if we die, then copy the bytes in, in two pieces if they wrap */
+	atomic<uint64_t>& word = recordHeader(ring, ringSize, position);
+	uint64_t tag = ((uint64_t)pid << RECORD_PID_SHIFT) | size;
+	uint64_t at = (position + RECORD_HEADER_SIZE) % ringSize;
+	uint64_t first = min((uint64_t)size, ringSize - at);
+
+	word.store(tag | RECORD_BUSY, memory_order_relaxed);
+	memcpy(ring + at, data, first);
+	memcpy(ring, static_cast<const char*>(data) + first, size - first);
+
+	/* Commit, and wake the collector if it sleeps */
+	word.store(tag | RECORD_COMMITTED, memory_order_release);
+	header->committedSeq.fetch_add(1);
+
+	if (header->collectorWaiting.load() > 0)
+	{
+		futexWake(header->committedSeq, 1);
+	}
+
+	++numRecords;
+
+	return 0;
+}
@@ -0,0 +1,200 @@
+/* Many-to-one record collection. A RecordCollector owns a ring in shared
+ * memory that any number of RecordProducers append records to, and writes
+ * the records to one sink in the order they reserved their space.
+ *
+ *	RecordCollector collector;
+ *	FileSink sink;
+ *
+ *	if (collector.open() < 0 || sink.open("combined") < 0 || collector.collect(sink) < 0)
+ *		fprintf(stderr, "%s\n", collector.lastError());
+ *
+ *	RecordProducer producer;
+ *
+ *	if (producer.open() < 0 || producer.append(line, strlen(line)) < 0)
+ *		fprintf(stderr, "%s\n", producer.lastError());
+ *
+ * A producer reserves a record's space with one fetch-add on the ring's
+ * head, so producers never take a lock or wait on each other, and the
+ * space is theirs alone. If the ring is full, the producer sleeps until
+ * the collector frees enough of it, and producers get room in the order
+ * they reserved it. The producer marks the record busy, copies the bytes
+ * in and marks it committed. The collector takes committed records from
+ * the tail in order, writing each to the sink. It zeroes their space so
+ * the next lap starts from clean headers, then moves the tail on. Both
+ * sides sleep on futexes in the header, and wake each other only when
+ * someone sleeps.
+ *
+ * A producer that dies while its record is busy loses that record, and
+ * the collector skips it. One that dies after reserving but before marking
+ * the record holds the collector up at that record for good, so keep
+ * producers from being killed while they wait for room.
+ *
+ * The segment uses the same key file as a Receiver's but its own key, and
+ * starts with the statistics page, where the collector counts the records
+ * as chunks. collect() runs until stop(). It then turns new records away
+ * and writes out every reserved one before returning.
+ *
+ * Include transfer.h first.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+struct transferStats;
+struct recordRingHeader;
+
+/* The ftok() project id of record rings, beside the 'a' of the normal protocol and the 'b' of broadcasts */
+#define RECORDS_PROJECT_ID 'r'
+
+/* The ring's size by default, and the smallest it may be */
+#define DEFAULT_RECORD_RING_SIZE (4 * 1024 * 1024)
+#define MIN_RECORD_RING_SIZE 4096
+
+/* How long collect() waits for reserved records after stop() before giving up on them, in milliseconds */
+#define RECORD_CLOSE_GRACE_MS 1000
+
+/**
+ * The collecting side of a record ring, of which there is one
+ */
+class RecordCollector
+{
+public:
+	RecordCollector();
+	~RecordCollector();
+	RecordCollector(const RecordCollector&) = delete;
+	RecordCollector& operator=(const RecordCollector&) = delete;
+
+	/**
+	 * Creates the ring producers attach to, first removing any a collector
+	 * that died left behind
+	 * @param  keyFile The file to generate the key from
+	 * @return 0, or -1 on failure
+	 */
+	int open(const char* keyFile = "keyfile.txt");
+
+	/**
+	 * Detaches from the ring and removes it
+	 */
+	void close();
+
+	/**
+	 * Writes records to a sink as producers commit them, until stop() is called
+	 * @param  sink Where the records go, back to back, finished before this returns
+	 * @return The number of bytes written, or -1 on failure
+	 */
+	int64_t collect(TransferSink& sink);
+
+	/**
+	 * Makes collect() return once every record reserved so far is written.
+	 * Safe to call from a signal handler.
+	 */
+	void stop();
+
+	/**
+	 * Describes the last failure
+	 * @return The description
+	 */
+	const char* lastError() const { return error.c_str(); }
+
+	/* The records written by the last collect(), and those skipped because their producer died */
+	uint64_t records() const { return numRecords; }
+	uint64_t abandoned() const { return numAbandoned; }
+
+	/* The size of the ring in bytes, a multiple of 8, set before open() */
+	size_t ringSize;
+
+private:
+	int fail(const char* format, ...) __attribute__((format(printf, 2, 3)));
+	void release(uint64_t tail);
+
+	/* The segment and where its parts start */
+	int shmid;
+	void* sharedMemPtr;
+	transferStats* stats;
+	recordRingHeader* header;
+	char* ring;
+
+	/* Set by stop() */
+	std::atomic<bool> stopping;
+
+	/* The outcome of the last collect() */
+	uint64_t numRecords;
+	uint64_t numAbandoned;
+
+	/* The description of the last failure */
+	std::string error;
+};
+
+/**
+ * One of the appending sides of a record ring
+ */
+class RecordProducer
+{
+public:
+	RecordProducer();
+	~RecordProducer();
+	RecordProducer(const RecordProducer&) = delete;
+	RecordProducer& operator=(const RecordProducer&) = delete;
+
+	/**
+	 * Waits up to readyTimeoutMs for a collector's ring and attaches to it
+	 * @param  keyFile The file the collector generated its key from
+	 * @return 0, or -1 on failure
+	 */
+	int open(const char* keyFile = "keyfile.txt");
+
+	/**
+	 * Detaches from the ring
+	 */
+	void close();
+
+	/**
+	 * Appends one record
+	 * @param  data The bytes
+	 * @param  size The number of bytes, from 1 to maxRecordSize()
+	 * @param  wait Whether to wait for room when the ring is full, rather
+	 *         than fail with nothing reserved
+	 * @return 0, or -1 on failure, with errno set to EAGAIN when the ring
+	 *         was full and wait was not set
+	 */
+	int append(const void* data, size_t size, bool wait = true);
+
+	/* The largest record the ring takes */
+	size_t maxRecordSize() const;
+
+	/**
+	 * Describes the last failure
+	 * @return The description
+	 */
+	const char* lastError() const { return error.c_str(); }
+
+	/* The number of records appended, and how many of them had to wait for room */
+	uint64_t records() const { return numRecords; }
+	uint64_t waits() const { return numWaits; }
+
+	/* How long open() waits for a collector, in milliseconds, -1 for as long as it takes */
+	int readyTimeoutMs;
+
+private:
+	int fail(const char* format, ...) __attribute__((format(printf, 2, 3)));
+	int waitForRoom(uint64_t end);
+
+	/* The segment and where its parts start */
+	int shmid;
+	void* sharedMemPtr;
+	recordRingHeader* header;
+	char* ring;
+
+	/* The collector that created the segment, and our pid, which tags our records */
+	pid_t collectorPid;
+	pid_t pid;
+
+	/* What we have appended */
+	uint64_t numRecords;
+	uint64_t numWaits;
+
+	/* The description of the last failure */
+	std::string error;
+};
@@ -1,224 +1,391 @@
-#include <sys/msg.h>
-#include <sys/shm.h>
-#include <sys/stat.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <map>
 #include <string>
-#include "msg.h"    /* For the message struct */
+#include <vector>
+#include "broadcast.h"    /* For the Subscriber */
+#include "msg.h"    /* For the FEATURE_* bits */
+#include "placement.h"    /* For pinning to CPUs and NUMA nodes */
+#include "session.h"    /* For naming the session */
+#include "stats.h"    /* For timing fan-out transfers */
+#include "trace.h"    /* For tracing transfer phases */
+#include "transfer.h"    /* For the Receiver */
+#include "pipeline.h"    /* For processing files as they arrive */
+#include "net.h"    /* For receiving over TCP */
+#include "perfcount.h"    /* For profiling the transfers */
+#include "records.h"    /* For collecting records from many producers */
+#include "util.h"    /* For parsing sizes */
 
 using namespace std;
 
-/* The size of the shared memory chunk */
-#define SHARED_MEMORY_CHUNK_SIZE 1000
+/* The receiver, which owns the shared memory segment and message queue */
+Receiver receiver;
 
-/* The ids for the shared memory segment and the message queue */
-int shmid, msqid;
+/* The subscriber, which reads a publisher's ring in fan-out mode */
+Subscriber subscriber;
 
-/* The pointer to the shared memory */
-void *sharedMemPtr;
+/* The socket receiver, which owns the listening socket in TCP mode */
+NetReceiver netReceiver;
+
+/* The collector, which owns the record ring in record mode */
+RecordCollector collector;
+
+/* The CPU to run on and the NUMA node to place the shared memory on */
+int cpu = PLACEMENT_ANY, node = PLACEMENT_ANY;
+
+/* The number of transfers to run before exiting, 0 meaning until interrupted */
+int numTransfers = 1;
+
+/* How each file gets to disk, and how many bytes write-behind lets pile up */
+int durability = DURABILITY_NONE;
+size_t writeBehindSize = DEFAULT_WRITE_BEHIND_SIZE;
+
+/* The session to run, NULL for the one in the environment or the default */
+const char* session = NULL;
+
+/* Whether to subscribe to a sender publishing to several receivers */
+bool broadcast = false;
+
+/* The [host:]port to listen on in TCP mode, NULL for shared memory */
+const char* netAddress = NULL;
+
+/* The file to collect producers' records into in record mode, NULL for normal transfers */
+const char* recordFile = NULL;
+
+/* The rate limit and burst in bytes, 0 for none and the default, and
+ * whether to back off while the host is under pressure
+ */
+size_t rateLimit = 0, rateBurst = 0;
+bool backOff = false;
+
+/* Whether to count cycles, cache misses and the like during the transfers */
+bool profile = false;
+
+/* Whether to publish how much of each file has arrived, for readers that start early */
+bool publishProgress = false;
+
+/* The processing stages every file goes through, and the threads that run them, 0 for one per stage */
+vector<string> stageSpecs;
+int numWorkers = 0;
 
 /**
- * The function for receiving the name of the file
- * @return The name of the file received from the sender
+ * Creates the file a transfer goes to, behind the processing stages if there are any
+ * @param  path The name of the file
+ * @return The sink, or NULL on failure
  */
-string recvFileName()
+TransferSink* createSink(const string& path)
 {
-	/* A message object for receiving the file name */
-	fileNameMsg msg;
+	FileSink* file = new FileSink;
+	file->durability = durability;
+	file->writeBehindSize = writeBehindSize;
+	file->publishProgress = publishProgress;
 
-	/* Receive the file name using msgrcv() */
-	if (msgrcv(msqid, &msg, sizeof(fileNameMsg) - sizeof(long), FILE_NAME_TRANSFER_TYPE, 0) < 0)
+	if (file->open(path.c_str()) < 0)
 	{
-		perror("msgrcv");
-		exit(-1);
+		perror("fopen");
+		delete file;
+		return NULL;
 	}
-	
-	/* Return the received file name */
-	return msg.fileName;
-}
 
- /**
-  * Sets up the shared memory segment and message queue
-  * @param  shmid The id of the allocated shared memory
-  * @param  msqid The id of the shared memory
-  * @param  sharedMemPtr The pointer to the shared memory
-  */
-void init(int& shmid, int& msqid, void*& sharedMemPtr)
-{
-	/* Generate a key for the shared memory segment and message queue */
-	key_t key = ftok("keyfile.txt", 'a');
-
-	/* Failed to generate the key */
-	if (key < 0)
+	if (stageSpecs.empty())
 	{
-		perror("ftok");
-		exit(-1);
+		return file;
 	}
 
-	/* Allocate a shared memory segment */
-	shmid = shmget(key, SHARED_MEMORY_CHUNK_SIZE, IPC_CREAT | S_IRUSR | S_IWUSR);
+	/* Every transfer gets stages of its own */
+	vector<ChunkStage*> stages;
+	string error;
 
-	/* Failed to allocate shared memory */
-	if (shmid < 0)
+	for (size_t i = 0; i < stageSpecs.size(); ++i)
 	{
-		perror("shmget");
-		exit(-1);
+		ChunkStage* stage = createStage(stageSpecs[i], error);
+
+		if (!stage)
+		{
+			fprintf(stderr, "%s\n", error.c_str());
+
+			for (size_t j = 0; j < stages.size(); ++j)
+			{
+				delete stages[j];
+			}
+
+			delete file;
+			return NULL;
+		}
+
+		stages.push_back(stage);
 	}
 
-	/* Attach to the shared memory segment */
-	sharedMemPtr = shmat(shmid, NULL, 0);
+	return new PipelineSink(file, stages, numWorkers);
+}
+
+/**
+ * Prints what the processing stages found in a file
+ * @param  fileName The name the sender gave
+ * @param  sink The file's sink
+ */
+void printStageResults(const string& fileName, TransferSink* sink)
+{
+	PipelineSink* pipeline = dynamic_cast<PipelineSink*>(sink);
 
-	/* Failed to attach to shared memory */
-	if (sharedMemPtr < 0)
+	if (!pipeline)
 	{
-		perror("shmat");
-		exit(-1);
+		return;
 	}
 
-	/* Create a message queue */
-	msqid = msgget(key, 0666 | IPC_CREAT);
+	vector<string> results = pipeline->results();
+	fprintf(stderr, "%s:", fileName.c_str());
 
-	/* Failed to create the message queue */
-	if (msqid < 0)
+	for (size_t i = 0; i < results.size(); ++i)
 	{
-		perror("msgget");
-		exit(-1);
+		fprintf(stderr, "%s %s", i ? "," : "", results[i].c_str());
 	}
+
+	fprintf(stderr, "\n");
 }
 
 /**
- * The main loop
- * @param  fileName The name of the file received from the sender
- * @return The number of bytes received
+ * Saves every transfer to <FILE NAME>__recv
  */
-unsigned long mainLoop(const char* fileName)
+class FileHandler : public TransferHandler
 {
-	/* The size of the message received from the sender */
-	int msgSize = -1;
-	
-	/* The number of bytes received */
-	int numBytesRecv = 0;
-	
-	/* The string representing the file name received from the sender */
-	string recvFileNameStr = fileName;
-	
-	/* Append __recv to the end of the file name */
-	recvFileNameStr += "__recv";
-	
-	/* Open the file for writing */
-	FILE* fp = fopen(recvFileNameStr.c_str(), "w");
-			
-	/* Error checks */
-	if (!fp)
-	{
-		perror("fopen");	
-		exit(-1);
-	}
+public:
+	FileHandler() : numBytesRecv(0) { }
 
-	/* Keep receiving until the sender sets the size to 0, indicating that
- 	 * there is no more data to send.
- 	 */	
-	while (msgSize != 0)
-	{	
-		/* Receive the message and get the value of the size field. The message will be of
-		 * of type SENDER_DATA_TYPE. That is, a message that is an instance of the message struct
-		 * with mtype field set to SENDER_DATA_TYPE (the macro SENDER_DATA_TYPE is defined in
-		 * msg.h).  If the size field of the message is not 0, then we copy that many bytes from 
-		 * the shared memory segment to the file. Otherwise, if 0, then we close the file 
-		 * and exit.
-		 *
-		 * NOTE: the received file will always be saved into the file called
+	/**
+	 * Opens the file a transfer goes to
+	 * @param  fileName The name the sender gave
+	 * @param  priority The sender's priority class
+	 * @param  config The configuration agreed with the sender
+	 * @return The file's sink, or NULL if it could not be opened
+	 */
+	TransferSink* start(const string& fileName, int priority, const transferConfig& config)
+	{
+		/* The name of each class */
+		static const char* priorityNames[NUM_PRIORITY_CLASSES] = PRIORITY_NAMES;
+
+		fprintf(stderr, "%s: using protocol version %d, %llu byte chunks, up to %d in flight, up to %zu bytes inline, checksums %s, durable completion %s, class %s\n",
+			fileName.c_str(), config.version, (unsigned long long)config.chunkSize, config.numSlots, config.inlineSize,
+			(config.features & FEATURE_CHECKSUM) ? "on" : "off", (config.features & FEATURE_DURABLE) ? "on" : "off",
+			priorityNames[priority]);
+
+		/* The received file will always be saved into the file called
 		 * <ORIGINAL FILENAME__recv>. For example, if the name of the original
 		 * file is song.mp3, the name of the received file is going to be song.mp3__recv.
 		 */
-		message rcvMsg;
+		TransferSink* sink = createSink(fileName + "__recv");
 
-		if (msgrcv(msqid, &rcvMsg, sizeof(message) - sizeof(long), SENDER_DATA_TYPE, 0) < 0)
+		if (!sink)
 		{
-			perror("msgrcv");
-			exit(-1);
+			return NULL;
 		}
-		
-		msgSize = rcvMsg.size;
 
-		/* If the sender is not telling us that we are done, then get to work */
-		if (msgSize != 0)
-		{
-			/* Count the number of bytes received */
-			numBytesRecv += msgSize;
-			
-			/* Save the shared memory to file */
-			if (fwrite(sharedMemPtr, sizeof(char), msgSize, fp) < 0)
-			{
-				perror("fwrite");
-				exit(-1);
-			}
-			
-			/* Tell the sender that we are ready for the next set of bytes.
- 			 * I.e. send a message of type RECV_DONE_TYPE. That is, a message
-			 * of type ackMessage with mtype field set to RECV_DONE_TYPE. 
- 			 */
-			ackMessage sndMsg;
-			sndMsg.mtype = RECV_DONE_TYPE;
-
-			if (msgsnd(msqid, &sndMsg, sizeof(ackMessage) - sizeof(long), 0) < 0)
-			{
-				perror("msgsnd");
-				exit(-1);
-			}
-		}
-		/* We are done */
-		else
+		names[sink] = fileName;
+		return sink;
+	}
+
+	/**
+	 * Reports a finished transfer
+	 * @param  sink The file's sink
+	 * @param  numBytes The number of bytes received
+	 * @param  latencyNs How long the transfer took
+	 */
+	void finish(TransferSink* sink, int64_t numBytes, uint64_t latencyNs)
+	{
+		fprintf(stderr, "%s: received %llu bytes in %.3f ms%s\n", names[sink].c_str(),
+			(unsigned long long)numBytes, latencyNs / 1e6, durability != DURABILITY_NONE ? ", on disk" : "");
+		printStageResults(names[sink], sink);
+
+		numBytesRecv += numBytes;
+		names.erase(sink);
+		delete sink;
+	}
+
+	/**
+	 * Reports a sender that was dropped, closing the file it left
+	 * @param  sink The file's sink, or NULL if the sender never named one
+	 * @param  reason What went wrong
+	 */
+	void abandon(TransferSink* sink, const char* reason)
+	{
+		fprintf(stderr, "%s: dropped the sender: %s\n", sink ? names[sink].c_str() : "recv", reason);
+
+		if (sink)
 		{
-			/* Close the file */
-			fclose(fp);
+			names.erase(sink);
+			delete sink;
 		}
 	}
-	
-	return numBytesRecv;
+
+	/* The number of bytes received in all transfers */
+	unsigned long long numBytesRecv;
+
+private:
+	/* The file name of each open sink */
+	map<TransferSink*, string> names;
+};
+
+/**
+ * Handles the exit signal
+ * @param  signal The signal type
+ */
+void ctrlCSignal(int signal)
+{
+	/* In record mode, write out the records already reserved and finish the file; a second Ctrl-C kills us */
+	if (recordFile)
+	{
+		collector.stop();
+		::signal(SIGINT, SIG_DFL);
+		return;
+	}
+
+	/* Free system V resources, stop the publisher waiting for us and stop listening */
+	receiver.close();
+	subscriber.close();
+	netReceiver.close();
+	collector.close();
+	exit(-1);
 }
 
 /**
- * Performs cleanup functions
- * @param  sharedMemPtr The pointer to the shared memory
- * @param  shmid The id of the shared memory segment
- * @param  msqid The id of the message queue
+ * Receives one file from a sender publishing to several receivers, saving
+ * it to <FILE NAME>__recv<INDEX> so receivers in one directory do not collide
+ * @param  keyFile The key file of the session
+ * @return The exit code
  */
-void cleanUp(const int& shmid, const int& msqid, void* sharedMemPtr)
+int subscribe(const char* keyFile)
 {
-	/* Detach from shared memory */
-	if (shmdt(sharedMemPtr) < 0)
+	/* The name the sender gave */
+	string fileName;
+
+	if (subscriber.open(keyFile) < 0 || subscriber.accept(fileName) < 0)
 	{
-		perror("shmdt");
-		exit(-1);
+		fprintf(stderr, "%s\n", subscriber.lastError());
+		return -1;
 	}
-	
-	/* Deallocate the shared memory segment */
-	if (shmctl(shmid, IPC_RMID, 0) < 0)
+
+	/* Where the file goes */
+	TransferSink* sink = createSink(fileName + "__recv" + to_string(subscriber.index()));
+
+	if (!sink)
 	{
-		perror("shmctl");
-		exit(-1);
+		return -1;
 	}
-	
-	/* Deallocate the message queue */
-	if (msgctl(msqid, IPC_RMID, 0) < 0)
+
+	fprintf(stderr, "%s: subscribed as receiver %d\n", fileName.c_str(), subscriber.index());
+
+	/* When the transfer started */
+	uint64_t start = nowNs();
+	int64_t numBytesRecv = subscriber.receive(*sink);
+
+	if (numBytesRecv < 0)
 	{
-		perror("msgctl");
-		exit(-1);
+		fprintf(stderr, "%s\n", subscriber.lastError());
+		delete sink;
+		return -1;
 	}
+
+	fprintf(stderr, "%s: received %llu bytes in %.3f ms%s\n", fileName.c_str(),
+		(unsigned long long)numBytesRecv, (nowNs() - start) / 1e6, durability != DURABILITY_NONE ? ", on disk" : "");
+	printStageResults(fileName, sink);
+	delete sink;
+
+	subscriber.close();
+
+	return 0;
 }
 
 /**
- * Handles the exit signal
- * @param  signal The signal type
+ * Collects the records producers append into one file until Ctrl-C
+ * @param  keyFile The key file of the session
+ * @return The exit code
  */
-void ctrlCSignal(int signal)
+int collectRecords(const char* keyFile)
 {
-	/* Free system V resources */
-	cleanUp(shmid, msqid, sharedMemPtr);
-	exit(-1);
+	if (collector.open(keyFile) < 0)
+	{
+		fprintf(stderr, "%s\n", collector.lastError());
+		return -1;
+	}
+
+	/* Where the records go */
+	TransferSink* sink = createSink(recordFile);
+
+	if (!sink)
+	{
+		collector.close();
+		return -1;
+	}
+
+	fprintf(stderr, "%s: collecting records, Ctrl-C to finish\n", recordFile);
+
+	/* When collecting started */
+	uint64_t start = nowNs();
+	int64_t numBytesRecv = collector.collect(*sink);
+
+	if (numBytesRecv < 0)
+	{
+		fprintf(stderr, "%s\n", collector.lastError());
+		delete sink;
+		collector.close();
+		return -1;
+	}
+
+	fprintf(stderr, "%s: collected %llu records, %llu bytes, in %.3f ms\n", recordFile,
+		(unsigned long long)collector.records(), (unsigned long long)numBytesRecv, (nowNs() - start) / 1e6);
+
+	if (collector.abandoned())
+	{
+		fprintf(stderr, "%s: skipped %llu records whose producers died\n", recordFile, (unsigned long long)collector.abandoned());
+	}
+
+	printStageResults(recordFile, sink);
+	delete sink;
+
+	collector.close();
+
+	return 0;
+}
+
+/**
+ * Receives files over TCP as senders connect
+ * @return The exit code
+ */
+int netServe()
+{
+	/* A sender that hangs up fails the transfer instead of killing us */
+	signal(SIGPIPE, SIG_IGN);
+
+	if (netReceiver.open(netAddress) < 0)
+	{
+		fprintf(stderr, "%s\n", netReceiver.lastError());
+		return -1;
+	}
+
+	fprintf(stderr, "recv: listening on %s\n", netAddress);
+
+	/* Run the transfers, saving each one as it arrives */
+	FileHandler handler;
+
+	if (netReceiver.serve(handler, numTransfers) < 0)
+	{
+		fprintf(stderr, "%s\n", netReceiver.lastError());
+		return -1;
+	}
+
+	fprintf(stderr, "The number of bytes received is: %llu\n", handler.numBytesRecv);
+	fprintf(stderr, "Socket syscalls: %lu\n", netReceiver.syscalls());
+
+	if (netReceiver.dropped())
+	{
+		fprintf(stderr, "Dropped %lu senders whose transfers failed\n", netReceiver.dropped());
+	}
+
+	netReceiver.close();
+
+	return 0;
 }
 
 /**
@@ -229,7 +396,254 @@ void ctrlCSignal(int signal)
  */
 int main(int argc, char** argv)
 {
-	
+	/* The command line option being parsed */
+	int opt;
+
+	/* Parse the command line options */
+	while ((opt = getopt(argc, argv, "w:s:kc:n:t:m:i:d:b:S:FP:j:N:R:B:QHWr:")) != -1)
+	{
+		switch (opt)
+		{
+			/* The number of chunks the sender may have in flight */
+			case 'w':
+				receiver.numSlots = atoi(optarg);
+
+				if (receiver.numSlots < 1 || receiver.numSlots > MAX_WINDOW_SIZE)
+				{
+					fprintf(stderr, "Window size must be between 1 and %d.\n", MAX_WINDOW_SIZE);
+					exit(-1);
+				}
+				netReceiver.numSlots = receiver.numSlots;
+				break;
+
+			/* The size of each chunk */
+			case 's':
+				receiver.chunkSize = parseSize(optarg);
+
+				if (receiver.chunkSize == 0)
+				{
+					fprintf(stderr, "Invalid chunk size %s.\n", optarg);
+					exit(-1);
+				}
+				netReceiver.chunkSize = receiver.chunkSize;
+				collector.ringSize = receiver.chunkSize;
+				break;
+
+			/* Ask for checksums on every chunk */
+			case 'k':
+				receiver.requestedFeatures |= FEATURE_CHECKSUM;
+				netReceiver.requestedFeatures |= FEATURE_CHECKSUM;
+				break;
+
+			/* The CPU to pin this process to */
+			case 'c':
+				cpu = atoi(optarg);
+				break;
+
+			/* The NUMA node to allocate the shared memory segment on */
+			case 'n':
+				node = atoi(optarg);
+				break;
+
+			/* The most transfers to run at once */
+			case 't':
+				receiver.maxTransfers = atoi(optarg);
+
+				if (receiver.maxTransfers < 1)
+				{
+					fprintf(stderr, "The number of concurrent transfers must be at least 1.\n");
+					exit(-1);
+				}
+				break;
+
+			/* The number of transfers to run */
+			case 'm':
+				numTransfers = atoi(optarg);
+
+				if (numTransfers < 0)
+				{
+					fprintf(stderr, "The number of transfers must not be negative.\n");
+					exit(-1);
+				}
+				break;
+
+			/* The most bytes senders may carry inside messages, 0 to always use the slots */
+			case 'i':
+				if (atoi(optarg) < 0 || atoi(optarg) > MAX_MSG_PAYLOAD)
+				{
+					fprintf(stderr, "Inline size must be between 0 and %d.\n", MAX_MSG_PAYLOAD);
+					exit(-1);
+				}
+				receiver.inlineSize = atoi(optarg);
+				netReceiver.inlineSize = receiver.inlineSize;
+				break;
+
+			/* How each file gets to disk */
+			case 'd':
+				durability = parseDurability(optarg);
+
+				if (durability < 0)
+				{
+					fprintf(stderr, "Durability must be none, fsync or writebehind.\n");
+					exit(-1);
+				}
+				break;
+
+			/* How many bytes write-behind lets pile up */
+			case 'b':
+				writeBehindSize = parseSize(optarg);
+
+				if (writeBehindSize == 0)
+				{
+					fprintf(stderr, "Invalid write-behind size %s.\n", optarg);
+					exit(-1);
+				}
+				break;
+
+			/* The session senders join */
+			case 'S':
+				session = optarg;
+				break;
+
+			/* Subscribe to a sender publishing to several receivers */
+			case 'F':
+				broadcast = true;
+				break;
+
+			/* Another processing stage */
+			case 'P':
+				if (stageSpecs.size() == MAX_STAGES)
+				{
+					fprintf(stderr, "At most %d stages.\n", MAX_STAGES);
+					exit(-1);
+				}
+				stageSpecs.push_back(optarg);
+				break;
+
+			/* The threads that run the stages */
+			case 'j':
+				numWorkers = atoi(optarg);
+
+				if (numWorkers < 1)
+				{
+					fprintf(stderr, "Workers must be at least 1.\n");
+					exit(-1);
+				}
+				break;
+
+			/* Receive over TCP on this [host:]port */
+			case 'N':
+				netAddress = optarg;
+				break;
+
+			/* The most bytes per second to write */
+			case 'R':
+				rateLimit = parseSize(optarg);
+
+				if (rateLimit == 0)
+				{
+					fprintf(stderr, "Invalid rate limit %s.\n", optarg);
+					exit(-1);
+				}
+				break;
+
+			/* The most bytes to write at once after a pause */
+			case 'B':
+				rateBurst = parseSize(optarg);
+
+				if (rateBurst == 0)
+				{
+					fprintf(stderr, "Invalid burst size %s.\n", optarg);
+					exit(-1);
+				}
+				break;
+
+			/* Back off while the host is under I/O or memory pressure */
+			case 'Q':
+				backOff = true;
+				break;
+
+			/* Count cycles, cache misses and the like during the transfers */
+			case 'H':
+				profile = true;
+				break;
+
+			/* Let readers follow each file as it arrives */
+			case 'W':
+				publishProgress = true;
+				break;
+
+			/* Collect the records of many producers into this file */
+			case 'r':
+				recordFile = optarg;
+				break;
+
+			default:
+				fprintf(stderr, "USAGE: %s [-w <WINDOW SIZE>] [-s <CHUNK SIZE>] [-k] [-c <CPU>] [-n <NUMA NODE>] [-t <CONCURRENT TRANSFERS>] [-m <TRANSFERS>] [-i <INLINE SIZE>] [-d <DURABILITY>] [-b <WRITE-BEHIND SIZE>] [-S <SESSION>] [-F] [-P <STAGE>]... [-j <WORKERS>] [-N <[HOST:]PORT>] [-R <RATE> [-B <BURST>]] [-Q] [-H] [-W] [-r <RECORD FILE>]\n", argv[0]);
+				exit(-1);
+		}
+	}
+
+	/* Load every plugin and check every stage now rather than at the first file */
+	for (size_t i = 0; i < stageSpecs.size(); ++i)
+	{
+		string error;
+		ChunkStage* stage = createStage(stageSpecs[i], error);
+
+		if (!stage)
+		{
+			fprintf(stderr, "%s\n", error.c_str());
+			exit(-1);
+		}
+
+		delete stage;
+	}
+
+	/* Records come from producers on this host, into a ring of our own */
+	if (recordFile && (netAddress || broadcast))
+	{
+		fprintf(stderr, "Record mode cannot be combined with TCP or fan-out mode.\n");
+		exit(-1);
+	}
+
+	/* Pacing only applies to our own segment */
+	if ((rateLimit || backOff) && (netAddress || broadcast || recordFile))
+	{
+		fprintf(stderr, "Rate limits only apply to shared memory transfers.\n");
+		exit(-1);
+	}
+
+	receiver.pacer.setRate(rateLimit, rateBurst);
+
+	if (backOff && receiver.pacer.watchPressure(true) < 0)
+	{
+		perror("The kernel reports no pressure stall information");
+		exit(-1);
+	}
+
+	/* Pin ourselves before any thread starts, since pinning only covers the
+	 * calling thread and the ones it starts later, and before touching the
+	 * shared memory so it is allocated locally by default
+	 */
+	if (cpu != PLACEMENT_ANY)
+	{
+		pinToCpu(cpu);
+	}
+
+	/* Let shmstat -R change the rate, before any thread starts */
+	if (adjustOnSignal(receiver.pacer) < 0)
+	{
+		perror("adjustOnSignal");
+		exit(-1);
+	}
+
+	/* Senders may wait for their files to be on disk if we put them there */
+	if (durability != DURABILITY_NONE)
+	{
+		receiver.supportedFeatures |= FEATURE_DURABLE;
+		netReceiver.supportedFeatures |= FEATURE_DURABLE;
+	}
+
 	/* Install a signal handler (see signaldemo.cpp sample file).
  	 * If user presses Ctrl-c, your program should delete the message
  	 * queue and the shared memory segment before exiting. You may add 
@@ -241,19 +655,88 @@ int main(int argc, char** argv)
 		exit(-1);
 	}
 				
-	/* Initialize */
-	init(shmid, msqid, sharedMemPtr);
-	
-	/* Receive the file name from the sender */
-	string fileName = recvFileName();
-	
-	/* Go to the main loop */
-	fprintf(stderr, "The number of bytes received is: %lu\n", mainLoop(fileName.c_str()));
+	/* Record spans if asked to, starting a new trace file */
+	traceInit("recv", true);
+
+	/* TCP mode needs no shared memory */
+	if (netAddress)
+	{
+		return netServe();
+	}
+
+	/* The key file of the session */
+	string keyFile = sessionKeyFile(session);
+
+	if (keyFile.empty())
+	{
+		fprintf(stderr, "Invalid session name %s.\n", session ? session : getenv(SESSION_ENV));
+		exit(-1);
+	}
+
+	/* Fan-out mode reads the sender's ring instead of running our own */
+	if (broadcast)
+	{
+		return subscribe(keyFile.c_str());
+	}
+
+	/* Record mode runs a record ring instead of a transfer segment */
+	if (recordFile)
+	{
+		return collectRecords(keyFile.c_str());
+	}
+
+	/* Initialize, clearing away what a receiver that died left behind */
+	if (receiver.open(keyFile.c_str()) < 0)
+	{
+		fprintf(stderr, "%s\n", receiver.lastError());
+		exit(-1);
+	}
+
+	/* Move the shared memory to the requested node */
+	if (node != PLACEMENT_ANY)
+	{
+		bindToNode(receiver.sharedMemory(), receiver.segmentSize(), node);
+	}
+
+	/* Report where everything ended up */
+	printPlacement(stderr, "recv", receiver.sharedMemory(), receiver.segmentSize());
+
+	/* Open the counters now so opening them is not counted. They count the
+	 * stage threads too, which start later.
+	 */
+	PerfCounters counters;
+
+	if (profile && counters.open() == 0)
+	{
+		fprintf(stderr, "No performance counters are available, so only the time is measured\n");
+	}
+
+	/* Run the transfers, saving each one as it arrives */
+	FileHandler handler;
+
+	counters.start();
+
+	if (receiver.serve(handler, numTransfers) < 0)
+	{
+		fprintf(stderr, "%s\n", receiver.lastError());
+		exit(-1);
+	}
+
+	counters.stop();
+
+	fprintf(stderr, "The number of bytes received is: %llu\n", handler.numBytesRecv);
+	receiver.printSyscallReport(stderr, handler.numBytesRecv);
+	receiver.printLatencyReport(stderr);
+
+	if (profile)
+	{
+		counters.print(stderr, "recv", handler.numBytesRecv, receiver.chunks());
+	}
 
 	/* Detach from shared memory segment, and deallocate shared memory
 	 * and message queue (i.e. call cleanup) 
 	 */
-	cleanUp(shmid, msqid, sharedMemPtr);
+	receiver.close();
 		
 	return 0;
 }
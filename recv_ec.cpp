@@ -1,10 +1,16 @@
 #include <sys/shm.h>
 #include <sys/stat.h>
+#include <errno.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
 #include <string>
+#include "rtsignal.h"    /* For the queued signal mode */
+#include "session.h"    /* For naming the session and clearing stale ones */
+#include "stats.h"    /* For the live statistics page */
+#include "trace.h"    /* For tracing transfer phases */
 
 using namespace std;
 
@@ -14,9 +20,12 @@ using namespace std;
 /* The id for the shared memory segment */
 int shmid;
 
-/* The pointer to the shared memory */
+/* The pointer to the shared memory, just past the statistics page */
 void* sharedMemPtr;
 
+/* The statistics page at the start of the shared memory */
+transferStats* stats;
+
 /* The sender's pid */
 pid_t spid;
 
@@ -27,12 +36,30 @@ sigset_t oldmask;
 /* The user interrupt flag */
 bool usr_interrupt;
 
+/* The number of the chunk being received */
+uint64_t chunkNum = 0;
+
+/* Whether to pipeline chunks with queued real-time signals, and the number of slots to offer then */
+bool queued = false;
+int numSlots = DEFAULT_QUEUED_SLOTS;
+
+/* The signal the sender's notices arrive on in queued mode, blocked so sigwaitinfo() takes it */
+sigset_t dataMask;
+
 /**
  * Sleeps until a specific signal is received
  * @param  flag The flag that is set once the signal is received
  */
 void wait(bool& flag)
 {
+	/* When we started waiting */
+	uint64_t start = nowNs();
+
+	/* When the wait span started */
+	uint64_t traceStart;
+
+	TRACE_BEGIN(wait, chunkNum, traceStart);
+
 	if (sigprocmask(SIG_BLOCK, &mask, &oldmask) < 0)
 	{
 		perror("sigprocmask");
@@ -51,6 +78,9 @@ void wait(bool& flag)
 	}
 
 	flag = false;
+
+	TRACE_END(wait, chunkNum, traceStart);
+	statAdd(stats->recv.blockedNs, nowNs() - start);
 }
 
 /**
@@ -75,6 +105,11 @@ string recvFileName()
 	/* The file name read from shared memory */
 	string fileName;
 
+	/* When receiving the name started */
+	uint64_t traceStart;
+
+	TRACE_BEGIN(recv_file_name, 0, traceStart);
+
 	/* Signal the sender to send the file name */
 	if (kill(spid, SIGUSR2) < 0)
 	{
@@ -88,6 +123,13 @@ string recvFileName()
 	/* Get the file name */
 	fileName = static_cast<char*>(sharedMemPtr);
 
+	TRACE_END(recv_file_name, 0, traceStart);
+
+	/* Publish the file name before telling readers the transfer has started */
+	strncpy(stats->fileName, fileName.c_str(), STATS_FILE_NAME_SIZE - 1);
+	stats->startNs.store(nowNs(), memory_order_relaxed);
+	stats->state.store(STATE_TRANSFERRING, memory_order_release);
+
 	/* Signal acknowledgment to sender */
 	if (kill(spid, SIGUSR2) < 0)
 	{
@@ -105,20 +147,49 @@ string recvFileName()
   */
 void init(int& shmid, void*& sharedMemPtr)
 {
-	/* Generate a key for the shared memory segment */
-	key_t key = ftok("keyfile.txt", 'a');
+	/* The key file of the session named in the environment, or keyfile.txt */
+	string keyFile = sessionKeyFile(NULL);
+
+	if (keyFile.empty())
+	{
+		fprintf(stderr, "Invalid session name %s.\n", getenv(SESSION_ENV));
+		exit(-1);
+	}
+
+	/* Generate a key for the shared memory segment, creating the key file if the sender has not */
+	key_t key = sessionKey(keyFile.c_str());
+
+	/* The creator of a segment already using the key */
+	pid_t owner;
 
 	/* Failed to generate the key */
 	if (key < 0)
 	{
-		perror("ftok");
+		perror(keyFile.c_str());
 		exit(-1);
 	}
 
-	/* Allocate a shared memory segment with sizeof(size_t) additional space
-	 * The additional space is used for storing the size of each chunk being transferred
+	/* Remove what a receiver that died left behind, but never a live receiver's segment */
+	if (clearStaleSession(key, owner) < 0)
+	{
+		if (errno == EBUSY)
+		{
+			fprintf(stderr, "Receiver %d is already using %s.\n", (int)owner, keyFile.c_str());
+		}
+		else
+		{
+			perror("Removing a stale session");
+		}
+		exit(-1);
+	}
+
+	/* Allocate a new shared memory segment with the statistics page and sizeof(size_t) additional space
+	 * The additional space is used for storing the size of each chunk being transferred.
+	 * In queued mode, the notices carry the sizes and the segment holds a slot per notice instead.
 	 */
-	shmid = shmget(key, SHARED_MEMORY_CHUNK_SIZE + sizeof(size_t), IPC_CREAT | S_IRUSR | S_IWUSR);
+	size_t size = queued ? (size_t)numSlots * SHARED_MEMORY_CHUNK_SIZE : SHARED_MEMORY_CHUNK_SIZE + sizeof(size_t);
+
+	shmid = shmget(key, STATS_PAGE_SIZE + size, IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
 
 	/* Failed to allocate shared memory */
 	if (shmid < 0)
@@ -131,12 +202,31 @@ void init(int& shmid, void*& sharedMemPtr)
 	sharedMemPtr = shmat(shmid, NULL, 0);
 
 	/* Failed to attach to shared memory */
-	if (sharedMemPtr < 0)
+	if (sharedMemPtr == (void*)-1)
 	{
 		perror("shmat");
 		exit(-1);
 	}
 
+	/* The statistics page comes first and the rest of the code works past it */
+	stats = static_cast<transferStats*>(sharedMemPtr);
+	sharedMemPtr = static_cast<char*>(sharedMemPtr) + STATS_PAGE_SIZE;
+
+	/* Clear the statistics page, publish our pid and only then mark the page ready, so the sender never reads the pid early.
+	 * The slots tell the sender to use queued mode.
+	 */
+	memset(static_cast<void*>(stats), 0, sizeof(transferStats));
+	stats->recv.pid.store(getpid(), memory_order_relaxed);
+
+	if (queued)
+	{
+		stats->numSlots.store(numSlots, memory_order_relaxed);
+		stats->chunkSize.store(SHARED_MEMORY_CHUNK_SIZE, memory_order_relaxed);
+		stats->window.store(numSlots, memory_order_relaxed);
+	}
+	stats->state.store(STATE_WAITING, memory_order_relaxed);
+	stats->magic.store(STATS_MAGIC, memory_order_release);
+
 	/* Initialize the mask of blocking signals to empty */
 	if (sigemptyset(&mask) < 0)
 	{
@@ -160,13 +250,22 @@ void init(int& shmid, void*& sharedMemPtr)
  * @param  fileName The name of the file received from the sender
  * @return The number of bytes received
  */
-unsigned long mainLoop(const char* fileName)
+unsigned long long mainLoop(const char* fileName)
 {
 	/* The size of the last chunk received from the sender */
 	size_t chunkSize = -1;
 	
 	/* The total number of bytes received */
-	int numBytesRecv = 0;
+	unsigned long long numBytesRecv = 0;
+
+	/* When the transfer rate was last refreshed and the byte count then */
+	uint64_t rateNs = nowNs(), rateBytes = 0;
+
+	/* When the current disk write started */
+	uint64_t start;
+
+	/* When the current phase of the chunk started */
+	uint64_t traceStart;
 	
 	/* The string representing the file name received from the sender */
 	string recvFileNameStr = fileName;
@@ -207,24 +306,41 @@ unsigned long mainLoop(const char* fileName)
 			numBytesRecv += chunkSize;
 			
 			/* Save the shared memory to file */
+			start = nowNs();
+			TRACE_BEGIN(write, chunkNum, traceStart);
+
 			if (fwrite(sharedMemPtr, sizeof(char), chunkSize, fp) < 0)
 			{
 				perror("fwrite");
 				exit(-1);
 			}
 
+			TRACE_END(write, chunkNum, traceStart);
+
+			statAdd(stats->recv.diskNs, nowNs() - start);
+			statAdd(stats->recv.bytes, chunkSize);
+			statAdd(stats->recv.chunks, 1);
+			statUpdateRate(stats->recv, nowNs(), rateNs, rateBytes);
+
 			/* Signal the sender to send the next chunk */
+			TRACE_BEGIN(ack, chunkNum, traceStart);
+
 			if (kill(spid, SIGUSR2) < 0)
 			{
 				perror("kill");
 				exit(-1);
 			}
+
+			TRACE_END(ack, chunkNum, traceStart);
+			++chunkNum;
 		}
 		/* We are done */
 		else
 		{
 			/* Close the file */
 			fclose(fp);
+
+			stats->state.store(STATE_DONE, memory_order_relaxed);
 		}
 	}
 	
@@ -234,6 +350,206 @@ unsigned long mainLoop(const char* fileName)
 	return numBytesRecv;
 }
 
+/**
+ * Waits for the sender's next notice in queued mode
+ * @param  info Set to the notice
+ */
+void waitForNotice(siginfo_t& info)
+{
+	/* When we started waiting */
+	uint64_t start = nowNs();
+
+	/* When the wait span started */
+	uint64_t traceStart;
+
+	TRACE_BEGIN(wait, chunkNum, traceStart);
+
+	while (true)
+	{
+		if (sigwaitinfo(&dataMask, &info) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			perror("sigwaitinfo");
+			exit(-1);
+		}
+
+		/* Only notices queued by our sender count, or by any sender until one names a file */
+		if (info.si_code == SI_QUEUE && (spid == 0 || info.si_pid == spid))
+		{
+			break;
+		}
+	}
+
+	TRACE_END(wait, chunkNum, traceStart);
+	statAdd(stats->recv.blockedNs, nowNs() - start);
+}
+
+/**
+ * Hands slots back to the sender in queued mode
+ * @param  value The number of slots, or QUEUED_END_ACK once the file is written
+ */
+void sendAck(int value)
+{
+	/* The signal's value */
+	union sigval ack;
+
+	ack.sival_int = value;
+
+	if (sigqueue(spid, ACK_SIGNAL, ack) < 0)
+	{
+		perror("sigqueue");
+		exit(-1);
+	}
+}
+
+/**
+ * The function for receiving the name of the file in queued mode, which
+ * also tells us who the sender is
+ * @return The name of the file received from the sender
+ */
+string queuedRecvFileName()
+{
+	/* The notice of the name */
+	siginfo_t info;
+
+	/* The name's length, with its terminator */
+	size_t length;
+
+	/* When receiving the name started */
+	uint64_t traceStart;
+
+	waitForNotice(info);
+
+	TRACE_BEGIN(recv_file_name, 0, traceStart);
+
+	spid = info.si_pid;
+	length = noticeLength(info.si_value.sival_int);
+
+	if (noticeSlot(info.si_value.sival_int) != 0 || length == 0 || length > SHARED_MEMORY_CHUNK_SIZE)
+	{
+		fprintf(stderr, "Got a file name of %zu bytes in slot %d.\n", length, noticeSlot(info.si_value.sival_int));
+		exit(-1);
+	}
+
+	/* Get the file name */
+	string fileName(static_cast<char*>(sharedMemPtr), strnlen(static_cast<char*>(sharedMemPtr), length));
+
+	TRACE_END(recv_file_name, 0, traceStart);
+
+	/* Publish the file name before telling readers the transfer has started */
+	strncpy(stats->fileName, fileName.c_str(), STATS_FILE_NAME_SIZE - 1);
+	stats->startNs.store(nowNs(), memory_order_relaxed);
+	stats->state.store(STATE_TRANSFERRING, memory_order_release);
+
+	/* Hand the sender every slot */
+	sendAck(numSlots);
+
+	return fileName;
+}
+
+/**
+ * The main loop in queued mode: write each slot the sender names and hand
+ * it straight back, while the sender fills the others
+ * @param  fileName The name of the file received from the sender
+ * @return The number of bytes received
+ */
+unsigned long long queuedMainLoop(const char* fileName)
+{
+	/* The notice of the next chunk */
+	siginfo_t info;
+
+	/* The slot the chunk is in and its size */
+	int slot;
+	size_t chunkSize;
+
+	/* The total number of bytes received */
+	unsigned long long numBytesRecv = 0;
+
+	/* When the transfer rate was last refreshed and the byte count then */
+	uint64_t rateNs = nowNs(), rateBytes = 0;
+
+	/* When the current disk write started */
+	uint64_t start;
+
+	/* When the current phase of the chunk started */
+	uint64_t traceStart;
+
+	/* The name of the file to write, with __recv appended */
+	string recvFileNameStr = string(fileName) + "__recv";
+
+	/* Open the file for writing */
+	FILE* fp = fopen(recvFileNameStr.c_str(), "w");
+
+	if (!fp)
+	{
+		perror("fopen");
+		exit(-1);
+	}
+
+	/* Keep receiving until a notice with no bytes ends the file */
+	while (true)
+	{
+		waitForNotice(info);
+
+		slot = noticeSlot(info.si_value.sival_int);
+		chunkSize = noticeLength(info.si_value.sival_int);
+
+		if (chunkSize == 0)
+		{
+			break;
+		}
+
+		if (slot >= numSlots || chunkSize > SHARED_MEMORY_CHUNK_SIZE)
+		{
+			fprintf(stderr, "Got a notice of %zu bytes in slot %d.\n", chunkSize, slot);
+			exit(-1);
+		}
+
+		/* Count the number of bytes received */
+		numBytesRecv += chunkSize;
+
+		/* Save the slot to file */
+		start = nowNs();
+		TRACE_BEGIN(write, chunkNum, traceStart);
+
+		if (fwrite(static_cast<char*>(sharedMemPtr) + slot * SHARED_MEMORY_CHUNK_SIZE, sizeof(char), chunkSize, fp) != chunkSize)
+		{
+			perror("fwrite");
+			exit(-1);
+		}
+
+		TRACE_END(write, chunkNum, traceStart);
+
+		statAdd(stats->recv.diskNs, nowNs() - start);
+		statAdd(stats->recv.bytes, chunkSize);
+		statAdd(stats->recv.chunks, 1);
+		statUpdateRate(stats->recv, nowNs(), rateNs, rateBytes);
+
+		/* Hand the slot back */
+		TRACE_BEGIN(ack, chunkNum, traceStart);
+		sendAck(1);
+		TRACE_END(ack, chunkNum, traceStart);
+
+		++chunkNum;
+	}
+
+	/* Close the file, then tell the sender it is written */
+	if (fclose(fp) != 0)
+	{
+		perror("fclose");
+		exit(-1);
+	}
+
+	stats->state.store(STATE_DONE, memory_order_relaxed);
+	sendAck(QUEUED_END_ACK);
+
+	return numBytesRecv;
+}
+
 /**
  * Performs cleanup functions
  * @param  sharedMemPtr The pointer to the shared memory
@@ -241,8 +557,8 @@ unsigned long mainLoop(const char* fileName)
  */
 void cleanUp(const int& shmid, void* sharedMemPtr)
 {
-	/* Detach from shared memory */
-	if (shmdt(sharedMemPtr) < 0)
+	/* Detach from shared memory, which starts at the statistics page */
+	if (shmdt(stats) < 0)
 	{
 		perror("shmdt");
 		exit(-1);
@@ -276,14 +592,6 @@ void ctrlCSignal(int signal)
 	exit(-1);
 }
 
-/**
- * Sends the pid of this process through shared memory
- */
-void sendpid()
-{
-	*static_cast<pid_t*>(sharedMemPtr) = getpid();
-}
-
 /**
  * Receives the pid of the sender through shared memory
  * @return The sender's pid
@@ -304,7 +612,36 @@ pid_t recvpid()
  */
 int main(int argc, char** argv)
 {
-	
+	/* The command line option being parsed */
+	int opt;
+
+	/* Parse the command line options */
+	while ((opt = getopt(argc, argv, "qw:")) != -1)
+	{
+		switch (opt)
+		{
+			/* Pipeline chunks with queued real-time signals */
+			case 'q':
+				queued = true;
+				break;
+
+			/* The number of slots in queued mode */
+			case 'w':
+				numSlots = atoi(optarg);
+
+				if (numSlots < 1 || numSlots > MAX_QUEUED_SLOTS)
+				{
+					fprintf(stderr, "Window size must be between 1 and %d.\n", MAX_QUEUED_SLOTS);
+					exit(-1);
+				}
+				break;
+
+			default:
+				fprintf(stderr, "USAGE: %s [-q [-w <WINDOW SIZE>]]\n", argv[0]);
+				exit(-1);
+		}
+	}
+
 	/* Install a signal handler (see signaldemo.cpp sample file).
  	 * If user presses Ctrl-c, your program should delete the
  	 * shared memory segment before exiting. You may add
@@ -316,6 +653,9 @@ int main(int argc, char** argv)
 		exit(-1);
 	}
 
+	/* Record spans if asked to, starting a new trace file */
+	traceInit("recv_ec", true);
+
 	/* Install a signal handler for the SIGUSR1 signal */
 	if (signal(SIGUSR1, usr1Signal) == SIG_ERR)
 	{
@@ -323,11 +663,34 @@ int main(int argc, char** argv)
 		exit(-1);
 	}
 				
-	/* Initialize */
+	/* Block the notices of queued mode before a sender can see the page and send one */
+	if (queued)
+	{
+		sigemptyset(&dataMask);
+		sigaddset(&dataMask, DATA_SIGNAL);
+
+		if (sigprocmask(SIG_BLOCK, &dataMask, NULL) < 0)
+		{
+			perror("sigprocmask");
+			exit(-1);
+		}
+	}
+
+	/* Initialize, which publishes the pid of this process on the statistics page */
 	init(shmid, sharedMemPtr);
-	
-	/* Send the pid of this process */
-	sendpid();
+
+	/* Pipeline the chunks through the slots */
+	if (queued)
+	{
+		fprintf(stderr, "recv_ec: queued signals, %d slots of %d bytes\n", numSlots, SHARED_MEMORY_CHUNK_SIZE);
+
+		string fileName = queuedRecvFileName();
+
+		fprintf(stderr, "The number of bytes received is: %llu\n", queuedMainLoop(fileName.c_str()));
+		cleanUp(shmid, sharedMemPtr);
+
+		return 0;
+	}
 
 	/* Get the pid of the sender */
 	spid = recvpid();
@@ -336,7 +699,7 @@ int main(int argc, char** argv)
 	string fileName = recvFileName();
 
 	/* Go to the main loop */
-	fprintf(stderr, "The number of bytes received is: %lu\n", mainLoop(fileName.c_str()));
+	fprintf(stderr, "The number of bytes received is: %llu\n", mainLoop(fileName.c_str()));
 
 	/* Detach from shared memory segment and deallocate shared memory
 	 * (i.e. call cleanup)
@@ -0,0 +1,65 @@
+/* The queued signal mode of the extra credit versions. Real-time signals
+ * queue instead of merging, and sigqueue() attaches a value to each, so
+ * the sender can have several slots outstanding: each notice names the
+ * slot and the length of its chunk, and each acknowledgment hands slots
+ * back. Both sides block the signals and take them with sigwaitinfo(), so
+ * there are no handlers and no flags to race on.
+ *
+ * The receiver picks the mode and publishes the number of slots and their
+ * size on the statistics page before marking it ready; a page with no slots
+ * means the lock-step mode. The first notice carries the file name in slot
+ * 0 and its acknowledgment grants every slot. A notice with length 0 ends
+ * the file, and the receiver answers it with QUEUED_END_ACK once the file
+ * is written.
+ */
+
+#include <signal.h>
+#include <stddef.h>
+
+/* The sender's notice of a filled slot, and the receiver's acknowledgment */
+#define DATA_SIGNAL (SIGRTMIN)
+#define ACK_SIGNAL (SIGRTMIN + 1)
+
+/* A notice's value holds the slot above the length, in the positive half of an int */
+#define QUEUED_SLOT_SHIFT 24
+#define QUEUED_LENGTH_MASK ((1 << QUEUED_SLOT_SHIFT) - 1)
+
+/* The most slots a notice can name */
+#define MAX_QUEUED_SLOTS 127
+
+/* The slots a receiver offers by default */
+#define DEFAULT_QUEUED_SLOTS 16
+
+/* The acknowledgment of the end of the file. Any other acknowledgment is the number of slots handed back. */
+#define QUEUED_END_ACK (-1)
+
+/**
+ * Packs a notice into a signal's value
+ * @param  slot The slot filled
+ * @param  length The number of bytes in it, 0 for the end of the file
+ * @return The value
+ */
+inline int packNotice(int slot, size_t length)
+{
+	return (slot << QUEUED_SLOT_SHIFT) | (int)length;
+}
+
+/**
+ * Gets the slot from a notice's value
+ * @param  value The value
+ * @return The slot
+ */
+inline int noticeSlot(int value)
+{
+	return value >> QUEUED_SLOT_SHIFT;
+}
+
+/**
+ * Gets the length from a notice's value
+ * @param  value The value
+ * @return The number of bytes in the slot
+ */
+inline size_t noticeLength(int value)
+{
+	return value & QUEUED_LENGTH_MASK;
+}
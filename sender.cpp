@@ -1,186 +1,259 @@
-#include <sys/msg.h>
-#include <sys/shm.h>
-#include <sys/stat.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <string.h>
-#include "msg.h"    /* For the message struct */
+#include <algorithm>
+#include "broadcast.h"    /* For the Publisher */
+#include "msg.h"    /* For the FEATURE_* bits */
+#include "placement.h"    /* For pinning to CPUs */
+#include "session.h"    /* For naming the session */
+#include "trace.h"    /* For tracing transfer phases */
+#include "transfer.h"    /* For the Sender */
+#include "net.h"    /* For sending over TCP */
+#include "perfcount.h"    /* For profiling the transfer */
+#include "follow.h"    /* For following a file as it grows */
+#include "records.h"    /* For appending records to a collector */
+#include "util.h"    /* For parsing sizes */
 
-/* The size of the shared memory chunk */
-#define SHARED_MEMORY_CHUNK_SIZE 1000
+/* The sender, which owns the shared memory attachment */
+Sender sender;
 
-/* The ids for the shared memory segment and the message queue */
-int shmid, msqid;
+/* The publisher, which owns the ring in fan-out mode */
+Publisher publisher;
 
-/* The pointer to the shared memory */
-void* sharedMemPtr;
+/* The socket sender, which owns the connection in TCP mode */
+NetSender netSender;
+
+/* The file being followed in follow mode */
+FollowSource follower;
+
+/* The producer, which appends to a collector's ring in record mode */
+RecordProducer producer;
 
 /**
- * Sets up the shared memory segment and message queue
- * @param  shmid The id of the allocated shared memory
- * @param  msqid The id of the allocated message queue
+ * Prints each chunk size change of the last transfer
+ * @param  fp The file stream to print to
  */
-void init(int& shmid, int& msqid, void*& sharedMemPtr)
+void printTuneReport(FILE* fp)
 {
-	/* Generate the key for the shared memory segment and message queue */
-	key_t key = ftok("keyfile.txt", 'a');
+	/* The measurements */
+	const std::vector<chunkTuneStep>& steps = sender.tuneLog();
 
-	/* Failed to generate the key */
-	if (key < 0)
+	if (steps.empty())
 	{
-		perror("ftok");
-		exit(-1);
+		fprintf(fp, "The transfer was too short to tune the chunk size\n");
+		return;
 	}
 
-	/* Get the shared memory segment ID */
-	shmid = shmget(key, SHARED_MEMORY_CHUNK_SIZE, S_IRUSR | S_IWUSR);
+	for (size_t i = 0; i < steps.size(); ++i)
+	{
+		if (steps[i].nextSize != steps[i].chunkSize)
+		{
+			fprintf(fp, "At byte %llu: %zu byte chunks ran at %.1f MB/s, %.0f%% waiting; trying %zu\n",
+				(unsigned long long)steps[i].offset, steps[i].chunkSize, steps[i].rate / (1024 * 1024),
+				100 * steps[i].blockedShare, steps[i].nextSize);
+		}
+	}
+
+	fprintf(fp, "%s %zu byte chunks, with room for %zu, after %zu measurements\n",
+		sender.tuneSettled() ? "Settled on" : "Ended mid-search; the fastest measured was",
+		sender.tunedChunkSize(), sender.config().chunkSize, steps.size());
+}
+
+/**
+ * Appends the outcome of the last tuned transfer to a log, one line each,
+ * for choosing static chunk sizes later: the file, its size, the slot size,
+ * the fastest chunk size measured, settled or searching for whether the
+ * search had ended there, and every size measured with its rate in MB/s
+ * @param  logName The name of the log
+ * @param  fileName The file sent
+ * @param  numBytes The number of bytes sent
+ * @return 0, or -1 on failure
+ */
+int appendTuneLog(const char* logName, const char* fileName, int64_t numBytes)
+{
+	/* The measurements */
+	const std::vector<chunkTuneStep>& steps = sender.tuneLog();
+
+	/* The log */
+	FILE* fp = fopen(logName, "a");
 
-	/* Failed to get the shared memory segment ID */
-	if (shmid < 0)
+	if (!fp)
 	{
-		perror("shmget");
-		exit(-1);
+		perror(logName);
+		return -1;
 	}
 
-	/* Attach to the shared memory segment */
-	sharedMemPtr = shmat(shmid, NULL, 0);
+	fprintf(fp, "%s\t%lld\t%zu\t%zu\t%s", fileName, (long long)numBytes, sender.config().chunkSize,
+		steps.empty() ? (size_t)0 : sender.tunedChunkSize(), sender.tuneSettled() ? "settled" : "searching");
 
-	/* Failed to attach to shared memory */
-	if (sharedMemPtr < 0)
+	for (size_t i = 0; i < steps.size(); ++i)
 	{
-		perror("shmat");
-		exit(-1);
+		fprintf(fp, "%c%zu:%.1f", i == 0 ? '\t' : ' ', steps[i].chunkSize, steps[i].rate / (1024 * 1024));
 	}
 
-	/* Attach to the message queue */
-	msqid = msgget(key, 0666 | IPC_CREAT);
+	fprintf(fp, "\n");
 
-	/* Failed to attach to the message queue */
-	if (msqid < 0)
+	if (fclose(fp) != 0)
 	{
-		perror("msgget");
-		exit(-1);
+		perror(logName);
+		return -1;
 	}
+
+	return 0;
 }
 
 /**
- * Performs the cleanup functions
- * @param  sharedMemPtr The pointer to the shared memory
- * @param  shmid The id of the shared memory segment
- * @param  msqid The id of the message queue
+ * Publishes a file to several receivers at once
+ * @param  fileName The name of the file
+ * @param  keyFile The key file of the session
+ * @return The exit code
  */
-void cleanUp(const int& shmid, const int& msqid, void* sharedMemPtr)
+int broadcastFile(const char* fileName, const char* keyFile)
 {
-	/* Detach from shared memory */
-	if (shmdt(sharedMemPtr) < 0)
+	/* The file being published */
+	FileSource source;
+
+	if (source.open(fileName) < 0)
 	{
-		perror("shmdt");
-		exit(-1);
+		perror(fileName);
+		return -1;
+	}
+
+	/* The window and chunk size asked for become the ring's */
+	if (sender.maxSlots > 0)
+	{
+		publisher.numSlots = sender.maxSlots;
+	}
+
+	if (sender.maxChunkSize > 0)
+	{
+		publisher.chunkSize = sender.maxChunkSize;
 	}
+
+	publisher.joinTimeoutMs = sender.readyTimeoutMs;
+
+	/* Create the ring, then wait for the receivers and publish */
+	int64_t numBytesSent;
+
+	if (publisher.open(keyFile) < 0 || (numBytesSent = publisher.publish(fileName, source)) < 0)
+	{
+		fprintf(stderr, "%s\n", publisher.lastError());
+		return -1;
+	}
+
+	fprintf(stderr, "The number of bytes published is %llu, to %d receivers (%d detached, %d evicted)\n",
+		(unsigned long long)numBytesSent, publisher.joined(), publisher.detached(), publisher.evicted());
+
+	publisher.close();
+
+	return 0;
 }
 
 /**
- * The main send function
+ * Appends each line of a file to a collector's ring as a record, splitting
+ * lines longer than the ring takes
  * @param  fileName The name of the file
- * @return The number of bytes sent
+ * @param  keyFile The key file of the session
+ * @return The exit code
  */
-unsigned long sendFile(const char* fileName)
+int appendRecords(const char* fileName, const char* keyFile)
 {
-	/* Open the file for reading */
+	/* The file of records */
 	FILE* fp = fopen(fileName, "r");
 
-	/* A buffer to store message we will send to the receiver. */
-	message sndMsg;
-	sndMsg.mtype = SENDER_DATA_TYPE;
-	
-	/* A buffer to store message received from the receiver. */
-	ackMessage rcvMsg;
-	
-	/* The number of bytes sent */
-	unsigned long numBytesSent = 0;
-	
-	/* Was the file open? */
 	if (!fp)
 	{
-		perror("fopen");
-		exit(-1);
+		perror(fileName);
+		return -1;
 	}
-	
-	/* Read the whole file */
-	while (!feof(fp))
-	{
-		/* Read at most SHARED_MEMORY_CHUNK_SIZE from the file and store them in shared memory. 
- 		 * fread will return how many bytes it has actually read (since the last chunk may be less
- 		 * than SHARED_MEMORY_CHUNK_SIZE).
- 		 */
-		if ((sndMsg.size = fread(sharedMemPtr, sizeof(char), SHARED_MEMORY_CHUNK_SIZE, fp)) < 0)
-		{
-			perror("fread");
-			exit(-1);
-		}
-		
-		/* Count the number of bytes sent */
-		numBytesSent += sndMsg.size;
 
-		/* Send a message to the receiver that the data is ready */
-		if (msgsnd(msqid, &sndMsg, sizeof(message) - sizeof(long), 0) < 0)
-		{
-			perror("msgsnd");
-			exit(-1);
-		}
-		
-		/* Get acknowledgment that the data has been received */
-		if (msgrcv(msqid, &rcvMsg, sizeof(rcvMsg) - sizeof(long), RECV_DONE_TYPE, 0) < 0)
-		{
-			perror("msgrcv");
-			exit(-1);
-		}
+	producer.readyTimeoutMs = sender.readyTimeoutMs;
+
+	if (producer.open(keyFile) < 0)
+	{
+		fprintf(stderr, "%s\n", producer.lastError());
+		fclose(fp);
+		return -1;
 	}
-	
-	/* Set the size of the sending message to zero to signal that there is no more data to send */
-	sndMsg.size = 0;
 
-	/* Send the message to the receiver */
-	if (msgsnd(msqid, &sndMsg, sizeof(message) - sizeof(long), 0) < 0)
+	/* The current line, and the bytes appended */
+	char* line = NULL;
+	size_t lineSize = 0;
+	ssize_t length;
+	unsigned long long numBytesSent = 0;
+
+	while ((length = getline(&line, &lineSize, fp)) > 0)
 	{
-		perror("fread");
-		exit(-1);
+		for (ssize_t offset = 0; offset < length; )
+		{
+			size_t size = std::min((size_t)(length - offset), producer.maxRecordSize());
+
+			if (producer.append(line + offset, size) < 0)
+			{
+				fprintf(stderr, "%s\n", producer.lastError());
+				free(line);
+				fclose(fp);
+				return -1;
+			}
+
+			offset += size;
+			numBytesSent += size;
+		}
 	}
 
-	/* Close the file */
+	free(line);
 	fclose(fp);
-	
-	return numBytesSent;
+
+	fprintf(stderr, "The number of records appended is %llu, %llu bytes, %llu of them after waiting for room\n",
+		(unsigned long long)producer.records(), numBytesSent, (unsigned long long)producer.waits());
+
+	producer.close();
+
+	return 0;
 }
 
 /**
- * Used to send the name of the file to the receiver
- * @param  fileName The name of the file to send
+ * Sends a file to a receiver over TCP
+ * @param  fileName The name of the file
+ * @param  address The receiver's host:port
+ * @return The exit code
  */
-void sendFileName(const char* fileName)
+int netSendFile(const char* fileName, const char* address)
 {
-	/* Get the length of the file name */
-	int fileNameSize = strlen(fileName);
+	/* The limits, features and timeout asked for carry over */
+	netSender.maxSlots = sender.maxSlots;
+	netSender.maxChunkSize = sender.maxChunkSize;
+	netSender.requestedFeatures = sender.requestedFeatures;
+	netSender.priority = sender.priority;
+	netSender.maxInline = sender.maxInline;
+	netSender.readyTimeoutMs = sender.readyTimeoutMs;
 
-	/* Validate the length of the file name */
-	if (fileNameSize > MAX_FILE_NAME_SIZE)
+	/* A receiver that hangs up fails the transfer instead of killing us */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Connect once the receiver listens, then send the name and the file */
+	int64_t numBytesSent;
+
+	if (netSender.open(address) < 0 || (numBytesSent = netSender.sendFile(fileName)) < 0)
 	{
-		fprintf(stderr, "File name exceeds max size of %d.\n", MAX_FILE_NAME_SIZE);
-		exit(-1);
+		fprintf(stderr, "%s\n", netSender.lastError());
+		return -1;
 	}
 
-	/* Create a message object for sending the filename */
-	fileNameMsg msg;
-	msg.mtype = FILE_NAME_TRANSFER_TYPE;
-	strncpy(msg.fileName, fileName, fileNameSize + 1);
+	fprintf(stderr, "The number of bytes sent is %llu, over TCP in %llu byte chunks\n",
+		(unsigned long long)numBytesSent, (unsigned long long)netSender.config().chunkSize);
 
-	/* Send the message using msgsnd */
-	if (msgsnd(msqid, &msg, sizeof(fileNameMsg) - sizeof(long), 0) < 0)
+	if (netSender.config().features & FEATURE_DURABLE)
 	{
-		perror("msgsnd");
-		exit(-1);
+		fprintf(stderr, "The receiver has stored the file\n");
 	}
+
+	fprintf(stderr, "Socket syscalls: %lu\n", netSender.syscalls());
+
+	netSender.close();
+
+	return 0;
 }
 
 /**
@@ -191,24 +264,390 @@ void sendFileName(const char* fileName)
  */
 int main(int argc, char** argv)
 {
+	/* The command line option being parsed */
+	int opt;
+
+	/* The CPU to run on */
+	int cpu = PLACEMENT_ANY;
+
+	/* The session to join, NULL for the one in the environment or the default */
+	const char* session = NULL;
+
+	/* Whether to publish to several receivers at once */
+	bool broadcast = false;
+
+	/* Where to log the chunk sizes tuning settled on, NULL for nowhere */
+	const char* tuneLogName = NULL;
+
+	/* The receiver's host:port when sending over TCP, NULL for shared memory */
+	const char* netAddress = NULL;
+
+	/* The rate limit and burst in bytes, 0 for none and the default, and
+	 * whether to back off while the host is under pressure
+	 */
+	size_t rateLimit = 0, rateBurst = 0;
+	bool backOff = false;
+
+	/* Whether to count cycles, cache misses and the like during the transfer, and the counters */
+	bool profile = false;
+	PerfCounters counters;
+
+	/* Whether to keep sending what is appended to the file until interrupted */
+	bool follow = false;
+
+	/* Whether to append the file's lines to a collector as records */
+	bool records = false;
+
+	/* Parse the command line options */
+	while ((opt = getopt(argc, argv, "w:s:kc:p:i:dS:T:F:L:Al:N:MR:B:QHfD:r")) != -1)
+	{
+		switch (opt)
+		{
+			/* The most chunks we want in flight */
+			case 'w':
+				sender.maxSlots = atoi(optarg);
+
+				if (sender.maxSlots < 1)
+				{
+					fprintf(stderr, "Window size must be at least 1.\n");
+					exit(-1);
+				}
+				break;
+
+			/* The largest chunk we want */
+			case 's':
+				sender.maxChunkSize = parseSize(optarg);
+
+				if (sender.maxChunkSize == 0)
+				{
+					fprintf(stderr, "Invalid chunk size %s.\n", optarg);
+					exit(-1);
+				}
+				break;
+
+			/* Ask for checksums on every chunk */
+			case 'k':
+				sender.requestedFeatures |= FEATURE_CHECKSUM;
+				break;
+
+			/* The CPU to pin this process to */
+			case 'c':
+				cpu = atoi(optarg);
+				break;
+
+			/* The priority class to ask for */
+			case 'p':
+				sender.priority = parsePriority(optarg);
+
+				if (sender.priority < 0)
+				{
+					fprintf(stderr, "Priority must be urgent, normal or bulk.\n");
+					exit(-1);
+				}
+				break;
+
+			/* The most bytes to carry inside messages, 0 to always use the slots */
+			case 'i':
+				if (atoi(optarg) < 0 || atoi(optarg) > MAX_MSG_PAYLOAD)
+				{
+					fprintf(stderr, "Inline size must be between 0 and %d.\n", MAX_MSG_PAYLOAD);
+					exit(-1);
+				}
+				sender.maxInline = atoi(optarg);
+				break;
+
+			/* Wait until the receiver has stored the file */
+			case 'd':
+				sender.requestedFeatures |= FEATURE_DURABLE;
+				break;
+
+			/* The session the receiver runs */
+			case 'S':
+				session = optarg;
+				break;
+
+			/* How long to wait for the receiver, -1 for ever */
+			case 'T':
+				sender.readyTimeoutMs = atoi(optarg);
+
+				if (sender.readyTimeoutMs < -1)
+				{
+					fprintf(stderr, "Timeout must be at least -1 ms.\n");
+					exit(-1);
+				}
+				break;
+
+			/* Publish to this many receivers at once */
+			case 'F':
+				publisher.minSubscribers = atoi(optarg);
+				broadcast = true;
+
+				if (publisher.minSubscribers < 1 || publisher.minSubscribers > MAX_SUBSCRIBERS)
+				{
+					fprintf(stderr, "Receivers must be between 1 and %d.\n", MAX_SUBSCRIBERS);
+					exit(-1);
+				}
+				break;
+
+			/* Evict a receiver that holds up publishing this long */
+			case 'L':
+				publisher.evictAfterMs = atoi(optarg);
+
+				if (publisher.evictAfterMs < 0)
+				{
+					fprintf(stderr, "Eviction time must be at least 0 ms.\n");
+					exit(-1);
+				}
+				break;
+
+			/* Tune the chunk size as we go */
+			case 'A':
+				sender.autoTune = true;
+				break;
+
+			/* Tune the chunk size and log what it settled on */
+			case 'l':
+				sender.autoTune = true;
+				tuneLogName = optarg;
+				break;
+
+			/* Map the file and stream it into the slots */
+			case 'M':
+				sender.mapInput = true;
+				break;
+
+			/* Send over TCP to this host:port */
+			case 'N':
+				netAddress = optarg;
+				break;
+
+			/* The most bytes per second to send */
+			case 'R':
+				rateLimit = parseSize(optarg);
+
+				if (rateLimit == 0)
+				{
+					fprintf(stderr, "Invalid rate limit %s.\n", optarg);
+					exit(-1);
+				}
+				break;
+
+			/* The most bytes to send at once after a pause */
+			case 'B':
+				rateBurst = parseSize(optarg);
+
+				if (rateBurst == 0)
+				{
+					fprintf(stderr, "Invalid burst size %s.\n", optarg);
+					exit(-1);
+				}
+				break;
+
+			/* Back off while the host is under I/O or memory pressure */
+			case 'Q':
+				backOff = true;
+				break;
+
+			/* Count cycles, cache misses and the like during the transfer */
+			case 'H':
+				profile = true;
+				break;
+
+			/* Keep sending what is appended to the file until interrupted */
+			case 'f':
+				follow = true;
+				break;
+
+			/* How long to hold new bytes for more in follow mode */
+			case 'D':
+				if (atoi(optarg) < 0)
+				{
+					fprintf(stderr, "Flush deadline must be at least 0 us.\n");
+					exit(-1);
+				}
+				follower.flushDeadlineUs = atoi(optarg);
+				break;
+
+			/* Append each line to a collector as a record */
+			case 'r':
+				records = true;
+				break;
+
+			default:
+				fprintf(stderr, "USAGE: %s [-w <WINDOW SIZE>] [-s <CHUNK SIZE>] [-k] [-c <CPU>] [-p <PRIORITY>] [-i <INLINE SIZE>] [-d] [-S <SESSION>] [-T <TIMEOUT MS>] [-A] [-l <TUNE LOG>] [-M] [-R <RATE> [-B <BURST>]] [-Q] [-H] [-f [-D <FLUSH DEADLINE US>]] [-r] [-N <HOST:PORT>] [-F <RECEIVERS> [-L <EVICT MS>]] <FILE NAME>\n", argv[0]);
+				exit(-1);
+		}
+	}
+
 	/* Check the command line arguments */
-	if (argc < 2)
+	if (optind >= argc)
+	{
+		fprintf(stderr, "USAGE: %s [-w <WINDOW SIZE>] [-s <CHUNK SIZE>] [-k] [-c <CPU>] [-p <PRIORITY>] [-i <INLINE SIZE>] [-d] [-S <SESSION>] [-T <TIMEOUT MS>] [-A] [-l <TUNE LOG>] [-M] [-R <RATE> [-B <BURST>]] [-Q] [-H] [-f [-D <FLUSH DEADLINE US>]] [-r] [-N <HOST:PORT>] [-F <RECEIVERS> [-L <EVICT MS>]] <FILE NAME>\n", argv[0]);
+		exit(-1);
+	}
+
+	/* The name of the file to send */
+	const char* fileName = argv[optind];
+
+	/* Records go into a ring of the collector's, a line at a time */
+	if (records && (netAddress || broadcast || follow))
+	{
+		fprintf(stderr, "Record mode cannot be combined with TCP, fan-out or follow mode.\n");
+		exit(-1);
+	}
+
+	/* Pacing only applies to the receiver's segment */
+	if ((rateLimit || backOff) && (netAddress || broadcast || records))
+	{
+		fprintf(stderr, "Rate limits only apply to shared memory transfers.\n");
+		exit(-1);
+	}
+
+	sender.pacer.setRate(rateLimit, rateBurst);
+
+	if (backOff && sender.pacer.watchPressure(true) < 0)
+	{
+		perror("The kernel reports no pressure stall information");
+		exit(-1);
+	}
+
+	/* Following needs a receiver that flushes every chunk and a file read as it grows */
+	if (follow && (netAddress || broadcast || sender.mapInput))
+	{
+		fprintf(stderr, "Follow mode only applies to shared memory transfers of files that are not mapped.\n");
+		exit(-1);
+	}
+
+	/* Pin ourselves before doing any work or starting any thread, since
+	 * pinning only covers the calling thread and the ones it starts later
+	 */
+	if (cpu != PLACEMENT_ANY)
+	{
+		pinToCpu(cpu);
+	}
+
+	/* Start watching the file, and let Ctrl-C end the transfer cleanly, before any other thread starts */
+	if (follow)
 	{
-		fprintf(stderr, "USAGE: %s <FILE NAME>\n", argv[0]);
+		sender.requestedFeatures |= FEATURE_LIVE;
+
+		if (follower.open(fileName) < 0)
+		{
+			perror(fileName);
+			exit(-1);
+		}
+
+		if (stopOnSignals(follower) < 0)
+		{
+			perror("stopOnSignals");
+			exit(-1);
+		}
+	}
+
+	/* Let shmstat -R change the rate, before any thread starts */
+	if (adjustOnSignal(sender.pacer) < 0)
+	{
+		perror("adjustOnSignal");
 		exit(-1);
 	}
-		
-	/* Connect to shared memory and the message queue */
-	init(shmid, msqid, sharedMemPtr);
-	
-	/* Send the name of the file */
-	sendFileName(argv[1]);
-		
-	/* Send the file */
-	fprintf(stderr, "The number of bytes sent is %lu\n", sendFile(argv[1]));
-	
+
+	/* Record spans if asked to */
+	traceInit("sender", false);
+
+	/* The key file of the session */
+	std::string keyFile = sessionKeyFile(session);
+
+	if (keyFile.empty())
+	{
+		fprintf(stderr, "Invalid session name %s.\n", session ? session : getenv(SESSION_ENV));
+		exit(-1);
+	}
+
+	/* Fan-out mode has a ring of its own */
+	if (broadcast)
+	{
+		return broadcastFile(fileName, keyFile.c_str());
+	}
+
+	/* Record mode appends to the collector's ring */
+	if (records)
+	{
+		return appendRecords(fileName, keyFile.c_str());
+	}
+
+	/* TCP mode needs no shared memory */
+	if (netAddress)
+	{
+		return netSendFile(fileName, netAddress);
+	}
+
+	/* Connect to shared memory and the message queue once the receiver is ready */
+	if (sender.open(keyFile.c_str()) < 0)
+	{
+		fprintf(stderr, "%s\n", sender.lastError());
+		exit(-1);
+	}
+
+	/* Report where everything ended up */
+	printPlacement(stderr, "sender", sender.sharedMemory(), sender.segmentSize());
+
+	/* Open the counters now so opening them is not counted */
+	if (profile && counters.open() == 0)
+	{
+		fprintf(stderr, "No performance counters are available, so only the time is measured\n");
+	}
+
+	/* Agree on a configuration with the receiver, then send the name and the file */
+	counters.start();
+	int64_t numBytesSent = follow ? sender.send(fileName, follower) : sender.sendFile(fileName);
+	counters.stop();
+
+	if (numBytesSent < 0)
+	{
+		fprintf(stderr, "%s\n", sender.lastError());
+		exit(-1);
+	}
+
+	fprintf(stderr, "The number of bytes sent is %llu\n", (unsigned long long)numBytesSent);
+
+	if (sender.config().features & FEATURE_DURABLE)
+	{
+		fprintf(stderr, "The receiver has stored the file\n");
+	}
+	else if (sender.requestedFeatures & FEATURE_DURABLE)
+	{
+		fprintf(stderr, "The receiver does not say when the file is stored\n");
+	}
+	sender.printSyscallReport(stderr, numBytesSent);
+
+	if (follow)
+	{
+		fprintf(stderr, "Followed the file through %lu rotations and %lu truncations\n",
+			follower.rotations(), follower.truncations());
+	}
+
+	if (sender.pacer.slept() > 0)
+	{
+		fprintf(stderr, "Slept %.3f s to stay under the rate limit\n", sender.pacer.slept() / 1e9);
+	}
+
+	if (sender.autoTune)
+	{
+		printTuneReport(stderr);
+	}
+
+	if (profile)
+	{
+		counters.print(stderr, "sender", numBytesSent, sender.chunks());
+	}
+
+	if (tuneLogName && appendTuneLog(tuneLogName, fileName, numBytesSent) < 0)
+	{
+		exit(-1);
+	}
+
 	/* Cleanup */
-	cleanUp(shmid, msqid, sharedMemPtr);
-		
+	sender.close();
+
 	return 0;
 }
@@ -1,10 +1,15 @@
 #include <sys/shm.h>
 #include <sys/stat.h>
+#include <errno.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include "rtsignal.h"    /* For the queued signal mode */
+#include "session.h"    /* For naming the session and waiting for the receiver */
+#include "stats.h"    /* For the live statistics page */
+#include "trace.h"    /* For tracing transfer phases */
 
 /* The maximum size of the file name */
 #define MAX_FILE_NAME_SIZE 100
@@ -15,9 +20,12 @@
 /* The id for the shared memory segment */
 int shmid;
 
-/* The pointer to the shared memory */
+/* The pointer to the shared memory, just past the statistics page */
 void* sharedMemPtr;
 
+/* The statistics page at the start of the shared memory */
+transferStats* stats;
+
 /* The receiver's pid */
 pid_t rpid;
 
@@ -28,42 +36,58 @@ sigset_t oldmask;
 /* The user interrupt flag */
 bool usr_interrupt;
 
+/* The number of the chunk being sent */
+uint64_t chunkNum = 0;
+
+/* The signal acknowledgments arrive on in queued mode, blocked so sigwaitinfo() takes it */
+sigset_t ackMask;
+
 /**
- * Sets up the shared memory segment
+ * Sets up the shared memory segment, waiting for the receiver to get ready
  * @param  shmid The id of the allocated shared memory
  */
 void init(int& shmid, void*& sharedMemPtr)
 {
-	/* Generate the key for the shared memory segment */
-	key_t key = ftok("keyfile.txt", 'a');
+	/* The key file of the session named in the environment, or keyfile.txt */
+	std::string keyFile = sessionKeyFile(NULL);
 
-	/* Failed to generate the key */
-	if (key < 0)
+	if (keyFile.empty())
 	{
-		perror("ftok");
+		fprintf(stderr, "Invalid session name %s.\n", getenv(SESSION_ENV));
 		exit(-1);
 	}
 
-	/* Get the shared memory segment ID */
-	shmid = shmget(key, SHARED_MEMORY_CHUNK_SIZE + sizeof(size_t), S_IRUSR | S_IWUSR);
+	/* Generate the key for the shared memory segment, creating the key file if the receiver has not */
+	key_t key = sessionKey(keyFile.c_str());
 
-	/* Failed to get the shared memory segment ID */
-	if (shmid < 0)
+	/* Failed to generate the key */
+	if (key < 0)
 	{
-		perror("shmget");
+		perror(keyFile.c_str());
 		exit(-1);
 	}
 
-	/* Attach to the shared memory segment */
-	sharedMemPtr = shmat(shmid, NULL, 0);
+	/* Attach once a live receiver has created the segment and marked it ready */
+	sharedMemPtr = attachWhenReady(key, DEFAULT_READY_TIMEOUT_MS, shmid);
 
-	/* Failed to attach to shared memory */
-	if (sharedMemPtr < 0)
+	/* No receiver got ready in time, or the segment could not be attached */
+	if (!sharedMemPtr)
 	{
-		perror("shmat");
+		if (errno == ETIMEDOUT)
+		{
+			fprintf(stderr, "No receiver got ready within %d ms.\n", DEFAULT_READY_TIMEOUT_MS);
+		}
+		else
+		{
+			perror("shmget");
+		}
 		exit(-1);
 	}
 
+	/* The statistics page comes first and the rest of the code works past it */
+	stats = static_cast<transferStats*>(sharedMemPtr);
+	sharedMemPtr = static_cast<char*>(sharedMemPtr) + STATS_PAGE_SIZE;
+
 	/* Initialize the mask of blocking signals to empty */
 	if (sigemptyset(&mask) < 0)
 	{
@@ -89,8 +113,8 @@ void init(int& shmid, void*& sharedMemPtr)
  */
 void cleanUp(const int& shmid, void* sharedMemPtr)
 {
-	/* Detach from shared memory */
-	if (shmdt(sharedMemPtr) < 0)
+	/* Detach from shared memory, which starts at the statistics page */
+	if (shmdt(stats) < 0)
 	{
 		perror("shmdt");
 		exit(-1);
@@ -103,6 +127,14 @@ void cleanUp(const int& shmid, void* sharedMemPtr)
  */
 void wait(bool& flag)
 {
+	/* When we started waiting */
+	uint64_t start = nowNs();
+
+	/* When the wait span started */
+	uint64_t traceStart;
+
+	TRACE_BEGIN(wait, chunkNum, traceStart);
+
 	if (sigprocmask(SIG_BLOCK, &mask, &oldmask) < 0)
 	{
 		perror("sigprocmask");
@@ -121,6 +153,9 @@ void wait(bool& flag)
 	}
 
 	flag = false;
+
+	TRACE_END(wait, chunkNum, traceStart);
+	statAdd(stats->sender.blockedNs, nowNs() - start);
 }
 
 /**
@@ -140,7 +175,7 @@ void setChunkSize(size_t size)
  * @param  fileName The name of the file
  * @return The number of bytes sent
  */
-unsigned long sendFile(const char* fileName)
+unsigned long long sendFile(const char* fileName)
 {
 	/* Open the file for reading */
 	FILE* fp = fopen(fileName, "r");
@@ -149,7 +184,19 @@ unsigned long sendFile(const char* fileName)
 	size_t chunkSize;
 
 	/* The number of bytes sent */
-	unsigned long numBytesSent = 0;
+	unsigned long long numBytesSent = 0;
+
+	/* The file's attributes */
+	struct stat fileInfo;
+
+	/* When the transfer rate was last refreshed and the byte count then */
+	uint64_t rateNs = nowNs(), rateBytes = 0;
+
+	/* When the current disk read started */
+	uint64_t start;
+
+	/* When the current phase of the chunk started */
+	uint64_t traceStart;
 	
 	/* Was the file open? */
 	if (!fp)
@@ -157,6 +204,14 @@ unsigned long sendFile(const char* fileName)
 		perror("fopen");
 		exit(-1);
 	}
+
+	/* Tell readers of the statistics page who we are and how much is coming */
+	stats->sender.pid.store(getpid(), std::memory_order_relaxed);
+
+	if (fstat(fileno(fp), &fileInfo) == 0)
+	{
+		stats->fileSize.store(fileInfo.st_size, std::memory_order_relaxed);
+	}
 	
 	/* Advance the shared memory pointer by sizeof(size_t) for writing data
 	 * since the first bytes in shared memory will store chunkSize
@@ -170,11 +225,18 @@ unsigned long sendFile(const char* fileName)
  		 * fread will return how many bytes it has actually read (since the last chunk may be less
  		 * than SHARED_MEMORY_CHUNK_SIZE).
  		 */
+		start = nowNs();
+		TRACE_BEGIN(read, chunkNum, traceStart);
+
 		if ((chunkSize = fread(sharedMemPtr, sizeof(char), SHARED_MEMORY_CHUNK_SIZE, fp)) < 0)
 		{
 			perror("fread");
 			exit(-1);
 		}
+
+		TRACE_END(read, chunkNum, traceStart);
+
+		statAdd(stats->sender.diskNs, nowNs() - start);
 		
 		/* Store the chunk size in shared memory and advance the shared memory pointer */
 		setChunkSize(chunkSize);
@@ -182,15 +244,25 @@ unsigned long sendFile(const char* fileName)
 		/* Count the number of bytes sent */
 		numBytesSent += chunkSize;
 
+		statAdd(stats->sender.bytes, chunkSize);
+		statAdd(stats->sender.chunks, 1);
+		statUpdateRate(stats->sender, nowNs(), rateNs, rateBytes);
+
 		/* Signal the receiver that the data is ready */
+		TRACE_BEGIN(publish, chunkNum, traceStart);
+
 		if (kill(rpid, SIGUSR1) < 0)
 		{
 			perror("kill");
 			exit(-1);
 		}
 
+		TRACE_END(publish, chunkNum, traceStart);
+
 		/* Wait for signal from receiver */
 		wait(usr_interrupt);
+
+		++chunkNum;
 	}
 	
 	/* Set the size of the chunk to zero to signal that there is no more data to send */
@@ -215,6 +287,219 @@ unsigned long sendFile(const char* fileName)
 	return numBytesSent;
 }
 
+/**
+ * Waits for the receiver to hand back slots in queued mode, taking every
+ * acknowledgment already queued along with the first
+ * @param  credits The number of slots we may fill, increased here
+ * @return Whether the receiver has written the whole file
+ */
+bool waitForAcks(int& credits)
+{
+	/* When we started waiting */
+	uint64_t start = nowNs();
+
+	/* When the wait span started */
+	uint64_t traceStart;
+
+	/* The acknowledgment */
+	siginfo_t info;
+
+	/* How long to wait for more once one has arrived */
+	const struct timespec noWait = { 0, 0 };
+
+	/* Whether the end of the file was acknowledged */
+	bool finished = false;
+
+	TRACE_BEGIN(wait, chunkNum, traceStart);
+
+	while (sigwaitinfo(&ackMask, &info) < 0)
+	{
+		if (errno != EINTR)
+		{
+			perror("sigwaitinfo");
+			exit(-1);
+		}
+	}
+
+	do
+	{
+		/* Only acknowledgments queued by the receiver count */
+		if (info.si_code != SI_QUEUE || info.si_pid != rpid)
+		{
+			continue;
+		}
+
+		if (info.si_value.sival_int == QUEUED_END_ACK)
+		{
+			finished = true;
+		}
+		else
+		{
+			credits += info.si_value.sival_int;
+		}
+	}
+	while (sigtimedwait(&ackMask, &info, &noWait) >= 0);
+
+	TRACE_END(wait, chunkNum, traceStart);
+	statAdd(stats->sender.blockedNs, nowNs() - start);
+
+	return finished;
+}
+
+/**
+ * Tells the receiver a slot is ready in queued mode
+ * @param  slot The slot
+ * @param  length The number of bytes in it, 0 for the end of the file
+ */
+void notify(int slot, size_t length)
+{
+	/* The signal's value */
+	union sigval notice;
+
+	notice.sival_int = packNotice(slot, length);
+
+	if (sigqueue(rpid, DATA_SIGNAL, notice) < 0)
+	{
+		perror("sigqueue");
+		exit(-1);
+	}
+}
+
+/**
+ * The send function in queued mode: fill every slot the receiver has handed
+ * back and tell it about each with a notice of its own, waiting only once
+ * every slot is full
+ * @param  fileName The name of the file
+ * @return The number of bytes sent
+ */
+unsigned long long queuedSendFile(const char* fileName)
+{
+	/* The slots and how many there are, as the receiver published them */
+	char* slots = static_cast<char*>(sharedMemPtr);
+	int numSlots = stats->numSlots.load(std::memory_order_relaxed);
+	size_t slotSize = stats->chunkSize.load(std::memory_order_relaxed);
+
+	/* The number of slots we may fill, and the next one */
+	int credits = 0, slot = 0;
+
+	/* The number of bytes read into the slot */
+	size_t chunkSize;
+
+	/* The number of bytes sent */
+	unsigned long long numBytesSent = 0;
+
+	/* The file's attributes */
+	struct stat fileInfo;
+
+	/* When the transfer rate was last refreshed and the byte count then */
+	uint64_t rateNs = nowNs(), rateBytes = 0;
+
+	/* When the current disk read started */
+	uint64_t start;
+
+	/* When the current phase of the chunk started */
+	uint64_t traceStart;
+
+	/* Validate the length of the file name */
+	if (strlen(fileName) >= MAX_FILE_NAME_SIZE || strlen(fileName) >= slotSize)
+	{
+		fprintf(stderr, "File name exceeds max size of %d.\n", MAX_FILE_NAME_SIZE);
+		exit(-1);
+	}
+
+	/* Open the file for reading */
+	FILE* fp = fopen(fileName, "r");
+
+	if (!fp)
+	{
+		perror("fopen");
+		exit(-1);
+	}
+
+	/* Block the acknowledgments before the receiver can send any */
+	sigemptyset(&ackMask);
+	sigaddset(&ackMask, ACK_SIGNAL);
+
+	if (sigprocmask(SIG_BLOCK, &ackMask, NULL) < 0)
+	{
+		perror("sigprocmask");
+		exit(-1);
+	}
+
+	/* Tell readers of the statistics page who we are and how much is coming */
+	stats->sender.pid.store(getpid(), std::memory_order_relaxed);
+
+	if (fstat(fileno(fp), &fileInfo) == 0)
+	{
+		stats->fileSize.store(fileInfo.st_size, std::memory_order_relaxed);
+	}
+
+	/* The name goes in the first slot, and its acknowledgment hands us every slot */
+	TRACE_BEGIN(send_file_name, 0, traceStart);
+	strcpy(slots, fileName);
+	notify(0, strlen(fileName) + 1);
+	TRACE_END(send_file_name, 0, traceStart);
+
+	waitForAcks(credits);
+
+	/* Read the whole file */
+	while (true)
+	{
+		/* Every slot is full, so wait for the receiver to write some */
+		if (credits == 0)
+		{
+			waitForAcks(credits);
+		}
+
+		start = nowNs();
+		TRACE_BEGIN(read, chunkNum, traceStart);
+
+		chunkSize = fread(slots + slot * slotSize, sizeof(char), slotSize, fp);
+
+		if (ferror(fp))
+		{
+			perror("fread");
+			exit(-1);
+		}
+
+		TRACE_END(read, chunkNum, traceStart);
+		statAdd(stats->sender.diskNs, nowNs() - start);
+
+		/* The file is exhausted */
+		if (chunkSize == 0)
+		{
+			break;
+		}
+
+		/* Count the number of bytes sent */
+		numBytesSent += chunkSize;
+
+		statAdd(stats->sender.bytes, chunkSize);
+		statAdd(stats->sender.chunks, 1);
+		statUpdateRate(stats->sender, nowNs(), rateNs, rateBytes);
+
+		/* Signal the receiver that the slot is ready */
+		TRACE_BEGIN(publish, chunkNum, traceStart);
+		notify(slot, chunkSize);
+		TRACE_END(publish, chunkNum, traceStart);
+
+		--credits;
+		slot = (slot + 1) % numSlots;
+		++chunkNum;
+	}
+
+	fclose(fp);
+
+	/* End the file and wait for the receiver to finish writing it */
+	notify(slot, 0);
+
+	while (!waitForAcks(credits))
+	{
+	}
+
+	return numBytesSent;
+}
+
 /**
  * Handles the SIGUSR2 signal
  */
@@ -240,12 +525,13 @@ void sendpid()
 }
 
 /**
- * Receives the pid of the receiver through shared memory
+ * Receives the pid of the receiver from the statistics page
  * @return The receiver's pid
  */
 pid_t recvpid()
 {
-	return *static_cast<pid_t*>(sharedMemPtr);
+	/* The receiver stored it before marking the page ready, which init() waited for */
+	return stats->recv.pid.load(std::memory_order_relaxed);
 }
 
 /**
@@ -258,15 +544,20 @@ void sendFileName(const char* fileName)
 	int fileNameSize = strlen(fileName);
 
 	/* Validate the length of the file name */
-	if (fileNameSize > MAX_FILE_NAME_SIZE)
+	if (fileNameSize >= MAX_FILE_NAME_SIZE)
 	{
 		fprintf(stderr, "File name exceeds max size of %d.\n", MAX_FILE_NAME_SIZE);
 		exit(-1);
 	}
 
+	/* When sending the name started */
+	uint64_t traceStart;
+
 	/* Wait for signal from receiver */
 	wait(usr_interrupt);
 
+	TRACE_BEGIN(send_file_name, 0, traceStart);
+
 	/* Store the file name in shared memory */
 	strcpy(static_cast<char*>(sharedMemPtr), fileName);
 
@@ -277,6 +568,8 @@ void sendFileName(const char* fileName)
 		exit(-1);
 	}
 
+	TRACE_END(send_file_name, 0, traceStart);
+
 	/* Wait for signal from receiver */
 	wait(usr_interrupt);
 }
@@ -296,6 +589,9 @@ int main(int argc, char** argv)
 		exit(-1);
 	}
 		
+	/* Record spans if asked to */
+	traceInit("sender_ec", false);
+
 	/* Install a signal handler for the SIGUSR2 signal */
 	if (signal(SIGUSR2, usr2Signal) == SIG_ERR)
 	{
@@ -309,6 +605,15 @@ int main(int argc, char** argv)
 	/* Get the pid of the receiver */
 	rpid = recvpid();
 
+	/* A receiver that published slots pipelines them with queued signals */
+	if (stats->numSlots.load(std::memory_order_relaxed) > 0)
+	{
+		fprintf(stderr, "The number of bytes sent is %llu\n", queuedSendFile(argv[1]));
+		cleanUp(shmid, sharedMemPtr);
+
+		return 0;
+	}
+
 	/* Send the pid of this process */
 	sendpid();
 
@@ -316,7 +621,7 @@ int main(int argc, char** argv)
 	sendFileName(argv[1]);
 
 	/* Send the file */
-	fprintf(stderr, "The number of bytes sent is %lu\n", sendFile(argv[1]));
+	fprintf(stderr, "The number of bytes sent is %llu\n", sendFile(argv[1]));
 	
 	/* Cleanup */
 	cleanUp(shmid, sharedMemPtr);
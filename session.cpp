@@ -0,0 +1,229 @@
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "session.h"
+#include "stats.h"    /* For the readiness mark and the receiver's pid */
+
+using namespace std;
+
+/**
+ * Gets the key file of a session
+ * @param  session The name of the session, or NULL to take it from the environment
+ * @return The path of the key file, or an empty string if the name is not a plain file name
+ */
+string sessionKeyFile(const char* session)
+{
+	if (!session)
+	{
+		session = getenv(SESSION_ENV);
+	}
+
+	/* The unnamed session */
+	if (!session)
+	{
+		return DEFAULT_KEY_FILE;
+	}
+
+	/* The name becomes part of a path, so it must not leave the directory */
+	if (!*session || strlen(session) > MAX_SESSION_NAME_SIZE || strchr(session, '/') || session[0] == '.')
+	{
+		return "";
+	}
+
+	return string(SESSION_KEY_DIR) + "/transfer-" + session + ".key";
+}
+
+/**
+ * Generates the key of a session, creating its key file if neither side has yet
+ * @param  keyFile The key file
+ * @param  projectId The ftok() project id
+ * @return The key, or -1 with errno set
+ */
+key_t sessionKey(const char* keyFile, int projectId)
+{
+	/* Whichever side starts first creates the file, so neither has to wait for the other */
+	int fd = open(keyFile, O_RDONLY | O_CREAT | O_CLOEXEC, 0666);
+
+	if (fd < 0)
+	{
+		return -1;
+	}
+
+	close(fd);
+
+	return ftok(keyFile, projectId);
+}
+
+/**
+ * Checks whether a process is still running. Zombies count as dead.
+ * @param  pid The process
+ * @return Whether it is running
+ */
+bool processAlive(pid_t pid)
+{
+	/* The path of the process's status */
+	char path[32];
+
+	/* The status line, which ends with the state after the command name */
+	char line[512];
+
+	if (pid <= 0 || (kill(pid, 0) < 0 && errno != EPERM))
+	{
+		return false;
+	}
+
+	/* A killed receiver its parent has not reaped yet still answers kill() */
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	FILE* fp = fopen(path, "r");
+
+	if (!fp)
+	{
+		return true;
+	}
+
+	bool alive = true;
+
+	if (fgets(line, sizeof(line), fp))
+	{
+		/* The command name may contain spaces and parentheses, so look past the last one */
+		const char* end = strrchr(line, ')');
+		alive = !(end && end[1] == ' ' && (end[2] == 'Z' || end[2] == 'X'));
+	}
+
+	fclose(fp);
+
+	return alive;
+}
+
+/**
+ * Removes the shared memory segment and message queue of a session if the process that created them is gone
+ * @param  key The session's key
+ * @param  owner Set to the creator of the segment, if there was one
+ * @return 1 if stale objects were removed, 0 if there were none, or -1 with errno set to EBUSY if a live process owns the session
+ */
+int clearStaleSession(key_t key, pid_t& owner)
+{
+	/* The segment's attributes */
+	struct shmid_ds shmInfo;
+
+	/* Whether anything was removed */
+	int removed = 0;
+
+	int shmid = shmget(key, 0, 0);
+	owner = 0;
+
+	if (shmid >= 0)
+	{
+		if (shmctl(shmid, IPC_STAT, &shmInfo) < 0)
+		{
+			return -1;
+		}
+
+		owner = shmInfo.shm_cpid;
+
+		if (processAlive(owner))
+		{
+			errno = EBUSY;
+			return -1;
+		}
+
+		/* Anyone still attached keeps their mapping, but the key is free from here on */
+		if (shmctl(shmid, IPC_RMID, 0) < 0)
+		{
+			return -1;
+		}
+
+		removed = 1;
+	}
+	else if (errno != ENOENT)
+	{
+		return -1;
+	}
+
+	/* A queue without a live receiver's segment beside it only holds messages nobody will read */
+	int msqid = msgget(key, 0);
+
+	if (msqid >= 0)
+	{
+		if (msgctl(msqid, IPC_RMID, 0) < 0)
+		{
+			return -1;
+		}
+
+		removed = 1;
+	}
+	else if (errno != ENOENT)
+	{
+		return -1;
+	}
+
+	return removed;
+}
+
+/**
+ * Waits for a live process to create the session's segment and mark its statistics page ready, then attaches to it
+ * @param  key The session's key
+ * @param  timeoutMs How long to wait, or -1 to wait forever
+ * @param  shmid Set to the segment's id
+ * @return The start of the segment, or NULL with errno set to ETIMEDOUT if nothing got ready in time
+ */
+void* attachWhenReady(key_t key, int timeoutMs, int& shmid)
+{
+	/* When to give up */
+	uint64_t deadline = nowNs() + (uint64_t)timeoutMs * 1000000;
+
+	/* The pause before the next look, which grows while nothing changes */
+	useconds_t delay = READY_POLL_MIN_US;
+
+	/* The segment's attributes */
+	struct shmid_ds shmInfo;
+
+	while (true)
+	{
+		/* Only a segment whose creator is still running can ever get ready */
+		if ((shmid = shmget(key, 0, S_IRUSR | S_IWUSR)) >= 0)
+		{
+			if (shmctl(shmid, IPC_STAT, &shmInfo) == 0 && processAlive(shmInfo.shm_cpid))
+			{
+				void* ptr = shmat(shmid, NULL, 0);
+
+				if (ptr == (void*)-1)
+				{
+					return NULL;
+				}
+
+				/* The creator fills in the page, its pid included, before marking it ready */
+				const transferStats* stats = static_cast<const transferStats*>(ptr);
+
+				if (stats->magic.load(memory_order_acquire) == STATS_MAGIC)
+				{
+					return ptr;
+				}
+
+				shmdt(ptr);
+			}
+		}
+		else if (errno != ENOENT)
+		{
+			return NULL;
+		}
+
+		if (timeoutMs >= 0 && nowNs() >= deadline)
+		{
+			shmid = -1;
+			errno = ETIMEDOUT;
+			return NULL;
+		}
+
+		usleep(delay);
+		delay = delay * 2 < READY_POLL_MAX_US ? delay * 2 : READY_POLL_MAX_US;
+	}
+}
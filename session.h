@@ -0,0 +1,73 @@
+/* Named transfer sessions: where both sides get their IPC key, how a sender
+ * waits for its receiver to get ready and how a receiver clears away what a
+ * dead one left behind */
+
+#include <sys/types.h>
+#include <string>
+
+/* The key file of the unnamed session, relative to the working directory */
+#define DEFAULT_KEY_FILE "keyfile.txt"
+
+/* Where the key files of named sessions live, so both sides agree on them
+ * whatever their working directories are */
+#define SESSION_KEY_DIR "/tmp"
+
+/* The environment variable naming the session when no option does */
+#define SESSION_ENV "TRANSFER_SESSION"
+
+/* The longest session name */
+#define MAX_SESSION_NAME_SIZE 64
+
+/* How long a sender waits for its receiver by default, in milliseconds */
+#define DEFAULT_READY_TIMEOUT_MS 10000
+
+/* The shortest and longest pauses between looks for the receiver */
+#define READY_POLL_MIN_US 100
+#define READY_POLL_MAX_US 10000
+
+/**
+ * Gets the key file of a session
+ * @param  session The name of the session, or NULL to take it from the
+ *         TRANSFER_SESSION environment variable, falling back on keyfile.txt
+ *         in the working directory when that is not set either
+ * @return The path of the key file, or an empty string if the name is not a
+ *         plain file name
+ */
+std::string sessionKeyFile(const char* session);
+
+/**
+ * Generates the key of a session, creating its key file if neither side has yet
+ * @param  keyFile The key file
+ * @param  projectId The ftok() project id, which tells apart the kinds of
+ *         segment one session can have
+ * @return The key, or -1 with errno set
+ */
+key_t sessionKey(const char* keyFile, int projectId = 'a');
+
+/**
+ * Checks whether a process is still running. Zombies count as dead.
+ * @param  pid The process
+ * @return Whether it is running
+ */
+bool processAlive(pid_t pid);
+
+/**
+ * Removes the shared memory segment and message queue of a session if the
+ * process that created them is gone
+ * @param  key The session's key
+ * @param  owner Set to the creator of the segment, if there was one
+ * @return 1 if stale objects were removed, 0 if there were none, or -1 with
+ *         errno set to EBUSY if a live process owns the session
+ */
+int clearStaleSession(key_t key, pid_t& owner);
+
+/**
+ * Waits for a live process, normally the receiver, to create the session's
+ * segment and mark its statistics page ready, then attaches to it
+ * @param  key The session's key
+ * @param  timeoutMs How long to wait, or -1 to wait forever
+ * @param  shmid Set to the segment's id
+ * @return The start of the segment, or NULL with errno set to ETIMEDOUT if
+ *         nothing got ready in time
+ */
+void* attachWhenReady(key_t key, int timeoutMs, int& shmid);
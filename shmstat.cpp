@@ -0,0 +1,387 @@
+#include <sys/msg.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "pacer.h"    /* For the signal that changes the rate limit */
+#include "session.h"    /* For naming the session */
+#include "stats.h"    /* For the live statistics page */
+#include "util.h"    /* For parsing sizes */
+
+using namespace std;
+
+/* The number of bytes in a megabyte */
+#define BYTES_PER_MB (1024.0 * 1024.0)
+
+/* The names of the transfer states */
+const char* stateNames[] = { "waiting", "transferring", "done" };
+
+/**
+ * Attaches read-only to the receiver's shared memory segment
+ * @param  key The key of the segment
+ * @param  shmid The id of the segment, set here
+ * @return The statistics page, or NULL if there is no segment yet
+ */
+const transferStats* attach(key_t key, int& shmid)
+{
+	/* Look up the segment without creating it */
+	shmid = shmget(key, 0, 0);
+
+	if (shmid < 0)
+	{
+		return NULL;
+	}
+
+	/* Attach read-only so we can never disturb the transfer */
+	void* ptr = shmat(shmid, NULL, SHM_RDONLY);
+
+	if (ptr == (void*)-1)
+	{
+		perror("shmat");
+		exit(-1);
+	}
+
+	return static_cast<const transferStats*>(ptr);
+}
+
+/**
+ * Checks whether the receiver has removed the segment
+ * @param  shmid The id of the segment
+ * @return True if the segment is gone or about to be
+ */
+bool isRemoved(int shmid)
+{
+	/* The segment's attributes */
+	struct shmid_ds shmInfo;
+
+	if (shmctl(shmid, IPC_STAT, &shmInfo) < 0)
+	{
+		return true;
+	}
+
+	return (shmInfo.shm_perm.mode & SHM_DEST) != 0;
+}
+
+/**
+ * Gets the number of messages waiting in the message queue
+ * @param  key The key of the message queue
+ * @return The number of messages, or -1 if there is no queue
+ */
+long getQueueDepth(key_t key)
+{
+	/* The message queue's attributes */
+	struct msqid_ds msqInfo;
+
+	/* Look up the queue without creating it */
+	int msqid = msgget(key, 0);
+
+	if (msqid < 0 || msgctl(msqid, IPC_STAT, &msqInfo) < 0)
+	{
+		return -1;
+	}
+
+	return msqInfo.msg_qnum;
+}
+
+/**
+ * Prints one view of the statistics page
+ * @param  fp The file stream to print to
+ * @param  stats The statistics page
+ * @param  queueDepth The number of messages waiting in the message queue
+ * @param  elapsedNs The time since the last view
+ * @param  lastSent The sender's byte count at the last view, updated here
+ * @param  lastRecv The receiver's byte count at the last view, updated here
+ */
+void printStats(FILE* fp, const transferStats* stats, long queueDepth, uint64_t elapsedNs,
+	uint64_t& lastSent, uint64_t& lastRecv)
+{
+	/* Take one snapshot of every counter */
+	uint32_t state = stats->state.load(memory_order_acquire);
+	uint64_t startNs = stats->startNs.load(memory_order_relaxed);
+	uint64_t fileSize = stats->fileSize.load(memory_order_relaxed);
+	uint64_t bytesSent = stats->sender.bytes.load(memory_order_relaxed);
+	uint64_t bytesRecv = stats->recv.bytes.load(memory_order_relaxed);
+	uint64_t chunksSent = stats->sender.chunks.load(memory_order_relaxed);
+	uint64_t chunksRecv = stats->recv.chunks.load(memory_order_relaxed);
+	uint64_t tunedChunkSize = stats->tunedChunkSize.load(memory_order_relaxed);
+
+	/* The time since the transfer started */
+	double runTime = (state != STATE_WAITING && startNs) ? (nowNs() - startNs) / 1e9 : 0.0;
+
+	/* The rates since the last view */
+	double intervalTime = elapsedNs ? elapsedNs / 1e9 : 1.0;
+	double sendRate = (bytesSent - lastSent) / BYTES_PER_MB / intervalTime;
+	double recvRate = (bytesRecv - lastRecv) / BYTES_PER_MB / intervalTime;
+
+	lastSent = bytesSent;
+	lastRecv = bytesRecv;
+
+	fprintf(fp, "file: %s  state: %s  elapsed: %.1f s", state != STATE_WAITING ? stats->fileName : "-",
+		stateNames[state <= STATE_DONE ? state : STATE_DONE], runTime);
+
+	if (fileSize > 0)
+	{
+		fprintf(fp, "  progress: %.1f%% of %lu bytes", 100.0 * bytesRecv / fileSize, fileSize);
+	}
+
+	fprintf(fp, "\n\n%-22s %16s %16s\n", "", "sender", "receiver");
+	fprintf(fp, "%-22s %16d %16d\n", "pid", stats->sender.pid.load(memory_order_relaxed),
+		stats->recv.pid.load(memory_order_relaxed));
+	fprintf(fp, "%-22s %16lu %16lu\n", "bytes", bytesSent, bytesRecv);
+	fprintf(fp, "%-22s %16lu %16lu\n", "chunks", chunksSent, chunksRecv);
+	fprintf(fp, "%-22s %16.1f %16.1f\n", "rate (MB/s)", sendRate, recvRate);
+	fprintf(fp, "%-22s %16.1f %16.1f\n", "reported rate (MB/s)",
+		stats->sender.rate.load(memory_order_relaxed) / BYTES_PER_MB,
+		stats->recv.rate.load(memory_order_relaxed) / BYTES_PER_MB);
+	fprintf(fp, "%-22s %16.3f %16.3f\n", "blocked (s)",
+		stats->sender.blockedNs.load(memory_order_relaxed) / 1e9,
+		stats->recv.blockedNs.load(memory_order_relaxed) / 1e9);
+	fprintf(fp, "%-22s %16.3f %16.3f\n", "disk (s)",
+		stats->sender.diskNs.load(memory_order_relaxed) / 1e9,
+		stats->recv.diskNs.load(memory_order_relaxed) / 1e9);
+	fprintf(fp, "%-22s %16.3f %16.3f\n", "paced (s)",
+		stats->sender.pacedNs.load(memory_order_relaxed) / 1e9,
+		stats->recv.pacedNs.load(memory_order_relaxed) / 1e9);
+	fprintf(fp, "%-22s %16.1f %16.1f\n", "rate limit (MB/s)",
+		stats->sender.rateLimit.load(memory_order_relaxed) / BYTES_PER_MB,
+		stats->recv.rateLimit.load(memory_order_relaxed) / BYTES_PER_MB);
+
+	fprintf(fp, "\nin flight: %lu chunks  window: %d  queued messages: ",
+		chunksSent >= chunksRecv ? chunksSent - chunksRecv : 0,
+		stats->window.load(memory_order_relaxed));
+
+	if (tunedChunkSize > 0)
+	{
+		fprintf(fp, "tuned chunk size: %lu  ", tunedChunkSize);
+	}
+
+	if (queueDepth < 0)
+	{
+		fprintf(fp, "-\n");
+	}
+	else
+	{
+		fprintf(fp, "%ld\n", queueDepth);
+	}
+
+	fflush(fp);
+}
+
+/**
+ * Asks the sender and receiver to switch to a new rate limit
+ * @param  stats The statistics page, which says who they are
+ * @param  rate The new limit in bytes per second, 0 for none
+ * @return The exit code
+ */
+int requestRate(const transferStats* stats, size_t rate)
+{
+	/* The signal's value, the limit in RATE_SIGNAL_UNIT bytes per second */
+	union sigval value;
+
+	/* The processes to ask, and how many were */
+	pid_t pids[] = { stats->sender.pid.load(memory_order_relaxed), stats->recv.pid.load(memory_order_relaxed) };
+	int numAsked = 0;
+
+	value.sival_int = (rate + RATE_SIGNAL_UNIT - 1) / RATE_SIGNAL_UNIT;
+
+	for (size_t i = 0; i < sizeof(pids) / sizeof(pids[0]); ++i)
+	{
+		if (pids[i] <= 0 || !processAlive(pids[i]))
+		{
+			continue;
+		}
+
+		if (sigqueue(pids[i], RATE_SIGNAL, value) < 0)
+		{
+			perror("sigqueue");
+			return -1;
+		}
+
+		if (rate)
+		{
+			fprintf(stderr, "Asked %s %d for %.1f MB/s\n", i == 0 ? "sender" : "receiver", pids[i], rate / BYTES_PER_MB);
+		}
+		else
+		{
+			fprintf(stderr, "Asked %s %d to lift its rate limit\n", i == 0 ? "sender" : "receiver", pids[i]);
+		}
+		++numAsked;
+	}
+
+	if (numAsked == 0)
+	{
+		fprintf(stderr, "No transfer is running.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Begins program execution
+ * @param  argc The number of command line arguments
+ * @param  argv An array of C strings containing each command line argument
+ * @return The exit code
+ */
+int main(int argc, char** argv)
+{
+	/* The command line option being parsed */
+	int opt;
+
+	/* How long to wait between views, in milliseconds */
+	int interval = 1000;
+
+	/* Print a single view and exit */
+	bool once = false;
+
+	/* The session to watch, NULL for the one in the environment or the default */
+	const char* session = NULL;
+
+	/* The rate limit to ask both sides for, 0 for none, and whether to ask */
+	size_t rate = 0;
+	bool setRate = false;
+
+	/* Parse the command line options */
+	while ((opt = getopt(argc, argv, "i:1S:R:")) != -1)
+	{
+		switch (opt)
+		{
+			/* The time between views */
+			case 'i':
+				interval = atoi(optarg);
+
+				if (interval < 1)
+				{
+					fprintf(stderr, "Interval must be at least 1 ms.\n");
+					exit(-1);
+				}
+				break;
+
+			/* A single view */
+			case '1':
+				once = true;
+				break;
+
+			/* The session to watch */
+			case 'S':
+				session = optarg;
+				break;
+
+			/* Change the rate limit instead of watching */
+			case 'R':
+				rate = parseSize(optarg);
+				setRate = true;
+
+				if (rate == 0 && strcmp(optarg, "0") != 0 && strcmp(optarg, "none") != 0)
+				{
+					fprintf(stderr, "Invalid rate limit %s.\n", optarg);
+					exit(-1);
+				}
+				break;
+
+			default:
+				fprintf(stderr, "USAGE: %s [-i <INTERVAL MS>] [-1] [-S <SESSION>] [-R <RATE>|none]\n", argv[0]);
+				exit(-1);
+		}
+	}
+
+	/* The key file of the session */
+	std::string keyFile = sessionKeyFile(session);
+
+	if (keyFile.empty())
+	{
+		fprintf(stderr, "Invalid session name %s.\n", session ? session : getenv(SESSION_ENV));
+		exit(-1);
+	}
+
+	/* Generate the same key as the sender and receiver */
+	key_t key = sessionKey(keyFile.c_str());
+
+	/* Failed to generate the key */
+	if (key < 0)
+	{
+		perror(keyFile.c_str());
+		exit(-1);
+	}
+
+	/* The id of the segment and its statistics page */
+	int shmid;
+	const transferStats* stats = attach(key, shmid);
+
+	/* Wait for the receiver to set up the segment */
+	while (!stats || stats->magic.load(memory_order_acquire) != STATS_MAGIC)
+	{
+		if (once || setRate)
+		{
+			fprintf(stderr, "No transfer is running.\n");
+			exit(-1);
+		}
+
+		if (stats)
+		{
+			shmdt(stats);
+		}
+
+		usleep(interval * 1000);
+		stats = attach(key, shmid);
+	}
+
+	/* Changing the rate is all there is to do */
+	if (setRate)
+	{
+		int result = requestRate(stats, rate);
+
+		shmdt(stats);
+		return result;
+	}
+
+	/* Clear the screen between views like top when printing to a terminal */
+	bool clearScreen = isatty(STDOUT_FILENO) && !once;
+
+	/* The byte counts and time at the last view */
+	uint64_t lastSent = stats->sender.bytes.load(memory_order_relaxed);
+	uint64_t lastRecv = stats->recv.bytes.load(memory_order_relaxed);
+	uint64_t lastNs = nowNs();
+
+	/* Keep printing until the transfer is over */
+	while (true)
+	{
+		if (!once)
+		{
+			usleep(interval * 1000);
+		}
+
+		uint64_t now = nowNs();
+		bool done = stats->state.load(memory_order_acquire) == STATE_DONE || isRemoved(shmid);
+
+		if (clearScreen)
+		{
+			printf("\033[H\033[2J");
+		}
+
+		printStats(stdout, stats, getQueueDepth(key), now - lastNs, lastSent, lastRecv);
+		lastNs = now;
+
+		if (once || done)
+		{
+			break;
+		}
+
+		if (!clearScreen)
+		{
+			printf("\n");
+		}
+	}
+
+	/* Detach from shared memory */
+	if (shmdt(stats) < 0)
+	{
+		perror("shmdt");
+		exit(-1);
+	}
+
+	return 0;
+}
@@ -0,0 +1,141 @@
+/* The live transfer statistics page kept at the start of the shared memory segment */
+
+#include <atomic>
+#include <stdint.h>
+#include <time.h>
+
+/* The size of the statistics page. The chunk data starts right after it. */
+#define STATS_PAGE_SIZE 4096
+
+/* Marks a statistics page the receiver has initialized. It changes with
+ * every change to the layout of the page, so a shmstat or sender from
+ * another build waits for a page it can read instead of misreading this one.
+ * The last change added tunedChunkSize and the pacing counters.
+ */
+#define STATS_MAGIC 0x54415454
+
+/* The longest file name the page keeps */
+#define STATS_FILE_NAME_SIZE 128
+
+/* How often the receiver refreshes its transfer rate */
+#define STATS_RATE_INTERVAL_NS 250000000ULL
+
+/* The states of a transfer */
+#define STATE_WAITING 0
+#define STATE_TRANSFERRING 1
+#define STATE_DONE 2
+
+/**
+ * The counters kept by one side of the transfer. Each side gets its own
+ * cache line so neither, nor a reader like shmstat, slows the other down.
+ */
+struct alignas(64) sideStats
+{
+	/* The pid of the process updating these counters */
+	std::atomic<int32_t> pid;
+
+	/* The number of bytes moved through shared memory */
+	std::atomic<uint64_t> bytes;
+
+	/* The number of chunks moved through shared memory */
+	std::atomic<uint64_t> chunks;
+
+	/* Nanoseconds spent blocked waiting on the other side */
+	std::atomic<uint64_t> blockedNs;
+
+	/* Nanoseconds spent reading or writing the file */
+	std::atomic<uint64_t> diskNs;
+
+	/* Bytes per second over the last STATS_RATE_INTERVAL_NS */
+	std::atomic<uint64_t> rate;
+
+	/* Nanoseconds spent sleeping to stay under the rate limit */
+	std::atomic<uint64_t> pacedNs;
+
+	/* The rate the pacer holds this side to now, 0 for none */
+	std::atomic<uint64_t> rateLimit;
+};
+
+/**
+ * The statistics page. Only the owner of a field writes it, with relaxed
+ * atomics, so updates never wait on a reader.
+ */
+struct transferStats
+{
+	/* STATS_MAGIC once the receiver has set up the page */
+	std::atomic<uint32_t> magic;
+
+	/* One of the STATE_* values */
+	std::atomic<uint32_t> state;
+
+	/* When the transfer started, in CLOCK_MONOTONIC nanoseconds */
+	std::atomic<uint64_t> startNs;
+
+	/* The size of the file being sent, if the sender knows it */
+	std::atomic<uint64_t> fileSize;
+
+	/* The number of chunks the receiver lets the sender have in flight */
+	std::atomic<int32_t> window;
+
+	/* The chunk size a tuning sender last announced, 0 if it is not tuning */
+	std::atomic<uint64_t> tunedChunkSize;
+
+	/* The number of chunk slots after this page and the size of each. The
+	 * receiver sets these before anything else in the page and never changes them.
+	 */
+	std::atomic<int32_t> numSlots;
+	std::atomic<uint64_t> chunkSize;
+
+	/* The name of the file being received, written before state leaves STATE_WAITING */
+	char fileName[STATS_FILE_NAME_SIZE];
+
+	/* The counters kept by the sender */
+	sideStats sender;
+
+	/* The counters kept by the receiver */
+	sideStats recv;
+};
+
+static_assert(sizeof(transferStats) <= STATS_PAGE_SIZE, "statistics do not fit in their page");
+
+/**
+ * Gets the current time
+ * @return CLOCK_MONOTONIC in nanoseconds
+ */
+inline uint64_t nowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Adds to a counter only the calling process writes, without a locked instruction
+ * @param  counter The counter to add to
+ * @param  n The amount to add
+ */
+inline void statAdd(std::atomic<uint64_t>& counter, uint64_t n)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+/**
+ * Refreshes a side's transfer rate once STATS_RATE_INTERVAL_NS has passed
+ * @param  side The counters to update
+ * @param  now The current time
+ * @param  lastNs When the rate was last refreshed, updated here
+ * @param  lastBytes The byte count at lastNs, updated here
+ */
+inline void statUpdateRate(sideStats& side, uint64_t now, uint64_t& lastNs, uint64_t& lastBytes)
+{
+	if (now - lastNs < STATS_RATE_INTERVAL_NS)
+	{
+		return;
+	}
+
+	uint64_t bytes = side.bytes.load(std::memory_order_relaxed);
+
+	side.rate.store((bytes - lastBytes) * 1000000000ULL / (now - lastNs), std::memory_order_relaxed);
+	lastNs = now;
+	lastBytes = bytes;
+}
@@ -0,0 +1,221 @@
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <atomic>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "trace.h"
+
+using namespace std;
+
+/**
+ * One recorded span
+ */
+struct traceEvent
+{
+	/* The name of the phase */
+	const char* name;
+
+	/* The chunk the phase worked on */
+	uint64_t chunk;
+
+	/* When the span started and ended, in CLOCK_MONOTONIC nanoseconds */
+	uint64_t start;
+	uint64_t end;
+
+	/* The thread that recorded the span */
+	int tid;
+
+	/* Set once the rest of the event has been written */
+	atomic<bool> ready;
+};
+
+/* Whether spans are being recorded */
+bool traceEnabled = false;
+
+/* The file to merge the spans into */
+static const char* traceFileName;
+
+/* The name to show for this process */
+static const char* traceProcessName;
+
+/* The span buffer and its capacity */
+static traceEvent* traceEvents;
+static size_t traceCapacity;
+
+/* The next free entry in the buffer. Threads claim entries with a fetch-add,
+ * so recording never takes a lock.
+ */
+static atomic<size_t> traceNext(0);
+
+/**
+ * Turns on span recording if TRANSFER_TRACE is set. The spans are written out
+ * when the process exits.
+ * @param  processName The name to show for this process in the trace
+ * @param  truncate Whether to start a new trace file rather than add to it
+ */
+void traceInit(const char* processName, bool truncate)
+{
+	/* The number of spans to make room for */
+	const char* capacity = getenv(TRACE_EVENTS_ENV);
+
+	traceFileName = getenv(TRACE_ENV);
+
+	/* Tracing is off */
+	if (!traceFileName || !*traceFileName)
+	{
+		return;
+	}
+
+	traceProcessName = processName;
+	traceCapacity = capacity ? strtoul(capacity, NULL, 10) : DEFAULT_TRACE_EVENTS;
+	traceEvents = static_cast<traceEvent*>(calloc(traceCapacity, sizeof(traceEvent)));
+
+	if (!traceEvents)
+	{
+		perror("calloc");
+		exit(-1);
+	}
+
+	/* Throw away spans from an earlier run */
+	if (truncate)
+	{
+		int fd = open(traceFileName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+		if (fd < 0)
+		{
+			perror("open");
+			exit(-1);
+		}
+
+		close(fd);
+	}
+
+	/* Write the spans out however we exit */
+	if (atexit(traceFlush) != 0)
+	{
+		fprintf(stderr, "Failed to register the trace flush.\n");
+		exit(-1);
+	}
+
+	traceEnabled = true;
+}
+
+/**
+ * Adds a span to this process's buffer
+ * @param  name The name of the phase
+ * @param  chunk The chunk the phase worked on
+ * @param  start When the span started
+ * @param  end When the span ended
+ */
+void traceAppend(const char* name, uint64_t chunk, uint64_t start, uint64_t end)
+{
+	/* Claim an entry */
+	size_t index = traceNext.fetch_add(1, memory_order_relaxed);
+
+	/* The buffer is full, so the span is dropped (and counted by traceNext) */
+	if (index >= traceCapacity)
+	{
+		return;
+	}
+
+	traceEvent& event = traceEvents[index];
+
+	event.name = name;
+	event.chunk = chunk;
+	event.start = start;
+	event.end = end;
+	event.tid = syscall(SYS_gettid);
+	event.ready.store(true, memory_order_release);
+}
+
+/**
+ * Merges this process's spans into the trace file
+ */
+void traceFlush()
+{
+	/* The file's attributes */
+	struct stat fileInfo;
+
+	/* The number of spans recorded and how many of them fit in the buffer */
+	size_t numEvents = traceNext.load(memory_order_acquire);
+	size_t numKept = numEvents < traceCapacity ? numEvents : traceCapacity;
+
+	/* Nothing more to record */
+	if (!traceEnabled)
+	{
+		return;
+	}
+
+	traceEnabled = false;
+
+	/* Open the file for both processes to add to */
+	int fd = open(traceFileName, O_RDWR | O_CREAT, 0666);
+
+	if (fd < 0)
+	{
+		perror("open");
+		return;
+	}
+
+	/* Only one process may merge at a time */
+	if (flock(fd, LOCK_EX) < 0 || fstat(fd, &fileInfo) < 0)
+	{
+		perror("flock");
+		close(fd);
+		return;
+	}
+
+	FILE* fp = fdopen(fd, "r+");
+
+	/* The file holds "[\n...\n]\n" once someone has written to it, so cut the closing
+	 * bracket off and carry on the array. Otherwise start it.
+	 */
+	if (fileInfo.st_size >= 3)
+	{
+		if (ftruncate(fd, fileInfo.st_size - 3) < 0)
+		{
+			perror("ftruncate");
+		}
+
+		fseek(fp, 0, SEEK_END);
+		fprintf(fp, ",\n");
+	}
+	else
+	{
+		fprintf(fp, "[\n");
+	}
+
+	/* Name the process */
+	fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}",
+		getpid(), traceProcessName);
+
+	/* One complete event per span, with times in microseconds */
+	for (size_t i = 0; i < numKept; ++i)
+	{
+		traceEvent& event = traceEvents[i];
+
+		if (!event.ready.load(memory_order_acquire))
+		{
+			continue;
+		}
+
+		fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+			"\"args\":{\"chunk\":%lu}}", event.name, getpid(), event.tid,
+			event.start / 1000.0, (event.end - event.start) / 1000.0, event.chunk);
+	}
+
+	fprintf(fp, "\n]\n");
+
+	/* Closing the file also releases the lock */
+	fclose(fp);
+
+	if (numEvents > numKept)
+	{
+		fprintf(stderr, "%s: dropped %lu trace spans; raise %s\n", traceProcessName,
+			numEvents - numKept, TRACE_EVENTS_ENV);
+	}
+}
@@ -0,0 +1,108 @@
+/* Optional tracing of transfer phases as Chrome trace spans and USDT probes.
+ *
+ * Spans are recorded when the TRANSFER_TRACE environment variable names a
+ * file. Each process keeps its spans in its own lock-free buffer and merges
+ * them into that file, in Chrome's JSON trace format, when it exits.
+ *
+ * Every phase is also a pair of USDT probes, <phase>_begin and <phase>_end in
+ * the "transfer" provider, taking the chunk number as their argument. They
+ * are compiled in when <sys/sdt.h> is available and cost a nop otherwise.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_HAVE_USDT 1
+#endif
+#endif
+
+#ifdef TRACE_HAVE_USDT
+#define TRACE_PROBE(probe, chunk) DTRACE_PROBE1(transfer, probe, chunk)
+#else
+#define TRACE_PROBE(probe, chunk) do { } while (0)
+#endif
+
+/* The environment variable naming the trace file */
+#define TRACE_ENV "TRANSFER_TRACE"
+
+/* The environment variable overriding how many spans each process can hold */
+#define TRACE_EVENTS_ENV "TRANSFER_TRACE_EVENTS"
+
+/* The default number of spans each process can hold */
+#define DEFAULT_TRACE_EVENTS (1 << 20)
+
+/**
+ * Starts a span
+ * @param  phase The name of the phase, without quotes
+ * @param  chunk The chunk the phase works on
+ * @param  start Set to the start time of the span
+ */
+#define TRACE_BEGIN(phase, chunk, start) \
+	do { TRACE_PROBE(phase##_begin, chunk); (start) = traceNow(); } while (0)
+
+/**
+ * Ends a span started by TRACE_BEGIN
+ * @param  phase The name of the phase, without quotes
+ * @param  chunk The chunk the phase works on
+ * @param  start The start time set by TRACE_BEGIN
+ */
+#define TRACE_END(phase, chunk, start) \
+	do { TRACE_PROBE(phase##_end, chunk); traceRecord(#phase, chunk, start); } while (0)
+
+/* Whether spans are being recorded */
+extern bool traceEnabled;
+
+/**
+ * Turns on span recording if TRANSFER_TRACE is set. The spans are written out
+ * when the process exits.
+ * @param  processName The name to show for this process in the trace
+ * @param  truncate Whether to start a new trace file rather than add to it
+ */
+void traceInit(const char* processName, bool truncate);
+
+/**
+ * Adds a span to this process's buffer
+ * @param  name The name of the phase
+ * @param  chunk The chunk the phase worked on
+ * @param  start When the span started
+ * @param  end When the span ended
+ */
+void traceAppend(const char* name, uint64_t chunk, uint64_t start, uint64_t end);
+
+/**
+ * Merges this process's spans into the trace file
+ */
+void traceFlush();
+
+/**
+ * Gets the time for a span, if spans are being recorded
+ * @return CLOCK_MONOTONIC in nanoseconds, or 0 when tracing is off
+ */
+inline uint64_t traceNow()
+{
+	if (__builtin_expect(!traceEnabled, 1))
+	{
+		return 0;
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Records a span that started at start and ends now, if spans are being recorded
+ * @param  name The name of the phase
+ * @param  chunk The chunk the phase worked on
+ * @param  start When the span started
+ */
+inline void traceRecord(const char* name, uint64_t chunk, uint64_t start)
+{
+	if (__builtin_expect(traceEnabled, 0))
+	{
+		traceAppend(name, chunk, start, traceNow());
+	}
+}
@@ -0,0 +1,2491 @@
+#include <sys/mman.h>
+#include <sys/msg.h>
+#include <sys/shm.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include "msg.h"    /* For the message struct */
+#include "checksum.h"    /* For checksumming chunks */
+#include "copy.h"    /* For copying mapped files into the slots */
+#include "stats.h"    /* For the live statistics page */
+#include "trace.h"    /* For tracing transfer phases */
+#include "session.h"    /* For waiting for the receiver and clearing stale sessions */
+#include "transfer.h"
+#include "progress.h"    /* For publishing how much of a file has arrived */
+#include "util.h"    /* For formatting errors and reading sources */
+
+using namespace std;
+
+/* The default size of the receiver's chunk slots */
+#define SHARED_MEMORY_CHUNK_SIZE 1000
+
+/* The smallest chunk size a tuning sender tries and the one it starts with */
+#define TUNE_MIN_CHUNK_SIZE 4096
+#define TUNE_START_CHUNK_SIZE (64 * 1024)
+
+/* A tuning measurement lasts at least this long and this many chunks */
+#define TUNE_WINDOW_NS 5000000
+#define TUNE_WINDOW_CHUNKS 8
+
+/* How much faster a size must be to count as better, and how much slower
+ * the settled size must get to start a new search
+ */
+#define TUNE_MIN_GAIN 0.05
+#define TUNE_MAX_DROP 0.25
+
+FileSource::FileSource() : fp(NULL)
+{
+}
+
+FileSource::~FileSource()
+{
+	if (fp)
+	{
+		fclose(fp);
+	}
+}
+
+int FileSource::open(const char* fileName)
+{
+	if (fp)
+	{
+		fclose(fp);
+	}
+
+	fp = fopen(fileName, "r");
+
+	return fp ? 0 : -1;
+}
+
+ssize_t FileSource::read(char* buffer, size_t size)
+{
+	/* Read at most size bytes. Only a short count with the error flag set is a failure. */
+	size_t numBytes = fread(buffer, sizeof(char), size, fp);
+
+	if (numBytes < size && ferror(fp))
+	{
+		errno = EIO;
+		return -1;
+	}
+
+	return numBytes;
+}
+
+int64_t FileSource::size()
+{
+	/* The file's attributes */
+	struct stat fileInfo;
+
+	return fstat(fileno(fp), &fileInfo) == 0 ? fileInfo.st_size : -1;
+}
+
+MappedFileSource::MappedFileSource() : map(NULL), length(0), pos(0), advisedTo(0)
+{
+}
+
+MappedFileSource::~MappedFileSource()
+{
+	unmap();
+}
+
+/**
+ * Drops the mapping, if there is one
+ */
+void MappedFileSource::unmap()
+{
+	if (map)
+	{
+		munmap(map, length);
+	}
+
+	map = NULL;
+	length = pos = advisedTo = 0;
+}
+
+/**
+ * Maps a file for reading from its start
+ * @param  fileName The name of the file
+ * @return 0, or -1 with errno set
+ */
+int MappedFileSource::open(const char* fileName)
+{
+	/* The file, which the mapping keeps open, and its attributes */
+	int fd = ::open(fileName, O_RDONLY);
+	struct stat fileInfo;
+
+	/* The mapping */
+	void* newMap = NULL;
+
+	unmap();
+
+	if (fd < 0)
+	{
+		return -1;
+	}
+
+	if (fstat(fd, &fileInfo) < 0 ||
+		(fileInfo.st_size > 0 && (newMap = mmap(NULL, fileInfo.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED))
+	{
+		int error = errno;
+		::close(fd);
+		errno = error;
+		return -1;
+	}
+
+	::close(fd);
+
+	map = static_cast<char*>(newMap);
+	length = fileInfo.st_size;
+
+	/* We read it once from start to end, so pages can go as soon as we pass them */
+	if (map)
+	{
+		madvise(map, length, MADV_SEQUENTIAL);
+	}
+
+	return 0;
+}
+
+/**
+ * Copies the next bytes out of the mapping with streaming stores, asking
+ * the kernel to read ahead as we go
+ * @param  buffer Where to put them
+ * @param  size The most bytes to copy
+ * @return The number of bytes copied, 0 at the end of the file
+ */
+ssize_t MappedFileSource::read(char* buffer, size_t size)
+{
+	/* The number of bytes left to read */
+	size_t numBytes = min(size, length - pos);
+
+	/* Keep the kernel reading well ahead of us, half a readahead at a time */
+	if (numBytes > 0 && pos + MAPPED_READAHEAD_SIZE / 2 >= advisedTo && advisedTo < length)
+	{
+		madvise(map + advisedTo, min((size_t)MAPPED_READAHEAD_SIZE, length - advisedTo), MADV_WILLNEED);
+		advisedTo = min(advisedTo + MAPPED_READAHEAD_SIZE, length);
+	}
+
+	streamCopy(buffer, map + pos, numBytes);
+	pos += numBytes;
+
+	return numBytes;
+}
+
+/**
+ * Gets the size of the mapped file
+ * @return The number of bytes it had when it was opened
+ */
+int64_t MappedFileSource::size()
+{
+	return length;
+}
+
+MemorySource::MemorySource(const void* data, size_t size) :
+	data(static_cast<const char*>(data)), remaining(size), total(size)
+{
+}
+
+ssize_t MemorySource::read(char* buffer, size_t size)
+{
+	size_t numBytes = size < remaining ? size : remaining;
+
+	memcpy(buffer, data, numBytes);
+	data += numBytes;
+	remaining -= numBytes;
+
+	return numBytes;
+}
+
+int64_t MemorySource::size()
+{
+	return total;
+}
+
+CallbackSource::CallbackSource(function<ssize_t(char*, size_t)> callback) : callback(callback)
+{
+}
+
+ssize_t CallbackSource::read(char* buffer, size_t size)
+{
+	return callback(buffer, size);
+}
+
+FileSink::FileSink() : durability(DURABILITY_NONE), writeBehindSize(DEFAULT_WRITE_BEHIND_SIZE),
+	publishProgress(false), progressStep(DEFAULT_PROGRESS_STEP), fp(NULL), progress(NULL),
+	numBytes(0), writingFrom(0), waitingFrom(0), publishedBytes(0), durableBytes(0)
+{
+}
+
+FileSink::~FileSink()
+{
+	if (fp)
+	{
+		fclose(fp);
+	}
+
+	/* A file that was never finished failed, which the page tells its readers */
+	delete progress;
+}
+
+int FileSink::open(const char* fileName)
+{
+	if (fp)
+	{
+		fclose(fp);
+	}
+
+	delete progress;
+	progress = NULL;
+
+	numBytes = 0;
+	writingFrom = 0;
+	waitingFrom = 0;
+	publishedBytes = 0;
+	durableBytes = 0;
+
+	/* The page goes first, so a reader that finds the file without one knows it is complete */
+	if (publishProgress)
+	{
+		progress = new ProgressWriter;
+
+		if (progress->open(fileName) < 0)
+		{
+			delete progress;
+			progress = NULL;
+			return -1;
+		}
+	}
+
+	fp = fopen(fileName, "w");
+
+	return fp ? 0 : -1;
+}
+
+int FileSink::flush()
+{
+	return progress ? publish() : fflush(fp);
+}
+
+/**
+ * Gets every byte written so far out to the file and tells readers about them
+ * @return 0, or -1 with errno set
+ */
+int FileSink::publish()
+{
+	if (fflush(fp) != 0)
+	{
+		return -1;
+	}
+
+	progress->publish(numBytes, durableBytes);
+	publishedBytes = numBytes;
+
+	return 0;
+}
+
+int FileSink::write(const char* data, size_t size)
+{
+	/* The file's descriptor */
+	int fd;
+
+	if (fwrite(data, sizeof(char), size, fp) != size)
+	{
+		return -1;
+	}
+	numBytes += size;
+
+	if (progress && numBytes - publishedBytes >= (int64_t)progressStep && publish() < 0)
+	{
+		return -1;
+	}
+
+	if (durability != DURABILITY_WRITE_BEHIND || numBytes - writingFrom < (int64_t)writeBehindSize)
+	{
+		return 0;
+	}
+
+	/* Start writing back what piled up, then wait for the range before it, which has had
+	 * a whole range's time to get there, and drop it from the cache. That keeps at most
+	 * two ranges dirty and the disk busy all along instead of in bursts.
+	 */
+	fd = fileno(fp);
+
+	if (fflush(fp) != 0 || sync_file_range(fd, writingFrom, numBytes - writingFrom, SYNC_FILE_RANGE_WRITE) < 0)
+	{
+		return -1;
+	}
+
+	if (writingFrom > waitingFrom)
+	{
+		if (sync_file_range(fd, waitingFrom, writingFrom - waitingFrom,
+			SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) < 0)
+		{
+			return -1;
+		}
+
+		posix_fadvise(fd, waitingFrom, writingFrom - waitingFrom, POSIX_FADV_DONTNEED);
+	}
+
+	/* Everything before the range just started is on disk, which the next publication says */
+	durableBytes = writingFrom;
+	waitingFrom = writingFrom;
+	writingFrom = numBytes;
+
+	return 0;
+}
+
+int FileSink::finish()
+{
+	/* The result of closing, which flushes and is where a full disk shows up */
+	int result = 0;
+
+	/* Get every byte and the file's size onto the disk */
+	if (durability != DURABILITY_NONE)
+	{
+		if (fflush(fp) != 0 || fsync(fileno(fp)) < 0)
+		{
+			result = -1;
+		}
+		else
+		{
+			durableBytes = numBytes;
+		}
+	}
+
+	/* Nothing of the file needs to stay in the cache now */
+	if (result == 0 && durability == DURABILITY_WRITE_BEHIND)
+	{
+		posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_DONTNEED);
+	}
+
+	if (fclose(fp) != 0)
+	{
+		result = -1;
+	}
+	fp = NULL;
+
+	/* Readers may have the rest now, or learn that they never will */
+	if (progress)
+	{
+		int error = errno;
+
+		progress->finish(numBytes, durableBytes, result == 0);
+		delete progress;
+		progress = NULL;
+
+		errno = error;
+	}
+
+	return result;
+}
+
+int MemorySink::write(const char* bytes, size_t size)
+{
+	data.insert(data.end(), bytes, bytes + size);
+	return 0;
+}
+
+CallbackSink::CallbackSink(function<int(const char*, size_t)> callback) : callback(callback)
+{
+}
+
+int CallbackSink::write(const char* data, size_t size)
+{
+	return callback(data, size);
+}
+
+Sender::Sender() : maxSlots(0), maxChunkSize(0), supportedFeatures(FEATURE_CHECKSUM | FEATURE_DURABLE | FEATURE_LIVE), requestedFeatures(0),
+	priority(PRIORITY_NORMAL), maxInline(MAX_MSG_PAYLOAD), readyTimeoutMs(DEFAULT_READY_TIMEOUT_MS), mapInput(false), autoTune(false), shmid(-1), msqid(-1), sharedMemPtr(NULL), stats(NULL),
+	segSize(0), lockFd(-1), slotSize(0), slotBase(0), ackType(RECV_DONE_TYPE), knowsReceiver(false), numMsgSyscalls(0), numSetupSyscalls(0),
+	numChunksSent(0)
+{
+	memset(&agreed, 0, sizeof(agreed));
+	memset(&tuner, 0, sizeof(tuner));
+}
+
+Sender::~Sender()
+{
+	close();
+}
+
+/**
+ * Records a failure
+ * @param  format The printf() format of the description
+ * @return -1
+ */
+int Sender::fail(const char* format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	formatError(error, format, args);
+	va_end(args);
+
+	return -1;
+}
+
+/**
+ * Attaches to the shared memory segment and message queue, waiting for a receiver to set them up
+ * @param  keyFile The file the receiver generated its key from
+ * @return 0, or -1 on failure
+ */
+int Sender::open(const char* keyFile)
+{
+	/* Generate the key for the shared memory segment and message queue, creating the key file if we are first */
+	key_t key = sessionKey(keyFile);
+
+	/* The shared memory segment's attributes */
+	struct shmid_ds shmInfo;
+
+	/* Failed to generate the key */
+	if (key < 0)
+	{
+		return fail("%s: %s", keyFile, strerror(errno));
+	}
+
+	/* Attach once a live receiver has set up the segment. The receiver decides how big it is. */
+	if ((sharedMemPtr = attachWhenReady(key, readyTimeoutMs, shmid)) == NULL)
+	{
+		shmid = -1;
+
+		if (errno == ETIMEDOUT)
+		{
+			return fail("No receiver got ready within %d ms.", readyTimeoutMs);
+		}
+
+		return fail("shmget: %s", strerror(errno));
+	}
+
+	/* The statistics page comes first */
+	stats = static_cast<transferStats*>(sharedMemPtr);
+
+	if (shmctl(shmid, IPC_STAT, &shmInfo) < 0)
+	{
+		close();
+		return fail("shmctl: %s", strerror(errno));
+	}
+	segSize = shmInfo.shm_segsz;
+
+	/* Attach to the message queue, which the receiver created before marking its page ready */
+	if ((msqid = msgget(key, 0666)) < 0)
+	{
+		close();
+		return fail("msgget: %s", strerror(errno));
+	}
+
+	/* Keep the key file open to lock it around each hello */
+	if ((lockFd = ::open(keyFile, O_RDONLY | O_CLOEXEC)) < 0)
+	{
+		close();
+		return fail("%s: %s", keyFile, strerror(errno));
+	}
+
+	return 0;
+}
+
+/**
+ * Detaches from the shared memory
+ */
+void Sender::close()
+{
+	if (sharedMemPtr)
+	{
+		shmdt(sharedMemPtr);
+		sharedMemPtr = NULL;
+		stats = NULL;
+	}
+
+	if (lockFd >= 0)
+	{
+		::close(lockFd);
+		lockFd = -1;
+	}
+
+	shmid = -1;
+	msqid = -1;
+
+	/* The next receiver may not be the one we said hello to */
+	knowsReceiver = false;
+}
+
+/**
+ * Gets a chunk slot in shared memory
+ * @param  slot The index of the slot
+ * @return The pointer to the start of the slot
+ */
+char* Sender::getSlot(int slot) const
+{
+	return static_cast<char*>(sharedMemPtr) + STATS_PAGE_SIZE + slot * slotSize;
+}
+
+/**
+ * Waits for the receiver to hand back credits
+ * @param  credits Set to the number of credits returned
+ * @param  stalled Set if no acknowledgment was waiting, so we had to block;
+ *                 left alone otherwise
+ * @return 0, or -1 on failure
+ */
+int Sender::recvCredits(int& credits, bool& stalled)
+{
+	/* A buffer to store message received from the receiver. */
+	ackMessage rcvMsg;
+
+	/* When we started waiting */
+	uint64_t start = nowNs();
+
+	/* Take an acknowledgment that is already waiting without blocking, since
+	 * only an empty queue means the receiver kept us waiting
+	 */
+	if (msgrcv(msqid, &rcvMsg, sizeof(rcvMsg) - sizeof(long), ackType, IPC_NOWAIT) < 0)
+	{
+		if (errno != ENOMSG)
+		{
+			return fail("msgrcv: %s", strerror(errno));
+		}
+		++numMsgSyscalls;
+		stalled = true;
+
+		/* Get acknowledgment that one or more chunks have been received */
+		if (msgrcv(msqid, &rcvMsg, sizeof(rcvMsg) - sizeof(long), ackType, 0) < 0)
+		{
+			return fail("msgrcv: %s", strerror(errno));
+		}
+	}
+	++numMsgSyscalls;
+
+	start = nowNs() - start;
+	statAdd(stats->sender.blockedNs, start);
+	tuner.windowBlockedNs += start;
+
+	credits = rcvMsg.credits;
+	return 0;
+}
+
+/**
+ * Waits for the receiver to say it stored the file, if it agreed to
+ * @return 0, or -1 on failure
+ */
+int Sender::recvDone()
+{
+	/* The receiver's answer, which may come after credits we did not use */
+	doneMsg rcvMsg;
+
+	/* When we started waiting */
+	uint64_t start = nowNs();
+
+	if (!(agreed.features & FEATURE_DURABLE))
+	{
+		return 0;
+	}
+
+	do
+	{
+		if (msgrcv(msqid, &rcvMsg, sizeof(doneMsg) - sizeof(long), ackType, 0) < 0)
+		{
+			return fail("msgrcv: %s", strerror(errno));
+		}
+		++numMsgSyscalls;
+	}
+	while (rcvMsg.credits >= 0);
+
+	++numSetupSyscalls;
+
+	statAdd(stats->sender.blockedNs, nowNs() - start);
+
+	if (rcvMsg.error != 0)
+	{
+		return fail("The receiver could not store the file: %s", strerror(rcvMsg.error));
+	}
+
+	return 0;
+}
+
+/**
+ * Tells the receiver what we can do and gets back the configuration to use
+ * @return 0, or -1 on failure
+ */
+int Sender::sendHello()
+{
+	/* Our capabilities */
+	helloMsg hello;
+	hello.mtype = HELLO_TYPE;
+	hello.version = PROTOCOL_VERSION;
+	hello.maxSlots = maxSlots;
+	hello.maxChunkSize = maxChunkSize;
+	hello.features = supportedFeatures;
+	hello.requested = requestedFeatures;
+	hello.maxInline = maxInline < MAX_MSG_PAYLOAD ? maxInline : MAX_MSG_PAYLOAD;
+
+	/* The receiver's answer */
+	helloAckMsg ack;
+
+	if (msgsnd(msqid, &hello, sizeof(helloMsg) - sizeof(long), 0) < 0)
+	{
+		return fail("msgsnd: %s", strerror(errno));
+	}
+	++numMsgSyscalls;
+
+	if (msgrcv(msqid, &ack, sizeof(helloAckMsg) - sizeof(long), HELLO_ACK_TYPE, 0) < 0)
+	{
+		return fail("msgrcv: %s", strerror(errno));
+	}
+	++numMsgSyscalls;
+	numSetupSyscalls += 2;
+
+	agreed.version = ack.version;
+	agreed.numSlots = ack.numSlots;
+	agreed.chunkSize = ack.chunkSize;
+	agreed.features = ack.features;
+	agreed.inlineSize = ack.version >= 5 ? ack.inlineSize : 0;
+	slotSize = ack.slotSize;
+
+	/* Older receivers have one lane and one acknowledgment type */
+	slotBase = ack.version >= 4 ? ack.slotBase : 0;
+	ackType = ack.version >= 4 ? ack.ackType : RECV_DONE_TYPE;
+
+	/* A configuration that does not fit the segment would scribble past its end */
+	if (agreed.numSlots < 1 || agreed.chunkSize == 0 || agreed.chunkSize > slotSize || slotBase < 0 ||
+		STATS_PAGE_SIZE + (slotBase + agreed.numSlots) * slotSize > segSize)
+	{
+		return fail("The receiver picked %d slots of %llu bytes from slot %d, which do not fit its %llu byte segment.",
+			agreed.numSlots, (unsigned long long)slotSize, slotBase, (unsigned long long)segSize);
+	}
+
+	if (agreed.inlineSize > MAX_MSG_PAYLOAD)
+	{
+		return fail("The receiver picked an inline size of %zu bytes, but messages carry at most %d.",
+			agreed.inlineSize, MAX_MSG_PAYLOAD);
+	}
+
+	/* Later small sources can skip the hello, unless the receiver has to answer for them */
+	knowsReceiver = agreed.inlineSize > 0 && !(agreed.features & FEATURE_DURABLE);
+
+	return 0;
+}
+
+/**
+ * Used to send the name of the file to the receiver
+ * @param  fileName The name of the file to send
+ * @param  data The bytes to carry inside the message
+ * @param  size The number of bytes in data
+ * @param  flags The NAME_FLAG_* bits
+ * @return 0, or -1 on failure
+ */
+int Sender::sendFileName(const char* fileName, const char* data, ssize_t size, int flags)
+{
+	/* Get the length of the file name */
+	int fileNameSize = strlen(fileName);
+
+	/* Create a message object for sending the filename */
+	fileNameMsg msg;
+	msg.mtype = FILE_NAME_TRANSFER_TYPE;
+	msg.version = agreed.version;
+	msg.priority = priority;
+	strncpy(msg.fileName, fileName, fileNameSize + 1);
+	msg.flags = flags;
+	msg.size = size;
+	memcpy(msg.data, data, size);
+
+	/* Older receivers expect shorter messages, newer ones only as many bytes as we carry */
+	size_t msgSize = agreed.version >= 5 ? offsetof(fileNameMsg, data) - sizeof(long) + size :
+		agreed.version >= 4 ? FILE_NAME_MSG_V4_SIZE : FILE_NAME_MSG_V3_SIZE;
+
+	/* When sending the name started */
+	uint64_t traceStart;
+
+	/* Send the message using msgsnd */
+	TRACE_BEGIN(send_file_name, 0, traceStart);
+
+	if (msgsnd(msqid, &msg, msgSize, 0) < 0)
+	{
+		return fail("msgsnd: %s", strerror(errno));
+	}
+	++numMsgSyscalls;
+
+	TRACE_END(send_file_name, 0, traceStart);
+
+	return 0;
+}
+
+/**
+ * Says hello and sends the file name while holding the key file's lock, so
+ * no other sender can take our acknowledgment. A source small enough to go
+ * inside the name goes along with it, without a hello if the receiver
+ * already agreed to carry that much.
+ * @param  fileName The name of the file to send
+ * @param  data The first bytes of the source
+ * @param  size The number of bytes in data if the source ends there, or -1
+ * @return 1 if the name carried the whole source, 0 if not, or -1 on failure
+ */
+int Sender::handshake(const char* fileName, const char* data, ssize_t size)
+{
+	/* The result of the exchange */
+	int result;
+
+	/* Whether we need to say hello first. Only a lane of our own gets an answer. */
+	bool hello = !(knowsReceiver && size >= 0 && (size_t)size <= agreed.inlineSize &&
+		!(requestedFeatures & FEATURE_DURABLE));
+
+	while (flock(lockFd, LOCK_EX) < 0)
+	{
+		if (errno != EINTR)
+		{
+			return fail("flock: %s", strerror(errno));
+		}
+	}
+
+	if (hello && sendHello() < 0)
+	{
+		result = -1;
+	}
+	/* Carry the whole source if it fits in what the receiver agreed to */
+	else if (size >= 0 && (size_t)size <= agreed.inlineSize)
+	{
+		result = sendFileName(fileName, data, size, NAME_FLAG_INLINE | (hello ? 0 : NAME_FLAG_NO_HELLO)) < 0 ? -1 : 1;
+	}
+	else
+	{
+		result = sendFileName(fileName, data, 0, 0) < 0 ? -1 : 0;
+	}
+
+	flock(lockFd, LOCK_UN);
+
+	return result;
+}
+
+/**
+ * Starts a chunk size search within the slots the receiver agreed to
+ * @param  now The time the first window starts
+ */
+void Sender::startTuning(uint64_t now)
+{
+	tuner.maxSize = agreed.chunkSize;
+	tuner.minSize = min((size_t)TUNE_MIN_CHUNK_SIZE, tuner.maxSize);
+	tuner.size = min((size_t)TUNE_START_CHUNK_SIZE, tuner.maxSize);
+	tuner.direction = 1;
+	tuner.numTurns = 0;
+	tuner.settled = false;
+	tuner.bestRate = 0;
+	tuner.bestSize = tuner.size;
+	tuner.windowStartNs = now;
+	tuner.windowBytes = tuner.windowChunks = tuner.windowBlockedNs = 0;
+	tuneSteps.clear();
+}
+
+/**
+ * Counts a sent chunk towards the current measurement and, once the window
+ * is over, moves the search along: keep stepping while the rate improves,
+ * turn around once when it does not, then settle on the best size until
+ * its rate drops by TUNE_MAX_DROP
+ * @param  now The time the chunk went out
+ * @param  numBytes The size of the chunk
+ * @param  offset The number of bytes sent so far
+ * @return Whether the chunk size changed
+ */
+bool Sender::tuneChunkSize(uint64_t now, size_t numBytes, uint64_t offset)
+{
+	/* The measurement */
+	chunkTuneStep step;
+
+	/* How long the window lasted */
+	uint64_t elapsed = now - tuner.windowStartNs;
+
+	/* Whether the size beat the best one */
+	bool improved;
+
+	tuner.windowBytes += numBytes;
+
+	if (++tuner.windowChunks < TUNE_WINDOW_CHUNKS || elapsed < TUNE_WINDOW_NS)
+	{
+		return false;
+	}
+
+	step.offset = offset;
+	step.chunkSize = tuner.size;
+	step.rate = tuner.windowBytes * 1e9 / elapsed;
+	step.blockedShare = min(1.0, (double)tuner.windowBlockedNs / elapsed);
+
+	/* Something changed under the settled size, so search again from it */
+	if (tuner.settled && step.rate < tuner.bestRate * (1 - TUNE_MAX_DROP))
+	{
+		tuner.settled = false;
+		tuner.numTurns = 0;
+		tuner.direction = 1;
+		tuner.bestRate = 0;
+	}
+
+	if (!tuner.settled)
+	{
+		improved = tuner.bestRate == 0 || step.rate > tuner.bestRate * (1 + TUNE_MIN_GAIN);
+
+		if (improved)
+		{
+			tuner.bestRate = step.rate;
+			tuner.bestSize = tuner.size;
+		}
+		else if (tuner.numTurns++ == 0)
+		{
+			tuner.direction = -tuner.direction;
+		}
+		else
+		{
+			tuner.settled = true;
+		}
+
+		/* Step away from the best size, turning around at the bounds */
+		if (!tuner.settled && (tuner.size = tuner.next(tuner.bestSize)) == tuner.bestSize)
+		{
+			if (tuner.numTurns++ == 0)
+			{
+				tuner.direction = -tuner.direction;
+				tuner.size = tuner.next(tuner.bestSize);
+			}
+
+			tuner.settled = tuner.size == tuner.bestSize;
+		}
+
+		if (tuner.settled)
+		{
+			tuner.size = tuner.bestSize;
+		}
+	}
+
+	step.nextSize = tuner.size;
+	tuneSteps.push_back(step);
+
+	/* Start the next window */
+	tuner.windowStartNs = now;
+	tuner.windowBytes = tuner.windowChunks = tuner.windowBlockedNs = 0;
+
+	return step.nextSize != step.chunkSize;
+}
+
+/**
+ * Runs one transfer
+ * @param  name The name to give the receiver
+ * @param  source Where the bytes come from
+ * @return The number of bytes sent, or -1 on failure
+ */
+int64_t Sender::send(const char* name, TransferSource& source)
+{
+	/* A buffer to store message we will send to the receiver. */
+	message sndMsg;
+	sndMsg.mtype = SENDER_DATA_TYPE;
+
+	/* The last notice when it carries its bytes inside itself */
+	inlineMessage tailMsg;
+
+	/* The bytes read before the handshake, how many there are and how many
+	 * of them have gone into slots
+	 */
+	char ahead[MAX_MSG_PAYLOAD + 1];
+	ssize_t numAhead = 0;
+	size_t aheadPos = 0;
+
+	/* The most bytes we may carry inline: whatever the receiver agreed to if
+	 * we already said hello to it, otherwise whatever we will ask for
+	 */
+	size_t inlineLimit = knowsReceiver ? agreed.inlineSize : (maxInline < MAX_MSG_PAYLOAD ? maxInline : MAX_MSG_PAYLOAD);
+
+	/* Whether the source has ended, and whether the last notice ended the transfer */
+	bool atEnd = false, ended = false;
+
+	/* The result of the handshake */
+	int result;
+
+	/* The slot being filled and the number of bytes the source gave for it */
+	char* slotPtr;
+	ssize_t numRead;
+
+	/* The number of bytes sent */
+	int64_t numBytesSent = 0;
+
+	/* The number of slots we may still fill before hearing back from the receiver */
+	int credits;
+
+	/* The next slot to fill */
+	int slot = 0;
+
+	/* When the transfer rate was last refreshed and the byte count then */
+	uint64_t rateNs = nowNs(), rateBytes = 0;
+
+	/* Timestamps around source calls */
+	uint64_t start, end;
+
+	/* The number of the chunk being sent and when its current phase started */
+	uint64_t chunk = 0, traceStart;
+
+	/* The most bytes to put in a chunk, and whether the next chunk is the
+	 * first of a new size
+	 */
+	size_t chunkLimit;
+	bool resized = false;
+
+	/* Whether we last had to block for credits, which the next chunk reports */
+	bool stalled = false;
+
+	if (!sharedMemPtr)
+	{
+		return fail("The sender is not open.");
+	}
+
+	/* Validate the length of the file name before the receiver hears anything */
+	if (strlen(name) >= MAX_FILE_NAME_SIZE)
+	{
+		return fail("File name exceeds max size of %d.", MAX_FILE_NAME_SIZE);
+	}
+
+	numMsgSyscalls = 0;
+	numSetupSyscalls = 0;
+	numChunksSent = 0;
+	tuneSteps.clear();
+
+	/* Read one byte past the inline size to find out whether the source fits in the name.
+	 * A live source may take its time, so start the transfer without waiting for it.
+	 */
+	if (inlineLimit > 0 && !source.live())
+	{
+		start = nowNs();
+
+		if ((numAhead = readFully(source, ahead, inlineLimit + 1, atEnd)) < 0)
+		{
+			return fail("read: %s", strerror(errno));
+		}
+
+		statAdd(stats->sender.diskNs, nowNs() - start);
+	}
+
+	/* Agree on a configuration with the receiver, then name the file */
+	if ((result = handshake(name, ahead, atEnd ? numAhead : -1)) < 0)
+	{
+		return -1;
+	}
+
+	/* Tell readers of the statistics page who we are and how much is coming */
+	stats->sender.pid.store(getpid(), memory_order_relaxed);
+
+	if (source.size() >= 0)
+	{
+		stats->fileSize.store(source.size(), memory_order_relaxed);
+	}
+
+	/* The name carried every byte */
+	if (result == 1)
+	{
+		statAdd(stats->sender.bytes, numAhead);
+		statAdd(stats->sender.chunks, 1);
+		return recvDone() < 0 ? -1 : numAhead;
+	}
+
+	/* The first acknowledgment grants the initial window */
+	TRACE_BEGIN(wait_credits, chunk, traceStart);
+
+	if (recvCredits(credits, stalled) < 0)
+	{
+		return -1;
+	}
+
+	TRACE_END(wait_credits, chunk, traceStart);
+	stalled = false;
+
+	/* Fill the slots, or start looking for a better size and announce it */
+	chunkLimit = agreed.chunkSize;
+
+	if (autoTune)
+	{
+		startTuning(nowNs());
+		chunkLimit = tuner.size;
+		resized = true;
+	}
+
+	/* Start with a full bucket */
+	pacer.restart(nowNs());
+
+	/* Read the whole source */
+	while (true)
+	{
+		/* Out of credits, so wait until the receiver frees up some slots */
+		while (credits == 0)
+		{
+			TRACE_BEGIN(wait_credits, chunk, traceStart);
+
+			if (recvCredits(credits, stalled) < 0)
+			{
+				return -1;
+			}
+
+			TRACE_END(wait_credits, chunk, traceStart);
+		}
+
+		/* Fill the next slot with chunkLimit bytes, first the ones read ahead, then
+ 		 * from the source. The last chunk may be less than chunkLimit.
+ 		 */
+		slotPtr = getSlot(slotBase + slot);
+		sndMsg.size = min((size_t)numAhead - aheadPos, chunkLimit);
+		memcpy(slotPtr, ahead + aheadPos, sndMsg.size);
+		aheadPos += sndMsg.size;
+
+		start = nowNs();
+		TRACE_BEGIN(read, chunk, traceStart);
+
+		if ((numRead = readFully(source, slotPtr + sndMsg.size, chunkLimit - sndMsg.size, atEnd)) < 0)
+		{
+			return fail("read: %s", strerror(errno));
+		}
+		sndMsg.size += numRead;
+
+		TRACE_END(read, chunk, traceStart);
+		statAdd(stats->sender.diskNs, nowNs() - start);
+
+		/* The source is exhausted */
+		if (sndMsg.size == 0)
+		{
+			break;
+		}
+
+		/* Say where the bytes go and count them */
+		sndMsg.offset = numBytesSent;
+		numBytesSent += sndMsg.size;
+
+		/* Let the receiver check the bytes if it agreed to */
+		sndMsg.checksum = (agreed.features & FEATURE_CHECKSUM) ? crc32c(slotPtr, sndMsg.size) : 0;
+
+		/* Tell the receiver when it has our last credit so it can ack right away */
+		sndMsg.slot = slotBase + slot;
+		sndMsg.flags = (--credits == 0) ? MSG_FLAG_LAST_CREDIT : 0;
+
+		/* Newer receivers need no terminator after the last chunk, and take a
+		 * short one inside the notice
+		 */
+		ended = agreed.version >= 5 && atEnd && aheadPos == (size_t)numAhead;
+
+		if (ended)
+		{
+			sndMsg.flags = MSG_FLAG_END;
+		}
+
+		if (resized)
+		{
+			sndMsg.flags |= MSG_FLAG_RESIZED;
+			resized = false;
+		}
+
+		/* Tell the receiver it kept us waiting so it can widen the window */
+		if (stalled)
+		{
+			sndMsg.flags |= MSG_FLAG_STALLED;
+			stalled = false;
+		}
+
+		/* Send a message to the receiver that the data is ready */
+		TRACE_BEGIN(publish, chunk, traceStart);
+
+		if (ended && (size_t)sndMsg.size <= agreed.inlineSize)
+		{
+			tailMsg.header = sndMsg;
+			tailMsg.header.flags |= MSG_FLAG_INLINE;
+			memcpy(tailMsg.data, slotPtr, sndMsg.size);
+
+			if (msgsnd(msqid, &tailMsg, sizeof(message) - sizeof(long) + sndMsg.size, 0) < 0)
+			{
+				return fail("msgsnd: %s", strerror(errno));
+			}
+		}
+		else if (msgsnd(msqid, &sndMsg, sizeof(message) - sizeof(long), 0) < 0)
+		{
+			return fail("msgsnd: %s", strerror(errno));
+		}
+		++numMsgSyscalls;
+
+		TRACE_END(publish, chunk, traceStart);
+		++chunk;
+		++numChunksSent;
+
+		end = nowNs();
+		statAdd(stats->sender.bytes, sndMsg.size);
+		statAdd(stats->sender.chunks, 1);
+		statUpdateRate(stats->sender, end, rateNs, rateBytes);
+
+		if (ended)
+		{
+			return recvDone() < 0 ? -1 : numBytesSent;
+		}
+
+		/* Stay under the rate limit before reading the next chunk */
+		statAdd(stats->sender.pacedNs, pacer.pace(sndMsg.size, end));
+		stats->sender.rateLimit.store(pacer.rate(), memory_order_relaxed);
+
+		/* Measure, and use whatever size the search picks next */
+		if (autoTune && tuneChunkSize(end, sndMsg.size, numBytesSent))
+		{
+			chunkLimit = tuner.size;
+			resized = true;
+		}
+
+		slot = (slot + 1) % agreed.numSlots;
+	}
+
+	/* Set the size of the sending message to zero to signal that there is no more data to send */
+	sndMsg.size = 0;
+	sndMsg.offset = numBytesSent;
+	sndMsg.slot = slotBase;
+	sndMsg.flags = 0;
+	sndMsg.checksum = 0;
+
+	/* Send the message to the receiver */
+	if (msgsnd(msqid, &sndMsg, sizeof(message) - sizeof(long), 0) < 0)
+	{
+		return fail("msgsnd: %s", strerror(errno));
+	}
+	++numMsgSyscalls;
+
+	return recvDone() < 0 ? -1 : numBytesSent;
+}
+
+/**
+ * Runs one transfer of a file under its own name
+ * @param  fileName The name of the file
+ * @return The number of bytes sent, or -1 on failure
+ */
+int64_t Sender::sendFile(const char* fileName)
+{
+	/* The file to read, through stdio or a mapping */
+	FileSource file;
+	MappedFileSource mapped;
+
+	if (mapInput ? mapped.open(fileName) < 0 : file.open(fileName) < 0)
+	{
+		return fail("%s: %s", fileName, strerror(errno));
+	}
+
+	return mapInput ? send(fileName, mapped) : send(fileName, file);
+}
+
+/**
+ * Prints how many message queue syscalls the last transfer took compared
+ * to sending one acknowledgment per chunk
+ * @param  fp The file stream to print to
+ * @param  numBytes The number of bytes transferred
+ */
+void Sender::printSyscallReport(FILE* fp, unsigned long long numBytes) const
+{
+	/* One notice and one acknowledgment per chunk, plus the file name, the
+	 * terminator and the calls both protocols make. Tuned chunks can be
+	 * smaller than the slots, so count them.
+	 */
+	unsigned long long numChunks = numChunksSent ? numChunksSent : (numBytes + agreed.chunkSize - 1) / agreed.chunkSize;
+	unsigned long long numLockStep = 2 * numChunks + 2 + numSetupSyscalls;
+
+	/* Guard against dividing by zero for empty files */
+	double numMB = numBytes ? numBytes / (1024.0 * 1024.0) : 1.0;
+
+	fprintf(fp, "Message queue syscalls: %lu (%.1f per MB, %.1f per MB saved with up to %d chunks in flight)\n",
+		numMsgSyscalls, numMsgSyscalls / numMB,
+		((double)numLockStep - numMsgSyscalls) / numMB, agreed.numSlots);
+}
+
+/* The states of a receiver's lane */
+#define LANE_FREE 0
+#define LANE_HANDSHAKE 1
+#define LANE_ACTIVE 2
+
+/**
+ * The slots, flow control and scheduling state of one transfer a Receiver
+ * is running
+ */
+struct transferLane
+{
+	/* One of the LANE_* states */
+	int state;
+
+	/* The configuration agreed with the sender and the PRIORITY_* class it asked for */
+	transferConfig config;
+	int priority;
+
+	/* The name the sender gave and where the bytes go */
+	string fileName;
+	TransferSink* sink;
+
+	/* The first slot of the lane and the type of the sender's acknowledgments */
+	int slotBase;
+	long ackType;
+
+	/* The number of credits granted to the sender, the number of slots saved but not
+	 * yet handed back and the number of chunks since the sender last ran out of credits
+	 */
+	int window;
+	int numFreed;
+	int numSinceStall;
+
+	/* The number of bytes received and the number of the chunk being received */
+	int64_t numBytesRecv;
+	uint64_t chunk;
+
+	/* When the sender said hello */
+	uint64_t startNs;
+
+	/* Whether the file name message carried every byte, and the bytes that
+	 * came inside it or inside the last notice
+	 */
+	bool wholeInline;
+	string inlineBytes;
+
+	/* The notices waiting for their turn, and the bytes the lane may still
+	 * handle in the current round of the deficit round robin
+	 */
+	deque<message> pending;
+	int64_t deficit;
+};
+
+/**
+ * Any message a sender sends the receiver
+ */
+struct pendingMsg
+{
+	union
+	{
+		inlineMessage data;
+		helloMsg hello;
+		fileNameMsg name;
+	} msg;
+
+	/* The number of bytes received after the message type, and when it arrived */
+	ssize_t size;
+	uint64_t receivedNs;
+};
+
+Receiver::Receiver() : numSlots(DEFAULT_WINDOW_SIZE), chunkSize(SHARED_MEMORY_CHUNK_SIZE), maxTransfers(1),
+	supportedFeatures(FEATURE_CHECKSUM | FEATURE_LIVE), requestedFeatures(0), inlineSize(MAX_MSG_PAYLOAD),
+	shmid(-1), msqid(-1), sharedMemPtr(NULL), stats(NULL), numMsgSyscalls(0), numSetupSyscalls(0),
+	lanes(NULL), numLanes(0), handshakeLane(-1), deferred(NULL), handler(NULL),
+	drrCursor(0), drrFresh(true), rateNs(0), rateBytes(0), latencies(NUM_PRIORITY_CLASSES)
+{
+	memset(&agreed, 0, sizeof(agreed));
+}
+
+Receiver::~Receiver()
+{
+	close();
+}
+
+/**
+ * Records a failure
+ * @param  format The printf() format of the description
+ * @return -1
+ */
+int Receiver::fail(const char* format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	formatError(error, format, args);
+	va_end(args);
+
+	return -1;
+}
+
+/**
+ * Gets the size of the shared memory segment
+ * @return The size in bytes
+ */
+size_t Receiver::segmentSize() const
+{
+	return STATS_PAGE_SIZE + (size_t)maxTransfers * numSlots * chunkSize;
+}
+
+unsigned long long Receiver::chunks() const
+{
+	return stats ? stats->recv.chunks.load(memory_order_relaxed) : 0;
+}
+
+/**
+ * Gets a chunk slot in shared memory
+ * @param  slot The index of the slot
+ * @return The pointer to the start of the slot
+ */
+char* Receiver::getSlot(int slot) const
+{
+	return static_cast<char*>(sharedMemPtr) + STATS_PAGE_SIZE + slot * chunkSize;
+}
+
+/**
+ * Clears the statistics page and marks it ready for readers
+ */
+void Receiver::initStats()
+{
+	memset(static_cast<void*>(stats), 0, sizeof(transferStats));
+	stats->numSlots.store(numSlots, memory_order_relaxed);
+	stats->chunkSize.store(chunkSize, memory_order_relaxed);
+	stats->recv.pid.store(getpid(), memory_order_relaxed);
+	stats->state.store(STATE_WAITING, memory_order_relaxed);
+	stats->magic.store(STATS_MAGIC, memory_order_release);
+
+	rateNs = nowNs();
+	rateBytes = 0;
+	pacer.restart(rateNs);
+}
+
+/**
+ * Sets up the shared memory segment and message queue, removing any a dead receiver left behind
+ * @param  keyFile The file to generate the key from
+ * @return 0, or -1 on failure
+ */
+int Receiver::open(const char* keyFile)
+{
+	/* Generate a key for the shared memory segment and message queue, creating the key file if we are first */
+	key_t key = sessionKey(keyFile);
+
+	/* The creator of a segment already using the key */
+	pid_t owner;
+
+	/* Failed to generate the key */
+	if (key < 0)
+	{
+		return fail("%s: %s", keyFile, strerror(errno));
+	}
+
+	/* Every chunk in flight in every lane has a notice waiting in the queue */
+	if (numSlots < 1 || maxTransfers < 1 || numSlots * maxTransfers > MAX_WINDOW_SIZE || chunkSize == 0)
+	{
+		return fail("The window size times the number of concurrent transfers must be between 1 and %d.", MAX_WINDOW_SIZE);
+	}
+
+	if (inlineSize > MAX_MSG_PAYLOAD)
+	{
+		return fail("The inline size must be at most %d bytes.", MAX_MSG_PAYLOAD);
+	}
+
+	/* A crashed receiver's segment and queue would hand us its old size and messages, so remove them, but never a live receiver's */
+	if (clearStaleSession(key, owner) < 0)
+	{
+		if (errno == EBUSY)
+		{
+			return fail("Receiver %d is already using %s.", (int)owner, keyFile);
+		}
+
+		return fail("Removing a stale session: %s", strerror(errno));
+	}
+
+	/* Allocate a shared memory segment with the statistics page and a lane of one chunk slot per credit for each transfer.
+	 * It must be new, or another receiver started on the same key file at the same time.
+	 */
+	if ((shmid = shmget(key, segmentSize(), IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR)) < 0)
+	{
+		if (errno == EEXIST)
+		{
+			return fail("Another receiver is already using %s.", keyFile);
+		}
+
+		return fail("shmget: %s", strerror(errno));
+	}
+
+	/* Attach to the shared memory segment */
+	if ((sharedMemPtr = shmat(shmid, NULL, 0)) == (void*)-1)
+	{
+		sharedMemPtr = NULL;
+		close();
+		return fail("shmat: %s", strerror(errno));
+	}
+
+	/* The statistics page comes first */
+	stats = static_cast<transferStats*>(sharedMemPtr);
+
+	/* Create a message queue */
+	if ((msqid = msgget(key, 0666 | IPC_CREAT)) < 0)
+	{
+		close();
+		return fail("msgget: %s", strerror(errno));
+	}
+
+	/* All lanes start out free, including the extra one for transfers without slots */
+	lanes = new transferLane[maxTransfers + 1];
+	numLanes = maxTransfers;
+
+	for (int lane = 0; lane <= numLanes; ++lane)
+	{
+		lanes[lane].state = LANE_FREE;
+	}
+
+	/* Let shmstat know we are here */
+	initStats();
+
+	return 0;
+}
+
+/**
+ * Detaches from the shared memory and deallocates it and the message queue
+ */
+void Receiver::close()
+{
+	/* Detach from shared memory */
+	if (sharedMemPtr)
+	{
+		shmdt(sharedMemPtr);
+		sharedMemPtr = NULL;
+		stats = NULL;
+	}
+
+	/* Deallocate the shared memory segment */
+	if (shmid >= 0)
+	{
+		shmctl(shmid, IPC_RMID, 0);
+		shmid = -1;
+	}
+
+	/* Deallocate the message queue */
+	if (msqid >= 0)
+	{
+		msgctl(msqid, IPC_RMID, 0);
+		msqid = -1;
+	}
+
+	delete[] lanes;
+	lanes = NULL;
+	numLanes = 0;
+	handshakeLane = -1;
+
+	delete deferred;
+	deferred = NULL;
+}
+
+/**
+ * Picks the best configuration both sides can do and tells the sender
+ * @param  hello The sender's capabilities
+ * @param  lane The lane the transfer will use
+ * @return 0, or -1 on failure
+ */
+int Receiver::negotiate(const helloMsg& hello, int lane)
+{
+	/* The lane's state */
+	transferLane& l = lanes[lane];
+
+	/* The configuration to send back */
+	helloAckMsg ack;
+	ack.mtype = HELLO_ACK_TYPE;
+
+	/* Speak the newer sender's language as far as we understand it */
+	ack.version = hello.version < PROTOCOL_VERSION ? hello.version : PROTOCOL_VERSION;
+
+	/* Use as many slots and as big chunks as both sides allow */
+	ack.numSlots = (hello.maxSlots > 0 && hello.maxSlots < numSlots) ? hello.maxSlots : numSlots;
+	ack.chunkSize = (hello.maxChunkSize > 0 && hello.maxChunkSize < chunkSize) ? hello.maxChunkSize : chunkSize;
+	ack.slotSize = chunkSize;
+
+	/* Use the features both sides support that either side asked for */
+	ack.features = hello.features & supportedFeatures & (hello.requested | requestedFeatures);
+
+	/* Version 4 senders get a lane of their own. Older ones always use the
+	 * first one and the shared acknowledgment type.
+	 */
+	ack.slotBase = lane * numSlots;
+	ack.ackType = ack.version >= 4 ? TRANSFER_ACK_TYPE_BASE + lane : RECV_DONE_TYPE;
+
+	/* Carry as many bytes inside messages as both sides allow */
+	ack.inlineSize = ack.version >= 5 ? min((size_t)hello.maxInline, inlineSize) : 0;
+
+	/* Older senders expect shorter messages */
+	size_t msgSize = ack.version >= 5 ? sizeof(helloAckMsg) - sizeof(long) :
+		ack.version >= 4 ? HELLO_ACK_MSG_V4_SIZE : HELLO_ACK_MSG_V3_SIZE;
+
+	if (msgsnd(msqid, &ack, msgSize, 0) < 0)
+	{
+		return fail("msgsnd: %s", strerror(errno));
+	}
+	++numMsgSyscalls;
+	numSetupSyscalls += 2;
+
+	l.state = LANE_HANDSHAKE;
+	l.config.version = ack.version;
+	l.config.numSlots = ack.numSlots;
+	l.config.chunkSize = ack.chunkSize;
+	l.config.features = ack.features;
+	l.config.inlineSize = ack.inlineSize;
+	l.slotBase = ack.slotBase;
+	l.ackType = ack.ackType;
+	l.startNs = nowNs();
+
+	return 0;
+}
+
+/**
+ * Sets up a lane for a version 2 sender, which went straight to the file
+ * name, using our own configuration
+ * @param  lane The lane the transfer will use, which must be the first
+ */
+void Receiver::acceptLegacy(int lane)
+{
+	/* The lane's state */
+	transferLane& l = lanes[lane];
+
+	l.state = LANE_HANDSHAKE;
+	l.config.version = 2;
+	l.config.numSlots = numSlots;
+	l.config.chunkSize = chunkSize;
+	l.config.features = 0;
+	l.config.inlineSize = 0;
+	l.slotBase = 0;
+	l.ackType = RECV_DONE_TYPE;
+	l.startNs = nowNs();
+}
+
+/**
+ * Tells whether a file name message comes from a sender that skipped the
+ * hello because it already agreed on a configuration with us
+ * @param  name The message
+ * @param  msgSize The number of bytes received after the message type
+ * @return Whether it did
+ */
+static bool isUnannounced(const fileNameMsg& name, ssize_t msgSize)
+{
+	return msgSize >= (ssize_t)(offsetof(fileNameMsg, data) - sizeof(long)) && name.version >= 5 &&
+		(name.flags & NAME_FLAG_NO_HELLO);
+}
+
+/**
+ * Sets up a lane for a sender that skipped the hello, using our own
+ * configuration. Its name message carries the whole source.
+ * @param  lane The lane the transfer will use
+ * @param  version The protocol version the sender speaks
+ */
+void Receiver::acceptUnannounced(int lane, int version)
+{
+	/* The lane's state */
+	transferLane& l = lanes[lane];
+
+	l.state = LANE_HANDSHAKE;
+	l.config.version = version < PROTOCOL_VERSION ? version : PROTOCOL_VERSION;
+	l.config.numSlots = numSlots;
+	l.config.chunkSize = chunkSize;
+	l.config.features = 0;
+	l.config.inlineSize = inlineSize;
+	l.slotBase = 0;
+	l.ackType = TRANSFER_ACK_TYPE_BASE + lane;
+	l.startNs = nowNs();
+}
+
+/**
+ * Checks the file name message of a transfer in its handshake and publishes it
+ * @param  lane The lane of the transfer
+ * @param  name The message
+ * @param  msgSize The number of bytes received after the message type
+ * @return 0, or -1 on failure
+ */
+int Receiver::acceptName(int lane, fileNameMsg& name, ssize_t msgSize)
+{
+	/* The lane's state */
+	transferLane& l = lanes[lane];
+
+	/* Refuse senders that lay out their messages differently */
+	if (msgSize < (ssize_t)FILE_NAME_MSG_V3_SIZE || name.version != l.config.version ||
+		(l.config.version >= 4 && msgSize < (ssize_t)FILE_NAME_MSG_V4_SIZE) ||
+		(l.config.version >= 5 && msgSize < (ssize_t)(offsetof(fileNameMsg, data) - sizeof(long))))
+	{
+		return fail("The sender speaks protocol version %d, but this receiver speaks versions %d to %d.",
+			msgSize < (ssize_t)FILE_NAME_MSG_V3_SIZE ? 1 : name.version,
+			MIN_PROTOCOL_VERSION, PROTOCOL_VERSION);
+	}
+
+	/* Older senders have no say in their class */
+	l.priority = PRIORITY_NORMAL;
+
+	if (l.config.version >= 4 && name.priority >= 0 && name.priority < NUM_PRIORITY_CLASSES)
+	{
+		l.priority = name.priority;
+	}
+
+	/* Newer senders may carry the whole source in the name, and must if they skipped the hello */
+	l.wholeInline = l.config.version >= 5 && (name.flags & NAME_FLAG_INLINE);
+
+	if (l.config.version >= 5 && (name.flags & NAME_FLAG_NO_HELLO) && !l.wholeInline)
+	{
+		return fail("The sender skipped the hello without carrying its whole source.");
+	}
+
+	if (l.wholeInline)
+	{
+		if (name.size < 0 || (size_t)name.size > l.config.inlineSize ||
+			msgSize < (ssize_t)(offsetof(fileNameMsg, data) - sizeof(long) + name.size))
+		{
+			return fail("Got %d bytes inside the file name message when at most %zu fit.", name.size, l.config.inlineSize);
+		}
+
+		l.inlineBytes.assign(name.data, name.size);
+	}
+
+	name.fileName[MAX_FILE_NAME_SIZE - 1] = '\0';
+	l.fileName = name.fileName;
+	agreed = l.config;
+
+	/* Publish the file name before telling readers the transfer has started */
+	strncpy(stats->fileName, name.fileName, STATS_FILE_NAME_SIZE - 1);
+	stats->startNs.store(nowNs(), memory_order_relaxed);
+	stats->tunedChunkSize.store(0, memory_order_relaxed);
+	stats->state.store(STATE_TRANSFERRING, memory_order_release);
+
+	return 0;
+}
+
+/**
+ * Hands credits back to the sender
+ * @param  lane The lane of the sender's transfer
+ * @param  credits The number of slots the sender may fill
+ * @return 0, or -1 on failure
+ */
+int Receiver::sendCredits(int lane, int credits)
+{
+	/* An acknowledgment without credits would leave the sender with none */
+	if (credits <= 0)
+	{
+		return 0;
+	}
+
+	/* Tell the sender that we are ready for more bytes.
+	 * I.e. send a message of the lane's acknowledgment type. That is, a message
+	 * of type ackMessage with mtype field set to the lane's ackType.
+	 */
+	ackMessage sndMsg;
+	sndMsg.mtype = lanes[lane].ackType;
+	sndMsg.credits = credits;
+
+	if (msgsnd(msqid, &sndMsg, sizeof(ackMessage) - sizeof(long), 0) < 0)
+	{
+		return fail("msgsnd: %s", strerror(errno));
+	}
+	++numMsgSyscalls;
+
+	return 0;
+}
+
+/**
+ * Tells the sender whether its file is stored
+ * @param  lane The lane of the sender's transfer
+ * @param  error 0 if it is, otherwise the errno of the failure
+ * @return 0, or -1 on failure
+ */
+int Receiver::sendDone(int lane, int error)
+{
+	doneMsg sndMsg;
+	sndMsg.mtype = lanes[lane].ackType;
+	sndMsg.credits = -1;
+	sndMsg.error = error;
+
+	if (msgsnd(msqid, &sndMsg, sizeof(doneMsg) - sizeof(long), 0) < 0)
+	{
+		return fail("msgsnd: %s", strerror(errno));
+	}
+	++numMsgSyscalls;
+	++numSetupSyscalls;
+
+	return 0;
+}
+
+/**
+ * Starts receiving the bytes of a transfer whose name has arrived
+ * @param  lane The lane of the transfer
+ * @param  sink Where the bytes go
+ * @return 0, or -1 on failure
+ */
+int Receiver::startLane(int lane, TransferSink* sink)
+{
+	/* The lane's state */
+	transferLane& l = lanes[lane];
+
+	l.sink = sink;
+	l.numBytesRecv = 0;
+	l.chunk = 0;
+	l.numFreed = 0;
+	l.numSinceStall = 0;
+	l.pending.clear();
+	l.deficit = 0;
+
+	/* The number of credits currently granted to the sender. It starts small, doubles
+	 * every time the sender has to wait for credits and shrinks again while it
+	 * does not.
+	 */
+	l.window = l.config.numSlots < INITIAL_WINDOW_SIZE ? l.config.numSlots : INITIAL_WINDOW_SIZE;
+	stats->window.store(l.window, memory_order_relaxed);
+
+	/* Grant the sender the initial window */
+	if (sendCredits(lane, l.window) < 0)
+	{
+		return -1;
+	}
+
+	l.state = LANE_ACTIVE;
+	return 0;
+}
+
+/**
+ * Finishes a transfer whose name carried every byte
+ * @param  lane The lane of the transfer
+ * @param  sink Where the bytes go
+ * @return 0, or -1 on failure
+ */
+int Receiver::receiveInline(int lane, TransferSink* sink)
+{
+	/* The lane's state */
+	transferLane& l = lanes[lane];
+
+	/* Timestamps around the sink call */
+	uint64_t start = nowNs(), end;
+
+	l.sink = sink;
+	l.state = LANE_ACTIVE;
+
+	if (!l.inlineBytes.empty() && sink->write(l.inlineBytes.data(), l.inlineBytes.size()) < 0)
+	{
+		return fail("write: %s", strerror(errno));
+	}
+
+	end = nowNs();
+	statAdd(stats->recv.diskNs, end - start);
+	statAdd(stats->recv.bytes, l.inlineBytes.size());
+	statAdd(stats->recv.chunks, 1);
+	statUpdateRate(stats->recv, end, rateNs, rateBytes);
+
+	l.numBytesRecv = l.inlineBytes.size();
+	return finishLane(lane);
+}
+
+/**
+ * Finishes a transfer whose terminator has arrived and frees its lane
+ * @param  lane The lane of the transfer
+ * @return 0, or -1 on failure
+ */
+int Receiver::finishLane(int lane)
+{
+	/* The lane's state */
+	transferLane& l = lanes[lane];
+
+	/* The sender stopped reading credits before sending the terminator. Take
+	 * back the ones it left so the next transfer does not start with them.
+	 */
+	ackMessage staleMsg;
+
+	while (!l.wholeInline && msgrcv(msqid, &staleMsg, sizeof(ackMessage) - sizeof(long), l.ackType, IPC_NOWAIT) >= 0)
+	{
+		++numMsgSyscalls;
+		++numSetupSyscalls;
+	}
+
+	l.state = LANE_FREE;
+
+	/* We are done. Once the sink has stored the file, tell a sender that asked. */
+	int error = l.sink->finish() < 0 ? errno : 0;
+
+	if ((l.config.features & FEATURE_DURABLE) && sendDone(lane, error) < 0)
+	{
+		return -1;
+	}
+
+	if (error)
+	{
+		return fail("finish: %s", strerror(error));
+	}
+
+	uint64_t latencyNs = nowNs() - l.startNs;
+	latencies[l.priority].push_back(latencyNs);
+
+	if (handler)
+	{
+		handler->finish(l.sink, l.numBytesRecv, latencyNs);
+	}
+
+	return 0;
+}
+
+/**
+ * Keeps the bytes the last notice of a transfer carried inside itself until
+ * the notice's turn
+ * @param  lane The lane of the sender's transfer
+ * @param  rcvMsg The notice
+ * @param  msgSize The number of bytes received after the message type
+ * @return 0, or -1 on failure
+ */
+int Receiver::saveInline(int lane, const inlineMessage& rcvMsg, ssize_t msgSize)
+{
+	/* The notice's bytes are in a slot */
+	if (!(rcvMsg.header.flags & MSG_FLAG_INLINE))
+	{
+		return 0;
+	}
+
+	/* Only the last notice carries bytes, and no more than we agreed on */
+	if (!(rcvMsg.header.flags & MSG_FLAG_END) || rcvMsg.header.size < 0 ||
+		rcvMsg.header.size > (int64_t)lanes[lane].config.inlineSize ||
+		msgSize < (ssize_t)(sizeof(message) - sizeof(long) + rcvMsg.header.size))
+	{
+		return fail("Got %lld bytes inside a notice when at most %zu fit.",
+			(long long)rcvMsg.header.size, lanes[lane].config.inlineSize);
+	}
+
+	lanes[lane].inlineBytes.assign(rcvMsg.data, rcvMsg.header.size);
+	return 0;
+}
+
+/**
+ * Handles one notice from a sender
+ * @param  lane The lane of the sender's transfer
+ * @param  rcvMsg The notice
+ * @return 1 if it ended the transfer, 0 if not, or -1 on failure
+ */
+int Receiver::handleChunk(int lane, const message& rcvMsg)
+{
+	/* The lane's state */
+	transferLane& l = lanes[lane];
+
+	/* The size of the message received from the sender */
+	int64_t msgSize = rcvMsg.size;
+
+	/* Timestamps around sink calls */
+	uint64_t start, end;
+
+	/* When the current phase of the chunk started */
+	uint64_t traceStart;
+
+	/* The sender is telling us that we are done */
+	if (msgSize == 0)
+	{
+		return finishLane(lane) < 0 ? -1 : 1;
+	}
+
+	/* Chunks arrive in order, so anything else means the sender is confused */
+	if ((int64_t)rcvMsg.offset != l.numBytesRecv || msgSize < 0 || (uint64_t)msgSize > l.config.chunkSize ||
+		(!(rcvMsg.flags & MSG_FLAG_INLINE) && (rcvMsg.slot < l.slotBase || rcvMsg.slot >= l.slotBase + l.config.numSlots)))
+	{
+		return fail("Got %lld bytes for offset %llu when expecting offset %lld.",
+			(long long)msgSize, (unsigned long long)rcvMsg.offset, (long long)l.numBytesRecv);
+	}
+
+	/* Where the bytes are */
+	const char* bytes = (rcvMsg.flags & MSG_FLAG_INLINE) ? l.inlineBytes.data() : getSlot(rcvMsg.slot);
+
+	/* Count the number of bytes received */
+	l.numBytesRecv += msgSize;
+
+	/* Follow a tuning sender's chunk size */
+	if (rcvMsg.flags & MSG_FLAG_RESIZED)
+	{
+		stats->tunedChunkSize.store(msgSize, memory_order_relaxed);
+	}
+
+	/* Make sure the chunk was not damaged on the way */
+	if ((l.config.features & FEATURE_CHECKSUM) && crc32c(bytes, msgSize) != rcvMsg.checksum)
+	{
+		return fail("Checksum mismatch in the chunk at offset %lld.", (long long)(l.numBytesRecv - msgSize));
+	}
+
+	/* Stay under the rate limit, which also holds back the acknowledgment */
+	statAdd(stats->recv.pacedNs, pacer.pace(msgSize, nowNs()));
+	stats->recv.rateLimit.store(pacer.rate(), memory_order_relaxed);
+
+	/* Hand the bytes to the sink */
+	start = nowNs();
+	TRACE_BEGIN(write, l.chunk, traceStart);
+
+	if (l.sink->write(bytes, msgSize) < 0 || ((l.config.features & FEATURE_LIVE) && l.sink->flush() < 0))
+	{
+		return fail("write: %s", strerror(errno));
+	}
+
+	TRACE_END(write, l.chunk, traceStart);
+
+	end = nowNs();
+	statAdd(stats->recv.diskNs, end - start);
+	statAdd(stats->recv.bytes, msgSize);
+	statAdd(stats->recv.chunks, 1);
+	statUpdateRate(stats->recv, end, rateNs, rateBytes);
+
+	/* The last chunk needs no acknowledgment */
+	if (rcvMsg.flags & MSG_FLAG_END)
+	{
+		++l.chunk;
+		return finishLane(lane) < 0 ? -1 : 1;
+	}
+
+	/* The slot can be reused, and the extra credits a wider window brings */
+	++l.numFreed;
+	++l.numSinceStall;
+	int growth = 0;
+
+	/* The sender found no credits waiting and had to block on us, so widen
+	 * the window. Once it has gone a few whole windows without that, withhold
+	 * a credit to narrow it again; the chunks still out keep the lane moving.
+	 */
+	if (rcvMsg.flags & MSG_FLAG_STALLED)
+	{
+		growth = (2 * l.window <= l.config.numSlots) ? l.window : l.config.numSlots - l.window;
+		l.window += growth;
+		stats->window.store(l.window, memory_order_relaxed);
+		l.numSinceStall = 0;
+	}
+	else if (l.numSinceStall >= WINDOW_SHRINK_WINDOWS * l.window && l.window > 1)
+	{
+		--l.window;
+		--l.numFreed;
+		stats->window.store(l.window, memory_order_relaxed);
+		l.numSinceStall = 0;
+	}
+
+	/* Hand back everything right away when the sender is out of credits or
+	 * the window just grew, otherwise once half the window has piled up. An
+	 * acknowledgment may already be waiting for a sender that used its last
+	 * credit, but a spare one costs less than a sender blocked on us.
+	 */
+	if ((rcvMsg.flags & MSG_FLAG_LAST_CREDIT) || growth > 0 || l.numFreed >= (l.window + 1) / 2)
+	{
+		TRACE_BEGIN(ack, l.chunk, traceStart);
+
+		if (sendCredits(lane, l.numFreed + growth) < 0)
+		{
+			return -1;
+		}
+
+		TRACE_END(ack, l.chunk, traceStart);
+		l.numFreed = 0;
+	}
+
+	++l.chunk;
+	return 0;
+}
+
+/**
+ * The function for receiving the name of the file. Current senders say hello
+ * first, so agree on a configuration with them before the name arrives.
+ * @param  fileName Set to the name of the file received from the sender
+ * @return 0, or -1 on failure
+ */
+int Receiver::accept(string& fileName)
+{
+	/* A message object for receiving the hello or the file name */
+	pendingMsg msg;
+
+	/* When waiting for the name started */
+	uint64_t traceStart;
+
+	if (!sharedMemPtr)
+	{
+		return fail("The receiver is not open.");
+	}
+
+	/* Start the statistics page over for the new transfer. The sender only
+	 * writes to it once we answer, so nothing of its can be lost.
+	 */
+	numMsgSyscalls = 0;
+	numSetupSyscalls = 0;
+	initStats();
+
+	/* Receive whichever of the hello or the file name comes first using msgrcv() */
+	TRACE_BEGIN(recv_file_name, 0, traceStart);
+
+	if ((msg.size = msgrcv(msqid, &msg.msg, sizeof(msg.msg) - sizeof(long), -HELLO_TYPE, 0)) < 0)
+	{
+		return fail("msgrcv: %s", strerror(errno));
+	}
+	++numMsgSyscalls;
+
+	/* A sender that already knows us sent a small source without a hello */
+	if (msg.msg.name.mtype == FILE_NAME_TRANSFER_TYPE && isUnannounced(msg.msg.name, msg.size))
+	{
+		acceptUnannounced(0, msg.msg.name.version);
+	}
+	/* A version 2 sender went straight to the file name */
+	else if (msg.msg.name.mtype == FILE_NAME_TRANSFER_TYPE)
+	{
+		acceptLegacy(0);
+	}
+	/* Otherwise agree on a configuration, then get the name */
+	else if (msg.msg.hello.mtype == HELLO_TYPE && msg.msg.hello.version >= MIN_PROTOCOL_VERSION)
+	{
+		if (negotiate(msg.msg.hello, 0) < 0)
+		{
+			return -1;
+		}
+
+		if ((msg.size = msgrcv(msqid, &msg.msg.name, sizeof(fileNameMsg) - sizeof(long), FILE_NAME_TRANSFER_TYPE, 0)) < 0)
+		{
+			return fail("msgrcv: %s", strerror(errno));
+		}
+		++numMsgSyscalls;
+	}
+	else
+	{
+		return fail("Got an unexpected message of type %ld from the sender.", msg.msg.name.mtype);
+	}
+
+	TRACE_END(recv_file_name, 0, traceStart);
+
+	if (acceptName(0, msg.msg.name, msg.size) < 0)
+	{
+		return -1;
+	}
+
+	fileName = lanes[0].fileName;
+	return 0;
+}
+
+/**
+ * Receives the bytes of the transfer accept() started
+ * @param  sink Where the bytes go
+ * @return The number of bytes received, or -1 on failure
+ */
+int64_t Receiver::receive(TransferSink& sink)
+{
+	/* The result of handling the last notice */
+	int result = 0;
+
+	/* When the current phase started */
+	uint64_t start, traceStart;
+
+	if (!sharedMemPtr || lanes[0].state != LANE_HANDSHAKE)
+	{
+		return fail("No transfer has been accepted.");
+	}
+
+	/* The name carried every byte */
+	if (lanes[0].wholeInline)
+	{
+		if (receiveInline(0, &sink) < 0)
+		{
+			return -1;
+		}
+
+		stats->state.store(STATE_DONE, memory_order_relaxed);
+		return lanes[0].numBytesRecv;
+	}
+
+	if (startLane(0, &sink) < 0)
+	{
+		return -1;
+	}
+
+	/* Keep receiving until the sender sets the size to 0, indicating that
+ 	 * there is no more data to send.
+ 	 */
+	while (result == 0)
+	{
+		/* Receive the message. The slot it names, or the message itself, holds the bytes. */
+		inlineMessage rcvMsg;
+		ssize_t msgSize;
+
+		start = nowNs();
+		TRACE_BEGIN(pickup, lanes[0].chunk, traceStart);
+
+		if ((msgSize = msgrcv(msqid, &rcvMsg, sizeof(inlineMessage) - sizeof(long), SENDER_DATA_TYPE, 0)) < 0)
+		{
+			return fail("msgrcv: %s", strerror(errno));
+		}
+		++numMsgSyscalls;
+
+		TRACE_END(pickup, lanes[0].chunk, traceStart);
+		statAdd(stats->recv.blockedNs, nowNs() - start);
+
+		if (saveInline(0, rcvMsg, msgSize) < 0 || (result = handleChunk(0, rcvMsg.header)) < 0)
+		{
+			return -1;
+		}
+	}
+
+	stats->state.store(STATE_DONE, memory_order_relaxed);
+
+	return lanes[0].numBytesRecv;
+}
+
+/**
+ * Names the chunk a message picked up while serving is, for its trace span
+ * @param  msg The message
+ * @return The number of the chunk in its transfer, or 0 for any other message
+ */
+uint64_t Receiver::pickupChunk(const pendingMsg& msg) const
+{
+	/* The lane the notice claims to be for */
+	int lane = msg.msg.data.header.slot / numSlots;
+
+	if (msg.msg.data.header.mtype != SENDER_DATA_TYPE || msg.msg.data.header.slot < 0 || lane >= numLanes)
+	{
+		return 0;
+	}
+
+	return lanes[lane].chunk + lanes[lane].pending.size();
+}
+
+/**
+ * Picks the next transfer to handle a chunk of by deficit round robin: each
+ * transfer with notices waiting may handle its class's weight in slots'
+ * worth of bytes per round
+ * @return The lane of the transfer
+ */
+int Receiver::pickLane()
+{
+	/* The weight of each class */
+	static const int64_t weights[NUM_PRIORITY_CLASSES] = PRIORITY_WEIGHTS;
+
+	/* Every lane gets its quantum at most once before one of them is picked */
+	for (int i = 0; i <= 2 * numLanes; ++i)
+	{
+		transferLane& l = lanes[drrCursor];
+
+		if (!l.pending.empty())
+		{
+			/* Top the lane up once per visit */
+			if (drrFresh)
+			{
+				l.deficit += weights[l.priority] * chunkSize;
+				drrFresh = false;
+			}
+
+			if (l.pending.front().size <= l.deficit)
+			{
+				l.deficit -= l.pending.front().size;
+				return drrCursor;
+			}
+		}
+		else
+		{
+			/* Idle lanes do not save up */
+			l.deficit = 0;
+		}
+
+		drrCursor = (drrCursor + 1) % numLanes;
+		drrFresh = true;
+	}
+
+	return -1;
+}
+
+/**
+ * Handles a hello, a file name or a notice received while serving
+ * @param  msg The message
+ * @return 0, or -1 on failure
+ */
+int Receiver::dispatch(pendingMsg& msg)
+{
+	/* The lane a message is for */
+	int lane;
+
+	/* When handling the file name started */
+	uint64_t traceStart;
+
+	switch (msg.msg.data.header.mtype)
+	{
+		case HELLO_TYPE:
+			if (msg.msg.hello.version < MIN_PROTOCOL_VERSION)
+			{
+				return fail("The sender speaks protocol version %d, but this receiver speaks versions %d to %d.",
+					msg.msg.hello.version, MIN_PROTOCOL_VERSION, PROTOCOL_VERSION);
+			}
+
+			/* Older senders only know the first lane, so they wait for it */
+			if (msg.msg.hello.version < 4)
+			{
+				lane = 0;
+			}
+			/* Newer ones take the last free lane, leaving the first for older ones */
+			else
+			{
+				for (lane = numLanes - 1; lane > 0 && lanes[lane].state != LANE_FREE; --lane)
+				{
+				}
+			}
+
+			if (lanes[lane].state != LANE_FREE)
+			{
+				deferred = new pendingMsg(msg);
+				return 0;
+			}
+
+			handshakeLane = lane;
+
+			if (negotiate(msg.msg.hello, lane) < 0)
+			{
+				return -1;
+			}
+
+			/* Count time spent deferred */
+			lanes[lane].startNs = msg.receivedNs;
+			return 0;
+
+		case FILE_NAME_TRANSFER_TYPE:
+			TRACE_BEGIN(recv_file_name, 0, traceStart);
+
+			/* A sender that already knows us skips the hello and needs no slots */
+			if (isUnannounced(msg.msg.name, msg.size))
+			{
+				lane = numLanes;
+				acceptUnannounced(lane, msg.msg.name.version);
+				lanes[lane].startNs = msg.receivedNs;
+			}
+			else
+			{
+				/* A version 2 sender skips the hello, and only knows the first lane */
+				if (handshakeLane < 0)
+				{
+					if (lanes[0].state != LANE_FREE)
+					{
+						deferred = new pendingMsg(msg);
+						return 0;
+					}
+
+					acceptLegacy(0);
+					lanes[0].startNs = msg.receivedNs;
+					handshakeLane = 0;
+				}
+
+				lane = handshakeLane;
+				handshakeLane = -1;
+			}
+
+			if (acceptName(lane, msg.msg.name, msg.size) < 0)
+			{
+				return -1;
+			}
+
+			TRACE_END(recv_file_name, 0, traceStart);
+
+			/* Ask where the bytes go, then let the sender start */
+			{
+				TransferSink* sink = handler->start(lanes[lane].fileName, lanes[lane].priority, lanes[lane].config);
+
+				if (!sink)
+				{
+					return fail("No sink for %s.", lanes[lane].fileName.c_str());
+				}
+
+				return lanes[lane].wholeInline ? receiveInline(lane, sink) : startLane(lane, sink);
+			}
+
+		case SENDER_DATA_TYPE:
+			lane = msg.msg.data.header.slot / numSlots;
+
+			if (msg.msg.data.header.slot < 0 || lane >= numLanes || lanes[lane].state != LANE_ACTIVE)
+			{
+				return fail("Got a notice for slot %d, which no transfer is using.", msg.msg.data.header.slot);
+			}
+
+			if (saveInline(lane, msg.msg.data, msg.size) < 0)
+			{
+				return -1;
+			}
+
+			lanes[lane].pending.push_back(msg.msg.data.header);
+			return 0;
+
+		default:
+			return fail("Got an unexpected message of type %ld from the sender.", msg.msg.data.header.mtype);
+	}
+}
+
+/**
+ * Runs transfers from any number of senders at once, interleaving their
+ * chunks by weighted fair share according to their priority classes
+ * @param  handler Decides where each transfer's bytes go
+ * @param  numTransfers The number of transfers to run, or 0 to run until failure
+ * @return 0, or -1 on failure
+ */
+int Receiver::serve(TransferHandler& handler, int numTransfers)
+{
+	/* The number of transfers whose sender has said hello */
+	int numStarted = 0;
+
+	/* A message from a sender */
+	pendingMsg msg;
+
+	/* When blocking started, and when the current pickup started */
+	uint64_t start, traceStart;
+
+	if (!sharedMemPtr)
+	{
+		return fail("The receiver is not open.");
+	}
+
+	this->handler = &handler;
+	numMsgSyscalls = 0;
+	numSetupSyscalls = 0;
+	initStats();
+
+	while (true)
+	{
+		/* Whether any notice is waiting for its turn, whether a lane is free and
+		 * how many transfers are between their hello and their terminator
+		 */
+		bool havePending = false, haveLane = false;
+		int numRunning = 0;
+
+		for (int lane = 0; lane < numLanes; ++lane)
+		{
+			havePending = havePending || !lanes[lane].pending.empty();
+			haveLane = haveLane || lanes[lane].state == LANE_FREE;
+			numRunning += lanes[lane].state != LANE_FREE;
+		}
+
+		if (numRunning == 0 && !deferred && numTransfers > 0 && numStarted >= numTransfers)
+		{
+			break;
+		}
+
+		/* A deferred older sender goes as soon as the first lane frees up */
+		if (deferred && lanes[0].state == LANE_FREE)
+		{
+			msg = *deferred;
+			delete deferred;
+			deferred = NULL;
+
+			if (dispatch(msg) < 0)
+			{
+				this->handler = NULL;
+				return -1;
+			}
+			continue;
+		}
+
+		/* Once the waiting notices run out, wait for a message, then take
+		 * whatever else has arrived so every transfer with work is in the next round
+		 */
+		if (!havePending)
+		{
+			/* While a sender is between its hello and its name, wait for the name.
+			 * Take new senders while a lane is free, unless an older sender is
+			 * running: its credits use a type below HELLO_TYPE.
+			 */
+			long type = SENDER_DATA_TYPE;
+
+			if (handshakeLane >= 0)
+			{
+				type = -FILE_NAME_TRANSFER_TYPE;
+			}
+			else if (haveLane && !deferred && (numTransfers == 0 || numStarted < numTransfers) &&
+				!(lanes[0].state == LANE_ACTIVE && lanes[0].ackType == RECV_DONE_TYPE))
+			{
+				type = -HELLO_TYPE;
+			}
+
+			start = nowNs();
+			TRACE_BEGIN(pickup, 0, traceStart);
+
+			while ((msg.size = msgrcv(msqid, &msg.msg, sizeof(msg.msg) - sizeof(long), type, havePending ? IPC_NOWAIT : 0)) >= 0)
+			{
+				++numMsgSyscalls;
+				msg.receivedNs = nowNs();
+				TRACE_END(pickup, pickupChunk(msg), traceStart);
+
+				if (msg.msg.hello.mtype == HELLO_TYPE || (msg.msg.name.mtype == FILE_NAME_TRANSFER_TYPE &&
+					(handshakeLane < 0 || isUnannounced(msg.msg.name, msg.size))))
+				{
+					++numStarted;
+				}
+
+				if (dispatch(msg) < 0)
+				{
+					this->handler = NULL;
+					return -1;
+				}
+
+				/* Starting a transfer or deferring a sender changes what to wait for */
+				if (msg.msg.data.header.mtype != SENDER_DATA_TYPE)
+				{
+					break;
+				}
+
+				havePending = true;
+				TRACE_BEGIN(pickup, 0, traceStart);
+			}
+
+			if (msg.size < 0)
+			{
+				if (errno != ENOMSG)
+				{
+					this->handler = NULL;
+					return fail("msgrcv: %s", strerror(errno));
+				}
+				++numMsgSyscalls;
+				++numSetupSyscalls;
+			}
+
+			statAdd(stats->recv.blockedNs, nowNs() - start);
+		}
+
+		/* Handle one chunk from whichever transfer's turn it is */
+		int lane = pickLane();
+
+		if (lane >= 0)
+		{
+			message rcvMsg = lanes[lane].pending.front();
+			lanes[lane].pending.pop_front();
+
+			if (handleChunk(lane, rcvMsg) < 0)
+			{
+				this->handler = NULL;
+				return -1;
+			}
+		}
+	}
+
+	this->handler = NULL;
+	stats->state.store(STATE_DONE, memory_order_relaxed);
+
+	return 0;
+}
+
+/**
+ * Prints how many message queue syscalls the last transfer took compared
+ * to sending one acknowledgment per chunk
+ * @param  fp The file stream to print to
+ * @param  numBytes The number of bytes transferred
+ */
+void Receiver::printSyscallReport(FILE* fp, unsigned long long numBytes) const
+{
+	/* The chunks counted on the statistics page, which tuning senders make smaller than the slots */
+	unsigned long long numChunks = stats->recv.chunks.load(memory_order_relaxed);
+
+	/* One notice and one acknowledgment per chunk, plus the file name, the
+	 * terminator and the calls both protocols make
+	 */
+	if (numChunks == 0)
+	{
+		numChunks = (numBytes + agreed.chunkSize - 1) / agreed.chunkSize;
+	}
+
+	unsigned long long numLockStep = 2 * numChunks + 2 + numSetupSyscalls;
+
+	/* Guard against dividing by zero for empty files */
+	double numMB = numBytes ? numBytes / (1024.0 * 1024.0) : 1.0;
+
+	fprintf(fp, "Message queue syscalls: %lu (%.1f per MB, %.1f per MB saved with up to %d chunks in flight)\n",
+		numMsgSyscalls, numMsgSyscalls / numMB,
+		((double)numLockStep - numMsgSyscalls) / numMB, agreed.numSlots);
+}
+
+/**
+ * Prints how long transfers took, from the sender's hello to the last byte,
+ * for each priority class
+ * @param  fp The file stream to print to
+ */
+void Receiver::printLatencyReport(FILE* fp) const
+{
+	/* The name of each class */
+	static const char* names[NUM_PRIORITY_CLASSES] = PRIORITY_NAMES;
+
+	for (int priority = 0; priority < NUM_PRIORITY_CLASSES; ++priority)
+	{
+		if (latencies[priority].empty())
+		{
+			continue;
+		}
+
+		vector<uint64_t> sorted = latencies[priority];
+		sort(sorted.begin(), sorted.end());
+
+		fprintf(fp, "Class %s: %zu transfers, latency p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+			names[priority], sorted.size(), sorted[(sorted.size() + 1) / 2 - 1] / 1e6,
+			sorted[(sorted.size() * 99 + 99) / 100 - 1] / 1e6, sorted.back() / 1e6);
+	}
+}
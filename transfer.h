@@ -0,0 +1,753 @@
+/* The shared memory transfer protocol as a library (libtransfer.a).
+ *
+ * A Sender or Receiver owns its shared memory segment and message queue from
+ * open() until close() or its destructor, reports failures through its
+ * return values and lastError() instead of exiting, and can run any number of
+ * transfers one after another. Bytes come from a TransferSource and go to a
+ * TransferSink, so files, memory buffers and callbacks all work:
+ *
+ *	Receiver receiver;
+ *	std::string name;
+ *	MemorySink sink;
+ *
+ *	if (receiver.open() < 0)
+ *		fprintf(stderr, "%s\n", receiver.lastError());
+ *
+ *	while (receiver.accept(name) == 0 && receiver.receive(sink) >= 0)
+ *		... sink.data holds the file called name ...
+ *
+ * Receiver::serve() runs transfers from several senders at once instead,
+ * giving each its own lane of slots and sharing the receiver's time among
+ * them by their priority class. Senders serialize their handshakes with a
+ * lock on the key file. Senders older than protocol version 4 always use
+ * the first lane and run alone.
+ *
+ * Small transfers skip the shared memory: a source that fits in the agreed
+ * inline size travels inside the file name message, and the last few bytes
+ * of a bigger one inside the last notice. Once a Sender has said hello, it
+ * sends further small sources as a single message without another hello.
+ *
+ * A Sender that asks for FEATURE_DURABLE waits, at the end of each transfer,
+ * for the Receiver to say the sink's finish() succeeded. Receivers only
+ * offer it when their sinks store durably, such as a FileSink with a
+ * durability policy.
+ *
+ * Either side may start first. The key file is created by whichever does,
+ * Sender::open() waits for a live receiver to mark its statistics page
+ * ready, and Receiver::open() removes the segment and queue of a receiver
+ * that died instead of reusing them. sessionKeyFile() in session.h names
+ * key files by session so unrelated transfers do not share them.
+ *
+ * A Sender with autoTune set searches for the best chunk size as it goes:
+ * it measures the rate over short windows, doubles or halves the chunk size
+ * while that pays off, settles on the best one and searches again if the
+ * rate later drops. The size never exceeds the receiver's slots, so give
+ * the receiver big slots to leave room for the search. Each change is
+ * flagged in the first chunk of the new size, and tuneLog() keeps every
+ * measurement for choosing a static size later.
+ *
+ * Each side has a Pacer that holds it to a rate limit, and can back off
+ * while the host is under I/O or memory pressure. The sender sleeps between
+ * chunks and the receiver before writing each one, which holds back its
+ * acknowledgments and so the sender too.
+ *
+ * A failed transfer leaves the queue in an unknown state, so close() and
+ * open() again before the next one.
+ */
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <functional>
+#include <string>
+#include <vector>
+#include "pacer.h"
+
+struct transferStats;
+struct helloMsg;
+struct fileNameMsg;
+struct message;
+struct inlineMessage;
+struct transferLane;
+struct pendingMsg;
+
+/**
+ * Where a Sender gets the bytes it sends
+ */
+class TransferSource
+{
+public:
+	virtual ~TransferSource() { }
+
+	/**
+	 * Reads the next bytes
+	 * @param  buffer Where to put them
+	 * @param  size The most bytes to read
+	 * @return The number of bytes read, 0 at the end, or -1 with errno set
+	 */
+	virtual ssize_t read(char* buffer, size_t size) = 0;
+
+	/**
+	 * Gets the total number of bytes, for the statistics page
+	 * @return The size, or -1 if it is not known
+	 */
+	virtual int64_t size() { return -1; }
+
+	/**
+	 * Says whether the bytes come over time, such as a file being followed,
+	 * so each read goes out as soon as it returns instead of waiting to fill a chunk
+	 * @return Whether the source is live
+	 */
+	virtual bool live() { return false; }
+};
+
+/**
+ * Reads from a file
+ */
+class FileSource : public TransferSource
+{
+public:
+	FileSource();
+	~FileSource();
+
+	/**
+	 * Opens the file
+	 * @param  fileName The name of the file
+	 * @return 0, or -1 with errno set
+	 */
+	int open(const char* fileName);
+
+	ssize_t read(char* buffer, size_t size);
+	int64_t size();
+
+private:
+	/* The open file */
+	FILE* fp;
+};
+
+/* How far ahead of the reader a MappedFileSource asks the kernel to read */
+#define MAPPED_READAHEAD_SIZE (16 * 1024 * 1024)
+
+/**
+ * Reads a file by mapping it and copying from the mapping with
+ * streamCopy(), so big files skip the stdio buffer and the copies do not
+ * fill the caches. The file must not shrink while it is mapped.
+ */
+class MappedFileSource : public TransferSource
+{
+public:
+	MappedFileSource();
+	~MappedFileSource();
+
+	/**
+	 * Maps the file for reading from start to end
+	 * @param  fileName The name of the file
+	 * @return 0, or -1 with errno set
+	 */
+	int open(const char* fileName);
+
+	ssize_t read(char* buffer, size_t size);
+	int64_t size();
+
+private:
+	void unmap();
+
+	/* The mapping and its size, NULL for an empty file */
+	char* map;
+	size_t length;
+
+	/* The next byte to read, and where the range the kernel was asked to read ahead ends */
+	size_t pos;
+	size_t advisedTo;
+};
+
+/**
+ * Reads from a buffer in memory, which must outlive the transfer
+ */
+class MemorySource : public TransferSource
+{
+public:
+	MemorySource(const void* data, size_t size);
+
+	ssize_t read(char* buffer, size_t size);
+	int64_t size();
+
+private:
+	/* The bytes not yet read, and the size of the whole buffer */
+	const char* data;
+	size_t remaining;
+	size_t total;
+};
+
+/**
+ * Reads by calling a function with the same contract as TransferSource::read()
+ */
+class CallbackSource : public TransferSource
+{
+public:
+	explicit CallbackSource(std::function<ssize_t(char*, size_t)> callback);
+
+	ssize_t read(char* buffer, size_t size);
+
+private:
+	/* The function to call */
+	std::function<ssize_t(char*, size_t)> callback;
+};
+
+/**
+ * Where a Receiver puts the bytes it receives
+ */
+class TransferSink
+{
+public:
+	virtual ~TransferSink() { }
+
+	/**
+	 * Stores the next bytes, which arrive in order
+	 * @param  data The bytes
+	 * @param  size The number of bytes
+	 * @return 0, or -1 with errno set
+	 */
+	virtual int write(const char* data, size_t size) = 0;
+
+	/**
+	 * Passes on any bytes held back in a buffer, after each chunk of a live source
+	 * @return 0, or -1 with errno set
+	 */
+	virtual int flush() { return 0; }
+
+	/**
+	 * Called once every byte has arrived
+	 * @return 0, or -1 with errno set
+	 */
+	virtual int finish() { return 0; }
+};
+
+/* How a FileSink gets its bytes to disk: leave it to the kernel, fsync() once
+ * every byte is written, or also write back every writeBehindSize bytes as
+ * they arrive and drop them from the page cache once they are on disk
+ */
+#define DURABILITY_NONE 0
+#define DURABILITY_FSYNC 1
+#define DURABILITY_WRITE_BEHIND 2
+#define NUM_DURABILITY_POLICIES 3
+#define DURABILITY_NAMES { "none", "fsync", "writebehind" }
+
+/* The default number of bytes a write-behind FileSink lets pile up */
+#define DEFAULT_WRITE_BEHIND_SIZE (8 * 1024 * 1024)
+
+class ProgressWriter;
+
+/**
+ * Writes to a file
+ */
+class FileSink : public TransferSink
+{
+public:
+	FileSink();
+	~FileSink();
+
+	/**
+	 * Creates or truncates the file
+	 * @param  fileName The name of the file
+	 * @return 0, or -1 with errno set
+	 */
+	int open(const char* fileName);
+
+	int write(const char* data, size_t size);
+
+	/* Writes out stdio's buffer, and publishes the progress if there is a page */
+	int flush();
+
+	/* Makes the file durable if the policy says so and closes it */
+	int finish();
+
+	/* The DURABILITY_* policy and the bytes write-behind lets pile up, set before open() */
+	int durability;
+	size_t writeBehindSize;
+
+	/* Whether to keep a progress page for readers of the file while it
+	 * arrives (see progress.h), and the bytes between publications, set
+	 * before open()
+	 */
+	bool publishProgress;
+	size_t progressStep;
+
+private:
+	int publish();
+
+	/* The open file */
+	FILE* fp;
+
+	/* The progress page, NULL when not publishing */
+	ProgressWriter* progress;
+
+	/* The number of bytes written, where the range being written back starts
+	 * and where the one before it, which we wait for next, starts
+	 */
+	int64_t numBytes;
+	int64_t writingFrom;
+	int64_t waitingFrom;
+
+	/* The number of bytes last published, and the number known to be on disk */
+	int64_t publishedBytes;
+	int64_t durableBytes;
+};
+
+/**
+ * Appends to a buffer in memory
+ */
+class MemorySink : public TransferSink
+{
+public:
+	int write(const char* data, size_t size);
+
+	/* Everything received so far */
+	std::vector<char> data;
+};
+
+/**
+ * Writes by calling a function with the same contract as TransferSink::write()
+ */
+class CallbackSink : public TransferSink
+{
+public:
+	explicit CallbackSink(std::function<int(const char*, size_t)> callback);
+
+	int write(const char* data, size_t size);
+
+private:
+	/* The function to call */
+	std::function<int(const char*, size_t)> callback;
+};
+
+/**
+ * The configuration a sender and receiver agreed on
+ */
+struct transferConfig
+{
+	/* The protocol version both sides speak */
+	int version;
+
+	/* The most chunks in flight */
+	int numSlots;
+
+	/* The most bytes in a chunk */
+	size_t chunkSize;
+
+	/* The FEATURE_* bits in use */
+	uint32_t features;
+
+	/* The most bytes carried inside a message, 0 for none */
+	size_t inlineSize;
+};
+
+/**
+ * One measurement of a tuning Sender and the chunk size it chose from it
+ */
+struct chunkTuneStep
+{
+	/* The number of bytes sent when the measurement ended */
+	uint64_t offset;
+
+	/* The chunk size measured, the rate it gave in bytes per second and the
+	 * share of the time spent waiting for credits
+	 */
+	size_t chunkSize;
+	double rate;
+	double blockedShare;
+
+	/* The chunk size to use next, the same one when the search has settled */
+	size_t nextSize;
+};
+
+/**
+ * Decides where the bytes of each transfer Receiver::serve() runs go
+ */
+class TransferHandler
+{
+public:
+	virtual ~TransferHandler() { }
+
+	/**
+	 * Called when a sender starts a transfer
+	 * @param  fileName The name the sender gave
+	 * @param  priority The PRIORITY_* class the sender asked for
+	 * @param  config The configuration agreed with the sender
+	 * @return Where the bytes go, or NULL to stop serving
+	 */
+	virtual TransferSink* start(const std::string& fileName, int priority, const transferConfig& config) = 0;
+
+	/**
+	 * Called once every byte of a transfer is in its sink
+	 * @param  sink The sink start() returned
+	 * @param  numBytes The number of bytes received
+	 * @param  latencyNs The time from the sender's hello to the last byte
+	 */
+	virtual void finish(TransferSink* /* sink */, int64_t /* numBytes */, uint64_t /* latencyNs */) { }
+
+	/**
+	 * Called instead of finish() when a receiver drops a sender whose
+	 * transfer failed and carries on serving others
+	 * @param  sink The sink start() returned, holding whatever arrived, or
+	 *         NULL if the sender failed before naming its file
+	 * @param  reason What went wrong
+	 */
+	virtual void abandon(TransferSink* /* sink */, const char* /* reason */) { }
+};
+
+/**
+ * The sending side of the protocol
+ */
+class Sender
+{
+public:
+	Sender();
+	~Sender();
+	Sender(const Sender&) = delete;
+	Sender& operator=(const Sender&) = delete;
+
+	/**
+	 * Attaches to a receiver's shared memory and message queue, waiting up
+	 * to readyTimeoutMs for a receiver to set them up
+	 * @param  keyFile The file the receiver generated its key from
+	 * @return 0, or -1 on failure
+	 */
+	int open(const char* keyFile = "keyfile.txt");
+
+	/**
+	 * Detaches from the shared memory
+	 */
+	void close();
+
+	/**
+	 * Runs one transfer
+	 * @param  name The name to give the receiver
+	 * @param  source Where the bytes come from
+	 * @return The number of bytes sent, or -1 on failure
+	 */
+	int64_t send(const char* name, TransferSource& source);
+
+	/**
+	 * Runs one transfer of a file under its own name
+	 * @param  fileName The name of the file
+	 * @return The number of bytes sent, or -1 on failure
+	 */
+	int64_t sendFile(const char* fileName);
+
+	/**
+	 * Prints how many message queue syscalls the last transfer took compared
+	 * to sending one acknowledgment per chunk
+	 * @param  fp The file stream to print to
+	 * @param  numBytes The number of bytes transferred
+	 */
+	void printSyscallReport(FILE* fp, unsigned long long numBytes) const;
+
+	/**
+	 * Describes the last failure
+	 * @return The description
+	 */
+	const char* lastError() const { return error.c_str(); }
+
+	/* The configuration of the last transfer */
+	const transferConfig& config() const { return agreed; }
+
+	/* The measurements of the last transfer when autoTune is set */
+	const std::vector<chunkTuneStep>& tuneLog() const { return tuneSteps; }
+
+	/* The fastest chunk size the last tuned transfer measured, and whether
+	 * its search had settled there rather than ending mid-search
+	 */
+	size_t tunedChunkSize() const { return tuner.bestSize; }
+	bool tuneSettled() const { return tuner.settled; }
+
+	/* The number of chunks the last transfer put in slots */
+	unsigned long chunks() const { return numChunksSent; }
+
+	/* The attached shared memory and its size */
+	void* sharedMemory() const { return sharedMemPtr; }
+	size_t segmentSize() const { return segSize; }
+
+	/* The limits we tell the receiver about: the most chunks in flight and the
+	 * largest chunk, 0 meaning whatever the receiver likes
+	 */
+	int maxSlots;
+	size_t maxChunkSize;
+
+	/* The FEATURE_* bits we support and the ones we ask to use */
+	uint32_t supportedFeatures;
+	uint32_t requestedFeatures;
+
+	/* The PRIORITY_* class to ask for */
+	int priority;
+
+	/* The most bytes to carry inside messages instead of slots, up to
+	 * MAX_MSG_PAYLOAD, 0 for none
+	 */
+	size_t maxInline;
+
+	/* How long open() waits for a receiver to get ready, in milliseconds,
+	 * -1 for as long as it takes
+	 */
+	int readyTimeoutMs;
+
+	/* Whether sendFile() reads through a MappedFileSource instead of stdio */
+	bool mapInput;
+
+	/* Whether to tune the chunk size during each transfer instead of
+	 * always filling the receiver's slots
+	 */
+	bool autoTune;
+
+	/* Paces the chunks sent, with no limit until one is set */
+	Pacer pacer;
+
+private:
+	int fail(const char* format, ...) __attribute__((format(printf, 2, 3)));
+	void startTuning(uint64_t now);
+	bool tuneChunkSize(uint64_t now, size_t numBytes, uint64_t offset);
+	int handshake(const char* fileName, const char* data, ssize_t size);
+	int sendHello();
+	int sendFileName(const char* fileName, const char* data, ssize_t size, int flags);
+	int recvCredits(int& credits, bool& stalled);
+	int recvDone();
+	char* getSlot(int slot) const;
+
+	/* The ids for the shared memory segment and the message queue */
+	int shmid, msqid;
+
+	/* The shared memory, the statistics page at its start and its size */
+	void* sharedMemPtr;
+	transferStats* stats;
+	size_t segSize;
+
+	/* The key file, locked while saying hello so acknowledgments go to the right sender */
+	int lockFd;
+
+	/* The configuration the receiver picked, the distance between slots, the
+	 * first slot of our lane and the type of our acknowledgments
+	 */
+	transferConfig agreed;
+	size_t slotSize;
+	int slotBase;
+	long ackType;
+
+	/* Whether a hello since open() agreed on an inline size, so small sources
+	 * can go without another one
+	 */
+	bool knowsReceiver;
+
+	/* The number of msgsnd()/msgrcv() calls made in the last transfer, and
+	 * how many of them the lock-step protocol would make too without counting
+	 * them per chunk: the hello exchange and the answer at the end of the file
+	 */
+	unsigned long numMsgSyscalls;
+	unsigned long numSetupSyscalls;
+
+	/* The number of data messages sent in the last transfer */
+	unsigned long numChunksSent;
+
+	/**
+	 * Where the chunk size search of a tuning transfer stands
+	 */
+	struct chunkTuner
+	{
+		/* The size being tried and the bounds of the search */
+		size_t size, minSize, maxSize;
+
+		/* Whether sizes go up (1) or down (-1), how often the search turned
+		 * around and whether it has settled
+		 */
+		int direction;
+		int numTurns;
+		bool settled;
+
+		/* The best rate seen and the size that gave it */
+		double bestRate;
+		size_t bestSize;
+
+		/* When the current window started, the bytes and chunks sent in it
+		 * and the time spent waiting for credits
+		 */
+		uint64_t windowStartNs, windowBytes, windowChunks, windowBlockedNs;
+
+		/**
+		 * Gets the size next to another one in the search's direction
+		 * @param  from The size to step from
+		 * @return Double or half the size within the bounds, or the size
+		 *         itself if it is already at the bound
+		 */
+		size_t next(size_t from) const
+		{
+			return direction > 0 ? (from * 2 < maxSize ? from * 2 : maxSize) : (from / 2 > minSize ? from / 2 : minSize);
+		}
+	};
+
+	/* The search, and the measurements taken so far */
+	chunkTuner tuner;
+	std::vector<chunkTuneStep> tuneSteps;
+
+	/* The last failure */
+	std::string error;
+};
+
+/**
+ * The receiving side of the protocol
+ */
+class Receiver
+{
+public:
+	Receiver();
+	~Receiver();
+	Receiver(const Receiver&) = delete;
+	Receiver& operator=(const Receiver&) = delete;
+
+	/**
+	 * Creates the shared memory and message queue senders attach to,
+	 * first removing any a receiver that died left behind
+	 * @param  keyFile The file to generate the key from
+	 * @return 0, or -1 on failure, including when a live receiver already
+	 *         uses the key file
+	 */
+	int open(const char* keyFile = "keyfile.txt");
+
+	/**
+	 * Detaches from the shared memory and removes it and the message queue
+	 */
+	void close();
+
+	/**
+	 * Waits for a sender, agrees on a configuration and gets the file name
+	 * @param  fileName Set to the name the sender gave
+	 * @return 0, or -1 on failure
+	 */
+	int accept(std::string& fileName);
+
+	/**
+	 * Receives the bytes of the transfer accept() started
+	 * @param  sink Where the bytes go
+	 * @return The number of bytes received, or -1 on failure
+	 */
+	int64_t receive(TransferSink& sink);
+
+	/**
+	 * Runs transfers from any number of senders at once, interleaving their
+	 * chunks by weighted fair share according to their priority classes
+	 * @param  handler Decides where each transfer's bytes go
+	 * @param  numTransfers The number of transfers to run, or 0 to run until failure
+	 * @return 0, or -1 on failure
+	 */
+	int serve(TransferHandler& handler, int numTransfers);
+
+	/**
+	 * Prints how many message queue syscalls the last transfer took compared
+	 * to sending one acknowledgment per chunk
+	 * @param  fp The file stream to print to
+	 * @param  numBytes The number of bytes transferred
+	 */
+	void printSyscallReport(FILE* fp, unsigned long long numBytes) const;
+
+	/**
+	 * Prints how long transfers took, from the sender's hello to the last
+	 * byte, for each priority class
+	 * @param  fp The file stream to print to
+	 */
+	void printLatencyReport(FILE* fp) const;
+
+	/**
+	 * Describes the last failure
+	 * @return The description
+	 */
+	const char* lastError() const { return error.c_str(); }
+
+	/* The configuration of the last transfer */
+	const transferConfig& config() const { return agreed; }
+
+	/* The attached shared memory and its size */
+	void* sharedMemory() const { return sharedMemPtr; }
+	size_t segmentSize() const;
+
+	/* The number of chunks taken from slots since the last accept() or serve() began */
+	unsigned long long chunks() const;
+
+	/* The number of chunk slots per transfer, the size of each and the most
+	 * transfers serve() runs at once, set before open()
+	 */
+	int numSlots;
+	size_t chunkSize;
+	int maxTransfers;
+
+	/* The FEATURE_* bits we support and the ones we ask to use */
+	uint32_t supportedFeatures;
+	uint32_t requestedFeatures;
+
+	/* The most bytes senders may carry inside messages, up to MAX_MSG_PAYLOAD, 0 for none */
+	size_t inlineSize;
+
+	/* Paces the chunks written across every transfer, with no limit until one is set */
+	Pacer pacer;
+
+private:
+	int fail(const char* format, ...) __attribute__((format(printf, 2, 3)));
+	int negotiate(const helloMsg& hello, int lane);
+	void acceptLegacy(int lane);
+	void acceptUnannounced(int lane, int version);
+	int acceptName(int lane, fileNameMsg& name, ssize_t msgSize);
+	int sendCredits(int lane, int credits);
+	int sendDone(int lane, int error);
+	int startLane(int lane, TransferSink* sink);
+	int receiveInline(int lane, TransferSink* sink);
+	int finishLane(int lane);
+	int saveInline(int lane, const inlineMessage& rcvMsg, ssize_t msgSize);
+	int handleChunk(int lane, const message& rcvMsg);
+	uint64_t pickupChunk(const pendingMsg& msg) const;
+	int pickLane();
+	int dispatch(pendingMsg& msg);
+	void initStats();
+	char* getSlot(int slot) const;
+
+	/* The ids for the shared memory segment and the message queue */
+	int shmid, msqid;
+
+	/* The shared memory and the statistics page at its start */
+	void* sharedMemPtr;
+	transferStats* stats;
+
+	/* The configuration agreed with the sender */
+	transferConfig agreed;
+
+	/* The number of msgsnd()/msgrcv() calls made in the last transfer, and
+	 * how many of them the lock-step protocol would make too without counting
+	 * them per chunk: the hello exchange, the answer at the end of a file,
+	 * leftover credits taken back and polls that found nothing
+	 */
+	unsigned long numMsgSyscalls;
+	unsigned long numSetupSyscalls;
+
+	/* One lane of slots per concurrent transfer plus one for transfers that skip
+	 * the hello and need no slots, and the lane between its hello and its name
+	 */
+	transferLane* lanes;
+	int numLanes;
+	int handshakeLane;
+
+	/* An older sender waiting for the first lane */
+	pendingMsg* deferred;
+
+	/* Where serve() sends each transfer */
+	TransferHandler* handler;
+
+	/* The lane whose turn it is, and whether it has had its quantum this turn */
+	int drrCursor;
+	bool drrFresh;
+
+	/* When the transfer rate was last refreshed and the byte count then */
+	uint64_t rateNs, rateBytes;
+
+	/* The latency of every finished transfer, by priority class */
+	std::vector<std::vector<uint64_t> > latencies;
+
+	/* The last failure */
+	std::string error;
+};
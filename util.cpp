@@ -0,0 +1,163 @@
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "msg.h"    /* For the priority classes */
+#include "transfer.h"    /* For the durability policies and sources */
+#include "util.h"
+
+using namespace std;
+
+/**
+ * Parses a size with an optional K, M or G suffix
+ * @param  str The string to parse
+ * @return The size in bytes, or 0 if the string is not a size
+ */
+size_t parseSize(const char* str)
+{
+	/* Where the number ends */
+	char* end;
+
+	/* The number before the suffix */
+	unsigned long long size = strtoull(str, &end, 10);
+
+	switch (*end)
+	{
+		case 'G': case 'g':
+			size *= 1024;
+			/* fall through */
+		case 'M': case 'm':
+			size *= 1024;
+			/* fall through */
+		case 'K': case 'k':
+			size *= 1024;
+			++end;
+			break;
+	}
+
+	return *end ? 0 : size;
+}
+
+/**
+ * Parses a priority class given by name or number
+ * @param  str The string to parse
+ * @return The PRIORITY_* class, or -1 if the string is not one
+ */
+int parsePriority(const char* str)
+{
+	/* The name of each class */
+	static const char* names[NUM_PRIORITY_CLASSES] = PRIORITY_NAMES;
+
+	for (int priority = 0; priority < NUM_PRIORITY_CLASSES; ++priority)
+	{
+		if (strcmp(str, names[priority]) == 0 || (str[0] == '0' + priority && str[1] == '\0'))
+		{
+			return priority;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Parses a FileSink durability policy given by name
+ * @param  str The string to parse
+ * @return The DURABILITY_* policy, or -1 if the string is not one
+ */
+int parseDurability(const char* str)
+{
+	/* The name of each policy */
+	static const char* names[NUM_DURABILITY_POLICIES] = DURABILITY_NAMES;
+
+	for (int durability = 0; durability < NUM_DURABILITY_POLICIES; ++durability)
+	{
+		if (strcmp(str, names[durability]) == 0)
+		{
+			return durability;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Formats a failure description
+ * @param  error Set to the description
+ * @param  format The printf() format
+ * @param  args The arguments
+ * @return -1
+ */
+int formatError(string& error, const char* format, va_list args)
+{
+	/* The formatted description */
+	char buffer[512];
+
+	vsnprintf(buffer, sizeof(buffer), format, args);
+	error = buffer;
+
+	return -1;
+}
+
+/**
+ * Reads until the buffer is full or the source ends
+ * @param  source Where the bytes come from
+ * @param  buffer Where to put them
+ * @param  size The number of bytes wanted
+ * @param  atEnd Set once the source has ended
+ * @return The number of bytes read, or -1 with errno set
+ */
+ssize_t readFully(TransferSource& source, char* buffer, size_t size, bool& atEnd)
+{
+	/* The number of bytes read so far and by the last call */
+	size_t numBytes = 0;
+	ssize_t numRead;
+
+	while (numBytes < size && !atEnd)
+	{
+		if ((numRead = source.read(buffer + numBytes, size - numBytes)) < 0)
+		{
+			return -1;
+		}
+
+		atEnd = numRead == 0;
+		numBytes += numRead;
+
+		/* A live source's bytes go out as soon as they come */
+		if (numRead > 0 && source.live())
+		{
+			break;
+		}
+	}
+
+	return numBytes;
+}
+
+/**
+ * Sleeps until a futex word in shared memory changes or a while passes
+ * @param  word The word
+ * @param  value The value it had when we last looked
+ * @param  timeoutNs The longest to sleep
+ * @return 0 once woken, or -1 with errno set to ETIMEDOUT, EAGAIN if the word had changed, or EINTR
+ */
+int futexWait(atomic<uint32_t>& word, uint32_t value, uint64_t timeoutNs)
+{
+	struct timespec timeout;
+	timeout.tv_sec = timeoutNs / 1000000000ULL;
+	timeout.tv_nsec = timeoutNs % 1000000000ULL;
+
+	/* The memory is shared between processes, so no FUTEX_PRIVATE_FLAG */
+	return syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, value, &timeout, NULL, 0) < 0 ? -1 : 0;
+}
+
+/**
+ * Wakes processes sleeping on a futex word in shared memory
+ * @param  word The word
+ * @param  count The most to wake
+ */
+void futexWake(atomic<uint32_t>& word, int count)
+{
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, count, NULL, NULL, 0);
+}
@@ -0,0 +1,67 @@
+/* Small helpers shared by the programs and the library */
+
+#include <sys/types.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+class TransferSource;
+
+/**
+ * Parses a size with an optional K, M or G suffix
+ * @param  str The string to parse
+ * @return The size in bytes, or 0 if the string is not a size
+ */
+size_t parseSize(const char* str);
+
+/**
+ * Parses a priority class given by name or number
+ * @param  str The string to parse
+ * @return The PRIORITY_* class, or -1 if the string is not one
+ */
+int parsePriority(const char* str);
+
+/**
+ * Parses a FileSink durability policy given by name
+ * @param  str The string to parse
+ * @return The DURABILITY_* policy, or -1 if the string is not one
+ */
+int parseDurability(const char* str);
+
+/**
+ * Formats a failure description
+ * @param  error Set to the description
+ * @param  format The printf() format
+ * @param  args The arguments
+ * @return -1
+ */
+int formatError(std::string& error, const char* format, va_list args);
+
+/**
+ * Reads until the buffer is full or the source ends. A live source's bytes
+ * are returned as soon as they come.
+ * @param  source Where the bytes come from
+ * @param  buffer Where to put them
+ * @param  size The number of bytes wanted
+ * @param  atEnd Set once the source has ended
+ * @return The number of bytes read, or -1 with errno set
+ */
+ssize_t readFully(TransferSource& source, char* buffer, size_t size, bool& atEnd);
+
+/**
+ * Sleeps until a futex word in shared memory changes or a while passes
+ * @param  word The word
+ * @param  value The value it had when we last looked
+ * @param  timeoutNs The longest to sleep
+ * @return 0 once woken, or -1 with errno set to ETIMEDOUT, EAGAIN if the word had changed, or EINTR
+ */
+int futexWait(std::atomic<uint32_t>& word, uint32_t value, uint64_t timeoutNs);
+
+/**
+ * Wakes processes sleeping on a futex word in shared memory
+ * @param  word The word
+ * @param  count The most to wake
+ */
+void futexWake(std::atomic<uint32_t>& word, int count);
@@ -0,0 +1,91 @@
+/* An example pipeline stage plugin, which counts words. Build it with
+ *	g++ -fPIC -shared wordstage.cpp -o wordstage.so
+ * and load it with recv -P ./wordstage.so, or -P ./wordstage.so:<N> to
+ * only count words at least N characters long.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include "transfer.h"
+#include "pipeline.h"
+
+using namespace std;
+
+/**
+ * Counts runs of non-space characters. A word can span two chunks, which is
+ * fine since a stage sees the chunks in order.
+ */
+class WordStage : public ChunkStage
+{
+public:
+	explicit WordStage(size_t minLength) : minLength(minLength), length(0), numWords(0) { }
+
+	int process(const char* data, size_t size)
+	{
+		for (size_t i = 0; i < size; ++i)
+		{
+			if (!isspace((unsigned char)data[i]))
+			{
+				++length;
+			}
+			else
+			{
+				endWord();
+			}
+		}
+
+		return 0;
+	}
+
+	string result()
+	{
+		/* The file may end in the middle of a word */
+		endWord();
+
+		return to_string(numWords) + " words";
+	}
+
+private:
+	/**
+	 * Counts the word just ended, if there was one and it is long enough
+	 */
+	void endWord()
+	{
+		if (length > 0 && length >= minLength)
+		{
+			++numWords;
+		}
+
+		length = 0;
+	}
+
+	/* The shortest word to count */
+	size_t minLength;
+
+	/* The length of the word in progress and the number counted */
+	size_t length;
+	unsigned long long numWords;
+};
+
+/**
+ * Creates a stage
+ * @param  arg The shortest word to count, or an empty string for every word
+ * @return The new stage, or NULL if arg is not a number
+ */
+extern "C" ChunkStage* createChunkStage(const char* arg)
+{
+	/* Where the number ends */
+	char* end;
+
+	long minLength = *arg ? strtol(arg, &end, 10) : 1;
+
+	if (*arg && (*end || minLength < 1))
+	{
+		fprintf(stderr, "wordstage: %s is not a word length\n", arg);
+		return NULL;
+	}
+
+	return new WordStage(minLength);
+}